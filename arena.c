@@ -0,0 +1,183 @@
+/*
+ * CPU arenas.
+ *
+ * An arena preallocates a fixed number of CPUs together with one slab of
+ * guest memory cut into equal slots, so creating and destroying a CPU
+ * neither allocates nor clears memory. A CPU keeps its code and stack
+ * adjacent inside its slot, because the operands of an instruction at
+ * the end of the code are read from the stack.
+ *
+ * Slots are cleared lazily. Releasing a CPU only records what it dirtied:
+ * the program words copied in and the slots still on its stack (nothing
+ * above the top of the stack is ever left non-zero, see clear_stack). The
+ * next acquire of the slot clears exactly those words. I/O buffers stay
+ * with their CPU from one use to the next.
+ *
+ * An arena is not thread-safe; give each thread its own.
+ */
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct arena_slot
+{
+    size_t code_words;  // Program words the last user copied in
+    size_t stack_start; // First word of its stack that may be non-zero
+    size_t stack_words;
+};
+
+struct cpu_arena
+{
+    int32_t *slab;
+    size_t slot_words;
+    size_t cpu_count;
+    struct cpu *cpus;
+    struct arena_slot *slots;
+    size_t *free_slots; // Stack of unused slot indices
+    size_t free_count;
+};
+
+/*
+ * Creates an arena for cpu_count CPUs of up to memory_words words of
+ * guest memory each. Pages of the slab are only committed once used.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu_arena *cpu_arena_create(size_t cpu_count, size_t memory_words)
+{
+    assert(cpu_count > 0);
+    assert(memory_words > 0);
+    // Page-aligned slots keep one CPU's pages from being dirtied by another
+    size_t slot_words = (memory_words + MEMORY_BLOCK_WORDS - 1) / MEMORY_BLOCK_WORDS * MEMORY_BLOCK_WORDS;
+    if (slot_words > INT32_MAX || cpu_count > SIZE_MAX / sizeof(int32_t) / slot_words
+            || cpu_count > SIZE_MAX / sizeof(struct cpu)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct cpu_arena *arena = malloc(sizeof(*arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->slot_words = slot_words;
+    arena->cpu_count = cpu_count;
+    arena->slab = memory_map_anonymous(cpu_count * slot_words);
+    void *cpus;
+    arena->cpus = posix_memalign(&cpus, CPU_CACHE_LINE, cpu_count * sizeof(struct cpu)) == 0 ? cpus : NULL;
+    arena->slots = calloc(cpu_count, sizeof(*arena->slots));
+    arena->free_slots = malloc(cpu_count * sizeof(*arena->free_slots));
+    if (arena->slab == NULL || arena->cpus == NULL || arena->slots == NULL
+            || arena->free_slots == NULL) {
+        if (arena->slab != NULL) {
+            munmap(arena->slab, cpu_count * slot_words * sizeof(int32_t));
+        }
+        free(arena->cpus);
+        free(arena->slots);
+        free(arena->free_slots);
+        free(arena);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(arena->cpus, 0, cpu_count * sizeof(struct cpu));
+    for (size_t i = 0; i < cpu_count; ++i) {
+        io_init(&arena->cpus[i]);
+        arena->free_slots[i] = cpu_count - 1 - i; // Hand out slot 0 first
+    }
+    arena->free_count = cpu_count;
+    return arena;
+}
+
+/*
+ * All CPUs of the arena must have been released.
+ */
+void cpu_arena_destroy(struct cpu_arena *arena)
+{
+    if (arena == NULL) {
+        return;
+    }
+    assert(arena->free_count == arena->cpu_count);
+    for (size_t i = 0; i < arena->cpu_count; ++i) {
+        io_destroy(&arena->cpus[i]);
+    }
+    munmap(arena->slab, arena->cpu_count * arena->slot_words * sizeof(int32_t));
+    free(arena->cpus);
+    free(arena->slots);
+    free(arena->free_slots);
+    free(arena);
+}
+
+/*
+ * Takes a CPU from the arena, set up to run program from the start with
+ * guest I/O on stdin and stdout. Costs a copy of the program's code and
+ * clearing what the slot's previous user left behind.
+ * Returns NULL with errno set if the arena is exhausted or the program
+ * needs more memory than a slot has.
+ */
+struct cpu *cpu_arena_acquire(struct cpu_arena *arena, struct cpu_program *program)
+{
+    assert(arena != NULL);
+    assert(program != NULL);
+    if (program->memory_words > arena->slot_words) {
+        errno = EFBIG;
+        return NULL;
+    }
+    if (arena->free_count == 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t index = arena->free_slots[--arena->free_count];
+    struct arena_slot *slot = &arena->slots[index];
+    int32_t *memory = arena->slab + index * arena->slot_words;
+
+    memset(memory + slot->stack_start, 0, slot->stack_words * sizeof(int32_t));
+    if (slot->code_words > program->program_words) {
+        memset(memory + program->program_words, 0,
+                (slot->code_words - program->program_words) * sizeof(int32_t));
+    }
+    memcpy(memory, program->decoder->memory, program->program_words * sizeof(int32_t));
+    slot->code_words = program->program_words;
+    slot->stack_words = 0;
+
+    struct cpu *cpu = &arena->cpus[index];
+    cpu_init(cpu, memory, &memory[program->memory_words - 1], program->stack_capacity);
+    cpu->memory_owner = CPU_MEMORY_ARENA;
+    cpu->decoded = program->decoder->decoded;
+    cpu->decoded_shared = true;
+    program_acquire(program);
+    cpu->program = program;
+    cpu_set_io_fd(cpu, STDIN_FILENO, STDOUT_FILENO);
+    return cpu;
+}
+
+/*
+ * Returns a CPU to its arena, this replaces cpu_destroy and free for
+ * arena CPUs. Pending output is flushed first.
+ */
+void cpu_arena_release(struct cpu_arena *arena, struct cpu *cpu)
+{
+    assert(arena != NULL);
+    assert(cpu >= arena->cpus && cpu < arena->cpus + arena->cpu_count);
+    assert(cpu->memory_owner == CPU_MEMORY_ARENA);
+
+    size_t index = (size_t) (cpu - arena->cpus);
+    struct arena_slot *slot = &arena->slots[index];
+    cpu_flush_output(cpu);
+    cpu_clear_debug(cpu);
+    cpu_discard_decoded(cpu);
+    program_release(cpu->program);
+    cpu->program = NULL;
+
+    slot->stack_words = (size_t) cpu->stack_size;
+    slot->stack_start = (size_t) (cpu->stack_bottom - cpu->memory) + 1 - slot->stack_words;
+    cpu->memory = NULL;
+    cpu->stack_bottom = NULL;
+    arena->free_slots[arena->free_count++] = index;
+}
@@ -0,0 +1,1200 @@
+/*
+ * Assembler: turns the textual assembly into the word stream the CPU runs.
+ *
+ * Every line holds one instruction with its operands or one "label:".
+ * Label operands are emitted as placeholders and patched once the whole
+ * source has been read. See asm.h for the interface.
+ */
+#include "asm.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define LABEL_UNDEFINED ((size_t)(-1))
+#define DELIMITERS " \r\t\n"
+
+typedef enum asm_status error_code;
+
+typedef enum
+{
+    ARGTYPE_NONE,
+    ARGTYPE_NUMBER,
+    ARGTYPE_REGISTER,
+    ARGTYPE_LABEL,
+    ARGTYPE_RETURN // implicit, address of the next instruction
+} argtype;
+
+typedef struct
+{
+    char name[10];
+    argtype args[3];
+    uint32_t code;
+} instruction_info;
+
+struct machinecode
+{
+    size_t capacity;
+    size_t occupied;
+    uint32_t *stream;
+};
+
+static const instruction_info instruction_set[] = {
+    { .name = "nop", .args = { ARGTYPE_NONE }, .code = 0x0 },
+    { .name = "halt", .args = { ARGTYPE_NONE }, .code = 0x1 },
+    { .name = "add", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x2 },
+    { .name = "sub", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x3 },
+    { .name = "mul", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x4 },
+    { .name = "div", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x5 },
+    { .name = "inc", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x6 },
+    { .name = "dec", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x7 },
+    { .name = "loop", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x8 },
+    { .name = "movr",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_NUMBER, ARGTYPE_NONE },
+            .code = 0x9 },
+    { .name = "load",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_NUMBER, ARGTYPE_NONE },
+            .code = 0xa },
+    { .name = "store",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_NUMBER, ARGTYPE_NONE },
+            .code = 0xb },
+    { .name = "in", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0xc },
+    { .name = "get", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0xd },
+    { .name = "out", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0xe },
+    { .name = "put", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0xf },
+    { .name = "swap",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_REGISTER, ARGTYPE_NONE },
+            .code = 0x10 },
+    { .name = "push", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x11 },
+    { .name = "pop", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x12 },
+    { .name = "cmp",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_REGISTER, ARGTYPE_NONE },
+            .code = 0x13 },
+    { .name = "jmp", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x14 },
+    { .name = "jz", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x15 },
+    { .name = "jnz", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x16 },
+    { .name = "jgt", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x17 },
+    { .name = "call",
+            .args = { ARGTYPE_LABEL, ARGTYPE_RETURN, ARGTYPE_NONE },
+            .code = 0x18 },
+    { .name = "ret", .args = { ARGTYPE_NONE }, .code = 0x19 },
+};
+
+#define INSTRUCTION_COUNT (sizeof(instruction_set) / sizeof(instruction_set[0]))
+
+typedef struct
+{
+    const char *label;
+    size_t definition;
+} label_record;
+
+/*
+ * Label names live in a chain of large blocks, freed all at once.
+ */
+#define NAME_BLOCK_SIZE 4096
+
+struct name_block
+{
+    struct name_block *next;
+    size_t used;
+    size_t size;
+    char names[];
+};
+
+/*
+ * Labels are kept in insertion order in an array and found through an
+ * open-addressing hash index over it, both grown by doubling.
+ * Every label operand leaves the index of its label in the placeholder word
+ * and its position in refs, so patch() resolves all of them in one sweep.
+ */
+typedef struct
+{
+    label_record *labels;
+    size_t num_labels;
+    size_t capacity;
+    size_t *index;       // Label number + 1 per slot, 0 for an empty slot
+    size_t index_size;   // Power of two, at least twice num_labels
+    size_t *refs;        // Positions of label placeholders in the stream
+    size_t refcount;
+    size_t refcapacity;
+    struct name_block *names;
+} label_table;
+
+struct asm_context
+{
+    FILE *errors; // Where messages go, NULL for nowhere
+    struct machinecode machinecode;
+    label_table labels;
+    char *tokens; // strtok_r state of the line being processed
+    char *line;   // Copy of the line, asm_assemble works on const input
+    size_t line_capacity;
+    bool optimize;       // Run optimize() before patch()
+    size_t instructions; // Instructions in the source
+    size_t optimized;    // Instructions left after optimize()
+};
+
+#define INITIAL_INDEX_SIZE 64
+
+static void report(struct asm_context *ctx, const char *format, ...)
+{
+    if (ctx->errors == NULL)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(ctx->errors, format, args);
+    va_end(args);
+}
+
+static char *next_token(struct asm_context *ctx)
+{
+    return strtok_r(NULL, DELIMITERS, &ctx->tokens);
+}
+
+static error_code stream_push(struct machinecode *machinecode, uint32_t word)
+{
+    if (machinecode->occupied + 1 >= machinecode->capacity) {
+        size_t new_capacity =
+                (machinecode->capacity > 0) ? machinecode->capacity * 2 : 1024;
+        uint32_t *nmem = realloc(machinecode->stream, new_capacity * sizeof(*nmem));
+        if (nmem == NULL)
+            return ASM_ERR_NOMEM;
+        machinecode->stream = nmem;
+        machinecode->capacity = new_capacity;
+    }
+
+    machinecode->stream[machinecode->occupied++] = word;
+    return ASM_SUCCESS;
+}
+
+static error_code machinecode_push(struct asm_context *ctx, uint32_t word)
+{
+    return stream_push(&ctx->machinecode, word);
+}
+
+static const instruction_info *seek_instruction(const char *name)
+{
+    // A handful of entries, a linear scan beats sorting them
+    for (size_t i = 0; i < INSTRUCTION_COUNT; ++i) {
+        if (strcmp(instruction_set[i].name, name) == 0)
+            return &instruction_set[i];
+    }
+    return NULL;
+}
+
+static int32_t registerno(const char *regname)
+{
+    assert(regname != NULL);
+
+    if (strcasecmp(regname, "result") == 0)
+        return 4;
+
+    if (strlen(regname) != 1)
+        return -1;
+
+    char reglabel = tolower(regname[0]);
+    if (reglabel >= 'a' && reglabel <= 'd')
+        return reglabel - 'a';
+
+    if (reglabel == 'r')
+        return 4;
+
+    if (reglabel >= '0' && reglabel < '5')
+        return reglabel - '0';
+
+    return -1;
+}
+
+static size_t label_hash(const char *name)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for (; *name != '\0'; ++name) {
+        hash = (hash ^ (unsigned char) *name) * 1099511628211u;
+    }
+    return (size_t) hash;
+}
+
+/*
+ * Forgets all labels but keeps the memory for the next source.
+ */
+static void reset_labels(label_table *labels)
+{
+    memset(labels->index, 0, labels->index_size * sizeof(*labels->index));
+    labels->num_labels = 0;
+    labels->refcount = 0;
+    while (labels->names != NULL && labels->names->next != NULL) {
+        struct name_block *next = labels->names->next;
+        free(labels->names);
+        labels->names = next;
+    }
+    if (labels->names != NULL)
+        labels->names->used = 0;
+}
+
+static void free_labels(label_table *labels)
+{
+    while (labels->names != NULL) {
+        struct name_block *next = labels->names->next;
+        free(labels->names);
+        labels->names = next;
+    }
+    free(labels->labels);
+    free(labels->index);
+    free(labels->refs);
+}
+
+static const char *store_name(label_table *labels, const char *name)
+{
+    size_t length = strlen(name) + 1;
+    struct name_block *block = labels->names;
+    if (block == NULL || block->size - block->used < length) {
+        size_t size = length > NAME_BLOCK_SIZE ? length : NAME_BLOCK_SIZE;
+        block = malloc(sizeof(*block) + size);
+        if (block == NULL)
+            return NULL;
+        block->next = labels->names;
+        block->used = 0;
+        block->size = size;
+        labels->names = block;
+    }
+    char *stored = block->names + block->used;
+    memcpy(stored, name, length);
+    block->used += length;
+    return stored;
+}
+
+static bool grow_index(label_table *labels)
+{
+    size_t size = labels->index_size * 2;
+    size_t *index = calloc(size, sizeof(*index));
+    if (index == NULL)
+        return false;
+    for (size_t i = 0; i < labels->num_labels; ++i) {
+        size_t slot = label_hash(labels->labels[i].label) & (size - 1);
+        while (index[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        index[slot] = i + 1;
+    }
+    free(labels->index);
+    labels->index = index;
+    labels->index_size = size;
+    return true;
+}
+
+/*
+ * Returns the number of the label, adding it as undefined if it is new.
+ * Returns LABEL_UNDEFINED if there is no memory for a new label.
+ */
+static size_t label_handle(label_table *labels, const char *label_name)
+{
+    size_t mask = labels->index_size - 1;
+    size_t slot = label_hash(label_name) & mask;
+    for (; labels->index[slot] != 0; slot = (slot + 1) & mask) {
+        size_t number = labels->index[slot] - 1;
+        if (strcmp(labels->labels[number].label, label_name) == 0)
+            return number;
+    }
+
+    if (labels->num_labels * 2 + 2 > labels->index_size) {
+        if (!grow_index(labels))
+            return LABEL_UNDEFINED;
+        return label_handle(labels, label_name);
+    }
+    if (labels->num_labels == labels->capacity) {
+        size_t capacity = labels->capacity > 0 ? labels->capacity * 2 : 64;
+        label_record *nlabels = realloc(labels->labels, capacity * sizeof(*nlabels));
+        if (nlabels == NULL)
+            return LABEL_UNDEFINED;
+        labels->labels = nlabels;
+        labels->capacity = capacity;
+    }
+    const char *name = store_name(labels, label_name);
+    if (name == NULL)
+        return LABEL_UNDEFINED;
+
+    size_t number = labels->num_labels++;
+    labels->labels[number].label = name;
+    labels->labels[number].definition = LABEL_UNDEFINED;
+    labels->index[slot] = number + 1;
+    return number;
+}
+
+static error_code label_reference(struct asm_context *ctx, const char *label_name, size_t placeholder_pos)
+{
+    label_table *labels = &ctx->labels;
+    if (labels->refcount == labels->refcapacity) {
+        size_t capacity = labels->refcapacity > 0 ? labels->refcapacity * 2 : 256;
+        size_t *refs = realloc(labels->refs, capacity * sizeof(*refs));
+        if (refs == NULL)
+            return ASM_ERR_NOMEM;
+        labels->refs = refs;
+        labels->refcapacity = capacity;
+    }
+    size_t number = label_handle(labels, label_name);
+    if (number == LABEL_UNDEFINED)
+        return ASM_ERR_NOMEM;
+    ctx->machinecode.stream[placeholder_pos] = (uint32_t) number;
+    labels->refs[labels->refcount++] = placeholder_pos;
+    return ASM_SUCCESS;
+}
+
+static error_code define_label(struct asm_context *ctx, const char *label_name)
+{
+    size_t number = label_handle(&ctx->labels, label_name);
+    if (number == LABEL_UNDEFINED)
+        return ASM_ERR_NOMEM;
+    label_record *handle = &ctx->labels.labels[number];
+    if (handle->definition != LABEL_UNDEFINED) {
+        report(ctx, "Duplicit label definition for %s\n", label_name);
+        return ASM_ERR_LABEL_DUPLICITY;
+    }
+
+    handle->definition = ctx->machinecode.occupied;
+    return ASM_SUCCESS;
+}
+
+static error_code parse_argument_register(struct asm_context *ctx, char *token)
+{
+    int32_t regno = registerno(token);
+    if (regno < 0) {
+        report(ctx, "Invalid register %s\n", token);
+        return ASM_ERR_INVREG;
+    }
+
+    return machinecode_push(ctx, regno);
+}
+
+static error_code parse_number(char *token, int32_t *value)
+{
+    char *endptr = NULL;
+    *value = strtol(token, &endptr, 10);
+    if (*endptr == 'x' && *value == 0) {
+        *value = strtol(endptr + 1, &endptr, 16);
+    }
+
+    if (*endptr != '\0') {
+        return ASM_ERR_INVNUM;
+    }
+
+    return ASM_SUCCESS;
+}
+
+static error_code parse_argument_number(struct asm_context *ctx, char *token)
+{
+    int32_t value = 0;
+    error_code rv = parse_number(token, &value);
+    if (rv != ASM_SUCCESS) {
+        report(ctx, "Invalid number %s\n", token);
+        return rv;
+    }
+
+    return machinecode_push(ctx, value);
+}
+
+static error_code parse_argument_label(struct asm_context *ctx, char *token)
+{
+    // attempt to parse as number, if not parse as label
+    int32_t address = 0;
+    if (parse_number(token, &address) == ASM_SUCCESS)
+        return machinecode_push(ctx, address);
+
+    size_t placeholder_pos = ctx->machinecode.occupied;
+    error_code rv = machinecode_push(ctx, 0xffffffff);
+    if (rv != ASM_SUCCESS)
+        return rv;
+    return label_reference(ctx, token, placeholder_pos);
+}
+
+static error_code process_instruction(struct asm_context *ctx, const instruction_info *info)
+{
+    ++ctx->instructions;
+    error_code rv = machinecode_push(ctx, info->code);
+    for (const argtype *arg = info->args; rv == ASM_SUCCESS && *arg != ARGTYPE_NONE; ++arg) {
+        if (*arg == ARGTYPE_RETURN) {
+            // the CPU pushes this word on call, not the address after call
+            rv = machinecode_push(ctx, ctx->machinecode.occupied + 1);
+            continue;
+        }
+
+        char *token = next_token(ctx);
+        if (token == NULL) {
+            report(ctx, "Missing instruction argument\n");
+            return ASM_ERR_ARGC;
+        }
+
+        switch (*arg) {
+        case ARGTYPE_REGISTER: {
+            rv = parse_argument_register(ctx, token);
+            break;
+        }
+        case ARGTYPE_NUMBER: {
+            rv = parse_argument_number(ctx, token);
+            break;
+        }
+        case ARGTYPE_LABEL: {
+            rv = parse_argument_label(ctx, token);
+            break;
+        }
+        default: {
+            break;
+        }
+        }
+    }
+    if (rv != ASM_SUCCESS)
+        return rv;
+
+    char *token = next_token(ctx);
+    if (token != NULL && token[0] != ';') {
+        report(ctx, "Extra token %s\n", token);
+        return ASM_ERR_EXTRA_TOKEN;
+    }
+
+    return ASM_SUCCESS;
+}
+
+static error_code decode_label(struct asm_context *ctx, char *label)
+{
+    char *colon = strchr(label, ':');
+    if (colon == NULL || colon[1] != '\0' || label == colon) {
+        report(ctx, "Incorrectly formated label %s\n", label);
+        return ASM_ERR_LABELFORMAT;
+    }
+
+    *colon = '\0';
+    error_code rv = define_label(ctx, label);
+    if (rv != ASM_SUCCESS)
+        return rv;
+
+    char *token = next_token(ctx);
+    if (token != NULL && token[0] != ';') {
+        report(ctx, "Extra token %s\n", token);
+        return ASM_ERR_EXTRA_TOKEN;
+    }
+
+    return ASM_SUCCESS;
+}
+
+static char *ltrim(char *line)
+{
+    while (isspace(*line) && *line != '\0')
+        ++line;
+    return line;
+}
+
+static error_code process_line(struct asm_context *ctx, char *line)
+{
+    assert(line != NULL);
+
+    line = ltrim(line);
+    if (line[0] == '\0' || line[0] == ';')
+        return ASM_SUCCESS;
+
+    char *instruction_name = strtok_r(line, DELIMITERS, &ctx->tokens);
+    if (instruction_name == NULL)
+        return ASM_ERR_TOKENIZE;
+
+    const instruction_info *instruction = seek_instruction(instruction_name);
+    if (instruction != NULL)
+        return process_instruction(ctx, instruction);
+
+    return decode_label(ctx, instruction_name);
+}
+
+static error_code patch(struct asm_context *ctx)
+{
+    const label_table *labels = &ctx->labels;
+    uint32_t *stream = ctx->machinecode.stream;
+    for (size_t i = 0; i < labels->refcount; ++i) {
+        size_t placeholder = labels->refs[i];
+        const label_record *label = &labels->labels[stream[placeholder]];
+        if (label->definition == LABEL_UNDEFINED) {
+            report(ctx, "Undefined reference to %s\n", label->label);
+            return ASM_ERR_LABEL_UNDEF;
+        }
+        if (placeholder == ctx->machinecode.occupied) {
+            report(ctx, "No instruction follows label %s\n", label->label);
+            return ASM_ERR_LABEL_EMPTY;
+        }
+        stream[placeholder] = label->definition;
+    }
+
+    return ASM_SUCCESS;
+}
+
+/*
+ * Optimizer, run between reading the source and patching it when enabled.
+ *
+ * The stream is decoded back into instructions and every label operand is
+ * turned into the index of the instruction its label stands in front of,
+ * which gives the control flow graph: an instruction falls through to the
+ * next one unless it is jmp, halt or ret, branches also lead to their target
+ * and calls to their target and their return point. The pass threads jumps
+ * past nops and chains of jmp, drops instructions that cannot be reached
+ * from the first one, nops and jumps to the next instruction, and folds
+ * movr/inc/dec chains within basic blocks. The stream is then emitted again
+ * with label operands resolved, so patch() has nothing left to do.
+ *
+ * Renumbering instructions changes the return addresses call pushes, so
+ * programs that use call or ret and also push, pop, load or store (and so
+ * could read a return address or ret to a number of their own) are left
+ * as they are, and so are programs with numeric jump or call targets.
+ */
+#define NO_TARGET ((size_t)(-1))
+#define REGISTERS 5
+#define REG_A 0
+#define REG_C 2
+#define REG_RESULT 4
+
+typedef struct
+{
+    size_t offset;    // Of the opcode in the stream as assembled
+    size_t target;    // Instruction a label operand leads to, NO_TARGET if none
+    size_t operand;   // Where the label operand is emitted
+    bool live;        // Reachable and not removed
+    bool leader;      // First instruction of a basic block
+} opt_instruction;
+
+/*
+ * Registers with a value known at the current point of a basic block.
+ * A pending register still waits for its movr to be emitted. A RESULT made
+ * pending by inc/dec of a pending register is emitted together with it as
+ * movr followed by that inc/dec.
+ */
+typedef struct
+{
+    struct machinecode out;
+    size_t instructions;
+    bool known[REGISTERS];
+    bool pending[REGISTERS];
+    uint32_t value[REGISTERS];
+    int result_from;    // Register whose inc/dec set the pending RESULT, -1 if none
+    uint32_t result_op; // That inc or dec
+} optimizer;
+
+enum
+{
+    EFFECT_FAILS = 1, // May stop the CPU with an error
+    EFFECT_ENDS = 2,  // Ends a basic block
+};
+
+static const instruction_info *instruction_by_code(uint32_t code)
+{
+    assert(code < INSTRUCTION_COUNT && instruction_set[code].code == code);
+    return &instruction_set[code];
+}
+
+static size_t instruction_length(const instruction_info *info)
+{
+    size_t length = 1;
+    for (const argtype *arg = info->args; *arg != ARGTYPE_NONE; ++arg) {
+        ++length;
+    }
+    return length;
+}
+
+static bool is_jump(uint32_t code)
+{
+    return code == 0x08 || (code >= 0x14 && code <= 0x17); // loop, jmp, jz, jnz, jgt
+}
+
+static bool is_stack_access(uint32_t code)
+{
+    return (code >= 0x0a && code <= 0x0b) || (code >= 0x11 && code <= 0x12); // load, store, push, pop
+}
+
+static bool falls_through(uint32_t code)
+{
+    return code != 0x01 && code != 0x14 && code != 0x19; // halt, jmp, ret
+}
+
+static unsigned operand_bit(const uint32_t *words, size_t n)
+{
+    return 1u << (words[n] % REGISTERS);
+}
+
+/*
+ * Registers the instruction reads, must write and may write, as bit masks.
+ */
+static unsigned effects(const uint32_t *words, unsigned *reads, unsigned *writes, unsigned *may_write)
+{
+    *reads = *writes = *may_write = 0;
+    switch (words[0]) {
+    case 0x02: // add
+    case 0x03: // sub
+    case 0x04: // mul
+        *reads = 1u << REG_A | operand_bit(words, 1);
+        *writes = 1u << REG_A | 1u << REG_RESULT;
+        return 0;
+    case 0x05: // div
+        *writes = 1u << REG_A | 1u << REG_RESULT;
+        return EFFECT_FAILS;
+    case 0x06: // inc
+    case 0x07: // dec
+        *reads = operand_bit(words, 1);
+        *writes = operand_bit(words, 1) | 1u << REG_RESULT;
+        return 0;
+    case 0x0a: // load
+    case 0x12: // pop
+        *writes = operand_bit(words, 1);
+        return EFFECT_FAILS;
+    case 0x0c: // in
+        *writes = operand_bit(words, 1);
+        *may_write = 1u << REG_C;
+        return EFFECT_FAILS;
+    case 0x0d: // get
+        *writes = operand_bit(words, 1);
+        *may_write = 1u << REG_C;
+        return 0;
+    case 0x0e: // out
+        *reads = operand_bit(words, 1);
+        return 0;
+    case 0x10: // swap
+        *reads = *writes = operand_bit(words, 1) | operand_bit(words, 2);
+        return 0;
+    case 0x13: // cmp
+        *reads = operand_bit(words, 1) | operand_bit(words, 2);
+        *writes = 1u << REG_RESULT;
+        return 0;
+    case 0x0b: // store
+    case 0x0f: // put
+    case 0x11: // push
+        return EFFECT_FAILS;
+    case 0x18: // call
+        *may_write = (1u << REGISTERS) - 1;
+        return EFFECT_FAILS | EFFECT_ENDS;
+    case 0x19: // ret
+        return EFFECT_FAILS | EFFECT_ENDS;
+    default: // halt and the jumps
+        return EFFECT_ENDS;
+    }
+}
+
+static error_code emit_instruction(optimizer *opt, uint32_t code)
+{
+    ++opt->instructions;
+    return stream_push(&opt->out, code);
+}
+
+static error_code emit_movr(optimizer *opt, int reg, uint32_t value)
+{
+    error_code rv = emit_instruction(opt, 0x09);
+    if (rv == ASM_SUCCESS)
+        rv = stream_push(&opt->out, reg);
+    if (rv == ASM_SUCCESS)
+        rv = stream_push(&opt->out, value);
+    return rv;
+}
+
+static error_code flush_register(optimizer *opt, int reg)
+{
+    if (reg == REG_RESULT && opt->result_from >= 0)
+        reg = opt->result_from;
+    if (!opt->pending[reg])
+        return ASM_SUCCESS;
+
+    opt->pending[reg] = false;
+    if (opt->result_from != reg)
+        return emit_movr(opt, reg, opt->value[reg]);
+
+    uint32_t before = opt->result_op == 0x06 ? opt->value[reg] - 1 : opt->value[reg] + 1;
+    opt->pending[REG_RESULT] = false;
+    opt->result_from = -1;
+    error_code rv = emit_movr(opt, reg, before);
+    if (rv == ASM_SUCCESS)
+        rv = emit_instruction(opt, opt->result_op);
+    if (rv == ASM_SUCCESS)
+        rv = stream_push(&opt->out, reg);
+    return rv;
+}
+
+static error_code flush_registers(optimizer *opt, unsigned mask)
+{
+    error_code rv = ASM_SUCCESS;
+    for (int reg = 0; rv == ASM_SUCCESS && reg < REGISTERS; ++reg) {
+        if (mask & 1u << reg)
+            rv = flush_register(opt, reg);
+    }
+    return rv;
+}
+
+/*
+ * Drops a pending value that is about to be overwritten unread.
+ */
+static void kill_register(optimizer *opt, int reg)
+{
+    if (reg == REG_RESULT || opt->result_from == reg)
+        opt->result_from = -1;
+    opt->pending[reg] = false;
+    opt->known[reg] = false;
+}
+
+static void forget_registers(optimizer *opt, unsigned mask)
+{
+    for (int reg = 0; reg < REGISTERS; ++reg) {
+        if (mask & 1u << reg) {
+            assert(!opt->pending[reg]);
+            opt->known[reg] = false;
+        }
+    }
+}
+
+/*
+ * Folds movr and inc/dec of a pending register into the state.
+ * Returns false if words has to be emitted.
+ */
+static bool fold(optimizer *opt, const uint32_t *words)
+{
+    if (words[0] != 0x06 && words[0] != 0x07 && words[0] != 0x09)
+        return false;
+    int reg = words[1] % REGISTERS;
+    if (words[0] == 0x09) {
+        if (!(opt->known[reg] && opt->value[reg] == words[2])) {
+            kill_register(opt, reg);
+            opt->known[reg] = opt->pending[reg] = true;
+            opt->value[reg] = words[2];
+        }
+        return true;
+    }
+    if (!opt->pending[reg])
+        return false;
+
+    uint32_t value = words[0] == 0x06 ? opt->value[reg] + 1 : opt->value[reg] - 1;
+    kill_register(opt, REG_RESULT);
+    opt->value[reg] = opt->value[REG_RESULT] = value;
+    opt->known[REG_RESULT] = opt->pending[REG_RESULT] = true;
+    opt->pending[reg] = true;
+    opt->result_from = reg;
+    opt->result_op = words[0];
+    return true;
+}
+
+static error_code emit(optimizer *opt, const uint32_t *words, opt_instruction *inst)
+{
+    if (fold(opt, words))
+        return ASM_SUCCESS;
+
+    unsigned reads, writes, may_write;
+    unsigned flags = effects(words, &reads, &writes, &may_write);
+    error_code rv;
+    if (flags & (EFFECT_FAILS | EFFECT_ENDS)) {
+        rv = flush_registers(opt, (1u << REGISTERS) - 1);
+    } else {
+        rv = flush_registers(opt, reads | may_write);
+        for (int reg = 0; reg < REGISTERS; ++reg) {
+            if ((writes & ~reads) & 1u << reg)
+                kill_register(opt, reg);
+        }
+    }
+    if (rv != ASM_SUCCESS)
+        return rv;
+
+    // inc/dec of a register already holding a known value
+    bool counted = (words[0] == 0x06 || words[0] == 0x07) && opt->known[words[1] % REGISTERS];
+    int reg = counted ? (int) (words[1] % REGISTERS) : 0;
+    uint32_t value = words[0] == 0x06 ? opt->value[reg] + 1 : opt->value[reg] - 1;
+
+    const instruction_info *info = instruction_by_code(words[0]);
+    rv = emit_instruction(opt, words[0]);
+    for (size_t i = 0; rv == ASM_SUCCESS && info->args[i] != ARGTYPE_NONE; ++i) {
+        if (info->args[i] == ARGTYPE_RETURN) {
+            rv = stream_push(&opt->out, opt->out.occupied + 1);
+            continue;
+        }
+        if (info->args[i] == ARGTYPE_LABEL)
+            inst->operand = opt->out.occupied;
+        rv = stream_push(&opt->out, words[1 + i]);
+    }
+
+    forget_registers(opt, writes | may_write);
+    if (counted) {
+        opt->known[reg] = opt->known[REG_RESULT] = true;
+        opt->value[reg] = opt->value[REG_RESULT] = value;
+    }
+    return rv;
+}
+
+/*
+ * Follows nops and jmp from instruction index to where execution really
+ * continues, giving up after count steps on a cycle of jumps.
+ */
+static size_t thread_jump(const uint32_t *stream, const opt_instruction *inst, size_t count, size_t index)
+{
+    for (size_t steps = 0; steps <= count && index < count; ++steps) {
+        uint32_t code = stream[inst[index].offset];
+        if (code == 0x00) {
+            ++index;
+        } else if (code == 0x14 && inst[index].target != index) {
+            index = inst[index].target;
+        } else {
+            break;
+        }
+    }
+    return index;
+}
+
+/*
+ * Decodes the stream into inst, with one more entry standing for the end
+ * of the code. Returns false if the program has to be left alone.
+ */
+static bool decode(const struct asm_context *ctx, opt_instruction *inst, size_t *index_at,
+        const bool *is_ref)
+{
+    const uint32_t *stream = ctx->machinecode.stream;
+    size_t occupied = ctx->machinecode.occupied;
+    size_t count = 0;
+    for (size_t pos = 0; pos < occupied; ++count) {
+        index_at[pos] = count;
+        inst[count].offset = pos;
+        pos += instruction_length(instruction_by_code(stream[pos]));
+    }
+    index_at[occupied] = count;
+    inst[count].offset = occupied;
+
+    // A frame the program can read or forge holds an index that renumbering changes
+    bool calls = false, accesses_stack = false;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t code = stream[inst[i].offset];
+        calls |= code == 0x18 || code == 0x19; // call, ret
+        accesses_stack |= is_stack_access(code);
+    }
+    if (calls && accesses_stack)
+        return false;
+
+    for (size_t i = 0; i < count; ++i) {
+        const instruction_info *info = instruction_by_code(stream[inst[i].offset]);
+        inst[i].target = NO_TARGET;
+        inst[i].live = false;
+        inst[i].leader = false;
+        if (info->args[0] != ARGTYPE_LABEL)
+            continue;
+
+        size_t operand = inst[i].offset + 1;
+        if (!is_ref[operand])
+            return false;
+        size_t definition = ctx->labels.labels[stream[operand]].definition;
+        if (definition == LABEL_UNDEFINED)
+            return false;
+        inst[i].target = index_at[definition];
+    }
+    return true;
+}
+
+static error_code optimize(struct asm_context *ctx)
+{
+    const uint32_t *stream = ctx->machinecode.stream;
+    size_t occupied = ctx->machinecode.occupied;
+    ctx->optimized = ctx->instructions;
+    if (occupied == 0)
+        return ASM_SUCCESS;
+
+    size_t count = ctx->instructions;
+    opt_instruction *inst = malloc((count + 1) * sizeof(*inst));
+    size_t *index_at = malloc((occupied + 1) * sizeof(*index_at));
+    size_t *next = malloc((count + 1) * sizeof(*next));
+    bool *is_ref = calloc(occupied, sizeof(*is_ref));
+    optimizer opt = { .result_from = -1 };
+    error_code rv = ASM_ERR_NOMEM;
+    if (inst == NULL || index_at == NULL || next == NULL || is_ref == NULL)
+        goto out;
+    for (size_t i = 0; i < ctx->labels.refcount; ++i) {
+        is_ref[ctx->labels.refs[i]] = true;
+    }
+
+    rv = ASM_SUCCESS;
+    if (!decode(ctx, inst, index_at, is_ref))
+        goto out;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (inst[i].target != NO_TARGET)
+            inst[i].target = thread_jump(stream, inst, count, inst[i].target);
+    }
+
+    // Reachability, next doubles as the work stack
+    size_t top = 0;
+    inst[0].live = true;
+    next[top++] = 0;
+    while (top > 0) {
+        size_t i = next[--top];
+        size_t successors[2] = { NO_TARGET, inst[i].target };
+        if (falls_through(stream[inst[i].offset]))
+            successors[0] = i + 1;
+        for (int s = 0; s < 2; ++s) {
+            size_t j = successors[s];
+            if (j < count && !inst[j].live) {
+                inst[j].live = true;
+                next[top++] = j;
+            }
+        }
+    }
+
+    // Drop nops and forward jumps to what executes next anyway
+    next[count] = count;
+    for (size_t i = count; i-- > 0;) {
+        uint32_t code = stream[inst[i].offset];
+        if (code == 0x00)
+            inst[i].live = false;
+        if (inst[i].live && is_jump(code) && inst[i].target > i
+                && next[inst[i].target] == next[i + 1])
+            inst[i].live = false;
+        next[i] = inst[i].live ? i : next[i + 1];
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (inst[i].live && inst[i].target != NO_TARGET) {
+            inst[i].target = next[inst[i].target];
+            inst[inst[i].target].leader = true;
+        }
+    }
+    inst[count].leader = true;
+
+    // Labels go with the instruction they stand in front of, or the next one kept
+    for (size_t n = 0; n < ctx->labels.num_labels; ++n) {
+        label_record *label = &ctx->labels.labels[n];
+        if (label->definition != LABEL_UNDEFINED)
+            label->definition = index_at[label->definition];
+    }
+
+    // Emit live instructions, new offsets go to index_at
+    for (size_t i = 0; rv == ASM_SUCCESS && i <= count; ++i) {
+        if (inst[i].leader) {
+            rv = flush_registers(&opt, (1u << REGISTERS) - 1);
+            forget_registers(&opt, (1u << REGISTERS) - 1);
+        }
+        index_at[i] = opt.out.occupied;
+        if (rv == ASM_SUCCESS && i < count && inst[i].live)
+            rv = emit(&opt, stream + inst[i].offset, &inst[i]);
+    }
+    if (rv != ASM_SUCCESS) {
+        free(opt.out.stream);
+        goto out;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (inst[i].live && inst[i].target != NO_TARGET)
+            opt.out.stream[inst[i].operand] = index_at[inst[i].target];
+    }
+
+    for (size_t n = 0; n < ctx->labels.num_labels; ++n) {
+        label_record *label = &ctx->labels.labels[n];
+        if (label->definition != LABEL_UNDEFINED)
+            label->definition = index_at[label->definition];
+    }
+    free(ctx->machinecode.stream);
+    ctx->machinecode = opt.out;
+    ctx->labels.refcount = 0; // Label operands are resolved already
+    ctx->optimized = opt.instructions;
+
+out:
+    free(inst);
+    free(index_at);
+    free(next);
+    free(is_ref);
+    return rv;
+}
+
+static error_code finish(struct asm_context *ctx)
+{
+    if (ctx->optimize) {
+        error_code rv = optimize(ctx);
+        if (rv != ASM_SUCCESS)
+            return rv;
+    } else {
+        ctx->optimized = ctx->instructions;
+    }
+    return patch(ctx);
+}
+
+/*
+ * Returns a context for assembling sources, NULL if there is no memory.
+ * Messages about errors in the source go to stderr.
+ */
+struct asm_context *asm_create(void)
+{
+    struct asm_context *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    ctx->errors = stderr;
+    ctx->labels.index_size = INITIAL_INDEX_SIZE;
+    ctx->labels.index = calloc(INITIAL_INDEX_SIZE, sizeof(*ctx->labels.index));
+    if (ctx->labels.index == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void asm_destroy(struct asm_context *ctx)
+{
+    if (ctx == NULL)
+        return;
+    free_labels(&ctx->labels);
+    free(ctx->machinecode.stream);
+    free(ctx->line);
+    free(ctx);
+}
+
+/*
+ * Sends messages about errors in the source to errors, NULL drops them.
+ */
+void asm_set_errors(struct asm_context *ctx, FILE *errors)
+{
+    assert(ctx != NULL);
+    ctx->errors = errors;
+}
+
+static void begin(struct asm_context *ctx)
+{
+    ctx->machinecode.occupied = 0;
+    ctx->instructions = 0;
+    reset_labels(&ctx->labels);
+}
+
+static error_code finish_line(struct asm_context *ctx, size_t lineno, error_code rv)
+{
+    if (rv != ASM_SUCCESS)
+        report(ctx, "Error processing line %zu\n", lineno);
+    return rv;
+}
+
+/*
+ * Assembles size bytes of source. On success the result is available
+ * through asm_words until the next call.
+ * Returns ASM_SUCCESS or the first error, already reported.
+ */
+enum asm_status asm_assemble(struct asm_context *ctx, const char *source, size_t size)
+{
+    assert(ctx != NULL);
+    assert(source != NULL || size == 0);
+    begin(ctx);
+
+    error_code rv = ASM_SUCCESS;
+    size_t lineno = 0;
+    for (size_t pos = 0; rv == ASM_SUCCESS && pos < size; ++lineno) {
+        const char *newline = memchr(source + pos, '\n', size - pos);
+        size_t length = newline != NULL ? (size_t) (newline - source - pos) + 1 : size - pos;
+        if (length + 1 > ctx->line_capacity) {
+            size_t capacity = ctx->line_capacity > 0 ? ctx->line_capacity : 256;
+            while (capacity < length + 1) {
+                capacity *= 2;
+            }
+            char *line = realloc(ctx->line, capacity);
+            if (line == NULL)
+                return ASM_ERR_NOMEM;
+            ctx->line = line;
+            ctx->line_capacity = capacity;
+        }
+        memcpy(ctx->line, source + pos, length);
+        ctx->line[length] = '\0';
+        pos += length;
+        rv = finish_line(ctx, lineno, process_line(ctx, ctx->line));
+    }
+
+    return rv == ASM_SUCCESS ? finish(ctx) : rv;
+}
+
+/*
+ * Same as asm_assemble for the rest of source.
+ */
+enum asm_status asm_assemble_file(struct asm_context *ctx, FILE *source)
+{
+    assert(ctx != NULL);
+    assert(source != NULL);
+    begin(ctx);
+
+    error_code rv = ASM_SUCCESS;
+    for (size_t lineno = 0;
+            rv == ASM_SUCCESS && getline(&ctx->line, &ctx->line_capacity, source) >= 0;
+            ++lineno) {
+        rv = finish_line(ctx, lineno, process_line(ctx, ctx->line));
+    }
+
+    return rv == ASM_SUCCESS ? finish(ctx) : rv;
+}
+
+/*
+ * Returns the words of the last program assembled and stores their number
+ * in count. The words belong to the context.
+ */
+const uint32_t *asm_words(const struct asm_context *ctx, size_t *count)
+{
+    assert(ctx != NULL);
+    assert(count != NULL);
+    *count = ctx->machinecode.occupied;
+    return ctx->machinecode.stream;
+}
+
+/*
+ * Turns the optimizing pass (see optimize()) on or off for the following
+ * sources. It is off in a new context.
+ */
+void asm_set_optimize(struct asm_context *ctx, bool enable)
+{
+    assert(ctx != NULL);
+    ctx->optimize = enable;
+}
+
+/*
+ * Stores how many instructions the last program had in the source and how
+ * many are left after optimizing it, the same number when not optimizing.
+ */
+void asm_instruction_counts(const struct asm_context *ctx, size_t *before, size_t *after)
+{
+    assert(ctx != NULL);
+    *before = ctx->instructions;
+    *after = ctx->optimized;
+}
+
+/*
+ * Returns how many labels the last program defined.
+ */
+size_t asm_label_count(const struct asm_context *ctx)
+{
+    assert(ctx != NULL);
+    return ctx->labels.num_labels;
+}
+
+/*
+ * Returns the name of label n of the last program, in the order of their
+ * first use, and stores the index of the word it stands in front of in
+ * index. The name belongs to the context.
+ */
+const char *asm_label(const struct asm_context *ctx, size_t n, uint32_t *index)
+{
+    assert(ctx != NULL);
+    assert(n < ctx->labels.num_labels);
+    *index = (uint32_t) ctx->labels.labels[n].definition;
+    return ctx->labels.labels[n].label;
+}
+
+size_t asm_instruction_count(void)
+{
+    return INSTRUCTION_COUNT;
+}
+
+/*
+ * Returns the mnemonic of the instruction with opcode code and stores the
+ * kinds of the operands written after it in operands, their number in
+ * operand_count. The return address of call is implicit and left out.
+ */
+const char *asm_instruction(uint32_t code, enum asm_operand operands[ASM_MAX_OPERANDS],
+        size_t *operand_count)
+{
+    const instruction_info *info = instruction_by_code(code);
+    size_t count = 0;
+    for (const argtype *arg = info->args; *arg != ARGTYPE_NONE; ++arg) {
+        if (*arg == ARGTYPE_RETURN) {
+            continue;
+        }
+        assert(count < ASM_MAX_OPERANDS);
+        operands[count++] = *arg == ARGTYPE_REGISTER ? ASM_OPERAND_REGISTER
+                : *arg == ARGTYPE_NUMBER ? ASM_OPERAND_NUMBER
+                : ASM_OPERAND_LABEL;
+    }
+    *operand_count = count;
+    return info->name;
+}
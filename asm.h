@@ -0,0 +1,83 @@
+#ifndef ASM_H
+#define ASM_H
+
+/*
+ * Assembler library (asm.c), the engine of the compiler tool.
+ *
+ * All state lives in a struct asm_context, so separate contexts can be used
+ * from separate threads. A context can assemble any number of sources one
+ * after the other and keeps its buffers between them, which makes
+ * assembling many small programs cheap:
+ *
+ *   struct asm_context *ctx = asm_create();
+ *   if (asm_assemble(ctx, source, strlen(source)) == ASM_SUCCESS) {
+ *       size_t count;
+ *       const uint32_t *words = asm_words(ctx, &count);
+ *       int32_t *memory = cpu_create_memory_from_words(words, count, capacity, &bottom);
+ *       ...
+ *   }
+ *   asm_destroy(ctx);
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum asm_status
+{
+    ASM_SUCCESS = 0,
+    ASM_ERR_TOKENIZE = 1,
+    ASM_ERR_PARSE = 2,
+    ASM_ERR_ARGC = 3,
+    ASM_ERR_LABEL_DUPLICITY = 4,
+    ASM_ERR_EXTRA_TOKEN = 5,
+    ASM_ERR_INVREG = 6,
+    ASM_ERR_INVNUM = 7,
+    ASM_ERR_LABELFORMAT = 8,
+    ASM_ERR_LABEL_UNDEF = 10,
+    ASM_ERR_LABEL_EMPTY = 11,
+    ASM_ERR_NOMEM = 12
+};
+
+struct asm_context;
+
+struct asm_context *asm_create(void);
+
+void asm_destroy(struct asm_context *ctx);
+
+void asm_set_errors(struct asm_context *ctx, FILE *errors);
+
+enum asm_status asm_assemble(struct asm_context *ctx, const char *source, size_t size);
+
+enum asm_status asm_assemble_file(struct asm_context *ctx, FILE *source);
+
+const uint32_t *asm_words(const struct asm_context *ctx, size_t *count);
+
+void asm_set_optimize(struct asm_context *ctx, bool enable);
+
+void asm_instruction_counts(const struct asm_context *ctx, size_t *before, size_t *after);
+
+size_t asm_label_count(const struct asm_context *ctx);
+
+const char *asm_label(const struct asm_context *ctx, size_t n, uint32_t *index);
+
+/*
+ * The instruction set as the assembler reads it, for tools that write
+ * assembly. Opcodes run from 0 to asm_instruction_count() - 1.
+ */
+enum asm_operand
+{
+    ASM_OPERAND_REGISTER,
+    ASM_OPERAND_NUMBER,
+    ASM_OPERAND_LABEL
+};
+
+#define ASM_MAX_OPERANDS 2
+
+size_t asm_instruction_count(void);
+
+const char *asm_instruction(uint32_t code, enum asm_operand operands[ASM_MAX_OPERANDS],
+        size_t *operand_count);
+
+#endif // ASM_H
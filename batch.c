@@ -0,0 +1,306 @@
+/*
+ * Batch runner.
+ *
+ * Runs one shared program against many inputs on a pool of threads. Each
+ * worker owns a range of jobs and takes them from the front; a worker that
+ * runs out steals the back half of another worker's range, so long jobs do
+ * not leave the other cores idle. A worker keeps one CPU made from the
+ * program and restarts it for every job, with guest I/O going to that
+ * job's buffers.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+struct batch_queue
+{
+    pthread_mutex_t lock;
+    size_t next; // First job not taken yet
+    size_t end;
+};
+
+struct batch
+{
+    struct cpu_program *program;
+    struct cpu_batch_job *jobs;
+    size_t steps;
+    bool lockstep; // Run jobs in groups with cpu_run_lockstep
+    unsigned workers;
+    struct batch_queue *queues;
+};
+
+struct batch_worker
+{
+    struct batch *batch;
+    unsigned index;
+};
+
+/*
+ * Guest I/O of a single job: input from the job, output into a buffer
+ * that grows as needed.
+ */
+struct job_io
+{
+    const char *input;
+    size_t input_size;
+    size_t input_pos;
+    char *output;
+    size_t output_size;
+    size_t output_capacity;
+};
+
+static long job_read(void *context, char *buf, size_t size)
+{
+    struct job_io *io = context;
+    size_t left = io->input_size - io->input_pos;
+    if (size > left) {
+        size = left;
+    }
+    memcpy(buf, io->input + io->input_pos, size);
+    io->input_pos += size;
+    return (long) size;
+}
+
+static int job_write(void *context, const char *buf, size_t size)
+{
+    struct job_io *io = context;
+    if (io->output_capacity - io->output_size < size) {
+        size_t capacity = io->output_capacity == 0 ? 4096 : io->output_capacity;
+        while (capacity - io->output_size < size) {
+            capacity *= 2;
+        }
+        char *bigger = realloc(io->output, capacity);
+        if (bigger == NULL) {
+            return -1;
+        }
+        io->output = bigger;
+        io->output_capacity = capacity;
+    }
+    memcpy(io->output + io->output_size, buf, size);
+    io->output_size += size;
+    return 0;
+}
+
+static const struct cpu_io_ops job_ops = { job_read, job_write };
+
+static bool take_job(struct batch *batch, unsigned self, size_t *job)
+{
+    struct batch_queue *own = &batch->queues[self];
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        *job = own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    // Only ever one lock held at a time, so workers never deadlock
+    for (unsigned k = 1; k < batch->workers; ++k) {
+        struct batch_queue *victim = &batch->queues[(self + k) % batch->workers];
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        if (left == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        size_t start = victim->end - (left + 1) / 2;
+        size_t end = victim->end;
+        victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&own->lock);
+        own->next = start + 1;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        *job = start;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Puts a CPU that ran a previous job back into its initial state.
+ */
+static void restart(struct cpu *cpu)
+{
+    cpu_reset(cpu);
+    cpu->inst_index = 0;
+}
+
+static void start_job(struct cpu *cpu, struct cpu_batch_job *job, struct job_io *io)
+{
+    io->input = job->input;
+    io->input_size = job->input_size;
+    io->input_pos = 0;
+    io->output = NULL;
+    io->output_size = 0;
+    io->output_capacity = 0;
+    restart(cpu);
+    cpu_set_io(cpu, &job_ops, io, 0);
+}
+
+static void finish_job(struct cpu *cpu, struct cpu_batch_job *job, struct job_io *io)
+{
+    if (cpu_flush_output(cpu) != 0) {
+        job->error = ENOMEM;
+    }
+    cpu_set_io(cpu, &job_ops, NULL, 0); // Nothing left to flush into io
+
+    job->output = io->output;
+    job->output_size = io->output_size;
+    job->status = cpu->status;
+    job->stack_size = cpu->stack_size;
+    memcpy(job->registers, cpu->registers, sizeof(job->registers));
+}
+
+/*
+ * Runs one job on a CPU made from the job's program, which may have run
+ * other jobs before. Also used by the server (serve.c).
+ */
+void batch_run_job(struct cpu *cpu, struct cpu_batch_job *job, size_t steps)
+{
+    struct job_io io;
+    start_job(cpu, job, &io);
+    job->steps = cpu_run_decoded(cpu, steps);
+    finish_job(cpu, job, &io);
+}
+
+/*
+ * Takes one job at a time, or in lockstep mode as many as there are
+ * lanes, with a CPU kept for each.
+ */
+static void *worker_main(void *argument)
+{
+    struct batch_worker *worker = argument;
+    struct batch *batch = worker->batch;
+    const unsigned lanes = batch->lockstep ? LOCKSTEP_LANES : 1;
+    struct cpu *cpus[LOCKSTEP_LANES] = { NULL };
+    struct cpu_batch_job *records[LOCKSTEP_LANES];
+    struct job_io io[LOCKSTEP_LANES];
+    long long results[LOCKSTEP_LANES];
+    int error = 0;
+    size_t job;
+
+    for (;;) {
+        unsigned taken = 0;
+        while (taken < lanes && take_job(batch, worker->index, &job)) {
+            struct cpu_batch_job *record = &batch->jobs[job];
+            record->output = NULL;
+            record->output_size = 0;
+            record->error = 0;
+            struct cpu **cpu = &cpus[taken];
+            if (*cpu == NULL && error == 0 && (*cpu = cpu_program_instance(batch->program)) == NULL) {
+                error = errno;
+            }
+            if (*cpu == NULL) {
+                record->error = error;
+                continue;
+            }
+            start_job(*cpu, record, &io[taken]);
+            records[taken++] = record;
+        }
+        if (taken == 0) {
+            break;
+        }
+
+        if (batch->lockstep) {
+            cpu_run_lockstep(cpus, taken, batch->steps, results);
+        } else {
+            results[0] = cpu_run_decoded(cpus[0], batch->steps);
+        }
+        for (unsigned i = 0; i < taken; ++i) {
+            records[i]->steps = results[i];
+            finish_job(cpus[i], records[i], &io[i]);
+        }
+    }
+
+    for (unsigned i = 0; i < lanes; ++i) {
+        if (cpus[i] != NULL) {
+            cpu_destroy(cpus[i]);
+            free(cpus[i]);
+        }
+    }
+    return NULL;
+}
+
+static int run_batch(struct cpu_program *program, struct cpu_batch_job *jobs, size_t job_count,
+        size_t steps, unsigned threads, bool lockstep)
+{
+    assert(program != NULL);
+    assert(jobs != NULL || job_count == 0);
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned) online : 1;
+    }
+    if (threads > job_count) {
+        threads = job_count > 0 ? (unsigned) job_count : 1;
+    }
+
+    struct batch batch = { program, jobs, steps, lockstep, threads, NULL };
+    batch.queues = malloc(threads * sizeof(*batch.queues));
+    struct batch_worker *workers = malloc(threads * sizeof(*workers));
+    pthread_t *handles = malloc(threads * sizeof(*handles));
+    if (batch.queues == NULL || workers == NULL || handles == NULL) {
+        free(batch.queues);
+        free(workers);
+        free(handles);
+        return -1;
+    }
+
+    // Contiguous ranges keep neighbouring jobs on the same worker
+    for (unsigned i = 0; i < threads; ++i) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].next = job_count * i / threads;
+        batch.queues[i].end = job_count * (i + 1) / threads;
+        workers[i].batch = &batch;
+        workers[i].index = i;
+    }
+
+    // The calling thread is worker 0; jobs of workers that fail to start get stolen
+    unsigned started = 1;
+    for (unsigned i = 1; i < threads; ++i) {
+        if (pthread_create(&handles[started], NULL, worker_main, &workers[i]) == 0) {
+            ++started;
+        }
+    }
+    worker_main(&workers[0]);
+    for (unsigned i = 1; i < started; ++i) {
+        pthread_join(handles[i], NULL);
+    }
+
+    for (unsigned i = 0; i < threads; ++i) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    }
+    free(batch.queues);
+    free(workers);
+    free(handles);
+    return 0;
+}
+
+/*
+ * Runs program once per job, for at most steps steps each, on up to
+ * threads threads (0 picks one per online CPU core).
+ * Returns 0 once all jobs are done, -1 if the runner could not be set up.
+ */
+int cpu_run_batch(struct cpu_program *program, struct cpu_batch_job *jobs, size_t job_count,
+        size_t steps, unsigned threads)
+{
+    return run_batch(program, jobs, job_count, steps, threads, false);
+}
+
+/*
+ * Same as cpu_run_batch, but every worker runs its jobs LOCKSTEP_LANES at
+ * a time with cpu_run_lockstep. Pays off when the jobs mostly take the
+ * same path through the program.
+ */
+int cpu_run_batch_lockstep(struct cpu_program *program, struct cpu_batch_job *jobs,
+        size_t job_count, size_t steps, unsigned threads)
+{
+    return run_batch(program, jobs, job_count, steps, threads, true);
+}
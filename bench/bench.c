@@ -0,0 +1,284 @@
+/*
+ * Emulator benchmark.
+ *
+ * Runs guest kernels on every engine a number of times and prints one CSV
+ * line per kernel and engine:
+ *
+ *   kernel,engine,instructions,repetitions,ns_per_instruction,stddev_ns,
+ *   min_ns,instructions_per_second
+ *
+ * ns_per_instruction is the mean over the repetitions, stddev_ns its
+ * sample standard deviation and instructions_per_second follows from the
+ * mean. Every repetition starts a fresh CPU from the same loaded program,
+ * so the pre-decoding is not timed and JIT compilation is. Guest output is
+ * thrown away and guest input is empty.
+ *
+ * With -p every timed run also reads the hardware counters (cpu_run_perf)
+ * and four columns follow: ipc, cycles, branch_misses and l1d_misses per
+ * guest instruction, summed over the repetitions. A column is empty when
+ * its counter is not available.
+ *
+ * Usage: bench [-r repetitions] [-e engine,...] [-p] KERNEL.bin...
+ */
+#include "cpu.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_REPETITIONS 5
+#define STACK_CAPACITY 256
+
+static long long run_step(struct cpu *cpu, size_t steps)
+{
+    long long executed = 0;
+    while ((size_t) executed < steps) {
+        ++executed;
+        if (!cpu_step(cpu)) {
+            break;
+        }
+    }
+    return executed;
+}
+
+struct engine
+{
+    const char *name;
+    long long (*run)(struct cpu *cpu, size_t steps);
+};
+
+static const struct engine engines[] = {
+    { "step", run_step },
+    { "run", cpu_run },
+    { "decoded", cpu_run_decoded },
+    { "jit", cpu_run_jit },
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+static long read_nothing(void *context, char *buf, size_t size)
+{
+    (void) context;
+    (void) buf;
+    (void) size;
+    return 0;
+}
+
+static int discard(void *context, const char *buf, size_t size)
+{
+    (void) context;
+    (void) buf;
+    (void) size;
+    return 0;
+}
+
+static const struct cpu_io_ops null_ops = { read_nothing, discard };
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/*
+ * Runs program once on engine. Stores the number of instructions it
+ * executed and the time it took, returns false if the guest did not halt.
+ * If perf is not NULL, the run goes through cpu_run_perf and its counters
+ * are stored there.
+ */
+static bool run_once(struct cpu_program *program, const struct engine *engine,
+        long long *instructions, double *ns, struct cpu_perf_result *perf)
+{
+    struct cpu *cpu = cpu_program_instance(program);
+    if (cpu == NULL) {
+        perror("bench: cpu_program_instance");
+        return false;
+    }
+    cpu_set_io(cpu, &null_ops, NULL, 0);
+
+    double start = now_ns();
+    long long result;
+    if (perf != NULL) {
+        *perf = cpu_run_perf(cpu, engine->run, INT_MAX);
+        result = perf->steps;
+    } else {
+        result = engine->run(cpu, INT_MAX);
+    }
+    cpu_flush_output(cpu);
+    *ns = now_ns() - start;
+
+    bool halted = cpu_get_status(cpu) == CPU_HALTED;
+    *instructions = result < 0 ? -result : result;
+    cpu_destroy(cpu);
+    free(cpu);
+    return halted;
+}
+
+static const char *kernel_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+// Prints the counter columns, the counts are sums over all repetitions
+static void print_counters(const struct cpu_perf_result *perf, double instructions)
+{
+    const unsigned long long counts[] = { perf->cycles, perf->branch_misses, perf->l1d_misses };
+    const unsigned bits[] = { CPU_PERF_CYCLES, CPU_PERF_BRANCH_MISSES, CPU_PERF_L1D_MISSES };
+    unsigned ipc = CPU_PERF_CYCLES | CPU_PERF_INSTRUCTIONS;
+    if ((perf->valid & ipc) == ipc && perf->cycles != 0) {
+        printf(",%.3f", (double) perf->instructions / (double) perf->cycles);
+    } else {
+        printf(",");
+    }
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+        if (perf->valid & bits[i]) {
+            printf(",%.4f", (double) counts[i] / instructions);
+        } else {
+            printf(",");
+        }
+    }
+}
+
+static bool bench_kernel(const char *path, const bool *enabled, int repetitions, bool counters)
+{
+    struct cpu_program *program = cpu_program_load(path, STACK_CAPACITY);
+    if (program == NULL) {
+        fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    long long expected = -1;
+    for (size_t e = 0; ok && e < ENGINE_COUNT; ++e) {
+        if (!enabled[e]) {
+            continue;
+        }
+        long long instructions;
+        double ns;
+        // Untimed first run, to fault in the pages and warm the caches
+        if (!run_once(program, &engines[e], &instructions, &ns, NULL)) {
+            fprintf(stderr, "bench: %s does not halt on %s\n", path, engines[e].name);
+            ok = false;
+            break;
+        }
+        if (expected >= 0 && instructions != expected) {
+            fprintf(stderr, "bench: %s runs %lld instructions on %s, expected %lld\n",
+                    path, instructions, engines[e].name, expected);
+            ok = false;
+            break;
+        }
+        expected = instructions;
+
+        double sum = 0, sum_squares = 0, min = INFINITY;
+        struct cpu_perf_result total = { .valid = ~0u };
+        for (int r = 0; ok && r < repetitions; ++r) {
+            struct cpu_perf_result perf;
+            if (!run_once(program, &engines[e], &instructions, &ns, counters ? &perf : NULL)) {
+                ok = false;
+                break;
+            }
+            if (counters) {
+                total.valid &= perf.valid;
+                total.cycles += perf.cycles;
+                total.instructions += perf.instructions;
+                total.branch_misses += perf.branch_misses;
+                total.l1d_misses += perf.l1d_misses;
+            }
+            double per_instruction = ns / (double) instructions;
+            sum += per_instruction;
+            sum_squares += per_instruction * per_instruction;
+            min = per_instruction < min ? per_instruction : min;
+        }
+        if (!ok) {
+            break;
+        }
+        double mean = sum / repetitions;
+        double variance = repetitions > 1
+                ? (sum_squares - sum * mean) / (repetitions - 1)
+                : 0;
+        printf("%s,%s,%lld,%d,%.3f,%.3f,%.3f,%.0f", kernel_name(path), engines[e].name,
+                instructions, repetitions, mean, sqrt(variance > 0 ? variance : 0), min,
+                1e9 / mean);
+        if (counters) {
+            print_counters(&total, (double) instructions * repetitions);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    cpu_program_destroy(program);
+    return ok;
+}
+
+static bool select_engines(char *list, bool *enabled)
+{
+    memset(enabled, 0, ENGINE_COUNT * sizeof(*enabled));
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        size_t e = 0;
+        while (e < ENGINE_COUNT && strcmp(engines[e].name, name) != 0) {
+            ++e;
+        }
+        if (e == ENGINE_COUNT) {
+            fprintf(stderr, "bench: unknown engine %s\n", name);
+            return false;
+        }
+        enabled[e] = true;
+    }
+    return true;
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "Usage: bench [-r repetitions] [-e engine,...] [-p] KERNEL.bin...\n");
+    fprintf(stderr, "Engines: step, run, decoded, jit (default all)\n");
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int repetitions = DEFAULT_REPETITIONS;
+    bool counters = false;
+    bool enabled[ENGINE_COUNT];
+    for (size_t e = 0; e < ENGINE_COUNT; ++e) {
+        enabled[e] = true;
+    }
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            char *end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 1 || value > INT_MAX) {
+                return usage();
+            }
+            repetitions = (int) value;
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            if (!select_engines(argv[++i], enabled)) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            counters = true;
+        } else {
+            return usage();
+        }
+    }
+    if (i == argc) {
+        return usage();
+    }
+
+    printf("kernel,engine,instructions,repetitions,ns_per_instruction,stddev_ns,min_ns,"
+           "instructions_per_second%s\n",
+            counters ? ",ipc,cycles,branch_misses,l1d_misses" : "");
+    int status = 0;
+    for (; i < argc; ++i) {
+        if (!bench_kernel(argv[i], enabled, repetitions, counters)) {
+            status = 1;
+        }
+    }
+    return status;
+}
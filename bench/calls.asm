@@ -0,0 +1,27 @@
+; Call/ret recursion: naive Fibonacci, about 20 million instructions
+; Register A counts the leaves of fib(22), 90 times over
+
+movr d 2
+movr c 90
+
+again:
+	movr b 22
+	call fib
+	dec c
+	loop again
+	halt
+
+; Adds fib(B) to A, for B >= 1
+fib:
+	cmp b d
+	jgt split
+	inc a
+	ret
+split:
+	dec b
+	push b
+	call fib
+	pop b
+	dec b
+	call fib
+	ret
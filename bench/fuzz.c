@@ -0,0 +1,601 @@
+/*
+ * Differential fuzzer for the execution engines.
+ *
+ * Generates random programs that assemble (every instruction of the
+ * assembler's instruction set with random registers, numbers and labels)
+ * and runs each of them on every engine with the same inputs:
+ *
+ *   step     cpu_step in a loop, the reference
+ *   run      cpu_run
+ *   decoded  cpu_run_decoded
+ *   jit      cpu_run_jit
+ *   slice    cpu_run_slice over cpu_run_jit in short quanta
+ *   lockstep cpu_run_lockstep with all the inputs of a program at a time
+ *
+ * Every engine has to end with the same registers, stack size, status,
+ * guest output and run result as step. Each program is assembled with
+ * the optimizer (-O) as well and run on the first engine, and where the
+ * plain build halts or fails the optimized one has to end with the same
+ * registers, status and output. The first difference is reported with
+ * the program and the run stops with exit status 1; the seed it prints
+ * reproduces it.
+ *
+ * The time every engine spent running is summed over all programs and
+ * printed as CSV, one line per engine:
+ *
+ *   label,seed,engine,programs,runs,instructions,ns_per_instruction,
+ *   instructions_per_second
+ *
+ * With -o the lines are appended to a file instead (with the header if
+ * it is empty), so successive builds can be compared; -l sets the label,
+ * e.g. the commit. The programs are short, so the numbers include the
+ * start-up of every run and are no substitute for bench.
+ *
+ * Usage: fuzz [-n programs] [-s seed] [-e engine,...] [-l label] [-o file]
+ */
+#include "asm.h"
+#include "cpu.h"
+#include "image.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PROGRAMS 1000
+#define MAX_INSTRUCTIONS 48
+#define INPUTS 8          // Runs per program, one lockstep group
+#define INPUT_SIZE 24
+#define STEPS 20000       // Budget of every run
+#define OUTPUT_CAPACITY (STEPS * 12) // Every out writes at most 11 characters
+
+static uint64_t rng_state;
+
+// xorshift64*, the same numbers on every host
+static uint64_t random_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static uint32_t random_below(uint32_t bound)
+{
+    return (uint32_t) (random_next() >> 32) % bound;
+}
+
+struct source
+{
+    char text[MAX_INSTRUCTIONS * 32 + 64];
+    size_t size;
+};
+
+static void append(struct source *source, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void append(struct source *source, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(source->text + source->size, sizeof(source->text) - source->size,
+            format, args);
+    va_end(args);
+    source->size += (size_t) length;
+}
+
+/*
+ * Numbers are mostly small, so load/store indices, loop counters and
+ * divisors hit the interesting cases, and now and then the extremes.
+ */
+static int32_t random_number(void)
+{
+    static const int32_t extremes[] = { INT32_MIN, INT32_MIN + 1, -1, INT32_MAX };
+    switch (random_below(8)) {
+    case 0:
+        return extremes[random_below(4)];
+    case 1:
+        return (int32_t) (uint32_t) random_next();
+    default:
+        return (int32_t) random_below(20) - 4;
+    }
+}
+
+/*
+ * Writes a random program: every instruction behind its own label, so
+ * jumps can go anywhere, and a halt behind the last one. Returns the
+ * stack capacity to run it with.
+ */
+static size_t generate(struct source *source)
+{
+    static const char *const registers[] = { "a", "b", "c", "d", "result" };
+    size_t count = 1 + random_below(MAX_INSTRUCTIONS);
+    source->size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        enum asm_operand operands[ASM_MAX_OPERANDS];
+        size_t operand_count;
+        const char *name = asm_instruction(random_below((uint32_t) asm_instruction_count()),
+                operands, &operand_count);
+        append(source, "l%zu:\n%s", i, name);
+        for (size_t o = 0; o < operand_count; ++o) {
+            switch (operands[o]) {
+            case ASM_OPERAND_REGISTER:
+                append(source, " %s", registers[random_below(5)]);
+                break;
+            case ASM_OPERAND_NUMBER:
+                append(source, " %" PRId32, random_number());
+                break;
+            case ASM_OPERAND_LABEL:
+                append(source, " l%" PRIu32, random_below((uint32_t) count + 1));
+                break;
+            }
+        }
+        append(source, "\n");
+    }
+    append(source, "l%zu:\nhalt\n", count);
+
+    // Small stacks overflow, large ones let call chains go deep
+    static const size_t capacities[] = { 1, 2, 4, 16, 256 };
+    return capacities[random_below(5)];
+}
+
+struct outcome
+{
+    int32_t registers[REGISTER_RESULT + 1];
+    int32_t stack_size;
+    enum cpu_status status;
+    long long result;
+    size_t output_size;
+    char output[OUTPUT_CAPACITY];
+};
+
+static long long run_step(struct cpu *cpu, size_t steps)
+{
+    // What cpu_run does without threaded dispatch
+    long long executed = 0;
+    while ((size_t) executed < steps) {
+        int result = cpu_step(cpu);
+        ++executed;
+        if (cpu_get_status(cpu) == CPU_HALTED) {
+            break;
+        }
+        if (result == 0) {
+            return -executed;
+        }
+    }
+    return executed;
+}
+
+static size_t slice_quantum;
+
+static long long run_slice(struct cpu *cpu, size_t steps)
+{
+    struct cpu_slice slice = { .run = cpu_run_jit, .budget = steps };
+    while (cpu_run_slice(cpu, &slice, slice_quantum) == CPU_SLICE_YIELDED) {
+    }
+    return slice.failed ? -(long long) slice.executed : (long long) slice.executed;
+}
+
+static void each(struct cpu **cpus, size_t count, size_t steps, long long *results,
+        long long (*run)(struct cpu *cpu, size_t steps))
+{
+    for (size_t i = 0; i < count; ++i) {
+        results[i] = run(cpus[i], steps);
+    }
+}
+
+#define EACH(name, run)                                                        \
+    static void name(struct cpu **cpus, size_t count, size_t steps,            \
+            long long *results)                                                \
+    {                                                                          \
+        each(cpus, count, steps, results, run);                                \
+    }
+
+EACH(each_step, run_step)
+EACH(each_run, cpu_run)
+EACH(each_decoded, cpu_run_decoded)
+EACH(each_jit, cpu_run_jit)
+EACH(each_slice, run_slice)
+
+struct engine
+{
+    const char *name;
+    void (*run)(struct cpu **cpus, size_t count, size_t steps, long long *results);
+    bool enabled;
+    unsigned long long instructions;
+    double ns;
+};
+
+static struct engine engines[] = {
+    { "step", each_step, true, 0, 0 },
+    { "run", each_run, true, 0, 0 },
+    { "decoded", each_decoded, true, 0, 0 },
+    { "jit", each_jit, true, 0, 0 },
+    { "slice", each_slice, true, 0, 0 },
+    { "lockstep", cpu_run_lockstep, true, 0, 0 },
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/*
+ * Runs every input on engine and stores what the runs ended with in
+ * outcomes. Returns false if a CPU could not be made.
+ */
+static bool run_engine(struct cpu_program *program, struct engine *engine,
+        char inputs[INPUTS][INPUT_SIZE], struct outcome *outcomes)
+{
+    struct cpu *cpus[INPUTS];
+    for (size_t i = 0; i < INPUTS; ++i) {
+        cpus[i] = cpu_program_instance(program);
+        if (cpus[i] == NULL) {
+            perror("fuzz: cpu_program_instance");
+            while (i-- > 0) {
+                cpu_destroy(cpus[i]);
+                free(cpus[i]);
+            }
+            return false;
+        }
+        cpu_set_io_memory(cpus[i], inputs[i], INPUT_SIZE, outcomes[i].output, OUTPUT_CAPACITY);
+    }
+
+    long long results[INPUTS];
+    double start = now_ns();
+    engine->run(cpus, INPUTS, STEPS, results);
+    engine->ns += now_ns() - start;
+
+    for (size_t i = 0; i < INPUTS; ++i) {
+        struct outcome *outcome = &outcomes[i];
+        for (int r = 0; r <= REGISTER_RESULT; ++r) {
+            outcome->registers[r] = cpu_get_register(cpus[i], (enum cpu_register) r);
+        }
+        outcome->stack_size = cpu_get_stack_size(cpus[i]);
+        outcome->status = cpu_get_status(cpus[i]);
+        outcome->result = results[i];
+        outcome->output_size = cpu_memory_output_size(cpus[i]);
+        engine->instructions += (unsigned long long) (results[i] < 0 ? -results[i] : results[i]);
+        cpu_destroy(cpus[i]);
+        free(cpus[i]);
+    }
+    return true;
+}
+
+// Returns the name of the first thing that differs, NULL if none does
+static const char *difference(const struct outcome *expected, const struct outcome *actual)
+{
+    if (memcmp(expected->registers, actual->registers, sizeof(expected->registers)) != 0) {
+        return "registers";
+    }
+    if (expected->stack_size != actual->stack_size) {
+        return "stack size";
+    }
+    if (expected->status != actual->status) {
+        return "status";
+    }
+    if (expected->result != actual->result) {
+        return "result";
+    }
+    if (expected->output_size != actual->output_size
+            || memcmp(expected->output, actual->output, expected->output_size) != 0) {
+        return "output";
+    }
+    return NULL;
+}
+
+/*
+ * The same for the run of the program built with -O: only the output,
+ * status and registers of a run that halted or failed are kept, the
+ * optimized program takes fewer steps.
+ */
+static const char *optimized_difference(const struct outcome *expected,
+        const struct outcome *actual)
+{
+    if (expected->status == CPU_OK) {
+        return NULL;
+    }
+    if (memcmp(expected->registers, actual->registers, sizeof(expected->registers)) != 0) {
+        return "registers";
+    }
+    if (expected->status != actual->status) {
+        return "status";
+    }
+    if (expected->output_size != actual->output_size
+            || memcmp(expected->output, actual->output, expected->output_size) != 0) {
+        return "output";
+    }
+    return NULL;
+}
+
+static void print_outcome(const char *engine, const struct outcome *outcome)
+{
+    fprintf(stderr, "  %-8s A=%" PRId32 " B=%" PRId32 " C=%" PRId32 " D=%" PRId32
+            " RESULT=%" PRId32 " stack %" PRId32 " status %d result %lld output %zu bytes\n",
+            engine, outcome->registers[REGISTER_A], outcome->registers[REGISTER_B],
+            outcome->registers[REGISTER_C], outcome->registers[REGISTER_D],
+            outcome->registers[REGISTER_RESULT], outcome->stack_size, (int) outcome->status,
+            outcome->result, outcome->output_size);
+}
+
+/*
+ * Writes the program as a compact image to the scratch file and loads it
+ * from there, the way every mode loads programs.
+ */
+static struct cpu_program *load(FILE *scratch, const char *path, const uint32_t *words,
+        size_t count, size_t stack_capacity)
+{
+    rewind(scratch);
+    if (ftruncate(fileno(scratch), 0) != 0
+            || image_write(scratch, words, count, (uint32_t) stack_capacity, NULL, 0) != 0
+            || fflush(scratch) != 0) {
+        return NULL;
+    }
+    return cpu_program_load(path, stack_capacity);
+}
+
+static struct outcome outcomes[ENGINE_COUNT][INPUTS];
+static struct outcome optimized_outcomes[INPUTS];
+
+static struct asm_context *create_context(bool optimize)
+{
+    struct asm_context *ctx = asm_create();
+    if (ctx == NULL) {
+        perror("fuzz: asm_create");
+        return NULL;
+    }
+    asm_set_errors(ctx, stderr);
+    asm_set_optimize(ctx, optimize);
+    return ctx;
+}
+
+/*
+ * Generates and checks programs programs. Returns 0 if every engine
+ * agreed, 1 on a difference and 2 on an error.
+ */
+static int fuzz(unsigned long programs, uint64_t seed)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/cpu-fuzz-XXXXXX", dir != NULL ? dir : "/tmp")
+            >= (int) sizeof(path)) {
+        fprintf(stderr, "fuzz: TMPDIR too long\n");
+        return 2;
+    }
+    int fd = mkstemp(path);
+    FILE *scratch = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (scratch == NULL) {
+        perror("fuzz: scratch file");
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        return 2;
+    }
+    // The same program is built with -O too and has to end the same way
+    struct asm_context *ctx = create_context(false);
+    struct asm_context *optimizer = ctx != NULL ? create_context(true) : NULL;
+    if (optimizer == NULL) {
+        asm_destroy(ctx);
+        fclose(scratch);
+        unlink(path);
+        return 2;
+    }
+
+    rng_state = seed != 0 ? seed : 1;
+    static struct source source;
+    int status = 0;
+    for (unsigned long p = 0; status == 0 && p < programs; ++p) {
+        size_t stack_capacity = generate(&source);
+        char inputs[INPUTS][INPUT_SIZE];
+        for (size_t i = 0; i < INPUTS; ++i) {
+            for (size_t c = 0; c < INPUT_SIZE; ++c) {
+                // Digits and separators, so in reads numbers
+                inputs[i][c] = "0123456789 -\n"[random_below(13)];
+            }
+        }
+        slice_quantum = 1 + random_below(16);
+
+        size_t count;
+        struct cpu_program *program = NULL;
+        if (asm_assemble(ctx, source.text, source.size) != ASM_SUCCESS) {
+            fprintf(stderr, "fuzz: program %lu does not assemble:\n%s", p, source.text);
+            status = 2;
+            break;
+        }
+        const uint32_t *words = asm_words(ctx, &count);
+        program = load(scratch, path, words, count, stack_capacity);
+        if (program == NULL) {
+            fprintf(stderr, "fuzz: program %lu: %s\n", p, strerror(errno));
+            status = 2;
+            break;
+        }
+
+        size_t reference = ENGINE_COUNT;
+        for (size_t e = 0; status == 0 && e < ENGINE_COUNT; ++e) {
+            if (!engines[e].enabled) {
+                continue;
+            }
+            if (!run_engine(program, &engines[e], inputs, outcomes[e])) {
+                status = 2;
+                break;
+            }
+            if (reference == ENGINE_COUNT) {
+                reference = e;
+                continue;
+            }
+            for (size_t i = 0; i < INPUTS; ++i) {
+                const char *what = difference(&outcomes[reference][i], &outcomes[e][i]);
+                if (what == NULL) {
+                    continue;
+                }
+                fprintf(stderr, "fuzz: seed %" PRIu64 " program %lu input %zu: %s differs "
+                        "on %s, stack capacity %zu, slice quantum %zu\n", seed, p, i, what,
+                        engines[e].name, stack_capacity, slice_quantum);
+                print_outcome(engines[reference].name, &outcomes[reference][i]);
+                print_outcome(engines[e].name, &outcomes[e][i]);
+                fprintf(stderr, "Input: \"%.*s\"\n%s", INPUT_SIZE, inputs[i], source.text);
+                status = 1;
+                break;
+            }
+        }
+        cpu_program_destroy(program);
+        if (status != 0 || reference == ENGINE_COUNT) {
+            break;
+        }
+
+        if (asm_assemble(optimizer, source.text, source.size) != ASM_SUCCESS) {
+            fprintf(stderr, "fuzz: program %lu does not assemble with -O:\n%s", p, source.text);
+            status = 2;
+            break;
+        }
+        words = asm_words(optimizer, &count);
+        program = load(scratch, path, words, count, stack_capacity);
+        // A copy, the time of these runs does not count for the engine
+        struct engine engine = engines[reference];
+        if (program == NULL || !run_engine(program, &engine, inputs, optimized_outcomes)) {
+            if (program == NULL) {
+                fprintf(stderr, "fuzz: program %lu: %s\n", p, strerror(errno));
+            }
+            status = 2;
+            break;
+        }
+        cpu_program_destroy(program);
+        for (size_t i = 0; i < INPUTS; ++i) {
+            const char *what = optimized_difference(&outcomes[reference][i],
+                    &optimized_outcomes[i]);
+            if (what == NULL) {
+                continue;
+            }
+            fprintf(stderr, "fuzz: seed %" PRIu64 " program %lu input %zu: %s differs "
+                    "with -O on %s, stack capacity %zu\n", seed, p, i, what,
+                    engine.name, stack_capacity);
+            print_outcome("plain", &outcomes[reference][i]);
+            print_outcome("-O", &optimized_outcomes[i]);
+            fprintf(stderr, "Input: \"%.*s\"\n%s", INPUT_SIZE, inputs[i], source.text);
+            status = 1;
+            break;
+        }
+    }
+
+    asm_destroy(optimizer);
+    asm_destroy(ctx);
+    fclose(scratch);
+    unlink(path);
+    return status;
+}
+
+static void print_dashboard(FILE *out, const char *label, uint64_t seed, unsigned long programs)
+{
+    for (size_t e = 0; e < ENGINE_COUNT; ++e) {
+        const struct engine *engine = &engines[e];
+        if (!engine->enabled || engine->instructions == 0) {
+            continue;
+        }
+        double per_instruction = engine->ns / (double) engine->instructions;
+        fprintf(out, "%s,%" PRIu64 ",%s,%lu,%lu,%llu,%.3f,%.0f\n", label, seed, engine->name,
+                programs, programs * INPUTS, engine->instructions, per_instruction,
+                1e9 / per_instruction);
+    }
+}
+
+static bool select_engines(char *list)
+{
+    for (size_t e = 0; e < ENGINE_COUNT; ++e) {
+        engines[e].enabled = false;
+    }
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        size_t e = 0;
+        while (e < ENGINE_COUNT && strcmp(engines[e].name, name) != 0) {
+            ++e;
+        }
+        if (e == ENGINE_COUNT) {
+            fprintf(stderr, "fuzz: unknown engine %s\n", name);
+            return false;
+        }
+        engines[e].enabled = true;
+    }
+    return true;
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "Usage: fuzz [-n programs] [-s seed] [-e engine,...] [-l label] [-o file]\n");
+    fprintf(stderr, "Engines: step, run, decoded, jit, slice, lockstep (default all, the first"
+                    " one is the reference)\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long programs = DEFAULT_PROGRAMS;
+    uint64_t seed = (uint64_t) time(NULL);
+    const char *label = "";
+    const char *dashboard = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 == argc) {
+            return usage();
+        }
+        char *end;
+        if (strcmp(argv[i], "-n") == 0) {
+            programs = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || programs == 0) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            unsigned long long value = strtoull(argv[++i], &end, 10);
+            if (*end != '\0') {
+                return usage();
+            }
+            seed = value;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            if (!select_engines(argv[++i])) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-l") == 0) {
+            label = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            dashboard = argv[++i];
+        } else {
+            return usage();
+        }
+    }
+
+    int status = fuzz(programs, seed);
+    if (status != 0) {
+        return status;
+    }
+    fprintf(stderr, "fuzz: %lu programs agree on every engine, seed %" PRIu64 "\n",
+            programs, seed);
+
+    const char *header = "label,seed,engine,programs,runs,instructions,ns_per_instruction,"
+                         "instructions_per_second\n";
+    if (dashboard == NULL) {
+        fputs(header, stdout);
+        print_dashboard(stdout, label, seed, programs);
+        return 0;
+    }
+    FILE *out = fopen(dashboard, "a");
+    if (out == NULL) {
+        fprintf(stderr, "fuzz: %s: %s\n", dashboard, strerror(errno));
+        return 2;
+    }
+    if (fseek(out, 0, SEEK_END) == 0 && ftell(out) == 0) {
+        fputs(header, out);
+    }
+    print_dashboard(out, label, seed, programs);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "fuzz: %s: %s\n", dashboard, strerror(errno));
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+; Output-heavy put/out traffic, about 10 million instructions
+
+movr c 2000000
+movr b 58
+movr d 10
+
+again:
+	out c
+	put b
+	put d
+	dec c
+	loop again
+	halt
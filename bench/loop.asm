@@ -0,0 +1,18 @@
+; Tight arithmetic loops, about 20 million instructions
+
+movr b 3
+movr d 4000
+
+outer:
+	movr c 1000
+inner:
+	inc a
+	add b
+	sub b
+	dec c
+	loop inner
+	dec d
+	movr c 0
+	cmp d c
+	jnz outer
+	halt
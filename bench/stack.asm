@@ -0,0 +1,24 @@
+; Stack-heavy load/store traffic, about 20 million instructions
+
+movr a 0
+push a
+push a
+push a
+push a
+push a
+push a
+push a
+push a
+movr d 0
+movr c 2500000
+
+again:
+	load a 0
+	inc a
+	store a 0
+	load b 3
+	add b
+	store a 5
+	dec c
+	loop again
+	halt
@@ -0,0 +1,589 @@
+/*
+ * Result cache.
+ *
+ * A run is a function of the CPU's state when it starts, its code, the
+ * step budget and the guest input: all I/O goes through the backend, and
+ * input is the only thing that can make two runs of a program differ (see
+ * replay.c). cpu_run_cached hashes all of that into a 128-bit key and
+ * looks for a file of that name in the cache directory. On a hit the
+ * stored output is written to the CPU's backend and the CPU is put into
+ * the stored final state without executing anything; on a miss the CPU
+ * runs with input from the caller's buffer, its output is kept on the way
+ * to the backend, and the result is stored.
+ *
+ * An entry holds the final state and everything the run wrote:
+ *
+ *   header   ENTRY_HEADER_SIZE bytes, little-endian fields
+ *   then     the stack items, bottom first, 4 bytes each
+ *   then     the output bytes
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * processes sharing a directory never see half an entry. A hit updates the
+ * entry's modification time. The cache keeps a running total of the bytes
+ * in the directory, found out by a scan on the first store and bumped by
+ * every store after it; once that passes max_size, and every
+ * TRIM_INTERVAL stores in case other processes add entries, the directory
+ * is scanned again and the least recently used entries are deleted until
+ * it holds at most 7/8 of max_size, so a miss rarely pays for a scan.
+ *
+ * The hash is not cryptographic: the cache trusts whoever can write to its
+ * directory.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENTRY_MAGIC "CPUCACH"
+#define ENTRY_VERSION 1
+#define KEY_SIZE 16
+#define KEY_NAME_SIZE (2 * KEY_SIZE + 1)
+#define TRIM_INTERVAL 1024 // Stores between scans that keep the total honest
+
+enum entry_field
+{
+    FIELD_VERSION = 8, // After the 8-byte magic
+    FIELD_STATUS = 12,
+    FIELD_INST_INDEX = 16,
+    FIELD_STACK_SIZE = 20,
+    FIELD_REGISTERS = 24, // 5 words
+    FIELD_STEPS = 44,     // 8 bytes
+    FIELD_OUTPUT_SIZE = 52, // 8 bytes
+    FIELD_KEY = 60,       // KEY_SIZE bytes, as in the file name
+    ENTRY_HEADER_SIZE = 76,
+};
+
+struct cpu_cache
+{
+    unsigned long long max_size;
+    unsigned long long stores; // Names temporary files apart
+    unsigned long long size;   // Bytes in the directory as of the last scan, plus stores since
+    unsigned long long unscanned; // Stores since the last scan
+    char dir[];
+};
+
+/*
+ * Two 64-bit lanes with different multipliers and rotations, mixed into
+ * each other at the end.
+ */
+struct cache_hash
+{
+    uint64_t a;
+    uint64_t b;
+    uint64_t length;
+};
+
+#define HASH_P1 0x9E3779B185EBCA87u
+#define HASH_P2 0xC2B2AE3D27D4EB4Fu
+#define HASH_P3 0x165667B19E3779F9u
+#define HASH_P4 0xFF51AFD7ED558CCDu
+
+static uint64_t rotate(uint64_t value, unsigned bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static void hash_u64(struct cache_hash *hash, uint64_t value)
+{
+    hash->a = rotate(hash->a + value * HASH_P2, 31) * HASH_P1;
+    hash->b = rotate(hash->b ^ (value * HASH_P3), 27) * HASH_P4 + HASH_P1;
+    hash->length++;
+}
+
+static void hash_words(struct cache_hash *hash, const int32_t *words, size_t count, ptrdiff_t step)
+{
+    hash_u64(hash, count);
+    for (; count >= 2; count -= 2, words += 2 * step) {
+        hash_u64(hash, (uint32_t) words[0] | (uint64_t) (uint32_t) words[step] << 32);
+    }
+    if (count > 0) {
+        hash_u64(hash, (uint32_t) words[0]);
+    }
+}
+
+static void hash_bytes(struct cache_hash *hash, const unsigned char *bytes, size_t size)
+{
+    hash_u64(hash, size);
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= (uint64_t) bytes[i] << (8 * i);
+        }
+        hash_u64(hash, value);
+    }
+    uint64_t tail = 0;
+    for (size_t i = 0; i < size; ++i) {
+        tail |= (uint64_t) bytes[i] << (8 * i);
+    }
+    hash_u64(hash, tail);
+}
+
+static uint64_t avalanche(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= HASH_P4;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53u;
+    value ^= value >> 33;
+    return value;
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= (uint64_t) p[i] << (8 * i);
+    }
+    return value;
+}
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= (uint32_t) p[i] << (8 * i);
+    }
+    return value;
+}
+
+static void compute_key(const struct cpu *cpu, size_t steps, const void *input, size_t input_size,
+        unsigned char key[KEY_SIZE])
+{
+    struct cache_hash hash = { HASH_P1, HASH_P2 ^ ENTRY_VERSION, 0 };
+    hash_u64(&hash, cpu->stack_capacity);
+    hash_u64(&hash, steps);
+    hash_u64(&hash, (uint64_t) cpu->status << 32 | (uint32_t) cpu->inst_index);
+    hash_words(&hash, cpu->registers, REGISTER_RESULT + 1, 1);
+    hash_words(&hash, cpu->memory, (size_t) cpu->end_of_stack + 1, 1);
+    hash_words(&hash, cpu->stack_bottom, (size_t) cpu->stack_size, -1);
+    hash_bytes(&hash, input, input_size);
+
+    uint64_t a = avalanche(hash.a ^ hash.length);
+    uint64_t b = avalanche(hash.b + a);
+    put_u64(key, avalanche(a ^ b));
+    put_u64(key + 8, b);
+}
+
+static void key_name(const unsigned char key[KEY_SIZE], char name[KEY_NAME_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < KEY_SIZE; ++i) {
+        name[2 * i] = digits[key[i] >> 4];
+        name[2 * i + 1] = digits[key[i] & 15];
+    }
+    name[2 * KEY_SIZE] = '\0';
+}
+
+static bool is_entry_name(const char *name)
+{
+    return strlen(name) == 2 * KEY_SIZE && strspn(name, "0123456789abcdef") == 2 * KEY_SIZE;
+}
+
+static char *entry_path(const struct cpu_cache *cache, const char *name)
+{
+    size_t length = strlen(cache->dir) + 1 + strlen(name) + 1;
+    char *path = malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s/%s", cache->dir, name);
+    }
+    return path;
+}
+
+static bool write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t result = write(fd, p, size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size > 0) {
+        ssize_t result = read(fd, p, size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+struct trim_entry
+{
+    char name[KEY_NAME_SIZE];
+    struct timespec used;
+    unsigned long long size;
+};
+
+static int compare_used(const void *left, const void *right)
+{
+    const struct timespec *a = &((const struct trim_entry *) left)->used;
+    const struct timespec *b = &((const struct trim_entry *) right)->used;
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+/*
+ * Finds out how many bytes the entries take and, if that is over
+ * max_size, deletes the least recently used ones until the rest fits
+ * 7/8 of it.
+ */
+static void trim(struct cpu_cache *cache)
+{
+    cache->unscanned = 0;
+    cache->size = 0;
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL) {
+        return;
+    }
+    struct trim_entry *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    unsigned long long total = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat info;
+        if (!is_entry_name(dirent->d_name)
+                || fstatat(dirfd(dir), dirent->d_name, &info, 0) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t bigger_capacity = capacity == 0 ? 64 : 2 * capacity;
+            struct trim_entry *bigger = realloc(entries, bigger_capacity * sizeof(*entries));
+            if (bigger == NULL) {
+                break;
+            }
+            entries = bigger;
+            capacity = bigger_capacity;
+        }
+        memcpy(entries[count].name, dirent->d_name, KEY_NAME_SIZE);
+        entries[count].used = info.st_mtim;
+        entries[count].size = (unsigned long long) info.st_size;
+        total += entries[count].size;
+        ++count;
+    }
+
+    if (total > cache->max_size) {
+        unsigned long long low_water = cache->max_size - cache->max_size / 8;
+        qsort(entries, count, sizeof(*entries), compare_used);
+        for (size_t i = 0; i < count && total > low_water; ++i) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    cache->size = total;
+    free(entries);
+    closedir(dir);
+}
+
+/*
+ * Opens the cache in the directory dir, creating the directory if needed.
+ * The entries in it are kept at max_size bytes or less.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu_cache *cpu_cache_open(const char *dir, unsigned long long max_size)
+{
+    assert(dir != NULL);
+    struct stat info;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    if (stat(dir, &info) != 0) {
+        return NULL;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    struct cpu_cache *cache = malloc(sizeof(*cache) + strlen(dir) + 1);
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->max_size = max_size;
+    cache->stores = 0;
+    strcpy(cache->dir, dir);
+    // Not known yet, the first store scans the directory
+    cache->size = 0;
+    cache->unscanned = TRIM_INTERVAL;
+    return cache;
+}
+
+void cpu_cache_close(struct cpu_cache *cache)
+{
+    free(cache);
+}
+
+/*
+ * Guest I/O of a run that is being cached: input from the caller's
+ * buffer, output kept in a buffer that grows as needed and passed on to
+ * the CPU's own backend.
+ */
+struct cache_io
+{
+    const char *input;
+    size_t input_size;
+    size_t input_pos;
+    char *output;
+    size_t output_size;
+    size_t output_capacity;
+    bool output_lost; // Could not keep the output, the run is not stored
+    struct cpu_io_ops ops;
+    void *context;
+};
+
+static long cache_read(void *context, char *buf, size_t size)
+{
+    struct cache_io *io = context;
+    size_t left = io->input_size - io->input_pos;
+    if (size > left) {
+        size = left;
+    }
+    memcpy(buf, io->input + io->input_pos, size);
+    io->input_pos += size;
+    return (long) size;
+}
+
+static int cache_write(void *context, const char *buf, size_t size)
+{
+    struct cache_io *io = context;
+    if (!io->output_lost && io->output_capacity - io->output_size < size) {
+        size_t capacity = io->output_capacity == 0 ? 4096 : io->output_capacity;
+        while (capacity - io->output_size < size) {
+            capacity *= 2;
+        }
+        char *bigger = realloc(io->output, capacity);
+        if (bigger == NULL) {
+            io->output_lost = true;
+        } else {
+            io->output = bigger;
+            io->output_capacity = capacity;
+        }
+    }
+    if (!io->output_lost) {
+        memcpy(io->output + io->output_size, buf, size);
+        io->output_size += size;
+    }
+    return io->ops.write(io->context, buf, size);
+}
+
+static const struct cpu_io_ops cache_ops = { cache_read, cache_write };
+
+/*
+ * Puts the CPU into the state stored in the entry at path and writes the
+ * stored output to its backend. Returns false, with the CPU untouched, if
+ * there is no valid entry.
+ */
+static bool replay_entry(struct cpu *cpu, const char *path, const unsigned char key[KEY_SIZE],
+        long long *steps)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    unsigned char header[ENTRY_HEADER_SIZE];
+    struct stat info;
+    if (!read_all(fd, header, sizeof(header)) || fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    const uint32_t status = get_u32(header + FIELD_STATUS);
+    const uint32_t stack_size = get_u32(header + FIELD_STACK_SIZE);
+    const uint64_t output_size = get_u64(header + FIELD_OUTPUT_SIZE);
+    if (memcmp(header, ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) != 0
+            || get_u32(header + FIELD_VERSION) != ENTRY_VERSION
+            || memcmp(header + FIELD_KEY, key, KEY_SIZE) != 0
+            || status > CPU_IO_ERROR || stack_size > cpu->stack_capacity
+            || output_size > SIZE_MAX - 4 * (uint64_t) stack_size
+            || (uint64_t) info.st_size != ENTRY_HEADER_SIZE + 4 * (uint64_t) stack_size + output_size) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t) info.st_size - ENTRY_HEADER_SIZE;
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL || !read_all(fd, data, size)) {
+        free(data);
+        close(fd);
+        return false;
+    }
+    futimens(fd, NULL); // Recently used
+    close(fd);
+
+    cpu->status = (enum cpu_status) status;
+    cpu->inst_index = (int32_t) get_u32(header + FIELD_INST_INDEX);
+    for (int i = 0; i <= REGISTER_RESULT; ++i) {
+        cpu->registers[i] = (int32_t) get_u32(header + FIELD_REGISTERS + 4 * i);
+    }
+    for (int32_t i = 0; i < cpu->stack_size; ++i) {
+        cpu->stack_bottom[-i] = 0;
+    }
+    cpu->stack_size = (int32_t) stack_size;
+    for (uint32_t i = 0; i < stack_size; ++i) {
+        cpu->stack_bottom[-(ptrdiff_t) i] = (int32_t) get_u32(data + 4 * i);
+    }
+    *steps = (long long) get_u64(header + FIELD_STEPS);
+
+    if (output_size > 0 && cpu->io.ops.write(cpu->io.context,
+                                   (const char *) data + 4 * (size_t) stack_size,
+                                   (size_t) output_size)
+                    != 0) {
+        cpu->io.write_failed = true;
+    }
+    free(data);
+    return true;
+}
+
+static void store_entry(struct cpu_cache *cache, const struct cpu *cpu, const char *path,
+        const unsigned char key[KEY_SIZE], long long steps, const struct cache_io *io)
+{
+    size_t stack_bytes = 4 * (size_t) cpu->stack_size;
+    if (ENTRY_HEADER_SIZE + stack_bytes + io->output_size > cache->max_size) {
+        return;
+    }
+    unsigned char *data = malloc(ENTRY_HEADER_SIZE + stack_bytes);
+    char *temporary = malloc(strlen(path) + 64);
+    if (data == NULL || temporary == NULL) {
+        free(data);
+        free(temporary);
+        return;
+    }
+    memset(data, 0, ENTRY_HEADER_SIZE);
+    memcpy(data, ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+    put_u32(data + FIELD_VERSION, ENTRY_VERSION);
+    put_u32(data + FIELD_STATUS, (uint32_t) cpu->status);
+    put_u32(data + FIELD_INST_INDEX, (uint32_t) cpu->inst_index);
+    put_u32(data + FIELD_STACK_SIZE, (uint32_t) cpu->stack_size);
+    for (int i = 0; i <= REGISTER_RESULT; ++i) {
+        put_u32(data + FIELD_REGISTERS + 4 * i, (uint32_t) cpu->registers[i]);
+    }
+    put_u64(data + FIELD_STEPS, (uint64_t) steps);
+    put_u64(data + FIELD_OUTPUT_SIZE, io->output_size);
+    memcpy(data + FIELD_KEY, key, KEY_SIZE);
+    for (int32_t i = 0; i < cpu->stack_size; ++i) {
+        put_u32(data + ENTRY_HEADER_SIZE + 4 * (size_t) i, (uint32_t) cpu->stack_bottom[-i]);
+    }
+
+    // Dot files are never taken for entries, so trim leaves them alone
+    sprintf(temporary, "%s/.%ld.%llu", cache->dir, (long) getpid(), cache->stores++);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        bool written = write_all(fd, data, ENTRY_HEADER_SIZE + stack_bytes)
+                && write_all(fd, io->output, io->output_size);
+        if (close(fd) != 0 || !written || rename(temporary, path) != 0) {
+            unlink(temporary);
+        } else {
+            cache->size += ENTRY_HEADER_SIZE + stack_bytes + io->output_size;
+        }
+    }
+    free(data);
+    free(temporary);
+    if (cache->size > cache->max_size || ++cache->unscanned >= TRIM_INTERVAL) {
+        trim(cache);
+    }
+}
+
+/*
+ * Runs the CPU with run for at most steps steps, reading guest input from
+ * input only, unless the cache already holds the result of that run; then
+ * the CPU ends up in the state the run would have left it in and its
+ * output is written without executing. Either way the output goes to the
+ * CPU's backend, and *hit, if not NULL, says which it was. Returns what
+ * run returned.
+ *
+ * CPUs with breakpoints or watchpoints run without the cache, and runs
+ * that stop at one are not stored. Problems with the cache directory only
+ * make the run uncached.
+ */
+long long cpu_run_cached(struct cpu *cpu, struct cpu_cache *cache,
+        long long (*run)(struct cpu *, size_t), size_t steps, const void *input,
+        size_t input_size, bool *hit)
+{
+    assert(cpu != NULL);
+    assert(cache != NULL);
+    assert(run != NULL);
+    assert(input != NULL || input_size == 0);
+
+    bool cacheable = cpu->debug == NULL;
+    unsigned char key[KEY_SIZE];
+    char name[KEY_NAME_SIZE];
+    char *path = NULL;
+    if (cacheable) {
+        compute_key(cpu, steps, input, input_size, key);
+        key_name(key, name);
+        path = entry_path(cache, name);
+    }
+
+    long long result;
+    cpu_flush_output(cpu);
+    if (path != NULL && replay_entry(cpu, path, key, &result)) {
+        free(path);
+        if (hit != NULL) {
+            *hit = true;
+        }
+        return result;
+    }
+
+    struct cpu_io *saved = &cpu->io;
+    struct cache_io io = { input, input_size, 0, NULL, 0, 0, false, saved->ops, saved->context };
+    unsigned flags = saved->flags;
+    bool probe_tty = saved->probe_tty;
+    cpu_set_io(cpu, &cache_ops, &io, flags & ~CPU_IO_INTERACTIVE_INPUT);
+    result = run(cpu, steps);
+    cpu_set_io(cpu, &io.ops, io.context, flags); // Flushes the rest through io
+    if (probe_tty) {
+        cpu->io.probe_tty = true;
+        cpu->io.out_capacity = 0;
+    }
+
+    if (path != NULL && !io.output_lost && cpu->status != CPU_BREAKPOINT
+            && cpu->status != CPU_WATCHPOINT) {
+        store_entry(cache, cpu, path, key, result, &io);
+    }
+    free(io.output);
+    free(path);
+    if (hit != NULL) {
+        *hit = false;
+    }
+    return result;
+}
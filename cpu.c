@@ -1,109 +1,121 @@
 #include "cpu.h"
+#include "cpu_internal.h"
+#include "image.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <string.h>
-/*
- * Main CPU structure holding the state of the machine.
- * It contains the memory, stack pointers, registers, and flags.
- * The stack is located at the very end of the allocated memory.
- */
-struct cpu
-{
-    int32_t *memory;       // Main memory (instructions + data)
-    int32_t *stack_bottom; // Pointer to the end of memory where stack begins
-    size_t stack_capacity; // Max items allowed on stack
-    enum cpu_status status;// Current status (running, halted, error...)
-    int32_t inst_index;    // Instruction pointer (index of next instruction)
-    int32_t stack_size;    // Current number of items on the stack
-
-    // Registers: A, B, C, D and the Result register (index 4)
-    int32_t registers[5];
-
-    // Helper variables to keep track of memory boundaries
-    int32_t end_of_stack;
-    size_t memory_size;
-};
 
 /*
- * Lookup table for instructions.
- * Maps the opcode number (e.g., 0x02) to the C function that executes it.
+ * Signature of an instruction handler.
+ * Returns 1 if the instruction executed successfully, 0 on halt or error
+ * (in which case cpu->status says which).
  */
-struct instruction
-{
-    uint32_t opcode;
-    int (*execute)(struct cpu *);
-};
+typedef int (*instruction_handler)(struct cpu *);
 
 /*
  * Reads the binary program from a file and loads it into memory.
- * Since the program is binary, we read it byte-by-byte and reconstruct
- * the 32-bit integers (instructions) using bitwise operations.
+ * The file is read in large chunks into a buffer and copied (or, for
+ * compact images, see image.h, expanded) into zeroed memory of the final
+ * size; the words are stored little-endian. The memory comes from calloc,
+ * which for large sizes hands out fresh pages that only get committed when
+ * the stack grows into them, so a big stack_capacity costs address space
+ * rather than memory. cpu_map_program in loader.c avoids the copy for
+ * regular raw images.
  */
 int32_t *cpu_create_memory(FILE *program, size_t stack_capacity, int32_t **stack_bottom)
 {
     assert(program != NULL);
     assert(stack_bottom != NULL);
 
-    int32_t *memory;
-    // We allocate memory in blocks to avoid calling realloc too often.
-    size_t BLOCK_SIZE = 4096 / sizeof(int32_t);
-    size_t memory_size = BLOCK_SIZE;
-    size_t memory_index = 0;
-    int32_t ch;
-    size_t cycle_index = 0;
-    uint32_t result = 0;
-
-    memory = (int32_t *) malloc(memory_size * sizeof(int32_t));
-    if (memory == NULL) {
+    // Read the whole image, doubling the buffer whenever it fills up
+    size_t capacity = 4096;
+    size_t size = 0;
+    char *image = malloc(capacity);
+    if (image == NULL) {
         return NULL;
     }
-
-    // Read the file byte by byte until EOF
-    while ((ch = fgetc(program)) != EOF) {
-
-        // If the current memory block is full, allocate more space
-        if (memory_index == memory_size) {
-            int32_t *new_memory = realloc(memory, (memory_size + BLOCK_SIZE) * sizeof(int32_t));
-            if (new_memory == NULL) {
-                free(memory);
-                memory = NULL;
+    for (;;) {
+        if (size == capacity) {
+            char *bigger = capacity <= SIZE_MAX / 2 ? realloc(image, capacity * 2) : NULL;
+            if (bigger == NULL) {
+                free(image);
                 return NULL;
             }
-            memory = new_memory;
-            memory_size += BLOCK_SIZE;
+            image = bigger;
+            capacity *= 2;
         }
-        /* Pack 4 bytes into one 32-bit integer */
-        result |= (ch << (cycle_index * 8));
-        cycle_index++;
-
-        /* Once we have a full 32-bit word, save it to memory */
-        if (cycle_index == 4) {
-            memory[memory_index++] = result;
-            result = 0;
-            cycle_index = 0;
+        size_t read = fread(image + size, 1, capacity - size, program);
+        if (read == 0) {
+            break;
         }
-        if (ch == EOF) {
-            free(memory);
-            memory = NULL;
-            return NULL;
+        size += read;
+    }
+    if (ferror(program)) {
+        free(image);
+        return NULL;
+    }
+    if (image_is_compact(image, size)) {
+        struct image_header header;
+        size_t memory_words;
+        int32_t *memory = NULL;
+        if (memory_layout_image(image, size, stack_capacity, &header, &memory_words)
+                && (memory = calloc(memory_words, sizeof(int32_t))) != NULL) {
+            if (image_decode(image, &header, memory) == 0) {
+                *stack_bottom = &memory[memory_words - 1];
+            } else {
+                free(memory);
+                memory = NULL;
+            }
         }
+        free(image);
+        return memory;
     }
-    assert(cycle_index == 0);
-    while ((memory_index + stack_capacity) > memory_size) {
-        int32_t *new_memory = realloc(memory, (memory_size + BLOCK_SIZE) * sizeof(int32_t));
 
-        if (new_memory == NULL) {
-            free(memory);
-            memory = NULL;
-            return NULL;
-        }
-        memory = new_memory;
-        memory_size += BLOCK_SIZE;
+    size_t program_words = size / sizeof(int32_t);
+    size_t memory_words;
+    if (size % sizeof(int32_t) != 0
+            || !memory_layout_words(program_words, stack_capacity, &memory_words)) {
+        free(image);
+        return NULL;
+    }
+
+    int32_t *memory = calloc(memory_words, sizeof(int32_t));
+    if (memory == NULL) {
+        free(image);
+        return NULL;
+    }
+    memcpy(memory, image, size);
+    free(image);
+    memory_words_from_le(memory, program_words);
+    *stack_bottom = &memory[memory_words - 1];
+    return memory;
+}
+
+/*
+ * Creates guest memory holding count program words given in host order,
+ * for example straight from asm_words. The memory is laid out and
+ * allocated like that of cpu_create_memory and can be handed to cpu_create.
+ */
+int32_t *cpu_create_memory_from_words(const uint32_t *words, size_t count, size_t stack_capacity,
+        int32_t **stack_bottom)
+{
+    assert(words != NULL || count == 0);
+    assert(stack_bottom != NULL);
+
+    size_t memory_words;
+    if (!memory_layout_words(count, stack_capacity, &memory_words)) {
+        return NULL;
     }
-    memset(memory + memory_index, 0, (memory_size - memory_index * sizeof(int32_t)));
-    *stack_bottom = &memory[memory_size - 1];
+    int32_t *memory = calloc(memory_words, sizeof(int32_t));
+    if (memory == NULL) {
+        return NULL;
+    }
+    if (count > 0) {
+        memcpy(memory, words, count * sizeof(int32_t));
+    }
+    *stack_bottom = &memory[memory_words - 1];
     return memory;
 }
 
@@ -116,10 +128,21 @@ struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom, size_t stack_capa
     assert(stack_bottom != NULL);
     assert(memory != NULL);
 
-    struct cpu *cpu_instance = (struct cpu *) malloc(sizeof(struct cpu));
-    if (cpu_instance == NULL) {
+    void *allocation;
+    if (posix_memalign(&allocation, CPU_CACHE_LINE, sizeof(struct cpu)) != 0) {
         return NULL;
     }
+    struct cpu *cpu_instance = allocation;
+    cpu_init(cpu_instance, memory, stack_bottom, stack_capacity);
+    io_init(cpu_instance);
+    return cpu_instance;
+}
+
+/*
+ * Sets up a CPU on the given memory, everything except its I/O.
+ */
+void cpu_init(struct cpu *cpu_instance, int32_t *memory, int32_t *stack_bottom, size_t stack_capacity)
+{
     // Link memory and stack
     cpu_instance->memory = memory;
     cpu_instance->stack_bottom = stack_bottom;
@@ -131,13 +154,33 @@ struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom, size_t stack_capa
     memset(cpu_instance->registers, 0, sizeof(cpu_instance->registers));
     cpu_instance->end_of_stack = 0;
     cpu_instance->stack_size = 0;
+    cpu_instance->decoded = NULL;
+    cpu_instance->decoded_shared = false;
+    memset(cpu_instance->fused_runs, 0, sizeof(cpu_instance->fused_runs));
+    cpu_instance->jit = NULL;
+    cpu_instance->debug = NULL;
+    cpu_instance->verified = NULL;
+    cpu_instance->verify_failed = false;
+    cpu_instance->code_shared = false;
+    cpu_instance->program = NULL;
 
     // Calculate memory boundaries for safety checks later
     int32_t *stack_end = stack_bottom - stack_capacity;
 
     cpu_instance->end_of_stack = stack_end - cpu_instance->memory;
-    cpu_instance->memory_size = ((cpu_instance->stack_bottom - cpu_instance->memory) * sizeof(int32_t));
-    cpu_instance->memory_size += sizeof(int32_t);
+    cpu_instance->memory_owner = CPU_MEMORY_MALLOC;
+}
+
+/*
+ * Same as cpu_create for memory returned by cpu_map_program; cpu_destroy
+ * unmaps it instead of freeing it.
+ */
+struct cpu *cpu_create_mapped(int32_t *memory, int32_t *stack_bottom, size_t stack_capacity)
+{
+    struct cpu *cpu_instance = cpu_create(memory, stack_bottom, stack_capacity);
+    if (cpu_instance != NULL) {
+        cpu_instance->memory_owner = CPU_MEMORY_MAPPED;
+    }
     return cpu_instance;
 }
 
@@ -164,15 +207,33 @@ int32_t cpu_get_stack_size(struct cpu *cpu)
     return cpu->stack_size;
 }
 
+int32_t cpu_get_inst_index(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return cpu->inst_index;
+}
+
+/*
+ * Empties the stack. The guest never leaves anything behind above the top
+ * of the stack (pop clears the slot it frees and store cannot reach past
+ * the top), so the stack size is also its high-water mark and only the
+ * slots still on the stack need clearing.
+ */
+void clear_stack(struct cpu *cpu)
+{
+    if (cpu->stack_size > 0) {
+        memset(cpu->stack_bottom - (cpu->stack_size - 1), 0,
+                (size_t) cpu->stack_size * sizeof(int32_t));
+    }
+    cpu->stack_size = 0;
+}
+
 void cpu_reset(struct cpu *cpu)
 {
     assert(cpu != NULL);
     memset(cpu->registers, 0, sizeof(cpu->registers));
-    cpu->stack_size = 0;
     cpu->status = CPU_OK;
-    //int32_t *end_of_stack = cpu->stack_bottom - cpu->stack_capacity;
-    size_t stack_size_bytes = cpu->stack_capacity * sizeof(int32_t);
-    memset(cpu->stack_bottom - cpu->stack_capacity, 0, stack_size_bytes);
+    clear_stack(cpu);
 }
 
 void cpu_destroy(struct cpu *cpu)
@@ -188,11 +249,21 @@ void cpu_destroy(struct cpu *cpu)
     }
     cpu->registers[4] = 0;
 
-    memset(cpu->memory, 0, cpu->memory_size);
-    cpu->memory_size = 0;
+    cpu_clear_debug(cpu);
+    cpu_discard_decoded(cpu);
+    io_destroy(cpu);
+    program_release(cpu->program);
+    cpu->program = NULL;
+
+    // Releasing the memory is enough, clearing it first would touch every page
+    assert(cpu->memory_owner != CPU_MEMORY_ARENA); // Use cpu_arena_release
+    if (cpu->memory_owner == CPU_MEMORY_MAPPED) {
+        cpu_unmap_memory(cpu->memory, cpu->stack_bottom);
+    } else {
+        free(cpu->memory);
+    }
     cpu->stack_size = 0;
 
-    free(cpu->memory);
     cpu->memory = NULL;
     cpu->stack_bottom = NULL;
 }
@@ -341,7 +412,12 @@ int execute_in(struct cpu *cpu)
     cpu->inst_index += 1;
 
     int32_t input;
-    if (scanf("%d", &input) != 1) {
+    if (!io_read_int(cpu, &input)) {
+        if (cpu->io.in_waiting) {
+            cpu->inst_index -= 1; // Runs again once there is input
+            cpu->status = CPU_WAITING_INPUT;
+            return 0;
+        }
         cpu->status = CPU_IO_ERROR;
         return 0;
     }
@@ -359,8 +435,13 @@ int execute_get(struct cpu *cpu)
         return 0;
     }
 
-    int32_t input_value = getchar();
+    int32_t input_value = io_getc(cpu);
 
+    if (input_value == EOF && cpu->io.in_waiting) {
+        cpu->inst_index -= 1;
+        cpu->status = CPU_WAITING_INPUT;
+        return 0;
+    }
     if (input_value == EOF) {
         cpu_set_register(cpu, REGISTER_C, 0);
         cpu_set_register(cpu, reg_to_input, -1);
@@ -380,7 +461,7 @@ int execute_out(struct cpu *cpu)
         return 0;
     }
 
-    printf("%d", cpu->registers[reg_to_print]);
+    io_put_int(cpu, cpu->registers[reg_to_print]);
     cpu->status = CPU_OK;
     return 1;
 }
@@ -401,7 +482,7 @@ int execute_put(struct cpu *cpu)
         return 0;
     }
 
-    printf("%c", reg_value);
+    io_put_char(cpu, (char) reg_value);
     cpu->status = CPU_OK;
     return 1;
 }
@@ -604,34 +685,43 @@ int execute_jgt(struct cpu *cpu)
 }
 
 
-const struct instruction instructions[] = {
-    { 0x00, execute_nop },
-    { 0x01, execute_halt },
-    { 0x02, execute_add },
-    { 0x03, execute_sub },
-    { 0x04, execute_mul },
-    { 0x05, execute_div },
-    { 0x06, execute_inc },
-    { 0x07, execute_dec },
-    { 0x08, execute_loop },
-    { 0x09, execute_movr },
-    { 0x0C, execute_in },
-    { 0x0E, execute_out },
-    { 0x0F, execute_put },
-    { 0x0D, execute_get },
-    { 0x0A, execute_load },
-    { 0x0B, execute_store },
-    { 0x11, execute_push },
-    { 0x10, execute_swap },
-    { 0x12, execute_pop },
-    { 0x18, execute_call }, // call
-    { 0x19, execute_ret },  // ret
-    { 19, execute_cmp },
-    { 20, execute_jmp },
-    { 21, execute_jz },
-    { 22, execute_jnz },
-    { 23, execute_jgt },
+int execute_illegal(struct cpu *cpu)
+{
+    cpu->status = CPU_ILLEGAL_INSTRUCTION;
+    return 0;
+}
+
+/* Fills the 230 slots that follow the last opcode (0x19) up to 0xFF. */
+#define REPEAT_2(x) x, x
+#define REPEAT_6(x) REPEAT_2(x), REPEAT_2(x), REPEAT_2(x)
+#define REPEAT_16(x) REPEAT_6(x), REPEAT_6(x), REPEAT_2(x), REPEAT_2(x)
+#define REPEAT_112(x) REPEAT_16(x), REPEAT_16(x), REPEAT_16(x), REPEAT_16(x), \
+    REPEAT_16(x), REPEAT_16(x), REPEAT_16(x)
+#define UNUSED_OPCODE_SLOTS(x) REPEAT_6(x), REPEAT_112(x), REPEAT_112(x)
+
+/*
+ * Dispatch table indexed directly by opcode.
+ * Unknown opcodes land on execute_illegal, so decoding an instruction costs
+ * one range check and one table load instead of a search.
+ */
+static const instruction_handler dispatch_table[CPU_OPCODE_SLOTS] = {
+#define DISPATCH_ENTRY(opcode, name, operands) [opcode] = execute_##name,
+    CPU_INSTRUCTION_LIST(DISPATCH_ENTRY)
+#undef DISPATCH_ENTRY
+    UNUSED_OPCODE_SLOTS(execute_illegal)
+};
+
+static inline instruction_handler decode_instruction(uint32_t opcode)
+{
+    return opcode < CPU_OPCODE_SLOTS ? dispatch_table[opcode] : execute_illegal;
+}
+
+static const uint8_t operand_count[CPU_OPCODE_SLOTS] = {
+#define OPERAND_ENTRY(opcode, name, operands) [opcode] = operands,
+    CPU_INSTRUCTION_LIST(OPERAND_ENTRY)
+#undef OPERAND_ENTRY
 };
+
 /*
  * Executes a single instruction.
  * Returns 1 if successful, 0 if an error occurs.
@@ -640,39 +730,410 @@ int cpu_step(struct cpu *cpu)
 {
     // We can only execute if the CPU is in a valid state
     assert(cpu != NULL);
-    if (cpu->status != CPU_OK) {
+    if (cpu->status != CPU_OK && !debug_resume(cpu)) {
         return 0;
     }
 
     //Ensure the instruction pointer is within valid memory bounds
     if (cpu->inst_index < 0 || cpu->inst_index > cpu->end_of_stack) {
         cpu->status = CPU_INVALID_ADDRESS;
+        cpu_flush_output(cpu);
         return 0;
     }
 
-    //Get the opcode from memory at the current position
+    //Get the opcode from memory at the current position and run its handler
     uint32_t instruction = cpu->memory[cpu->inst_index];
-    int instruction_found = 0;
-
-    //Find the matching opcode in our lookup table
-    for (size_t i = 0; i < sizeof(instructions) / sizeof(instructions[0]); ++i) {
-        if (instructions[i].opcode == instruction) {
-            int executed = instructions[i].execute(cpu);
-            instruction_found = 1;
-            if (executed == 0) {
-                return 0; // Runtime error occurred
+    if (decode_instruction(instruction)(cpu) == 0) {
+        cpu_flush_output(cpu); // Guest output is complete once the CPU stops
+        return 0; // Runtime error occurred
+    }
+    cpu->inst_index++; // Move to next instruction
+    return 1;
+}
+
+/*
+ * Threaded code needs the "labels as values" extension (GCC, Clang).
+ * Define CPU_NO_THREADED_DISPATCH to force the portable loop.
+ */
+#if defined(__GNUC__) && !defined(CPU_NO_THREADED_DISPATCH)
+#define CPU_THREADED_DISPATCH
+#endif
+
+/*
+ * GCC merges handlers that end the same way (cross-jumping, GCSE), which
+ * turns their dispatch jumps back into a shared one.
+ */
+#if defined(CPU_THREADED_DISPATCH) && !defined(__clang__)
+#define CPU_KEEP_DISPATCH __attribute__((optimize("no-crossjumping", "no-gcse")))
+#else
+#define CPU_KEEP_DISPATCH
+#endif
+
+#ifdef CPU_THREADED_DISPATCH
+/*
+ * Threaded variant of the cpu_run loop.
+ * Every instruction gets its own copy of the fetch/dispatch sequence, which
+ * gives the host branch predictor one indirect jump per guest opcode instead
+ * of a single shared one. Semantics match the cpu_step loop exactly.
+ */
+static long long cpu_run_threaded(struct cpu *cpu, size_t steps)
+{
+    static const void *const labels[CPU_OPCODE_SLOTS] = {
+#define LABEL_ENTRY(opcode, name, operands) [opcode] = __extension__ &&op_##name,
+        CPU_INSTRUCTION_LIST(LABEL_ENTRY)
+#undef LABEL_ENTRY
+        UNUSED_OPCODE_SLOTS(__extension__ &&op_illegal)
+    };
+    size_t executed_steps = 0;
+
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        if (executed_steps == steps) {                                         \
+            return (long long) executed_steps;                                 \
+        }                                                                      \
+        if (cpu->inst_index < 0 || cpu->inst_index > cpu->end_of_stack) {      \
+            cpu->status = CPU_INVALID_ADDRESS;                                 \
+            goto stopped;                                                      \
+        }                                                                      \
+        uint32_t opcode = cpu->memory[cpu->inst_index];                        \
+        __extension__({                                                        \
+            goto *(opcode < CPU_OPCODE_SLOTS ? labels[opcode] : &&op_illegal); \
+        });                                                                    \
+    } while (0)
+
+#define THREADED_OP(opcode, name, operands) \
+    op_##name:                              \
+    if (execute_##name(cpu) == 0) {         \
+        goto stopped;                       \
+    }                                       \
+    cpu->inst_index++;                      \
+    ++executed_steps;                       \
+    DISPATCH();
+
+    DISPATCH();
+    CPU_INSTRUCTION_LIST(THREADED_OP)
+    THREADED_OP(0, illegal, 0)
+
+#undef THREADED_OP
+#undef DISPATCH
+
+stopped:
+    // The halting or failing instruction counts as a step as well
+    ++executed_steps;
+    cpu_flush_output(cpu);
+    return stop_result(cpu, (long long) executed_steps);
+}
+#endif
+
+static bool is_instruction_start(const uint8_t *starts, int32_t index)
+{
+    return (starts[index >> 3] >> (index & 7)) & 1;
+}
+
+/*
+ * Checks once whether cpu_run may drop its run-time checks for the loaded
+ * program. A linear sweep from index 0 has to cover executable memory
+ * exactly, so no instruction reaches into the stack. Every opcode has to
+ * fit the dispatch table and every register operand has to name a
+ * register. The targets of jmp, jz, jnz, jgt, loop and call and the
+ * return addresses of call have to be instruction starts, and the last
+ * instruction may only run off the end if it is a nop (the padding behind
+ * the code). A CPU running such a program only ever executes instruction
+ * starts of memory that never changes, except after a ret, whose target
+ * cpu_run still checks.
+ * Returns 1 if the program passed, 0 if cpu_run keeps all its checks.
+ */
+int cpu_verify(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    if (cpu->verified != NULL || cpu->verify_failed) {
+        return cpu->verified != NULL;
+    }
+    cpu->verify_failed = true;
+    if (cpu->end_of_stack < 0) {
+        return 0;
+    }
+    const int32_t *const code = cpu->memory;
+    const int32_t end = cpu->end_of_stack;
+    uint8_t *starts = calloc((size_t) end / 8 + 1, 1);
+    if (starts == NULL) {
+        return 0;
+    }
+
+    int32_t index = 0;
+    int32_t last = 0;
+    while (index <= end) {
+        uint32_t opcode = (uint32_t) code[index];
+        if (opcode >= CPU_OPCODE_SLOTS || index + operand_count[opcode] > end) {
+            free(starts);
+            return 0;
+        }
+        for (int k = 1; k <= operand_count[opcode]; ++k) {
+            bool is_register = opcode < 0x08 || (opcode >= 0x0C && opcode <= 0x13)
+                    || (k == 1 && opcode >= 0x09 && opcode <= 0x0B); // Not loop/jumps/call
+            uint32_t operand = (uint32_t) code[index + k];
+            if (is_register && operand > REGISTER_RESULT) {
+                free(starts);
+                return 0;
             }
-            break;
         }
+        starts[index >> 3] |= (uint8_t) (1u << (index & 7));
+        last = index;
+        index += 1 + operand_count[opcode];
     }
-    if (!instruction_found) {
-        cpu->status = CPU_ILLEGAL_INSTRUCTION;
+    uint32_t last_opcode = (uint32_t) code[last];
+    bool falls_off = last_opcode != 0x00 && last_opcode != 0x01 && last_opcode != 0x14
+            && last_opcode != 0x19 && decode_instruction(last_opcode) != execute_illegal;
+
+    for (index = 0; index <= end && !falls_off; index += 1 + operand_count[code[index]]) {
+        uint32_t opcode = (uint32_t) code[index];
+        bool jumps = opcode == 0x08 || (opcode >= 0x14 && opcode <= 0x18);
+        for (int k = 1; jumps && k <= operand_count[opcode]; ++k) {
+            int32_t target = code[index + k];
+            if (target < 0 || target > end || !is_instruction_start(starts, target)) {
+                free(starts);
+                return 0;
+            }
+        }
+    }
+    if (falls_off) {
+        free(starts);
         return 0;
     }
-    cpu->inst_index++; // Move to next instruction
+    cpu->verified = starts;
+    cpu->verify_failed = false;
     return 1;
 }
 
+#ifdef CPU_THREADED_DISPATCH
+/*
+ * cpu_run for a program cpu_verify accepted. Register operands are used
+ * without checks, instructions are fetched without bounds checks and
+ * load/store test their slot with one comparison. Whenever an
+ * instruction can fail, it is handed to its regular handler, so status,
+ * inst_index and the step count come out exactly as in the checked loop.
+ * A ret to anything but an instruction start continues in the checked
+ * loop.
+ */
+CPU_KEEP_DISPATCH static long long verified_run(struct cpu *cpu, size_t steps)
+{
+    static const void *const labels[CPU_OPCODE_SLOTS] = {
+#define LABEL_ENTRY(opcode, name, operands) [opcode] = __extension__ &&op_##name,
+        CPU_INSTRUCTION_LIST(LABEL_ENTRY)
+#undef LABEL_ENTRY
+        UNUSED_OPCODE_SLOTS(__extension__ &&op_illegal)
+    };
+    const int32_t *const code = cpu->memory;
+    const uint8_t *const starts = cpu->verified;
+    const int32_t end = cpu->end_of_stack;
+    int32_t *const reg = cpu->registers;
+    int32_t ip = cpu->inst_index;
+    size_t executed_steps = 0;
+    if (ip < 0 || ip > end || !is_instruction_start(starts, ip)) {
+        return cpu_run_threaded(cpu, steps);
+    }
+
+#define DISPATCH() __extension__({ goto *labels[(uint32_t) code[ip]]; })
+// Retires the current instruction and goes on with the one at ip
+#define NEXT_AT(index)                                                         \
+    do {                                                                       \
+        ip = (index);                                                          \
+        if (++executed_steps == steps) {                                       \
+            goto out_of_steps;                                                 \
+        }                                                                      \
+        DISPATCH();                                                            \
+    } while (0)
+#define NEXT(length) NEXT_AT(ip + (length))
+// Lets the regular handler run (or fail) the current instruction
+#define CHECKED(name)                                                          \
+    do {                                                                       \
+        cpu->inst_index = ip;                                                  \
+        if (execute_##name(cpu) == 0) {                                        \
+            goto stopped;                                                      \
+        }                                                                      \
+        NEXT_AT(cpu->inst_index + 1);                                          \
+    } while (0)
+#define OPERAND(k) code[ip + (k)]
+
+    DISPATCH();
+
+op_nop:
+    ip += 1;
+    if (++executed_steps == steps) {
+        goto out_of_steps;
+    }
+    if (ip > end) {
+        // Ran off the padding behind the code
+        cpu->inst_index = ip;
+        cpu->status = CPU_INVALID_ADDRESS;
+        goto stopped;
+    }
+    DISPATCH();
+
+op_halt:
+    cpu->inst_index = ip;
+    cpu->status = CPU_HALTED;
+    goto stopped;
+
+op_add:
+    reg[REGISTER_A] += reg[OPERAND(1)];
+    reg[REGISTER_RESULT] = reg[REGISTER_A];
+    NEXT(2);
+
+op_sub:
+    reg[REGISTER_A] -= reg[OPERAND(1)];
+    reg[REGISTER_RESULT] = reg[REGISTER_A];
+    NEXT(2);
+
+op_mul:
+    reg[REGISTER_A] *= reg[OPERAND(1)];
+    reg[REGISTER_RESULT] = reg[REGISTER_A];
+    NEXT(2);
+
+op_div:
+    if (reg[OPERAND(1)] == 0) {
+        CHECKED(div);
+    }
+    reg[REGISTER_A] /= reg[OPERAND(1)];
+    reg[REGISTER_RESULT] = reg[REGISTER_A];
+    NEXT(2);
+
+op_inc:
+    reg[OPERAND(1)] += 1;
+    reg[REGISTER_RESULT] = reg[OPERAND(1)];
+    NEXT(2);
+
+op_dec:
+    reg[OPERAND(1)] -= 1;
+    reg[REGISTER_RESULT] = reg[OPERAND(1)];
+    NEXT(2);
+
+op_loop:
+    NEXT_AT(reg[REGISTER_C] != 0 ? OPERAND(1) : ip + 2);
+
+op_movr:
+    reg[OPERAND(1)] = OPERAND(2);
+    NEXT(3);
+
+op_load: {
+    // Slot D + operand counted from the top, the same test execute_load makes
+    uint32_t offset = (uint32_t) reg[REGISTER_D] + (uint32_t) OPERAND(2);
+    if (offset >= (uint32_t) cpu->stack_size) {
+        CHECKED(load);
+    }
+    reg[OPERAND(1)] = cpu->stack_bottom[-(cpu->stack_size - 1 - (int32_t) offset)];
+    NEXT(3);
+}
+
+op_store: {
+    uint32_t offset = (uint32_t) reg[REGISTER_D] + (uint32_t) OPERAND(2);
+    if (offset >= (uint32_t) cpu->stack_size) {
+        CHECKED(store);
+    }
+    cpu->stack_bottom[-(cpu->stack_size - 1 - (int32_t) offset)] = reg[OPERAND(1)];
+    NEXT(3);
+}
+
+op_in:
+    CHECKED(in);
+
+op_get:
+    CHECKED(get);
+
+op_out:
+    CHECKED(out);
+
+op_put:
+    CHECKED(put);
+
+op_swap: {
+    int32_t temp = reg[OPERAND(1)];
+    reg[OPERAND(1)] = reg[OPERAND(2)];
+    reg[OPERAND(2)] = temp;
+    NEXT(3);
+}
+
+op_push:
+    if (cpu->stack_size >= (int32_t) cpu->stack_capacity) {
+        CHECKED(push);
+    }
+    cpu->stack_bottom[-cpu->stack_size] = reg[OPERAND(1)];
+    cpu->stack_size += 1;
+    NEXT(2);
+
+op_pop:
+    if (cpu->stack_size <= 0) {
+        CHECKED(pop);
+    }
+    reg[OPERAND(1)] = cpu->stack_bottom[-(cpu->stack_size - 1)];
+    cpu->stack_bottom[-(cpu->stack_size - 1)] = 0;
+    cpu->stack_size -= 1;
+    NEXT(2);
+
+op_cmp:
+    reg[REGISTER_RESULT] = reg[OPERAND(1)] - reg[OPERAND(2)];
+    NEXT(3);
+
+op_jmp:
+    NEXT_AT(OPERAND(1));
+
+op_jz:
+    NEXT_AT(reg[REGISTER_RESULT] == 0 ? OPERAND(1) : ip + 2);
+
+op_jnz:
+    NEXT_AT(reg[REGISTER_RESULT] != 0 ? OPERAND(1) : ip + 2);
+
+op_jgt:
+    NEXT_AT(reg[REGISTER_RESULT] > 0 ? OPERAND(1) : ip + 2);
+
+op_call:
+    if (cpu->stack_size >= (int32_t) cpu->stack_capacity) {
+        CHECKED(call);
+    }
+    cpu->stack_bottom[-cpu->stack_size] = OPERAND(2);
+    cpu->stack_size += 1;
+    NEXT_AT(OPERAND(1));
+
+op_ret: {
+    if (cpu->stack_size == 0) {
+        CHECKED(ret);
+    }
+    int32_t return_index = cpu->stack_bottom[-(cpu->stack_size - 1)];
+    cpu->stack_bottom[-(cpu->stack_size - 1)] = 0;
+    cpu->stack_size -= 1;
+    if (return_index >= 0 && return_index <= end && is_instruction_start(starts, return_index)) {
+        NEXT_AT(return_index);
+    }
+    // Not a place the verifier vouched for, go on with every check
+    cpu->inst_index = return_index;
+    if (++executed_steps == steps) {
+        return (long long) executed_steps;
+    }
+    long long rest = cpu_run_threaded(cpu, steps - executed_steps);
+    return rest < 0 ? rest - (long long) executed_steps : rest + (long long) executed_steps;
+}
+
+op_illegal:
+    CHECKED(illegal);
+
+#undef OPERAND
+#undef CHECKED
+#undef NEXT
+#undef NEXT_AT
+#undef DISPATCH
+
+out_of_steps:
+    cpu->inst_index = ip;
+    return (long long) executed_steps;
+
+stopped:
+    // The halting or failing instruction counts as a step as well
+    ++executed_steps;
+    cpu_flush_output(cpu);
+    return stop_result(cpu, (long long) executed_steps);
+}
+#endif
+
 /*
  * Runs the CPU for a specified number of steps.
  * Returns the number of executed steps.
@@ -681,16 +1142,25 @@ int cpu_step(struct cpu *cpu)
 long long cpu_run(struct cpu *cpu, size_t steps)
 {
     assert(cpu != NULL);
-    if (cpu->status != CPU_OK) {
+    if (cpu->debug != NULL) {
+        return debug_run(cpu, steps);
+    }
+    if (cpu->status != CPU_OK && !debug_resume(cpu)) {
         return 0;
     }
+#ifdef CPU_THREADED_DISPATCH
+    if (cpu_verify(cpu)) {
+        return verified_run(cpu, steps);
+    }
+    return cpu_run_threaded(cpu, steps);
+#else
     long long executed_steps = 0;
     long long error_steps = 0;
     // Main execution loop
     for (size_t i = 0; i < steps; ++i) {
         int result = cpu_step(cpu);
 
-        // If the program halted normally, we stop counting and exit    
+        // If the program halted normally, we stop counting and exit
         if (cpu->status == CPU_HALTED) {
             executed_steps += 1;
             break;
@@ -698,6 +1168,9 @@ long long cpu_run(struct cpu *cpu, size_t steps)
 
         // If an error occurred (step returned 0), we record it and stop
         if (result == 0) {
+            if (cpu->status == CPU_WAITING_INPUT) {
+                break; // The in/get did not run, it is no step
+            }
             ++error_steps;
             break;
         }
@@ -709,4 +1182,797 @@ long long cpu_run(struct cpu *cpu, size_t steps)
         return -(error_steps + executed_steps);
     }
     return executed_steps;
+#endif
+}
+
+/*
+ * Runs like cpu_run, but stops in front of the first in or get
+ * instruction without executing it, so the CPU can be saved with
+ * cpu_snapshot right before the program reads its input.
+ */
+long long cpu_run_to_input(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    long long executed_steps = 0;
+    for (size_t i = 0; i < steps && cpu->status == CPU_OK; ++i) {
+        int32_t index = cpu->inst_index;
+        if (index >= 0 && index <= cpu->end_of_stack
+                && (cpu->memory[index] == 0x0C || cpu->memory[index] == 0x0D)) {
+            break;
+        }
+        if (cpu_step(cpu) == 0) {
+            return stop_result(cpu, executed_steps + 1);
+        }
+        ++executed_steps;
+    }
+    return executed_steps;
+}
+
+/*
+ * Runs the next part of a resumable run, see struct cpu_slice. The budget
+ * is 64 bits wide even where size_t is not, a run can take any number of
+ * quanta.
+ */
+enum cpu_slice_state cpu_run_slice(struct cpu *cpu, struct cpu_slice *slice, size_t quantum)
+{
+    assert(cpu != NULL);
+    assert(slice != NULL);
+    size_t steps = slice->budget < quantum ? (size_t) slice->budget : quantum;
+    if (steps > 0) {
+        long long (*run)(struct cpu *, size_t) = slice->run != NULL ? slice->run : cpu_run_decoded;
+        long long result = run(cpu, steps);
+        unsigned long long executed = result < 0 ? 0 - (unsigned long long) result
+                                                 : (unsigned long long) result;
+        slice->budget -= executed;
+        slice->executed += executed;
+        slice->failed = result < 0;
+    }
+
+    switch (cpu->status) {
+    case CPU_OK:
+        return slice->budget > 0 ? CPU_SLICE_YIELDED : CPU_SLICE_STOPPED;
+    case CPU_WAITING_INPUT:
+        if (slice->waiting != NULL) {
+            slice->waiting(cpu, slice->context);
+        }
+        return CPU_SLICE_WAITING;
+    default:
+        return CPU_SLICE_STOPPED;
+    }
+}
+
+static bool decode_register(int32_t word, uint8_t *reg)
+{
+    if (word < 0 || word > REGISTER_RESULT) {
+        return false;
+    }
+    *reg = (uint8_t) word;
+    return true;
+}
+
+static void decode_op(struct cpu *cpu, int32_t index, struct decoded_op *op)
+{
+    uint32_t opcode = cpu->memory[index];
+    memset(op, 0, sizeof(*op));
+
+    if (opcode >= CPU_OPCODE_SLOTS || decode_instruction(opcode) == execute_illegal) {
+        op->kind = DECODED_ILLEGAL_INSTRUCTION;
+        return;
+    }
+    // Operands stored in stack memory may change, leave those to the interpreter
+    if (index + operand_count[opcode] > cpu->end_of_stack) {
+        op->kind = DECODED_INTERPRET;
+        return;
+    }
+    int32_t arg1 = operand_count[opcode] > 0 ? cpu->memory[index + 1] : 0;
+    int32_t arg2 = operand_count[opcode] > 1 ? cpu->memory[index + 2] : 0;
+
+    switch (opcode) {
+    case 0x00: op->kind = DECODED_NOP; return;
+    case 0x01: op->kind = DECODED_HALT; return;
+    case 0x02: op->kind = DECODED_ADD; break;
+    case 0x03: op->kind = DECODED_SUB; break;
+    case 0x04: op->kind = DECODED_MUL; break;
+    case 0x05: op->kind = DECODED_DIV; break;
+    case 0x06: op->kind = DECODED_INC; break;
+    case 0x07: op->kind = DECODED_DEC; break;
+    case 0x08: op->kind = DECODED_LOOP; break;
+    case 0x09: op->kind = DECODED_MOVR; break;
+    case 0x0A: op->kind = DECODED_LOAD; break;
+    case 0x0B: op->kind = DECODED_STORE; break;
+    case 0x10: op->kind = DECODED_SWAP; break;
+    case 0x11: op->kind = DECODED_PUSH; break;
+    case 0x12: op->kind = DECODED_POP; break;
+    case 0x13: op->kind = DECODED_CMP; break;
+    case 0x14: op->kind = DECODED_JMP; break;
+    case 0x15: op->kind = DECODED_JZ; break;
+    case 0x16: op->kind = DECODED_JNZ; break;
+    case 0x17: op->kind = DECODED_JGT; break;
+    case 0x18: op->kind = DECODED_CALL; break;
+    case 0x19: op->kind = DECODED_RET; return;
+    default: op->kind = DECODED_INTERPRET; return; // in, get, out, put
+    }
+
+    switch (op->kind) {
+    case DECODED_LOOP:
+    case DECODED_JMP:
+    case DECODED_JZ:
+    case DECODED_JNZ:
+    case DECODED_JGT:
+    case DECODED_CALL:
+        if (arg1 < 0 || arg1 > cpu->end_of_stack) {
+            op->kind = DECODED_INTERPRET;
+            return;
+        }
+        op->target = arg1;
+        op->imm = arg2;
+        return;
+    case DECODED_SWAP:
+    case DECODED_CMP:
+        if (!decode_register(arg1, &op->reg1) || !decode_register(arg2, &op->reg2)) {
+            break;
+        }
+        return;
+    default:
+        if (!decode_register(arg1, &op->reg1)) {
+            break;
+        }
+        op->imm = arg2;
+        return;
+    }
+
+    // Invalid register: cpu_step fails after moving past all operands
+    op->kind = DECODED_ILLEGAL_OPERAND;
+    op->imm = operand_count[opcode];
+}
+
+static bool is_valid_register_word(int32_t word)
+{
+    return word >= 0 && word <= REGISTER_RESULT;
+}
+
+/*
+ * Peephole pass over the decoded program.
+ * Looks at the op at each index together with the ops that follow it in
+ * straight-line order and turns the first one into a fused op. Only slots
+ * past the current one are read, and those are still unfused.
+ */
+static void fuse_ops(struct cpu *cpu, struct decoded_op *ops)
+{
+    const int32_t end = cpu->end_of_stack;
+    const int32_t *memory = cpu->memory;
+
+    for (int32_t i = 0; i <= end; ++i) {
+        struct decoded_op *op = &ops[i];
+        const struct decoded_op *next = &ops[i + 1]; // valid thanks to the sentinel
+
+        switch (op->kind) {
+        case DECODED_DEC:
+            next = &ops[i + 2];
+            if (next->kind == DECODED_LOOP) {
+                op->kind = DECODED_DEC_LOOP;
+                op->target = next->target;
+            }
+            break;
+        case DECODED_CMP:
+            next = &ops[i + 3];
+            if (next->kind == DECODED_JZ || next->kind == DECODED_JNZ || next->kind == DECODED_JGT) {
+                op->kind = next->kind == DECODED_JZ ? DECODED_CMP_JZ
+                        : next->kind == DECODED_JNZ ? DECODED_CMP_JNZ
+                                                    : DECODED_CMP_JGT;
+                op->target = next->target;
+            }
+            break;
+        case DECODED_PUSH:
+            next = &ops[i + 2];
+            if (next->kind == DECODED_ADD && ops[i + 4].kind == DECODED_POP) {
+                op->kind = DECODED_PUSH_ADD_POP;
+                op->reg2 = next->reg1;
+                op->reg3 = ops[i + 4].reg1;
+            }
+            break;
+        case DECODED_INTERPRET:
+            // out and put are only fused when both operands are known registers
+            if (i + 3 <= end && memory[i] == 0x0E && memory[i + 2] == 0x0F
+                    && is_valid_register_word(memory[i + 1])
+                    && is_valid_register_word(memory[i + 3])) {
+                op->kind = DECODED_OUT_PUT;
+                op->reg1 = (uint8_t) memory[i + 1];
+                op->reg2 = (uint8_t) memory[i + 3];
+            }
+            break;
+        default:
+            break;
+        }
+        (void) next;
+    }
+}
+
+/*
+ * Whether op overwrites RESULT before anything can read it: it writes
+ * RESULT first thing, cannot fail and has no RESULT operand.
+ */
+bool decoded_kills_result(const struct decoded_op *op)
+{
+    switch (op->base) {
+    case DECODED_ADD:
+    case DECODED_SUB:
+    case DECODED_MUL:
+    case DECODED_INC:
+    case DECODED_DEC:
+        return op->reg1 != REGISTER_RESULT;
+    case DECODED_CMP:
+        return op->reg1 != REGISTER_RESULT && op->reg2 != REGISTER_RESULT;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Gives the single-register ops left over by fuse_ops the kind of their
+ * operand register, the _LAZY one if the op after them makes their RESULT
+ * dead. The per-register kinds of an op are consecutive in register order.
+ */
+static void specialize_ops(struct cpu *cpu, struct decoded_op *ops)
+{
+    for (int32_t i = 0; i <= cpu->end_of_stack; ++i) {
+        // All of them are two words long, ops[i + 2] is at most the sentinel
+        bool lazy = i + 2 <= cpu->end_of_stack + 1 && decoded_kills_result(&ops[i + 2]);
+        switch (ops[i].kind) {
+#define SPECIALIZE_CASE(name)                                                  \
+        case DECODED_##name:                                                   \
+            ops[i].kind = (uint8_t) (DECODED_##name##_A + ops[i].reg1);        \
+            break;
+#define SPECIALIZE_LAZY_CASE(name)                                             \
+        case DECODED_##name:                                                   \
+            ops[i].kind = (uint8_t) (lazy ? DECODED_##name##_LAZY_A            \
+                                          : DECODED_##name##_A);               \
+            ops[i].kind += ops[i].reg1;                                        \
+            break;
+        SPECIALIZE_LAZY_CASE(ADD)
+        SPECIALIZE_LAZY_CASE(SUB)
+        SPECIALIZE_LAZY_CASE(MUL)
+        SPECIALIZE_LAZY_CASE(INC)
+        SPECIALIZE_LAZY_CASE(DEC)
+        SPECIALIZE_CASE(PUSH)
+        SPECIALIZE_CASE(POP)
+#undef SPECIALIZE_LAZY_CASE
+#undef SPECIALIZE_CASE
+        default:
+            break;
+        }
+    }
+}
+
+/*
+ * Builds the pre-decoded form of the loaded program.
+ * Returns 1 on success, 0 if memory could not be allocated.
+ */
+int cpu_predecode(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    if (cpu->decoded != NULL) {
+        return 1;
+    }
+    if (cpu->end_of_stack < 0) {
+        return 0;
+    }
+
+    size_t op_count = (size_t) cpu->end_of_stack + 2;
+    struct decoded_op *decoded = malloc(op_count * sizeof(*decoded));
+    if (decoded == NULL) {
+        return 0;
+    }
+    for (int32_t i = 0; i <= cpu->end_of_stack; ++i) {
+        decode_op(cpu, i, &decoded[i]);
+        decoded[i].base = decoded[i].kind;
+    }
+    // Falling off the end of executable memory
+    memset(&decoded[op_count - 1], 0, sizeof(*decoded));
+    decoded[op_count - 1].kind = DECODED_END;
+    decoded[op_count - 1].base = DECODED_END;
+    fuse_ops(cpu, decoded);
+    specialize_ops(cpu, decoded);
+
+    cpu->decoded = decoded;
+    return 1;
+}
+
+/*
+ * Drops the pre-decoded program, any native code compiled from it and what
+ * cpu_verify found out about it. Must be called after modifying the code
+ * in memory directly.
+ */
+void cpu_discard_decoded(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    jit_destroy(cpu->jit);
+    cpu->jit = NULL;
+    if (cpu->debug != NULL) {
+        debug_discard_decoded(cpu);
+    }
+    if (!cpu->decoded_shared) {
+        free(cpu->decoded);
+    }
+    cpu->decoded = NULL;
+    cpu->decoded_shared = false;
+    free(cpu->verified);
+    cpu->verified = NULL;
+    cpu->verify_failed = false;
+}
+
+/*
+ * Runs the pre-decoded program, equivalent to cpu_run.
+ */
+long long cpu_run_decoded(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    if (cpu->debug != NULL) {
+        return debug_run(cpu, steps);
+    }
+    if (cpu->status != CPU_OK && !debug_resume(cpu)) {
+        return 0;
+    }
+    return decoded_run(cpu, steps);
+}
+
+/*
+ * The decoded engine behind cpu_run_decoded, without breakpoint handling.
+ * Falls back to cpu_run if the program cannot be pre-decoded.
+ */
+CPU_KEEP_DISPATCH long long decoded_run(struct cpu *cpu, size_t steps)
+{
+    if (cpu->status != CPU_OK) {
+        return 0;
+    }
+    if (!cpu_predecode(cpu)) {
+        return cpu_run(cpu, steps);
+    }
+
+    const struct decoded_op *const ops = cpu->decoded;
+    const struct decoded_op *op = ops;
+    int32_t *const reg = cpu->registers;
+    size_t executed_steps = 0;
+
+#ifdef CPU_THREADED_DISPATCH
+    static const void *const labels[DECODED_KIND_COUNT] = {
+#define LABEL_ENTRY(kind) [DECODED_##kind] = __extension__ &&decoded_##kind,
+        DECODED_KIND_LIST(LABEL_ENTRY)
+#undef LABEL_ENTRY
+    };
+#define TARGET(kind) decoded_##kind
+#define DISPATCH() __extension__({ goto *labels[op->kind]; })
+#define DISPATCH_BASE() __extension__({ goto *labels[op->base]; })
+#else
+    enum decoded_kind kind;
+#define TARGET(kind) case DECODED_##kind
+#define DISPATCH() goto dispatch
+#define DISPATCH_BASE()                                                        \
+    do {                                                                       \
+        kind = (enum decoded_kind) op->base;                                   \
+        goto dispatch_kind;                                                    \
+    } while (0)
+#endif
+
+// Retires the current op and continues at the given decoded index
+#define NEXT_AT(index)                                                         \
+    do {                                                                       \
+        op = ops + (index);                                                    \
+        if (++executed_steps == steps) {                                       \
+            goto out_of_steps;                                                 \
+        }                                                                      \
+        DISPATCH();                                                            \
+    } while (0)
+#define NEXT(length) NEXT_AT(op - ops + (length))
+
+/*
+ * Fused ops retire several steps at once. FUSED_GUARD runs the unfused op
+ * instead when the budget ends inside the sequence or when the condition
+ * says the sequence would stop part-way.
+ */
+#define FUSED_GUARD(length, fallback)                                          \
+    do {                                                                       \
+        if (steps - executed_steps < (length) || (fallback)) {                 \
+            DISPATCH_BASE();                                                   \
+        }                                                                      \
+        cpu->fused_runs[op->kind - DECODED_FIRST_FUSED]++;                     \
+    } while (0)
+#define NEXT_FUSED_AT(index, length)                                           \
+    do {                                                                       \
+        executed_steps += (length) - 1;                                        \
+        NEXT_AT(index);                                                        \
+    } while (0)
+
+// NEXT(2) for a _LAZY op, which only sets RESULT (from source) when it is the last step
+#define NEXT_LAZY(source)                                                      \
+    do {                                                                       \
+        op += 2;                                                               \
+        if (++executed_steps == steps) {                                       \
+            reg[REGISTER_RESULT] = reg[source];                                \
+            goto out_of_steps;                                                 \
+        }                                                                      \
+        DISPATCH();                                                            \
+    } while (0)
+
+// Same for an index computed at run time, which still has to be checked
+#define NEXT_CHECKED(index)                                                    \
+    do {                                                                       \
+        int32_t next_index = (index);                                          \
+        if (next_index < 0 || next_index > cpu->end_of_stack) {                \
+            cpu->inst_index = next_index;                                      \
+            ++executed_steps;                                                  \
+            goto invalid_address;                                              \
+        }                                                                      \
+        NEXT_AT(next_index);                                                   \
+    } while (0)
+
+// Stops on the current op with inst_index where cpu_step would leave it
+#define STOP(advance)                                                          \
+    do {                                                                       \
+        cpu->inst_index = (int32_t) (op - ops) + (advance);                    \
+        goto stopped;                                                          \
+    } while (0)
+
+    if (steps == 0) {
+        return 0;
+    }
+    if (cpu->inst_index < 0 || cpu->inst_index > cpu->end_of_stack) {
+        goto invalid_address;
+    }
+    op = ops + cpu->inst_index;
+    DISPATCH();
+
+#ifndef CPU_THREADED_DISPATCH
+dispatch:
+    kind = (enum decoded_kind) op->kind;
+dispatch_kind:
+    switch (kind) {
+#endif
+
+    TARGET(NOP):
+        NEXT(1);
+
+    TARGET(HALT):
+        cpu->status = CPU_HALTED;
+        STOP(0);
+
+    TARGET(ADD):
+        reg[REGISTER_A] += reg[op->reg1];
+        reg[REGISTER_RESULT] = reg[REGISTER_A];
+        NEXT(2);
+
+    TARGET(SUB):
+        reg[REGISTER_A] -= reg[op->reg1];
+        reg[REGISTER_RESULT] = reg[REGISTER_A];
+        NEXT(2);
+
+    TARGET(MUL):
+        reg[REGISTER_A] *= reg[op->reg1];
+        reg[REGISTER_RESULT] = reg[REGISTER_A];
+        NEXT(2);
+
+    TARGET(DIV):
+        if (reg[op->reg1] == 0) {
+            cpu->status = CPU_DIV_BY_ZERO;
+            STOP(1);
+        }
+        reg[REGISTER_A] /= reg[op->reg1];
+        reg[REGISTER_RESULT] = reg[REGISTER_A];
+        NEXT(2);
+
+    TARGET(INC):
+        reg[op->reg1] += 1;
+        reg[REGISTER_RESULT] = reg[op->reg1];
+        NEXT(2);
+
+    TARGET(DEC):
+        reg[op->reg1] -= 1;
+        reg[REGISTER_RESULT] = reg[op->reg1];
+        NEXT(2);
+
+    TARGET(LOOP):
+        if (reg[REGISTER_C] != 0) {
+            NEXT_AT(op->target);
+        }
+        NEXT(2);
+
+    TARGET(MOVR):
+        reg[op->reg1] = op->imm;
+        NEXT(3);
+
+    TARGET(LOAD): {
+        int32_t end = cpu->stack_size;
+        int32_t stack_index = end - (reg[REGISTER_D] + op->imm) - 1;
+        if ((reg[REGISTER_D] + op->imm) < 0 || stack_index > end || stack_index < 0 || end == 0) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            STOP(2);
+        }
+        reg[op->reg1] = cpu->stack_bottom[-stack_index];
+        NEXT(3);
+    }
+
+    TARGET(STORE): {
+        int32_t end = cpu->stack_size;
+        int32_t stack_index = end - reg[REGISTER_D] - op->imm - 1;
+        if ((reg[REGISTER_D] + op->imm) < 0 || stack_index > end || stack_index < 0 || end == 0) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            STOP(2);
+        }
+        cpu->stack_bottom[-stack_index] = reg[op->reg1];
+        NEXT(3);
+    }
+
+    TARGET(SWAP): {
+        int32_t temp = reg[op->reg1];
+        reg[op->reg1] = reg[op->reg2];
+        reg[op->reg2] = temp;
+        NEXT(3);
+    }
+
+    TARGET(PUSH):
+        if (cpu->stack_size >= (int32_t) cpu->stack_capacity) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            STOP(1);
+        }
+        cpu->stack_bottom[-cpu->stack_size] = reg[op->reg1];
+        cpu->stack_size += 1;
+        NEXT(2);
+
+    TARGET(POP):
+        if (cpu->stack_size <= 0) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            STOP(1);
+        }
+        reg[op->reg1] = cpu->stack_bottom[-(cpu->stack_size - 1)];
+        cpu->stack_bottom[-(cpu->stack_size - 1)] = 0;
+        cpu->stack_size -= 1;
+        NEXT(2);
+
+    TARGET(CMP):
+        reg[REGISTER_RESULT] = reg[op->reg1] - reg[op->reg2];
+        NEXT(3);
+
+    TARGET(JMP):
+        NEXT_AT(op->target);
+
+    TARGET(JZ):
+        if (reg[REGISTER_RESULT] == 0) {
+            NEXT_AT(op->target);
+        }
+        NEXT(2);
+
+    TARGET(JNZ):
+        if (reg[REGISTER_RESULT] != 0) {
+            NEXT_AT(op->target);
+        }
+        NEXT(2);
+
+    TARGET(JGT):
+        if (reg[REGISTER_RESULT] > 0) {
+            NEXT_AT(op->target);
+        }
+        NEXT(2);
+
+    TARGET(CALL):
+        if (cpu->stack_size >= (int32_t) cpu->stack_capacity) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            STOP(2);
+        }
+        cpu->stack_bottom[-cpu->stack_size] = op->imm;
+        cpu->stack_size += 1;
+        NEXT_AT(op->target);
+
+    TARGET(RET): {
+        if (cpu->stack_size == 0) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            STOP(0);
+        }
+        int32_t return_index = cpu->stack_bottom[-(cpu->stack_size - 1)];
+        cpu->stack_bottom[-(cpu->stack_size - 1)] = 0;
+        cpu->stack_size -= 1;
+        NEXT_CHECKED(return_index);
+    }
+
+// The single-register ops for one operand register r
+#define REGISTER_TARGETS(suffix, r)                                            \
+    TARGET(ADD_##suffix):                                                      \
+        reg[REGISTER_A] += reg[r];                                             \
+        reg[REGISTER_RESULT] = reg[REGISTER_A];                                \
+        NEXT(2);                                                               \
+    TARGET(SUB_##suffix):                                                      \
+        reg[REGISTER_A] -= reg[r];                                             \
+        reg[REGISTER_RESULT] = reg[REGISTER_A];                                \
+        NEXT(2);                                                               \
+    TARGET(MUL_##suffix):                                                      \
+        reg[REGISTER_A] *= reg[r];                                             \
+        reg[REGISTER_RESULT] = reg[REGISTER_A];                                \
+        NEXT(2);                                                               \
+    TARGET(INC_##suffix):                                                      \
+        reg[r] += 1;                                                           \
+        reg[REGISTER_RESULT] = reg[r];                                         \
+        NEXT(2);                                                               \
+    TARGET(DEC_##suffix):                                                      \
+        reg[r] -= 1;                                                           \
+        reg[REGISTER_RESULT] = reg[r];                                         \
+        NEXT(2);                                                               \
+    TARGET(PUSH_##suffix):                                                     \
+        if (cpu->stack_size >= (int32_t) cpu->stack_capacity) {                \
+            cpu->status = CPU_INVALID_STACK_OPERATION;                         \
+            STOP(1);                                                           \
+        }                                                                      \
+        cpu->stack_bottom[-cpu->stack_size] = reg[r];                          \
+        cpu->stack_size += 1;                                                  \
+        NEXT(2);                                                               \
+    TARGET(POP_##suffix):                                                      \
+        if (cpu->stack_size <= 0) {                                            \
+            cpu->status = CPU_INVALID_STACK_OPERATION;                         \
+            STOP(1);                                                           \
+        }                                                                      \
+        reg[r] = cpu->stack_bottom[-(cpu->stack_size - 1)];                    \
+        cpu->stack_bottom[-(cpu->stack_size - 1)] = 0;                         \
+        cpu->stack_size -= 1;                                                  \
+        NEXT(2);                                                               \
+    TARGET(ADD_LAZY_##suffix):                                                 \
+        reg[REGISTER_A] += reg[r];                                             \
+        NEXT_LAZY(REGISTER_A);                                                 \
+    TARGET(SUB_LAZY_##suffix):                                                 \
+        reg[REGISTER_A] -= reg[r];                                             \
+        NEXT_LAZY(REGISTER_A);                                                 \
+    TARGET(MUL_LAZY_##suffix):                                                 \
+        reg[REGISTER_A] *= reg[r];                                             \
+        NEXT_LAZY(REGISTER_A);                                                 \
+    TARGET(INC_LAZY_##suffix):                                                 \
+        reg[r] += 1;                                                           \
+        NEXT_LAZY(r);                                                          \
+    TARGET(DEC_LAZY_##suffix):                                                 \
+        reg[r] -= 1;                                                           \
+        NEXT_LAZY(r);
+
+    REGISTER_TARGETS(A, REGISTER_A)
+    REGISTER_TARGETS(B, REGISTER_B)
+    REGISTER_TARGETS(C, REGISTER_C)
+    REGISTER_TARGETS(D, REGISTER_D)
+    REGISTER_TARGETS(RESULT, REGISTER_RESULT)
+#undef REGISTER_TARGETS
+
+    TARGET(DEC_LOOP):
+        FUSED_GUARD(2, false);
+        reg[op->reg1] -= 1;
+        reg[REGISTER_RESULT] = reg[op->reg1];
+        if (reg[REGISTER_C] != 0) {
+            NEXT_FUSED_AT(op->target, 2);
+        }
+        NEXT_FUSED_AT(op - ops + 4, 2);
+
+    TARGET(CMP_JZ):
+        FUSED_GUARD(2, false);
+        reg[REGISTER_RESULT] = reg[op->reg1] - reg[op->reg2];
+        if (reg[REGISTER_RESULT] == 0) {
+            NEXT_FUSED_AT(op->target, 2);
+        }
+        NEXT_FUSED_AT(op - ops + 5, 2);
+
+    TARGET(CMP_JNZ):
+        FUSED_GUARD(2, false);
+        reg[REGISTER_RESULT] = reg[op->reg1] - reg[op->reg2];
+        if (reg[REGISTER_RESULT] != 0) {
+            NEXT_FUSED_AT(op->target, 2);
+        }
+        NEXT_FUSED_AT(op - ops + 5, 2);
+
+    TARGET(CMP_JGT):
+        FUSED_GUARD(2, false);
+        reg[REGISTER_RESULT] = reg[op->reg1] - reg[op->reg2];
+        if (reg[REGISTER_RESULT] > 0) {
+            NEXT_FUSED_AT(op->target, 2);
+        }
+        NEXT_FUSED_AT(op - ops + 5, 2);
+
+    TARGET(PUSH_ADD_POP): {
+        FUSED_GUARD(3, cpu->stack_size >= (int32_t) cpu->stack_capacity);
+        int32_t pushed = reg[op->reg1];
+        // The slot is written by push and cleared again by pop
+        cpu->stack_bottom[-cpu->stack_size] = 0;
+        reg[REGISTER_A] += reg[op->reg2];
+        reg[REGISTER_RESULT] = reg[REGISTER_A];
+        reg[op->reg3] = pushed;
+        NEXT_FUSED_AT(op - ops + 6, 3);
+    }
+
+    TARGET(OUT_PUT):
+        FUSED_GUARD(2, reg[op->reg2] < 0 || reg[op->reg2] > 255);
+        cpu->inst_index = (int32_t) (op - ops);
+        execute_out(cpu);
+        cpu->inst_index += 1;
+        execute_put(cpu);
+        NEXT_FUSED_AT(op - ops + 4, 2);
+
+    TARGET(INTERPRET):
+        cpu->inst_index = (int32_t) (op - ops);
+        if (decode_instruction(cpu->memory[cpu->inst_index])(cpu) == 0) {
+            goto stopped;
+        }
+        NEXT_CHECKED(cpu->inst_index + 1);
+
+    TARGET(ILLEGAL_OPERAND):
+        cpu->status = CPU_ILLEGAL_OPERAND;
+        STOP(op->imm);
+
+    TARGET(ILLEGAL_INSTRUCTION):
+        cpu->status = CPU_ILLEGAL_INSTRUCTION;
+        STOP(0);
+
+    TARGET(BREAKPOINT):
+        // Not a step, the instruction under the trap has not run yet
+        cpu->inst_index = (int32_t) (op - ops);
+        cpu->status = CPU_BREAKPOINT;
+        cpu_flush_output(cpu);
+        return (long long) executed_steps;
+
+    TARGET(END):
+        cpu->status = CPU_INVALID_ADDRESS;
+        STOP(0);
+
+#ifndef CPU_THREADED_DISPATCH
+    case DECODED_KIND_COUNT:
+        break;
+    }
+    assert(false && "corrupted decoded program");
+#endif
+
+#undef STOP
+#undef NEXT_CHECKED
+#undef NEXT_LAZY
+#undef NEXT_FUSED_AT
+#undef FUSED_GUARD
+#undef NEXT
+#undef NEXT_AT
+#undef DISPATCH_BASE
+#undef DISPATCH
+#undef TARGET
+
+out_of_steps:
+    cpu->inst_index = (int32_t) (op - ops);
+    return (long long) executed_steps;
+
+invalid_address:
+    // inst_index already holds the bad address; failing on it takes a step
+    if (executed_steps == steps) {
+        return (long long) executed_steps;
+    }
+    cpu->status = CPU_INVALID_ADDRESS;
+
+stopped:
+    // The halting or failing instruction counts as a step as well
+    ++executed_steps;
+    cpu_flush_output(cpu);
+    return stop_result(cpu, (long long) executed_steps);
+}
+
+/*
+ * Prints which superinstructions the pre-decoder formed (sites) and how
+ * often cpu_run_decoded executed each of them.
+ */
+void cpu_fusion_report(struct cpu *cpu, FILE *out)
+{
+    static const char *const names[DECODED_FUSED_COUNT] = {
+        "dec+loop", "cmp+jz", "cmp+jnz", "cmp+jgt", "push+add+pop", "out+put",
+    };
+    unsigned long long sites[DECODED_FUSED_COUNT] = { 0 };
+
+    assert(cpu != NULL);
+    assert(out != NULL);
+    if (cpu->decoded != NULL) {
+        for (int32_t i = 0; i <= cpu->end_of_stack; ++i) {
+            if (cpu->decoded[i].kind >= DECODED_FIRST_FUSED
+                    && cpu->decoded[i].kind < DECODED_FIRST_FUSED + DECODED_FUSED_COUNT) {
+                sites[cpu->decoded[i].kind - DECODED_FIRST_FUSED]++;
+            }
+        }
+    }
+
+    fprintf(out, "%-14s %10s %16s\n", "fusion", "sites", "executed");
+    for (int i = 0; i < DECODED_FUSED_COUNT; ++i) {
+        fprintf(out, "%-14s %10llu %16llu\n", names[i], sites[i], cpu->fused_runs[i]);
+    }
 }
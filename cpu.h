@@ -1,6 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,7 +14,10 @@ enum cpu_status
     CPU_INVALID_ADDRESS,
     CPU_INVALID_STACK_OPERATION,
     CPU_DIV_BY_ZERO,
-    CPU_IO_ERROR
+    CPU_IO_ERROR,
+    CPU_BREAKPOINT, // Stopped in front of a breakpoint, running resumes
+    CPU_WATCHPOINT, // Stopped after a watched value changed, running resumes
+    CPU_WAITING_INPUT // Stopped in front of in/get for lack of input, running resumes
 };
 
 enum cpu_register
@@ -30,6 +34,17 @@ struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom, size_t stack_capa
 
 int32_t *cpu_create_memory(FILE *program, size_t stack_capacity, int32_t **stack_bottom);
 
+int32_t *cpu_create_memory_from_words(const uint32_t *words, size_t count, size_t stack_capacity,
+        int32_t **stack_bottom);
+
+int32_t *cpu_map_program(const char *path, size_t stack_capacity, int32_t **stack_bottom);
+
+int32_t *cpu_map_program_fd(int fd, size_t stack_capacity, int32_t **stack_bottom);
+
+void cpu_unmap_memory(int32_t *memory, int32_t *stack_bottom);
+
+struct cpu *cpu_create_mapped(int32_t *memory, int32_t *stack_bottom, size_t stack_capacity);
+
 int32_t cpu_get_register(struct cpu *cpu, enum cpu_register reg);
 
 void cpu_set_register(struct cpu *cpu, enum cpu_register reg, int32_t value);
@@ -38,6 +53,8 @@ enum cpu_status cpu_get_status(struct cpu *cpu);
 
 int32_t cpu_get_stack_size(struct cpu *cpu);
 
+int32_t cpu_get_inst_index(struct cpu *cpu);
+
 void cpu_destroy(struct cpu *cpu);
 
 void cpu_reset(struct cpu *cpu);
@@ -46,4 +63,308 @@ long long cpu_run(struct cpu *cpu, size_t steps);
 
 int cpu_step(struct cpu *cpu);
 
+long long cpu_run_to_input(struct cpu *cpu, size_t steps);
+
+/*
+ * Resumable runs for cooperative time slicing. Every cpu_run_slice call
+ * runs at most quantum steps of the budget with the given engine and
+ * tells the caller why it returned; calling it again continues the run.
+ * A guest that reads under CPU_IO_NONBLOCKING_INPUT while no input is
+ * there stops in front of the in/get, waiting is called and the state is
+ * CPU_SLICE_WAITING; the next call retries the read.
+ */
+enum cpu_slice_state
+{
+    CPU_SLICE_YIELDED, // The quantum is used up, the run goes on
+    CPU_SLICE_WAITING, // Stopped with CPU_WAITING_INPUT
+    CPU_SLICE_STOPPED, // Halted, failed, at a breakpoint or out of budget
+};
+
+struct cpu_slice
+{
+    long long (*run)(struct cpu *cpu, size_t steps); // cpu_run_decoded if NULL
+    unsigned long long budget;   // Steps the run may still take
+    unsigned long long executed; // Steps taken so far
+    bool failed;                 // The last step failed, cpu_run would be negative
+    void (*waiting)(struct cpu *cpu, void *context); // NULL if not needed
+    void *context;
+};
+
+enum cpu_slice_state cpu_run_slice(struct cpu *cpu, struct cpu_slice *slice, size_t quantum);
+
+int cpu_snapshot(struct cpu *cpu, const char *path);
+
+struct cpu *cpu_restore(const char *path);
+
+int cpu_predecode(struct cpu *cpu);
+
+void cpu_discard_decoded(struct cpu *cpu);
+
+long long cpu_run_decoded(struct cpu *cpu, size_t steps);
+
+int cpu_verify(struct cpu *cpu);
+
+void cpu_fusion_report(struct cpu *cpu, FILE *out);
+
+long long cpu_run_jit(struct cpu *cpu, size_t steps);
+
+/*
+ * Breakpoints and watchpoints (debug.c). cpu_run, cpu_run_decoded and
+ * cpu_run_jit stop with CPU_BREAKPOINT or CPU_WATCHPOINT when one
+ * triggers; running the CPU again continues where it stopped.
+ */
+enum cpu_watch_kind
+{
+    CPU_WATCH_REGISTER, // which is an enum cpu_register
+    CPU_WATCH_STACK,    // which is a stack slot, 0 at the bottom
+};
+
+int cpu_set_breakpoint(struct cpu *cpu, int32_t index);
+
+int cpu_clear_breakpoint(struct cpu *cpu, int32_t index);
+
+int cpu_set_watchpoint(struct cpu *cpu, enum cpu_watch_kind kind, int32_t which);
+
+int cpu_clear_watchpoint(struct cpu *cpu, enum cpu_watch_kind kind, int32_t which);
+
+void cpu_clear_debug(struct cpu *cpu);
+
+int cpu_watchpoint_hit(struct cpu *cpu, enum cpu_watch_kind *kind, int32_t *which);
+
+/*
+ * Execution profile: executions per opcode and per instruction index,
+ * taken/not-taken counts of branches and steps per call path.
+ */
+struct cpu_profile;
+
+struct cpu_profile *cpu_profile_create(struct cpu *cpu);
+
+void cpu_profile_destroy(struct cpu_profile *profile);
+
+long long cpu_run_profiled(struct cpu *cpu, struct cpu_profile *profile, size_t steps);
+
+void cpu_profile_report(const struct cpu_profile *profile, const struct cpu *cpu, FILE *out);
+
+int cpu_profile_folded(const struct cpu_profile *profile, FILE *out);
+
+/*
+ * Hardware counters (perf.c, Linux perf_event_open) around one call of
+ * run, for the calling thread in user space. valid has a bit set for
+ * every counter that could be read; if it is 0, error says why.
+ */
+enum cpu_perf_counter
+{
+    CPU_PERF_CYCLES = 1,
+    CPU_PERF_INSTRUCTIONS = 2,      // Host instructions
+    CPU_PERF_BRANCH_MISSES = 4,
+    CPU_PERF_L1D_MISSES = 8,        // L1 data cache read misses
+};
+
+struct cpu_perf_result
+{
+    long long steps;                // What run returned
+    unsigned valid;                 // enum cpu_perf_counter bits
+    int error;                      // errno value if no counter could be read
+    unsigned long long cycles;
+    unsigned long long instructions;
+    unsigned long long branch_misses;
+    unsigned long long l1d_misses;
+};
+
+struct cpu_perf_result cpu_run_perf(struct cpu *cpu, long long (*run)(struct cpu *, size_t),
+        size_t steps);
+
+void cpu_perf_report(const struct cpu_perf_result *result, FILE *out);
+
+/*
+ * Binary execution trace, one record per step (format in trace.c).
+ */
+struct cpu_trace_record
+{
+    uint32_t inst_index; // Where the instruction was fetched
+    uint8_t opcode;      // Saturated at 255
+    uint8_t changed;     // Bit i set if register i changed
+    uint8_t status;      // enum cpu_status after the step
+    int32_t value;       // New value of the lowest changed register
+    int32_t stack_size;  // After the step
+};
+
+enum cpu_trace_flags
+{
+    CPU_TRACE_COMPRESSED = 1, // Delta-encode records
+};
+
+struct cpu_trace_writer;
+
+struct cpu_trace_writer *cpu_trace_writer_create(int fd, unsigned flags);
+
+int cpu_trace_writer_finish(struct cpu_trace_writer *trace);
+
+long long cpu_run_traced(struct cpu *cpu, struct cpu_trace_writer *trace, size_t steps);
+
+struct cpu_trace_reader;
+
+struct cpu_trace_reader *cpu_trace_reader_open(int fd);
+
+int cpu_trace_read(struct cpu_trace_reader *reader, struct cpu_trace_record *record);
+
+void cpu_trace_reader_close(struct cpu_trace_reader *reader);
+
+/*
+ * Record and replay (replay.c): logs guest input and checkpoints the CPU
+ * every few steps, so it can be sent back to any step it has executed.
+ */
+struct cpu_recording;
+
+struct cpu_recording *cpu_recording_create(struct cpu *cpu, size_t interval);
+
+void cpu_recording_destroy(struct cpu_recording *recording);
+
+long long cpu_run_recorded(struct cpu *cpu, struct cpu_recording *recording, size_t steps);
+
+unsigned long long cpu_recording_position(const struct cpu_recording *recording);
+
+unsigned long long cpu_recording_length(const struct cpu_recording *recording);
+
+int cpu_replay_seek(struct cpu *cpu, struct cpu_recording *recording, unsigned long long step);
+
+/*
+ * Guest I/O backend used by the in/get/out/put instructions.
+ * read stores up to size bytes in buf and returns how many it stored,
+ * 0 at the end of input or -1 on error. write returns 0 once all size
+ * bytes are written and -1 on error. The CPU buffers both directions and
+ * calls write only when its buffer fills, on halt or error, on
+ * cpu_flush_output and on cpu_destroy. With CPU_IO_NONBLOCKING_INPUT,
+ * read may fail with errno EAGAIN to say that no input is there yet; the
+ * file descriptor backend sets the flag for an O_NONBLOCK input.
+ */
+struct cpu_io_ops
+{
+    long (*read)(void *context, char *buf, size_t size);
+    int (*write)(void *context, const char *buf, size_t size);
+};
+
+enum cpu_io_flags
+{
+    CPU_IO_INTERACTIVE_INPUT = 1, // Flush output before waiting for input
+    CPU_IO_LINE_OUTPUT = 2,       // Flush output after every newline
+    CPU_IO_NONBLOCKING_INPUT = 4, // read failing with EAGAIN means no input yet
+};
+
+void cpu_set_io(struct cpu *cpu, const struct cpu_io_ops *ops, void *context, unsigned flags);
+
+void cpu_set_io_fd(struct cpu *cpu, int input_fd, int output_fd);
+
+void cpu_set_io_memory(struct cpu *cpu, const void *input, size_t input_size,
+        void *output, size_t output_capacity);
+
+size_t cpu_memory_output_size(struct cpu *cpu);
+
+int cpu_flush_output(struct cpu *cpu);
+
+/*
+ * Result cache (cache.c): a directory of finished runs, keyed by a hash of
+ * the CPU's starting state and code, the step budget and the whole guest
+ * input, bounded to max_size bytes by deleting the least recently used.
+ */
+struct cpu_cache;
+
+struct cpu_cache *cpu_cache_open(const char *dir, unsigned long long max_size);
+
+void cpu_cache_close(struct cpu_cache *cache);
+
+long long cpu_run_cached(struct cpu *cpu, struct cpu_cache *cache,
+        long long (*run)(struct cpu *, size_t), size_t steps, const void *input,
+        size_t input_size, bool *hit);
+
+/*
+ * A program loaded and pre-decoded once, for running many CPUs at a time.
+ */
+struct cpu_program;
+
+struct cpu_program *cpu_program_load(const char *path, size_t stack_capacity);
+
+void cpu_program_destroy(struct cpu_program *program);
+
+struct cpu *cpu_program_instance(struct cpu_program *program);
+
+/*
+ * One run of a program in cpu_run_batch. The caller fills in the input,
+ * the runner everything else.
+ */
+struct cpu_batch_job
+{
+    const char *input;    // Guest input
+    size_t input_size;
+    char *output;         // Guest output, release with free()
+    size_t output_size;
+    int error;            // errno value if the job could not run, otherwise 0
+    enum cpu_status status;
+    int32_t registers[5]; // A, B, C, D and RESULT
+    int32_t stack_size;
+    long long steps;      // What cpu_run returned
+};
+
+int cpu_run_batch(struct cpu_program *program, struct cpu_batch_job *jobs, size_t job_count,
+        size_t steps, unsigned threads);
+
+int cpu_run_batch_lockstep(struct cpu_program *program, struct cpu_batch_job *jobs,
+        size_t job_count, size_t steps, unsigned threads);
+
+void cpu_run_lockstep(struct cpu **cpus, size_t count, size_t steps, long long *results);
+
+/*
+ * Emulator service (serve.c, protocol described there): runs requests for
+ * resident programs that arrive over a Unix socket on worker threads
+ * until cpu_server_stop.
+ */
+struct cpu_server;
+
+struct cpu_server *cpu_server_create(const char *socket_path, struct cpu_program **programs,
+        size_t program_count, size_t steps, unsigned threads);
+
+int cpu_server_run(struct cpu_server *server);
+
+void cpu_server_stop(struct cpu_server *server);
+
+void cpu_server_stats(struct cpu_server *server, FILE *out);
+
+void cpu_server_destroy(struct cpu_server *server);
+
+int cpu_server_connect(const char *socket_path);
+
+int cpu_server_request(int fd, uint32_t program, struct cpu_batch_job *job);
+
+char *cpu_server_request_stats(int fd);
+
+/*
+ * Pool of preallocated CPUs and guest memory for creating and destroying
+ * CPUs at a high rate.
+ */
+struct cpu_arena;
+
+struct cpu_arena *cpu_arena_create(size_t cpu_count, size_t memory_words);
+
+void cpu_arena_destroy(struct cpu_arena *arena);
+
+struct cpu *cpu_arena_acquire(struct cpu_arena *arena, struct cpu_program *program);
+
+void cpu_arena_release(struct cpu_arena *arena, struct cpu *cpu);
+
+/*
+ * What a CPU keeps resident, in bytes (footprint.c). The first three are
+ * its own; shared_bytes is memory it uses together with the other CPUs of
+ * its cpu_program (decoded ops, code pages of a mapped image), counted in
+ * full for each of them.
+ */
+struct cpu_memory_stats
+{
+    size_t state_bytes;  // struct cpu, I/O buffers, decoded ops and native code of its own
+    size_t code_bytes;   // Resident pages of guest code of its own
+    size_t stack_bytes;  // Resident pages of the guest stack
+    size_t shared_bytes;
+};
+
+void cpu_memory_stats(struct cpu *cpu, struct cpu_memory_stats *stats);
+
 #endif // CPU_H
@@ -0,0 +1,415 @@
+#ifndef CPU_INTERNAL_H
+#define CPU_INTERNAL_H
+
+/*
+ * Definitions shared by the execution engines (cpu.c, jit.c).
+ * Not part of the public interface, embedders only ever see cpu.h.
+ */
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The instruction set in opcode order.
+ * X(opcode, name, operands) is expanded once per instruction and binds the
+ * opcode to its execute_<name> handler; operands is the number of words that
+ * follow the opcode. The dispatch table, the threaded label table in cpu_run,
+ * the pre-decoder and the profiler's opcode names are all generated from
+ * this list.
+ */
+#define CPU_INSTRUCTION_LIST(X) \
+    X(0x00, nop, 0)             \
+    X(0x01, halt, 0)            \
+    X(0x02, add, 1)             \
+    X(0x03, sub, 1)             \
+    X(0x04, mul, 1)             \
+    X(0x05, div, 1)             \
+    X(0x06, inc, 1)             \
+    X(0x07, dec, 1)             \
+    X(0x08, loop, 1)            \
+    X(0x09, movr, 2)            \
+    X(0x0A, load, 2)            \
+    X(0x0B, store, 2)           \
+    X(0x0C, in, 1)              \
+    X(0x0D, get, 1)             \
+    X(0x0E, out, 1)             \
+    X(0x0F, put, 1)             \
+    X(0x10, swap, 2)            \
+    X(0x11, push, 1)            \
+    X(0x12, pop, 1)             \
+    X(0x13, cmp, 2)             \
+    X(0x14, jmp, 1)             \
+    X(0x15, jz, 1)              \
+    X(0x16, jnz, 1)             \
+    X(0x17, jgt, 1)             \
+    X(0x18, call, 2)            \
+    X(0x19, ret, 0)
+
+#define CPU_OPCODE_SLOTS 256
+
+/*
+ * Pre-decoded program.
+ *
+ * cpu_predecode turns the word stream into one fixed-size decoded_op per
+ * word of executable memory (indices 0 .. end_of_stack), plus a sentinel
+ * for the first index past it. Decoding every word, not only the ones the
+ * linear sweep reaches, keeps jumps into the middle of an instruction
+ * exact: the op at any index is what cpu_step would execute there.
+ *
+ * Register operands and static jump targets are checked once here. The only
+ * executable words whose value can change at run time are operands of an
+ * instruction near end_of_stack that reach into stack memory (push, store
+ * and call never write below it). Such instructions, out-of-range jump
+ * targets and all I/O are decoded as DECODED_INTERPRET, which hands the
+ * instruction to the regular handler. Code that writes to memory behind the
+ * CPU's back must call cpu_discard_decoded.
+ *
+ * A peephole pass then replaces the first op of common idioms with a fused
+ * op doing the whole sequence in one dispatch (DECODED_DEC_LOOP and the
+ * following kinds). The ops behind it stay as they are, so jumping into the
+ * middle of a fused sequence still works, and a fused op falls back to its
+ * base kind whenever it cannot retire the whole sequence at once.
+ *
+ * Finally the single-register arithmetic and stack ops that were not fused
+ * get a kind per operand register (DECODED_ADD_A and so on), whose handler
+ * names the register as a constant instead of reading reg1. Their base is
+ * still the generic kind. An add/sub/mul/inc/dec directly followed by an op
+ * that overwrites RESULT without reading it (see decoded_kills_result) gets
+ * the _LAZY kind instead, which only sets RESULT if the budget runs out
+ * right after it.
+ */
+#define DECODED_REGISTER_KINDS(X, kind) \
+    X(kind##_A)                         \
+    X(kind##_B)                         \
+    X(kind##_C)                         \
+    X(kind##_D)                         \
+    X(kind##_RESULT)
+
+#define DECODED_KIND_LIST(X)            \
+    X(NOP)                              \
+    X(HALT)                             \
+    X(ADD)                              \
+    X(SUB)                              \
+    X(MUL)                              \
+    X(DIV)                              \
+    X(INC)                              \
+    X(DEC)                              \
+    X(LOOP)                             \
+    X(MOVR)                             \
+    X(LOAD)                             \
+    X(STORE)                            \
+    X(SWAP)                             \
+    X(PUSH)                             \
+    X(POP)                              \
+    X(CMP)                              \
+    X(JMP)                              \
+    X(JZ)                               \
+    X(JNZ)                              \
+    X(JGT)                              \
+    X(CALL)                             \
+    X(RET)                              \
+    DECODED_REGISTER_KINDS(X, ADD)      \
+    DECODED_REGISTER_KINDS(X, SUB)      \
+    DECODED_REGISTER_KINDS(X, MUL)      \
+    DECODED_REGISTER_KINDS(X, INC)      \
+    DECODED_REGISTER_KINDS(X, DEC)      \
+    DECODED_REGISTER_KINDS(X, PUSH)     \
+    DECODED_REGISTER_KINDS(X, POP)      \
+    DECODED_REGISTER_KINDS(X, ADD_LAZY) \
+    DECODED_REGISTER_KINDS(X, SUB_LAZY) \
+    DECODED_REGISTER_KINDS(X, MUL_LAZY) \
+    DECODED_REGISTER_KINDS(X, INC_LAZY) \
+    DECODED_REGISTER_KINDS(X, DEC_LAZY) \
+    X(DEC_LOOP)                         \
+    X(CMP_JZ)                           \
+    X(CMP_JNZ)                          \
+    X(CMP_JGT)                          \
+    X(PUSH_ADD_POP)                     \
+    X(OUT_PUT)                          \
+    X(INTERPRET)                        \
+    X(ILLEGAL_OPERAND)                  \
+    X(ILLEGAL_INSTRUCTION)              \
+    X(BREAKPOINT)                       \
+    X(END)
+
+enum decoded_kind
+{
+#define KIND_ENUM(kind) DECODED_##kind,
+    DECODED_KIND_LIST(KIND_ENUM)
+#undef KIND_ENUM
+    DECODED_KIND_COUNT
+};
+
+#define DECODED_FIRST_FUSED DECODED_DEC_LOOP
+#define DECODED_FUSED_COUNT (DECODED_OUT_PUT - DECODED_DEC_LOOP + 1)
+
+struct decoded_op
+{
+    uint8_t kind;   // enum decoded_kind
+    uint8_t base;   // Kind before fusion, equal to kind for plain instructions
+    uint8_t reg1;   // First register operand, already validated
+    uint8_t reg2;   // Second register operand, already validated
+    uint8_t reg3;   // Third register of a fused sequence
+    int32_t imm;    // Immediate operand (movr/load/store value, call return index),
+                    // for ILLEGAL_OPERAND how far cpu_step advances inst_index
+    int32_t target; // Jump target, always inside the decoded array
+};
+
+/*
+ * Buffered guest I/O (io.c).
+ * Input is read in bulk into in_buf, output collects in out_buf until it
+ * fills up or the CPU stops. Both buffers are allocated on first use.
+ */
+#define CPU_IO_BUFFER_SIZE (64 * 1024)
+#define CPU_IO_INT_DIGITS 11 // "-2147483648"
+
+struct cpu_io_fd
+{
+    int input_fd;
+    int output_fd;
+};
+
+struct cpu_io_memory
+{
+    const char *input;
+    size_t input_size;
+    size_t input_pos;
+    char *output;
+    size_t output_capacity;
+    size_t output_size;
+};
+
+// scanf("%d") state kept while an in waits for the rest of its number
+struct io_number
+{
+    bool started;  // Sign or digits consumed already
+    bool negative;
+    bool digits;
+    unsigned long long magnitude;
+};
+
+struct cpu_io
+{
+    struct cpu_io_ops ops;
+    void *context;
+    unsigned flags;     // enum cpu_io_flags
+    bool probe_tty;     // Terminal flags of the fd backend not known yet
+    bool write_failed;  // Reported by cpu_flush_output
+
+    char *in_buf;
+    size_t in_pos;
+    size_t in_len;
+    bool in_eof;        // Sticky like the EOF flag of a stdio stream
+    bool in_waiting;    // The last read found no input yet (CPU_IO_NONBLOCKING_INPUT)
+    struct io_number number; // An in that had to wait in the middle of its number
+    char *out_buf;
+    size_t out_len;
+    size_t out_capacity; // 0 sends the next output through io_reserve
+
+    // Contexts of the built-in backends
+    union {
+        struct cpu_io_fd fd;
+        struct cpu_io_memory memory;
+    } backend;
+};
+
+enum cpu_memory_owner
+{
+    CPU_MEMORY_MALLOC, // Passed to cpu_create, freed by cpu_destroy
+    CPU_MEMORY_MAPPED, // From cpu_map_program, unmapped by cpu_destroy
+    CPU_MEMORY_ARENA,  // A slot of a cpu_arena, see cpu_arena_release
+};
+
+/*
+ * State native code keeps next to the registers while cpu_run_jit runs,
+ * addressed through the struct cpu like everything else (see jit.c).
+ */
+struct jit_frame
+{
+    int64_t budget;  // Steps left
+    uintptr_t stack; // Host rsp native code was entered with
+    uintptr_t limit; // Lowest rsp guest calls made as host calls may take
+};
+
+#define CPU_CACHE_LINE 64
+
+#ifdef __GNUC__
+#define CPU_CACHE_ALIGNED __attribute__((aligned(CPU_CACHE_LINE)))
+#else
+#define CPU_CACHE_ALIGNED
+#endif
+
+/*
+ * Main CPU structure holding the state of the machine.
+ * It contains the memory, stack pointers, registers, and flags.
+ * The stack is located at the very end of the allocated memory.
+ *
+ * Everything an instruction touches comes first and fits in one cache
+ * line; the struct is allocated cache-line aligned (cpu_create and arena
+ * CPUs). The rest is only used when a run starts or stops, or by a few
+ * engines and the embedding API.
+ */
+struct CPU_CACHE_ALIGNED cpu
+{
+    int32_t *memory;       // Main memory (instructions + data)
+    int32_t *stack_bottom; // Pointer to the end of memory where stack begins
+    size_t stack_capacity; // Max items allowed on stack
+    enum cpu_status status;// Current status (running, halted, error...)
+    int32_t inst_index;    // Instruction pointer (index of next instruction)
+    int32_t stack_size;    // Current number of items on the stack
+
+    // Registers: A, B, C, D and the Result register (index 4)
+    int32_t registers[5];
+
+    // Last word of executable memory, the stack starts right after it
+    int32_t end_of_stack;
+
+    // Native code cache for cpu_run_jit, NULL until first used
+    struct jit_frame jit_frame;
+    struct jit_state *jit;
+
+    // Pre-decoded program for cpu_run_decoded, NULL until cpu_predecode
+    struct decoded_op *decoded;
+    bool decoded_shared; // decoded belongs to a cpu_program, do not free it
+    unsigned long long fused_runs[DECODED_FUSED_COUNT]; // Executions per fused kind
+
+    // Instruction starts of a program cpu_verify accepted, one bit per word
+    uint8_t *verified;
+    bool verify_failed; // cpu_verify rejected the program, cpu_run checks everything
+
+    enum cpu_memory_owner memory_owner; // How cpu_destroy releases memory
+    bool code_shared; // Code pages map a file copy-on-write, shared until written
+
+    // Program the CPU was made from, holds a reference to it; NULL otherwise
+    struct cpu_program *program;
+
+    // Breakpoints and watchpoints, NULL while there are none
+    struct cpu_debug *debug;
+
+    struct cpu_io io;
+};
+
+void jit_destroy(struct jit_state *jit);
+
+long long decoded_run(struct cpu *cpu, size_t steps);
+bool decoded_kills_result(const struct decoded_op *op);
+
+// Breakpoints and watchpoints (debug.c)
+long long debug_run(struct cpu *cpu, size_t steps);
+void debug_discard_decoded(struct cpu *cpu);
+
+/*
+ * Lets a CPU stopped by a breakpoint or watchpoint, or waiting for input,
+ * continue. Returns false if it is stopped for good.
+ */
+static inline bool debug_resume(struct cpu *cpu)
+{
+    if (cpu->status != CPU_BREAKPOINT && cpu->status != CPU_WATCHPOINT
+            && cpu->status != CPU_WAITING_INPUT) {
+        return false;
+    }
+    cpu->status = CPU_OK;
+    return true;
+}
+
+/*
+ * What a run returns when its last step stopped the CPU, executed_steps
+ * including that step: halting counts as success, an in/get waiting for
+ * input has not run and is no step at all, anything else failed.
+ */
+static inline long long stop_result(const struct cpu *cpu, long long executed_steps)
+{
+    if (cpu->status == CPU_HALTED) {
+        return executed_steps;
+    }
+    if (cpu->status == CPU_WAITING_INPUT) {
+        return executed_steps - 1;
+    }
+    return -executed_steps;
+}
+
+struct cpu_program
+{
+    int fd;               // Image file, -1 if it could not be mapped
+    size_t image_size;    // Size of the image in bytes
+    size_t program_words; // Words up to the last non-zero one of the image
+    size_t memory_words;  // Guest memory per instance
+    size_t stack_capacity;
+    struct cpu *decoder;  // CPU the shared decoded ops belong to
+    unsigned refs;        // One for the loader and one per CPU made from it
+};
+
+void program_acquire(struct cpu_program *program);
+void program_release(struct cpu_program *program);
+size_t jit_footprint(const struct jit_state *jit);
+
+void batch_run_job(struct cpu *cpu, struct cpu_batch_job *job, size_t steps);
+
+#define LOCKSTEP_LANES 8 // CPUs cpu_run_lockstep runs at a time
+
+void cpu_init(struct cpu *cpu, int32_t *memory, int32_t *stack_bottom, size_t stack_capacity);
+void clear_stack(struct cpu *cpu);
+
+// Programs and snapshots store little-endian words
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CPU_NATIVE_LITTLE_ENDIAN
+#endif
+
+#define MEMORY_BLOCK_WORDS (4096 / sizeof(int32_t)) // Guest memory grows in pages
+
+bool memory_layout_words(size_t program_words, size_t stack_capacity, size_t *total_words);
+void memory_words_from_le(int32_t *memory, size_t count);
+int32_t *memory_map_anonymous(size_t total_words);
+int32_t *memory_map_image(int fd, size_t size, size_t total_words);
+int32_t *memory_load_fd(int fd, size_t stack_capacity, int32_t **stack_bottom, bool *mapped);
+bool memory_is_source(const char *path);
+int32_t *memory_load_source(const char *path, size_t stack_capacity, int32_t **stack_bottom);
+struct image_header;
+bool memory_layout_image(const void *image, size_t size, size_t stack_capacity,
+        struct image_header *header, size_t *total_words);
+
+void io_init(struct cpu *cpu);
+void io_destroy(struct cpu *cpu);
+int io_getc(struct cpu *cpu);
+bool io_read_int(struct cpu *cpu, int32_t *value);
+bool io_reserve(struct cpu *cpu, size_t size);
+
+static inline void io_put_char(struct cpu *cpu, char c)
+{
+    struct cpu_io *io = &cpu->io;
+    if (io->out_len == io->out_capacity && !io_reserve(cpu, 1)) {
+        return;
+    }
+    io->out_buf[io->out_len++] = c;
+    if (c == '\n' && (io->flags & CPU_IO_LINE_OUTPUT)) {
+        cpu_flush_output(cpu);
+    }
+}
+
+static inline void io_put_int(struct cpu *cpu, int32_t value)
+{
+    struct cpu_io *io = &cpu->io;
+    if (io->out_capacity - io->out_len < CPU_IO_INT_DIGITS
+            && !io_reserve(cpu, CPU_IO_INT_DIGITS)) {
+        return;
+    }
+    char digits[CPU_IO_INT_DIGITS];
+    char *p = digits + sizeof(digits);
+    uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+    do {
+        *--p = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    size_t length = (size_t) (digits + sizeof(digits) - p);
+    memcpy(io->out_buf + io->out_len, p, length);
+    io->out_len += length;
+}
+
+#endif // CPU_INTERNAL_H
@@ -0,0 +1,182 @@
+/*
+ * cputrace: turns binary traces written by ./cpu trace --trace-file into
+ * text, or finds the first step where two traces differ.
+ *
+ *   cputrace dump TRACE
+ *   cputrace diff TRACE1 TRACE2
+ *
+ * diff exits with 0 if the traces are identical, 1 if they differ and 2 on
+ * error, like cmp.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DIFF_CONTEXT 8 // Identical records shown before a divergence
+
+static const char *const opcode_names[CPU_OPCODE_SLOTS] = {
+#define NAME_ENTRY(opcode, name, operands) [opcode] = #name,
+    CPU_INSTRUCTION_LIST(NAME_ENTRY)
+#undef NAME_ENTRY
+};
+
+static const char *const status_names[] = {
+    "CPU_OK",
+    "CPU_HALTED",
+    "CPU_ILLEGAL_INSTRUCTION",
+    "CPU_ILLEGAL_OPERAND",
+    "CPU_INVALID_ADDRESS",
+    "CPU_INVALID_STACK_OPERATION",
+    "CPU_DIV_BY_ZERO",
+    "CPU_IO_ERROR",
+    "CPU_BREAKPOINT",
+    "CPU_WATCHPOINT",
+    "CPU_WAITING_INPUT",
+};
+
+static void print_record(unsigned long long step, const struct cpu_trace_record *record)
+{
+    static const char register_names[] = "ABCDR";
+    const char *name = opcode_names[record->opcode] != NULL ? opcode_names[record->opcode] : "???";
+    printf("%10llu %8u  %-6s", step, record->inst_index, name);
+
+    char changes[32] = "";
+    size_t len = 0;
+    for (int r = 0; r <= REGISTER_RESULT; ++r) {
+        if (record->changed & (1u << r)) {
+            len += (size_t) snprintf(changes + len, sizeof(changes) - len, len == 0 ? "%c=%d" : ",%c",
+                    register_names[r], record->value);
+        }
+    }
+    printf(" %-16s stack=%d", changes, record->stack_size);
+    if (record->status != CPU_OK) {
+        printf(" %s", record->status < sizeof(status_names) / sizeof(status_names[0])
+                        ? status_names[record->status]
+                        : "???");
+    }
+    printf("\n");
+}
+
+static struct cpu_trace_reader *open_trace(const char *path, int *fd)
+{
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct cpu_trace_reader *reader = *fd < 0 ? NULL : cpu_trace_reader_open(*fd);
+    if (reader == NULL) {
+        fprintf(stderr, "cputrace: %s: %s\n", path,
+                errno == EINVAL ? "not a trace file" : strerror(errno));
+        if (*fd >= 0) {
+            close(*fd);
+        }
+    }
+    return reader;
+}
+
+static int dump(const char *path)
+{
+    int fd;
+    struct cpu_trace_reader *reader = open_trace(path, &fd);
+    if (reader == NULL) {
+        return 2;
+    }
+    struct cpu_trace_record record;
+    unsigned long long step = 0;
+    int result;
+    while ((result = cpu_trace_read(reader, &record)) > 0) {
+        print_record(++step, &record);
+    }
+    if (result < 0) {
+        fprintf(stderr, "cputrace: %s: %s\n", path, errno == EINVAL ? "truncated trace" : strerror(errno));
+    }
+    cpu_trace_reader_close(reader);
+    close(fd);
+    return result < 0 ? 2 : 0;
+}
+
+static bool same_record(const struct cpu_trace_record *a, const struct cpu_trace_record *b)
+{
+    return a->inst_index == b->inst_index && a->opcode == b->opcode && a->changed == b->changed
+            && a->status == b->status && a->value == b->value && a->stack_size == b->stack_size;
+}
+
+static int diff(const char *path1, const char *path2)
+{
+    int fd1, fd2;
+    struct cpu_trace_reader *trace1 = open_trace(path1, &fd1);
+    if (trace1 == NULL) {
+        return 2;
+    }
+    struct cpu_trace_reader *trace2 = open_trace(path2, &fd2);
+    if (trace2 == NULL) {
+        cpu_trace_reader_close(trace1);
+        close(fd1);
+        return 2;
+    }
+
+    struct cpu_trace_record context[DIFF_CONTEXT];
+    struct cpu_trace_record a, b;
+    unsigned long long step = 0;
+    int exit_code = 0;
+    for (;;) {
+        int got1 = cpu_trace_read(trace1, &a);
+        int got2 = cpu_trace_read(trace2, &b);
+        if (got1 < 0 || got2 < 0) {
+            fprintf(stderr, "cputrace: %s: %s\n", got1 < 0 ? path1 : path2,
+                    errno == EINVAL ? "truncated trace" : strerror(errno));
+            exit_code = 2;
+            break;
+        }
+        if (got1 == 0 && got2 == 0) {
+            break;
+        }
+        ++step;
+        if (got1 > 0 && got2 > 0 && same_record(&a, &b)) {
+            context[step % DIFF_CONTEXT] = a;
+            continue;
+        }
+
+        printf("Traces differ at step %llu\n", step);
+        unsigned long long first = step > DIFF_CONTEXT ? step - DIFF_CONTEXT : 1;
+        for (unsigned long long s = first; s < step; ++s) {
+            print_record(s, &context[s % DIFF_CONTEXT]);
+        }
+        printf("--- %s\n", path1);
+        if (got1 > 0) {
+            print_record(step, &a);
+        } else {
+            printf("(trace ends)\n");
+        }
+        printf("+++ %s\n", path2);
+        if (got2 > 0) {
+            print_record(step, &b);
+        } else {
+            printf("(trace ends)\n");
+        }
+        exit_code = 1;
+        break;
+    }
+
+    cpu_trace_reader_close(trace1);
+    cpu_trace_reader_close(trace2);
+    close(fd1);
+    close(fd2);
+    return exit_code;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+        return dump(argv[2]);
+    }
+    if (argc == 4 && strcmp(argv[1], "diff") == 0) {
+        return diff(argv[2], argv[3]);
+    }
+    fprintf(stderr, "Usage: cputrace dump TRACE\n"
+                    "       cputrace diff TRACE1 TRACE2\n");
+    return 2;
+}
@@ -0,0 +1,384 @@
+/*
+ * Breakpoints and watchpoints.
+ *
+ * A CPU without any has no debug state (cpu->debug is NULL) and the
+ * engines run exactly as before. Otherwise cpu_run, cpu_run_decoded and
+ * cpu_run_jit all go through debug_run.
+ *
+ * Breakpoints cost nothing per step: they are patched into a private copy
+ * of the decoded program as DECODED_BREAKPOINT ops, and cpu_run_decoded
+ * stops when it dispatches one. Guest memory is never touched, so the
+ * instruction under a breakpoint is still there for cpu_step to execute
+ * when the run resumes. Fused ops that would retire the instruction under
+ * a breakpoint as part of their sequence are put back to their base kind.
+ *
+ * Watchpoints have to look at the watched values after every step, so
+ * while any are set the CPU runs one cpu_step at a time.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+
+// Furthest a fused op reaches past its own index (push+add+pop)
+#define FUSED_REACH 4
+
+struct watchpoint
+{
+    enum cpu_watch_kind kind;
+    int32_t which;
+    int32_t value; // Last value seen
+};
+
+struct cpu_debug
+{
+    int32_t *breakpoints; // Sorted
+    size_t breakpoint_count;
+    size_t breakpoint_capacity;
+    struct watchpoint *watchpoints;
+    size_t watch_count;
+    size_t watch_capacity;
+    int hit; // Index of the watchpoint that stopped the CPU, -1 if none
+
+    // Decoded program without traps, cpu->decoded is the patched copy
+    struct decoded_op *original;
+    bool original_shared;
+    bool patched; // cpu->decoded matches the breakpoints
+};
+
+static struct cpu_debug *get_debug(struct cpu *cpu)
+{
+    if (cpu->debug == NULL) {
+        cpu->debug = calloc(1, sizeof(*cpu->debug));
+        if (cpu->debug != NULL) {
+            cpu->debug->hit = -1;
+        }
+    }
+    return cpu->debug;
+}
+
+static bool grow(void **array, size_t *capacity, size_t count, size_t size)
+{
+    if (count < *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+    void *bigger = realloc(*array, new_capacity * size);
+    if (bigger == NULL) {
+        return false;
+    }
+    *array = bigger;
+    *capacity = new_capacity;
+    return true;
+}
+
+/*
+ * Finds the breakpoint at index, or where it would go.
+ */
+static size_t find_breakpoint(const struct cpu_debug *debug, int32_t index)
+{
+    size_t low = 0, high = debug->breakpoint_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (debug->breakpoints[middle] < index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static bool is_breakpoint(const struct cpu_debug *debug, int32_t index)
+{
+    size_t at = find_breakpoint(debug, index);
+    return at < debug->breakpoint_count && debug->breakpoints[at] == index;
+}
+
+static int32_t watched_value(const struct cpu *cpu, const struct watchpoint *watch)
+{
+    return watch->kind == CPU_WATCH_REGISTER ? cpu->registers[watch->which]
+                                             : cpu->stack_bottom[-watch->which];
+}
+
+/*
+ * Gives the CPU its undebugged decoded program back and drops the debug
+ * state once nothing is set any more.
+ */
+static void release_if_unused(struct cpu *cpu)
+{
+    struct cpu_debug *debug = cpu->debug;
+    if (debug->original != NULL && debug->breakpoint_count == 0) {
+        free(cpu->decoded);
+        cpu->decoded = debug->original;
+        cpu->decoded_shared = debug->original_shared;
+        debug->original = NULL;
+    }
+    if (debug->breakpoint_count == 0 && debug->watch_count == 0) {
+        free(debug->breakpoints);
+        free(debug->watchpoints);
+        free(debug);
+        cpu->debug = NULL;
+    }
+}
+
+/*
+ * Stops execution in front of the instruction at index.
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int cpu_set_breakpoint(struct cpu *cpu, int32_t index)
+{
+    assert(cpu != NULL);
+    if (index < 0 || index > cpu->end_of_stack) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct cpu_debug *debug = get_debug(cpu);
+    if (debug == NULL) {
+        return -1;
+    }
+    size_t at = find_breakpoint(debug, index);
+    if (at < debug->breakpoint_count && debug->breakpoints[at] == index) {
+        return 0;
+    }
+    if (!grow((void **) &debug->breakpoints, &debug->breakpoint_capacity,
+                debug->breakpoint_count, sizeof(*debug->breakpoints))) {
+        release_if_unused(cpu);
+        errno = ENOMEM;
+        return -1;
+    }
+    memmove(debug->breakpoints + at + 1, debug->breakpoints + at,
+            (debug->breakpoint_count - at) * sizeof(*debug->breakpoints));
+    debug->breakpoints[at] = index;
+    debug->breakpoint_count++;
+    debug->patched = false;
+    return 0;
+}
+
+/*
+ * Returns 0 if there was a breakpoint at index, -1 otherwise.
+ */
+int cpu_clear_breakpoint(struct cpu *cpu, int32_t index)
+{
+    assert(cpu != NULL);
+    struct cpu_debug *debug = cpu->debug;
+    if (debug == NULL || !is_breakpoint(debug, index)) {
+        return -1;
+    }
+    size_t at = find_breakpoint(debug, index);
+    debug->breakpoint_count--;
+    memmove(debug->breakpoints + at, debug->breakpoints + at + 1,
+            (debug->breakpoint_count - at) * sizeof(*debug->breakpoints));
+    debug->patched = false;
+    release_if_unused(cpu);
+    return 0;
+}
+
+/*
+ * Stops execution after any step that changes a register (which is an
+ * enum cpu_register) or the stack slot which (0 being the bottom of the
+ * stack). Returns 0 on success, -1 with errno set on failure.
+ */
+int cpu_set_watchpoint(struct cpu *cpu, enum cpu_watch_kind kind, int32_t which)
+{
+    assert(cpu != NULL);
+    if (which < 0 || (kind == CPU_WATCH_REGISTER ? which > REGISTER_RESULT
+                                                 : (size_t) which >= cpu->stack_capacity)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct cpu_debug *debug = get_debug(cpu);
+    if (debug == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < debug->watch_count; ++i) {
+        if (debug->watchpoints[i].kind == kind && debug->watchpoints[i].which == which) {
+            return 0;
+        }
+    }
+    if (!grow((void **) &debug->watchpoints, &debug->watch_capacity, debug->watch_count,
+                sizeof(*debug->watchpoints))) {
+        release_if_unused(cpu);
+        errno = ENOMEM;
+        return -1;
+    }
+    struct watchpoint *watch = &debug->watchpoints[debug->watch_count++];
+    watch->kind = kind;
+    watch->which = which;
+    watch->value = watched_value(cpu, watch);
+    return 0;
+}
+
+/*
+ * Returns 0 if the watchpoint was set, -1 otherwise.
+ */
+int cpu_clear_watchpoint(struct cpu *cpu, enum cpu_watch_kind kind, int32_t which)
+{
+    assert(cpu != NULL);
+    struct cpu_debug *debug = cpu->debug;
+    if (debug == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < debug->watch_count; ++i) {
+        if (debug->watchpoints[i].kind == kind && debug->watchpoints[i].which == which) {
+            debug->watchpoints[i] = debug->watchpoints[--debug->watch_count];
+            debug->hit = -1;
+            release_if_unused(cpu);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Removes all breakpoints and watchpoints.
+ */
+void cpu_clear_debug(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    if (cpu->debug != NULL) {
+        cpu->debug->breakpoint_count = 0;
+        cpu->debug->watch_count = 0;
+        release_if_unused(cpu);
+    }
+}
+
+/*
+ * After a run stopped with CPU_WATCHPOINT, tells which watchpoint it was.
+ * Returns 1 and fills in kind and which if there is one, 0 otherwise.
+ */
+int cpu_watchpoint_hit(struct cpu *cpu, enum cpu_watch_kind *kind, int32_t *which)
+{
+    assert(cpu != NULL);
+    if (cpu->status != CPU_WATCHPOINT || cpu->debug == NULL || cpu->debug->hit < 0) {
+        return 0;
+    }
+    const struct watchpoint *watch = &cpu->debug->watchpoints[cpu->debug->hit];
+    *kind = watch->kind;
+    *which = watch->which;
+    return 1;
+}
+
+/*
+ * The decoded program is about to be freed, the original goes with it.
+ */
+void debug_discard_decoded(struct cpu *cpu)
+{
+    struct cpu_debug *debug = cpu->debug;
+    if (debug->original != NULL && !debug->original_shared) {
+        free(debug->original);
+    }
+    debug->original = NULL;
+    debug->patched = false;
+}
+
+/*
+ * Brings the trap ops in cpu->decoded in line with the breakpoints.
+ * Returns false if the program cannot be pre-decoded.
+ */
+static bool patch_breakpoints(struct cpu *cpu)
+{
+    struct cpu_debug *debug = cpu->debug;
+    size_t op_count = (size_t) cpu->end_of_stack + 2;
+    if (debug->original == NULL) {
+        if (!cpu_predecode(cpu)) {
+            return false;
+        }
+        struct decoded_op *copy = malloc(op_count * sizeof(*copy));
+        if (copy == NULL) {
+            return false;
+        }
+        debug->original = cpu->decoded;
+        debug->original_shared = cpu->decoded_shared;
+        cpu->decoded = copy;
+        cpu->decoded_shared = false;
+    } else if (debug->patched) {
+        return true;
+    }
+
+    memcpy(cpu->decoded, debug->original, op_count * sizeof(*cpu->decoded));
+    for (size_t i = 0; i < debug->breakpoint_count; ++i) {
+        int32_t index = debug->breakpoints[i];
+        int32_t first = index > FUSED_REACH ? index - FUSED_REACH : 0;
+        for (int32_t k = first; k < index; ++k) {
+            cpu->decoded[k].kind = cpu->decoded[k].base;
+        }
+        cpu->decoded[index].kind = DECODED_BREAKPOINT;
+    }
+    debug->patched = true;
+    return true;
+}
+
+/*
+ * Returns the index of the first watchpoint whose value changed and
+ * remembers the new values.
+ */
+static int changed_watchpoint(struct cpu *cpu)
+{
+    struct cpu_debug *debug = cpu->debug;
+    int hit = -1;
+    for (size_t i = 0; i < debug->watch_count; ++i) {
+        int32_t value = watched_value(cpu, &debug->watchpoints[i]);
+        if (value != debug->watchpoints[i].value) {
+            debug->watchpoints[i].value = value;
+            hit = hit < 0 ? (int) i : hit;
+        }
+    }
+    return hit;
+}
+
+static long long stop_at(struct cpu *cpu, enum cpu_status status, long long executed_steps)
+{
+    cpu->status = status;
+    cpu_flush_output(cpu);
+    return executed_steps;
+}
+
+/*
+ * cpu_run for a CPU with breakpoints or watchpoints. A CPU stopped on a
+ * breakpoint resumes by executing the instruction under it.
+ */
+long long debug_run(struct cpu *cpu, size_t steps)
+{
+    struct cpu_debug *debug = cpu->debug;
+    bool step_over = cpu->status == CPU_BREAKPOINT;
+    if (cpu->status != CPU_OK && !debug_resume(cpu)) {
+        return 0;
+    }
+    debug->hit = -1;
+    for (size_t i = 0; i < debug->watch_count; ++i) {
+        // Only changes made by the guest during this run count
+        debug->watchpoints[i].value = watched_value(cpu, &debug->watchpoints[i]);
+    }
+
+    long long executed_steps = 0;
+    if (debug->watch_count == 0 && step_over && steps > 0) {
+        ++executed_steps;
+        if (cpu_step(cpu) == 0) {
+            return stop_result(cpu, executed_steps);
+        }
+        step_over = false;
+    }
+    if (debug->watch_count == 0 && patch_breakpoints(cpu)) {
+        if ((size_t) executed_steps == steps) {
+            return executed_steps;
+        }
+        long long result = decoded_run(cpu, steps - (size_t) executed_steps);
+        return result < 0 ? result - executed_steps : result + executed_steps;
+    }
+
+    for (; (size_t) executed_steps < steps; step_over = false) {
+        if (!step_over && debug->breakpoint_count > 0 && is_breakpoint(debug, cpu->inst_index)) {
+            return stop_at(cpu, CPU_BREAKPOINT, executed_steps);
+        }
+        ++executed_steps;
+        if (cpu_step(cpu) == 0) {
+            return stop_result(cpu, executed_steps);
+        }
+        if (debug->watch_count > 0 && (debug->hit = changed_watchpoint(cpu)) >= 0) {
+            return stop_at(cpu, CPU_WATCHPOINT, executed_steps);
+        }
+    }
+    return executed_steps;
+}
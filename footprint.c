@@ -0,0 +1,96 @@
+/*
+ * Memory footprint of a CPU.
+ *
+ * Guest memory is reserved in full but only committed page by page as the
+ * guest touches it (see loader.c), so what a CPU costs is found out with
+ * mincore: the pages of its code and stack that are resident. Code pages
+ * mapping an image file copy-on-write are never written by the guest and
+ * stay shared with the page cache and every other CPU of the same program,
+ * and so do the decoded ops of a cpu_program.
+ */
+#define _DEFAULT_SOURCE // mincore
+
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MINCORE_PAGES 4096 // Pages asked about at a time
+
+/*
+ * Resident bytes of the pages overlapping [start, end). Pages the kernel
+ * cannot tell about are counted as resident.
+ */
+static size_t resident_bytes(const void *start, const void *end, size_t page)
+{
+    uintptr_t at = (uintptr_t) start / page * page;
+    uintptr_t last = ((uintptr_t) end + page - 1) / page * page;
+    unsigned char vec[MINCORE_PAGES];
+    size_t resident = 0;
+    while (at < last) {
+        size_t pages = (last - at) / page;
+        if (pages > MINCORE_PAGES) {
+            pages = MINCORE_PAGES;
+        }
+        if (mincore((void *) at, pages * page, vec) != 0) {
+            resident += pages;
+        } else {
+            for (size_t i = 0; i < pages; ++i) {
+                resident += vec[i] & 1;
+            }
+        }
+        at += pages * page;
+    }
+    return resident * page;
+}
+
+/*
+ * Fills in what the CPU keeps resident right now. Cheap enough to call
+ * for every CPU of a host now and then, not on every step.
+ */
+void cpu_memory_stats(struct cpu *cpu, struct cpu_memory_stats *stats)
+{
+    assert(cpu != NULL);
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(*stats));
+
+    stats->state_bytes = sizeof(*cpu) + jit_footprint(cpu->jit);
+    if (cpu->io.in_buf != NULL) {
+        stats->state_bytes += CPU_IO_BUFFER_SIZE;
+    }
+    if (cpu->io.out_buf != NULL) {
+        stats->state_bytes += CPU_IO_BUFFER_SIZE;
+    }
+    if (cpu->verified != NULL) {
+        stats->state_bytes += (size_t) cpu->end_of_stack / 8 + 1;
+    }
+    if (cpu->decoded != NULL) {
+        size_t op_bytes = ((size_t) cpu->end_of_stack + 2) * sizeof(*cpu->decoded);
+        if (cpu->decoded_shared) {
+            stats->shared_bytes += op_bytes;
+        } else {
+            stats->state_bytes += op_bytes;
+        }
+    }
+    if (cpu->memory == NULL) {
+        return;
+    }
+
+    // The page with the last code word may hold the start of the stack too
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const int32_t *stack_start = cpu->memory + cpu->end_of_stack + 1;
+    const void *split = (const void *) ((uintptr_t) stack_start / page * page);
+    if ((uintptr_t) split < (uintptr_t) cpu->memory) {
+        split = cpu->memory;
+    }
+    size_t code = resident_bytes(cpu->memory, split, page);
+    if (cpu->code_shared) {
+        stats->shared_bytes += code;
+    } else {
+        stats->code_bytes = code;
+    }
+    stats->stack_bytes = resident_bytes(split, cpu->stack_bottom + 1, page);
+}
@@ -0,0 +1,342 @@
+/*
+ * Compact program images, see image.h for the format.
+ *
+ * Shared by the assembler, which writes them, and the loaders, which expand
+ * them back into the guest memory layout raw images get. The CPU itself
+ * only ever sees words: jump targets and return addresses are word
+ * indices, so the packing cannot reach past the file.
+ */
+#include "image.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_RAW_WORD 0x1F // Opcode byte of a word stored as it is
+#define IMAGE_OPCODES 0x1A
+#define IMAGE_REGISTERS 5
+
+enum image_field
+{
+    FIELD_MAGIC = 0,
+    FIELD_VERSION = 4,
+    FIELD_ENTRY = 8,
+    FIELD_WORDS = 12,
+    FIELD_STACK_CAPACITY = 16,
+    FIELD_CODE_SIZE = 20,
+    FIELD_SYMBOL_COUNT = 24,
+    FIELD_RESERVED = 28,
+};
+
+// How the words after an opcode are packed
+enum shape
+{
+    SHAPE_NONE,     // No operands
+    SHAPE_REG,      // Register
+    SHAPE_REG_REG,  // Register, register
+    SHAPE_REG_NUM,  // Register, signed number
+    SHAPE_TARGET,   // Instruction index
+    SHAPE_CALL,     // Instruction index, return address
+};
+
+static const unsigned char shapes[IMAGE_OPCODES] = {
+    [0x00] = SHAPE_NONE,    [0x01] = SHAPE_NONE,    [0x02] = SHAPE_REG,
+    [0x03] = SHAPE_REG,     [0x04] = SHAPE_REG,     [0x05] = SHAPE_REG,
+    [0x06] = SHAPE_REG,     [0x07] = SHAPE_REG,     [0x08] = SHAPE_TARGET,
+    [0x09] = SHAPE_REG_NUM, [0x0A] = SHAPE_REG_NUM, [0x0B] = SHAPE_REG_NUM,
+    [0x0C] = SHAPE_REG,     [0x0D] = SHAPE_REG,     [0x0E] = SHAPE_REG,
+    [0x0F] = SHAPE_REG,     [0x10] = SHAPE_REG_REG, [0x11] = SHAPE_REG,
+    [0x12] = SHAPE_REG,     [0x13] = SHAPE_REG_REG, [0x14] = SHAPE_TARGET,
+    [0x15] = SHAPE_TARGET,  [0x16] = SHAPE_TARGET,  [0x17] = SHAPE_TARGET,
+    [0x18] = SHAPE_CALL,    [0x19] = SHAPE_NONE,
+};
+
+static const unsigned char shape_words[] = {
+    [SHAPE_NONE] = 1, [SHAPE_REG] = 2, [SHAPE_REG_REG] = 3,
+    [SHAPE_REG_NUM] = 3, [SHAPE_TARGET] = 2, [SHAPE_CALL] = 3,
+};
+
+static void put_u32(unsigned char *header, enum image_field field, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        header[field + i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *header, enum image_field field)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= (uint32_t) header[field + i] << (8 * i);
+    }
+    return value;
+}
+
+static uint32_t zigzag(uint32_t value)
+{
+    return value << 1 ^ (value & 0x80000000u ? 0xFFFFFFFFu : 0);
+}
+
+static uint32_t unzigzag(uint32_t value)
+{
+    return value >> 1 ^ (0u - (value & 1));
+}
+
+struct buffer
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static bool put_byte(struct buffer *buffer, unsigned char byte)
+{
+    if (buffer->size == buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 4096;
+        unsigned char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            return false;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    buffer->data[buffer->size++] = byte;
+    return true;
+}
+
+static bool put_leb(struct buffer *buffer, uint32_t value)
+{
+    while (value >= 0x80) {
+        if (!put_byte(buffer, (unsigned char) (value | 0x80))) {
+            return false;
+        }
+        value >>= 7;
+    }
+    return put_byte(buffer, (unsigned char) value);
+}
+
+/*
+ * Packs the instruction at words[pos], false if there is no memory.
+ * Stores how many words it took in length, 0 if they do not form an
+ * instruction that can be packed.
+ */
+static bool put_instruction(struct buffer *buffer, const uint32_t *words, size_t count,
+        size_t pos, size_t *length)
+{
+    uint32_t opcode = words[pos];
+    *length = 0;
+    if (opcode >= IMAGE_OPCODES || count - pos < shape_words[shapes[opcode]]) {
+        return true;
+    }
+    enum shape shape = (enum shape) shapes[opcode];
+    uint32_t reg = 0;
+    if (shape == SHAPE_REG || shape == SHAPE_REG_REG || shape == SHAPE_REG_NUM) {
+        if ((reg = words[pos + 1]) >= IMAGE_REGISTERS) {
+            return true;
+        }
+    }
+    if (shape == SHAPE_REG_REG && words[pos + 2] >= IMAGE_REGISTERS) {
+        return true;
+    }
+
+    bool ok = put_byte(buffer, (unsigned char) (opcode | reg << 5));
+    switch (shape) {
+    case SHAPE_NONE:
+    case SHAPE_REG:
+        break;
+    case SHAPE_REG_REG:
+        ok = ok && put_byte(buffer, (unsigned char) words[pos + 2]);
+        break;
+    case SHAPE_REG_NUM:
+        ok = ok && put_leb(buffer, zigzag(words[pos + 2]));
+        break;
+    case SHAPE_TARGET:
+        ok = ok && put_leb(buffer, words[pos + 1]);
+        break;
+    case SHAPE_CALL:
+        ok = ok && put_leb(buffer, words[pos + 1])
+                && put_leb(buffer, zigzag(words[pos + 2] - (uint32_t) (pos + 3)));
+        break;
+    }
+    *length = shape_words[shape];
+    return ok;
+}
+
+/*
+ * Writes the count words as a compact image to out, with the given stack
+ * requirement and symbols. Returns 0 on success, -1 with errno set
+ * otherwise.
+ */
+int image_write(FILE *out, const uint32_t *words, size_t count, uint32_t stack_capacity,
+        const struct image_symbol *symbols, size_t symbol_count)
+{
+    if (count > UINT32_MAX || symbol_count > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    struct buffer code = { NULL, 0, 0 };
+    bool ok = true;
+    for (size_t pos = 0; ok && pos < count;) {
+        size_t length;
+        ok = put_instruction(&code, words, count, pos, &length);
+        if (ok && length == 0) {
+            ok = put_byte(&code, IMAGE_RAW_WORD) && put_leb(&code, words[pos]);
+            length = 1;
+        }
+        pos += length;
+    }
+    size_t code_size = code.size;
+    for (size_t i = 0; ok && i < symbol_count; ++i) {
+        size_t length = strlen(symbols[i].name);
+        ok = length <= UINT32_MAX && put_leb(&code, symbols[i].index)
+                && put_leb(&code, (uint32_t) length);
+        for (size_t c = 0; ok && c < length; ++c) {
+            ok = put_byte(&code, (unsigned char) symbols[i].name[c]);
+        }
+    }
+    if (!ok || code_size > UINT32_MAX) {
+        free(code.data);
+        errno = ok ? EFBIG : ENOMEM;
+        return -1;
+    }
+
+    unsigned char header[IMAGE_HEADER_SIZE] = { 0 };
+    put_u32(header, FIELD_MAGIC, IMAGE_MAGIC);
+    put_u32(header, FIELD_VERSION, IMAGE_VERSION);
+    put_u32(header, FIELD_ENTRY, 0);
+    put_u32(header, FIELD_WORDS, (uint32_t) count);
+    put_u32(header, FIELD_STACK_CAPACITY, stack_capacity);
+    put_u32(header, FIELD_CODE_SIZE, (uint32_t) code_size);
+    put_u32(header, FIELD_SYMBOL_COUNT, (uint32_t) symbol_count);
+    ok = fwrite(header, 1, sizeof(header), out) == sizeof(header)
+            && (code.size == 0 || fwrite(code.data, 1, code.size, out) == code.size);
+    free(code.data);
+    if (!ok) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Whether the size bytes at data start like a compact image rather than
+ * a raw one.
+ */
+bool image_is_compact(const void *data, size_t size)
+{
+    return size >= 4 && get_u32(data, FIELD_MAGIC) == IMAGE_MAGIC;
+}
+
+/*
+ * Reads the header of the compact image of size bytes at data. Returns 0
+ * on success, -1 with errno set to EINVAL if the header is not one this
+ * version reads or the code does not fit in size.
+ */
+int image_read_header(const void *data, size_t size, struct image_header *header)
+{
+    const unsigned char *bytes = data;
+    if (size < IMAGE_HEADER_SIZE || get_u32(bytes, FIELD_MAGIC) != IMAGE_MAGIC
+            || get_u32(bytes, FIELD_VERSION) != IMAGE_VERSION
+            || get_u32(bytes, FIELD_ENTRY) != 0 || get_u32(bytes, FIELD_RESERVED) != 0
+            || get_u32(bytes, FIELD_CODE_SIZE) > size - IMAGE_HEADER_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    header->entry = get_u32(bytes, FIELD_ENTRY);
+    header->words = get_u32(bytes, FIELD_WORDS);
+    header->stack_capacity = get_u32(bytes, FIELD_STACK_CAPACITY);
+    header->code_size = get_u32(bytes, FIELD_CODE_SIZE);
+    header->symbol_count = get_u32(bytes, FIELD_SYMBOL_COUNT);
+    return 0;
+}
+
+static bool get_leb(const unsigned char **p, const unsigned char *end, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*p == end) {
+            return false;
+        }
+        unsigned char byte = *(*p)++;
+        if (shift == 28 && byte > 0x0F) {
+            return false; // More than 32 bits
+        }
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Expands the code of the compact image at data, whose header was read
+ * into header, into header->words host-order words. Returns 0 on success,
+ * -1 with errno set to EINVAL if the code is malformed.
+ */
+int image_decode(const void *data, const struct image_header *header, int32_t *words)
+{
+    const unsigned char *p = (const unsigned char *) data + IMAGE_HEADER_SIZE;
+    const unsigned char *end = p + header->code_size;
+    size_t pos = 0;
+    while (p < end) {
+        unsigned char byte = *p++;
+        uint32_t opcode = byte & 0x1F;
+        uint32_t reg = byte >> 5;
+        uint32_t value;
+        if (opcode == IMAGE_RAW_WORD && reg == 0) {
+            if (pos == header->words || !get_leb(&p, end, &value)) {
+                break;
+            }
+            words[pos++] = (int32_t) value;
+            continue;
+        }
+
+        enum shape shape = opcode < IMAGE_OPCODES ? (enum shape) shapes[opcode] : SHAPE_NONE;
+        bool has_reg = shape == SHAPE_REG || shape == SHAPE_REG_REG || shape == SHAPE_REG_NUM;
+        if (opcode >= IMAGE_OPCODES || reg >= (has_reg ? IMAGE_REGISTERS : 1)
+                || header->words - pos < shape_words[shape]) {
+            break;
+        }
+        words[pos] = (int32_t) opcode;
+        bool ok = true;
+        switch (shape) {
+        case SHAPE_NONE:
+            break;
+        case SHAPE_REG:
+            words[pos + 1] = (int32_t) reg;
+            break;
+        case SHAPE_REG_REG:
+            words[pos + 1] = (int32_t) reg;
+            ok = p < end && *p < IMAGE_REGISTERS;
+            if (ok) {
+                words[pos + 2] = *p++;
+            }
+            break;
+        case SHAPE_REG_NUM:
+            words[pos + 1] = (int32_t) reg;
+            ok = get_leb(&p, end, &value);
+            words[pos + 2] = (int32_t) unzigzag(value);
+            break;
+        case SHAPE_TARGET:
+            ok = get_leb(&p, end, &value);
+            words[pos + 1] = (int32_t) value;
+            break;
+        case SHAPE_CALL:
+            ok = get_leb(&p, end, &value);
+            words[pos + 1] = (int32_t) value;
+            ok = ok && get_leb(&p, end, &value);
+            words[pos + 2] = (int32_t) (unzigzag(value) + (uint32_t) (pos + 3));
+            break;
+        }
+        if (!ok) {
+            break;
+        }
+        pos += shape_words[shape];
+    }
+    if (p != end || pos != header->words) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
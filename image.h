@@ -0,0 +1,69 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * Compact program images (image.c), written by the assembler and read by
+ * the loaders next to the raw word images they always read.
+ *
+ * A compact image starts with a fixed header of little-endian 32-bit
+ * fields, so a loader knows how much memory the program needs before it
+ * looks at the code:
+ *
+ *   magic          IMAGE_MAGIC, "\x7f" "CPU" in the file
+ *   version        IMAGE_VERSION
+ *   entry          Index of the first instruction, 0 (reserved)
+ *   words          Program words the code expands to
+ *   stack_capacity Stack items the program needs, 0 if unknown
+ *   code_size      Bytes of code that follow the header
+ *   symbol_count   Symbols that follow the code
+ *   reserved       0
+ *
+ * The code packs the word stream instruction by instruction. The first
+ * byte holds the opcode in its low five bits and the first register
+ * operand, if any, in the top three; a second register operand takes
+ * one more byte. Numeric operands are LEB128, zigzag-encoded where they
+ * can be negative, and the return address of call is stored relative to
+ * the instruction after the call (so it is a single zero byte). Words
+ * that do not form an instruction like that (data, bad register
+ * operands, an instruction cut off by the end) are stored one by one
+ * behind IMAGE_RAW_WORD. Decoding gives back exactly the words that were
+ * encoded, whatever they are.
+ *
+ * Every symbol is the LEB128 word index it names, the LEB128 length of
+ * its name and the name itself, without a terminator. Loaders skip them.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define IMAGE_MAGIC 0x5550437Fu // Not an opcode: a raw image starting with it fails at once
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 32
+
+struct image_header
+{
+    uint32_t entry;
+    uint32_t words;
+    uint32_t stack_capacity;
+    uint32_t code_size;
+    uint32_t symbol_count;
+};
+
+struct image_symbol
+{
+    const char *name;
+    uint32_t index;
+};
+
+int image_write(FILE *out, const uint32_t *words, size_t count, uint32_t stack_capacity,
+        const struct image_symbol *symbols, size_t symbol_count);
+
+bool image_is_compact(const void *data, size_t size);
+
+int image_read_header(const void *data, size_t size, struct image_header *header);
+
+int image_decode(const void *data, const struct image_header *header, int32_t *words);
+
+#endif // IMAGE_H
@@ -0,0 +1,339 @@
+/*
+ * Buffered guest I/O.
+ *
+ * The in/get/out/put instructions used to go through scanf, getchar and
+ * printf, paying for stream locking and format parsing on every guest
+ * instruction. They now work on two user-space buffers per CPU that are
+ * filled and drained through a small backend (struct cpu_io_ops): file
+ * descriptors by default, caller-owned memory for embedding, or anything
+ * the caller provides. Number parsing for 'in' follows scanf("%d").
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+static long fd_read(void *context, char *buf, size_t size)
+{
+    struct cpu_io_fd *fds = context;
+    ssize_t result;
+    do {
+        result = read(fds->input_fd, buf, size);
+    } while (result < 0 && errno == EINTR);
+    return (long) result;
+}
+
+static int fd_write(void *context, const char *buf, size_t size)
+{
+    struct cpu_io_fd *fds = context;
+    while (size > 0) {
+        ssize_t result = write(fds->output_fd, buf, size);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += result;
+        size -= (size_t) result;
+    }
+    return 0;
+}
+
+static const struct cpu_io_ops fd_ops = { fd_read, fd_write };
+
+static long memory_read(void *context, char *buf, size_t size)
+{
+    struct cpu_io_memory *memory = context;
+    size_t left = memory->input_size - memory->input_pos;
+    if (size > left) {
+        size = left;
+    }
+    memcpy(buf, memory->input + memory->input_pos, size);
+    memory->input_pos += size;
+    return (long) size;
+}
+
+static int memory_write(void *context, const char *buf, size_t size)
+{
+    struct cpu_io_memory *memory = context;
+    size_t left = memory->output_capacity - memory->output_size;
+    size_t stored = size < left ? size : left;
+    memcpy(memory->output + memory->output_size, buf, stored);
+    memory->output_size += stored;
+    return stored == size ? 0 : -1;
+}
+
+static const struct cpu_io_ops memory_ops = { memory_read, memory_write };
+
+void io_init(struct cpu *cpu)
+{
+    memset(&cpu->io, 0, sizeof(cpu->io));
+    cpu_set_io_fd(cpu, STDIN_FILENO, STDOUT_FILENO);
+}
+
+void io_destroy(struct cpu *cpu)
+{
+    cpu_flush_output(cpu);
+    free(cpu->io.in_buf);
+    free(cpu->io.out_buf);
+    cpu->io.in_buf = NULL;
+    cpu->io.out_buf = NULL;
+    cpu->io.out_capacity = 0;
+}
+
+/*
+ * Switches the CPU to another backend. Pending output still goes to the
+ * old one, unread buffered input is dropped.
+ */
+void cpu_set_io(struct cpu *cpu, const struct cpu_io_ops *ops, void *context, unsigned flags)
+{
+    assert(cpu != NULL);
+    assert(ops != NULL);
+    cpu_flush_output(cpu);
+
+    struct cpu_io *io = &cpu->io;
+    io->ops = *ops;
+    io->context = context;
+    io->flags = flags;
+    io->probe_tty = false;
+    io->write_failed = false;
+    io->in_pos = 0;
+    io->in_len = 0;
+    io->in_eof = false;
+    io->in_waiting = false;
+    io->number.started = false;
+}
+
+/*
+ * Reads from and writes to file descriptors. Terminals get the behaviour
+ * of stdio: output is flushed before waiting for input and after newlines.
+ * An input descriptor in O_NONBLOCK mode turns on CPU_IO_NONBLOCKING_INPUT.
+ * The descriptors are only looked at once the guest does I/O, so creating
+ * a CPU does not cost any system calls.
+ */
+void cpu_set_io_fd(struct cpu *cpu, int input_fd, int output_fd)
+{
+    assert(cpu != NULL);
+    cpu_set_io(cpu, &fd_ops, &cpu->io.backend.fd, 0);
+    cpu->io.backend.fd.input_fd = input_fd;
+    cpu->io.backend.fd.output_fd = output_fd;
+    cpu->io.probe_tty = true;
+    cpu->io.out_capacity = 0; // Sends the next output through io_reserve
+}
+
+static void probe_tty(struct cpu_io *io)
+{
+    if (!io->probe_tty) {
+        return;
+    }
+    io->probe_tty = false;
+    if (isatty(io->backend.fd.input_fd)) {
+        io->flags |= CPU_IO_INTERACTIVE_INPUT;
+    }
+    if (isatty(io->backend.fd.output_fd)) {
+        io->flags |= CPU_IO_LINE_OUTPUT;
+    }
+    int input_flags = fcntl(io->backend.fd.input_fd, F_GETFL);
+    if (input_flags >= 0 && (input_flags & O_NONBLOCK)) {
+        io->flags |= CPU_IO_NONBLOCKING_INPUT;
+    }
+}
+
+/*
+ * Reads guest input from input and stores guest output in output, both
+ * owned by the caller. Output that does not fit is dropped and makes
+ * cpu_flush_output fail.
+ */
+void cpu_set_io_memory(struct cpu *cpu, const void *input, size_t input_size,
+        void *output, size_t output_capacity)
+{
+    assert(cpu != NULL);
+    assert(input != NULL || input_size == 0);
+    assert(output != NULL || output_capacity == 0);
+    cpu_set_io(cpu, &memory_ops, &cpu->io.backend.memory, 0);
+
+    struct cpu_io_memory *memory = &cpu->io.backend.memory;
+    memory->input = input;
+    memory->input_size = input_size;
+    memory->input_pos = 0;
+    memory->output = output;
+    memory->output_capacity = output_capacity;
+    memory->output_size = 0;
+}
+
+/*
+ * Flushes pending output and returns how many bytes the memory backend
+ * has stored so far.
+ */
+size_t cpu_memory_output_size(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    assert(cpu->io.ops.write == memory_write);
+    cpu_flush_output(cpu);
+    return cpu->io.backend.memory.output_size;
+}
+
+/*
+ * Hands buffered output to the backend.
+ * Returns 0 on success, -1 if any output was lost since the last call.
+ */
+int cpu_flush_output(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    struct cpu_io *io = &cpu->io;
+    if (io->out_len > 0) {
+        if (io->ops.write(io->context, io->out_buf, io->out_len) != 0) {
+            io->write_failed = true;
+        }
+        io->out_len = 0;
+    }
+    if (io->write_failed) {
+        io->write_failed = false;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Makes room for size more bytes of output, allocating the buffer on
+ * first use. Returns false if the output has to be dropped.
+ */
+bool io_reserve(struct cpu *cpu, size_t size)
+{
+    struct cpu_io *io = &cpu->io;
+    assert(size <= CPU_IO_BUFFER_SIZE);
+    probe_tty(io);
+    if (io->out_buf == NULL && (io->out_buf = malloc(CPU_IO_BUFFER_SIZE)) == NULL) {
+        io->write_failed = true;
+        return false;
+    }
+    io->out_capacity = CPU_IO_BUFFER_SIZE;
+    if (io->out_capacity - io->out_len < size) {
+        cpu_flush_output(cpu);
+    }
+    return true;
+}
+
+/*
+ * Refills the input buffer. Returns false at the end of input, read errors
+ * count as the end of input just like they do for getchar. A backend with
+ * CPU_IO_NONBLOCKING_INPUT that has no input yet sets in_waiting instead.
+ */
+static bool io_refill(struct cpu *cpu)
+{
+    struct cpu_io *io = &cpu->io;
+    if (io->in_eof) {
+        return false;
+    }
+    if (io->in_buf == NULL && (io->in_buf = malloc(CPU_IO_BUFFER_SIZE)) == NULL) {
+        return false;
+    }
+    probe_tty(io);
+    if (io->flags & CPU_IO_INTERACTIVE_INPUT) {
+        cpu_flush_output(cpu);
+    }
+    long result = io->ops.read(io->context, io->in_buf, CPU_IO_BUFFER_SIZE);
+    io->in_waiting = result < 0 && (io->flags & CPU_IO_NONBLOCKING_INPUT)
+            && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (io->in_waiting) {
+        return false;
+    }
+    if (result <= 0) {
+        io->in_eof = true;
+        return false;
+    }
+    io->in_pos = 0;
+    io->in_len = (size_t) result;
+    return true;
+}
+
+static int io_peek(struct cpu *cpu)
+{
+    struct cpu_io *io = &cpu->io;
+    if (io->in_pos == io->in_len && !io_refill(cpu)) {
+        return EOF;
+    }
+    return (unsigned char) io->in_buf[io->in_pos];
+}
+
+/*
+ * Returns the next input byte or EOF, which may also mean in_waiting.
+ */
+int io_getc(struct cpu *cpu)
+{
+    int c = io_peek(cpu);
+    if (c != EOF) {
+        cpu->io.in_pos++;
+    }
+    return c;
+}
+
+static bool is_space(int c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static bool is_digit(int c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/*
+ * Reads a decimal number the way scanf("%d") does: leading white space is
+ * skipped, the sign is consumed even if no digit follows, out of range
+ * values saturate to a long before they are truncated to 32 bits.
+ * Returns false if no number could be read. If the input runs dry with
+ * in_waiting set, what was read of the number stays in io->number and the
+ * next call goes on from there.
+ */
+bool io_read_int(struct cpu *cpu, int32_t *value)
+{
+    struct io_number *number = &cpu->io.number;
+    int c;
+    if (!number->started) {
+        while (is_space(c = io_peek(cpu))) {
+            cpu->io.in_pos++;
+        }
+        number->negative = false;
+        number->digits = false;
+        number->magnitude = 0;
+        if (c == '-' || c == '+') {
+            number->negative = c == '-';
+            number->started = true;
+            cpu->io.in_pos++;
+        }
+    }
+
+    const unsigned long long limit
+            = number->negative ? (unsigned long long) LONG_MAX + 1 : LONG_MAX;
+    unsigned long long magnitude = number->magnitude;
+    while (is_digit(c = io_peek(cpu))) {
+        cpu->io.in_pos++;
+        unsigned digit = (unsigned) (c - '0');
+        if (magnitude <= limit) {
+            magnitude = magnitude > (limit - digit) / 10 ? limit + 1 : magnitude * 10 + digit;
+        }
+        number->started = true;
+        number->digits = true;
+    }
+    number->magnitude = magnitude;
+    if (cpu->io.in_waiting) {
+        return false;
+    }
+    number->started = false;
+    if (!number->digits) {
+        return false;
+    }
+    if (magnitude > limit) {
+        magnitude = limit;
+    }
+
+    *value = (int32_t) (uint32_t) (number->negative ? -magnitude : magnitude);
+    return true;
+}
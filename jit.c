@@ -0,0 +1,1133 @@
+/*
+ * Basic-block JIT compiler for x86-64.
+ *
+ * Blocks are compiled lazily from the pre-decoded program. A block starts
+ * at any instruction index and runs up to the first jmp/jz/jnz/jgt/loop/
+ * call/ret/halt (or an instruction that has to stop the CPU). Guest
+ * registers A-D live in r12d-r15d and RESULT in ebx for as long as native
+ * code runs; rbp points at the struct cpu, which also holds the remaining
+ * step budget (cpu->jit_frame).
+ *
+ * Every static block exit is a small stub that initially returns to the
+ * dispatcher in cpu_run_jit, which compiles the target and patches the
+ * stub into a direct jump, so hot loops run from block to block without
+ * leaving native code. Dynamic exits look the target up in the block table
+ * inline.
+ *
+ * A guest call is also a host call and a guest ret a host ret, so returns
+ * are predicted by the host's return stack instead of going through the
+ * table as an indirect jump. The call site checks the index the guest
+ * popped against its own return index and uses the table if they differ.
+ * The host frames are dropped whenever native code is left; below them
+ * sits a return address that looks rets to older frames up in the table.
+ *
+ * Each block charges its whole length against the budget on entry. If the
+ * budget does not cover the block, or an instruction fails half-way, the
+ * unexecuted part is refunded and cpu_run_decoded finishes the partial
+ * block. The same entry check makes sure the stack has room for every
+ * push and call in the block, which then go unchecked; a block that could
+ * overflow it is run by cpu_run_decoded, which fails at the exact push.
+ * I/O and other rare instructions call back into cpu_step, so the
+ * observable results are those of cpu_run, step count included.
+ */
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(CPU_NO_JIT)
+
+#include <sys/mman.h>
+
+#ifndef JIT_CACHE_SIZE
+#define JIT_CACHE_SIZE (8u << 20)
+#endif
+#define JIT_MAX_BLOCK_OPS 256
+#define JIT_MAX_STUBS (2 * JIT_MAX_BLOCK_OPS + 8)
+#define JIT_MAX_CALLS 4096 // Host frames for guest calls, 16 bytes each
+
+enum jit_exit_reason
+{
+    JIT_EXIT_CHAIN,   // Static exit not linked yet, exit.stub wants patching
+    JIT_EXIT_DYNAMIC, // Computed target that is not compiled yet
+    JIT_EXIT_BUDGET,  // Next block does not fit into the remaining budget
+    JIT_EXIT_STACK,   // Next block might overflow the stack, exit.stub is its length
+    JIT_EXIT_STOP,    // Halted or failed, status and inst_index are final
+};
+
+// Exchanged with the entry/exit trampolines, layout is used by native code
+struct jit_exit
+{
+    uint8_t *stub;  // Chain stub that caused JIT_EXIT_CHAIN
+    int64_t budget; // Remaining steps, read on entry and written on exit
+};
+
+typedef int (*jit_entry_fn)(struct cpu *cpu, const void *code, struct jit_exit *exit);
+
+struct jit_state
+{
+    uint8_t *cache;        // RWX code cache
+    uint8_t *free;         // First unused byte of the cache
+    uint8_t *blocks_start; // Cache contents past the trampolines
+    uint8_t *exit_code;    // Exit trampoline
+    uint8_t *return_code;  // Where guest rets without a host call land
+    jit_entry_fn entry;    // Entry trampoline
+    void **blocks;         // Native code for the block at each index, or NULL
+    int32_t block_count;   // Number of executable indices (end_of_stack + 1)
+    unsigned generation;   // Bumped whenever the cache is flushed
+};
+
+enum host_register
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Host registers holding A, B, C, D and RESULT while native code runs
+static const int guest_register[5] = { R12, R13, R14, R15, RBX };
+
+enum condition_code
+{
+    CC_AE = 0x3,
+    CC_Z = 0x4,
+    CC_NZ = 0x5,
+    CC_BE = 0x6,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF,
+};
+
+#define CPU_OFFSET(field) ((int32_t) offsetof(struct cpu, field))
+#define BUDGET_OFFSET CPU_OFFSET(jit_frame.budget)
+#define REGISTER_OFFSET(reg) (CPU_OFFSET(registers) + (int32_t) sizeof(int32_t) * (reg))
+
+/*
+ * Machine code emitter.
+ * Writes past the end of the buffer are dropped and flagged; the block
+ * compiler checks the flag before patching anything.
+ */
+struct emitter
+{
+    uint8_t *pos;
+    uint8_t *end;
+    bool full;
+};
+
+static void emit8(struct emitter *e, uint8_t byte)
+{
+    if (e->pos < e->end) {
+        *e->pos++ = byte;
+    } else {
+        e->full = true;
+    }
+}
+
+static void emit32(struct emitter *e, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        emit8(e, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+static void emit64(struct emitter *e, uint64_t value)
+{
+    emit32(e, (uint32_t) value);
+    emit32(e, (uint32_t) (value >> 32));
+}
+
+// REX prefix, left out when no bit is set
+static void emit_rex(struct emitter *e, bool wide, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40) {
+        emit8(e, rex);
+    }
+}
+
+static void emit_opcode(struct emitter *e, unsigned opcode)
+{
+    if (opcode > 0xFF) {
+        emit8(e, (uint8_t) (opcode >> 8));
+    }
+    emit8(e, (uint8_t) opcode);
+}
+
+// opcode with a register-direct ModRM: reg field and r/m register
+static void emit_rr(struct emitter *e, bool wide, unsigned opcode, int reg, int rm)
+{
+    emit_rex(e, wide, reg, 0, rm);
+    emit_opcode(e, opcode);
+    emit8(e, (uint8_t) (0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+// opcode with a [rbp + disp32] memory operand
+static void emit_rbp(struct emitter *e, bool wide, unsigned opcode, int reg, int32_t disp)
+{
+    emit_rex(e, wide, reg, 0, RBP);
+    emit_opcode(e, opcode);
+    emit8(e, (uint8_t) (0x80 | (reg & 7) << 3 | RBP));
+    emit32(e, (uint32_t) disp);
+}
+
+// opcode with a [rsp + disp8] memory operand
+static void emit_rsp(struct emitter *e, bool wide, unsigned opcode, int reg, int8_t disp)
+{
+    emit_rex(e, wide, reg, 0, RSP);
+    emit_opcode(e, opcode);
+    emit8(e, (uint8_t) (0x40 | (reg & 7) << 3 | RSP));
+    emit8(e, 0x24);
+    emit8(e, (uint8_t) disp);
+}
+
+// opcode with a [base + index << scale] memory operand, base not rbp/r13
+static void emit_sib(struct emitter *e, bool wide, unsigned opcode, int reg, int base, int index, int scale)
+{
+    emit_rex(e, wide, reg, index, base);
+    emit_opcode(e, opcode);
+    emit8(e, (uint8_t) ((reg & 7) << 3 | RSP));
+    emit8(e, (uint8_t) (scale << 6 | (index & 7) << 3 | (base & 7)));
+}
+
+static void emit_mov(struct emitter *e, int dst, int src)
+{
+    if (dst != src) {
+        emit_rr(e, false, 0x89, src, dst);
+    }
+}
+
+static void emit_mov_imm(struct emitter *e, int dst, uint32_t value)
+{
+    emit_rex(e, false, 0, 0, dst);
+    emit8(e, (uint8_t) (0xB8 | (dst & 7)));
+    emit32(e, value);
+}
+
+static void emit_mov_imm64(struct emitter *e, int dst, uint64_t value)
+{
+    emit_rex(e, true, 0, 0, dst);
+    emit8(e, (uint8_t) (0xB8 | (dst & 7)));
+    emit64(e, value);
+}
+
+static void emit_load_field(struct emitter *e, int dst, int32_t offset)
+{
+    emit_rbp(e, false, 0x8B, dst, offset);
+}
+
+static void emit_store_field(struct emitter *e, int32_t offset, int src)
+{
+    emit_rbp(e, false, 0x89, src, offset);
+}
+
+static void emit_store_field_imm(struct emitter *e, int32_t offset, uint32_t value)
+{
+    emit_rbp(e, false, 0xC7, 0, offset);
+    emit32(e, value);
+}
+
+// Emits a 32-bit relative jump or call and returns where its offset lives
+static uint8_t *emit_rel32(struct emitter *e, const uint8_t *target)
+{
+    uint8_t *at = e->pos;
+    emit32(e, (uint32_t) (target != NULL ? target - (at + 4) : 0));
+    return at;
+}
+
+static uint8_t *emit_jcc(struct emitter *e, enum condition_code cc)
+{
+    emit8(e, 0x0F);
+    emit8(e, (uint8_t) (0x80 | cc));
+    return emit_rel32(e, NULL);
+}
+
+static void emit_jmp(struct emitter *e, const uint8_t *target)
+{
+    emit8(e, 0xE9);
+    emit_rel32(e, target);
+}
+
+static void patch_rel32(uint8_t *at, const uint8_t *target)
+{
+    int32_t rel = (int32_t) (target - (at + 4));
+    memcpy(at, &rel, sizeof(rel));
+}
+
+static void emit_spill_registers(struct emitter *e)
+{
+    for (int reg = REGISTER_A; reg <= REGISTER_RESULT; ++reg) {
+        emit_store_field(e, REGISTER_OFFSET(reg), guest_register[reg]);
+    }
+}
+
+static void emit_reload_registers(struct emitter *e)
+{
+    for (int reg = REGISTER_A; reg <= REGISTER_RESULT; ++reg) {
+        emit_load_field(e, guest_register[reg], REGISTER_OFFSET(reg));
+    }
+}
+
+static void emit_exit(struct emitter *e, struct jit_state *jit, enum jit_exit_reason reason)
+{
+    emit_mov_imm(e, RAX, reason);
+    emit_jmp(e, jit->exit_code);
+}
+
+/*
+ * jit_entry_fn: saves the callee-saved registers, keeps the exit record at
+ * [rsp], sets up cpu->jit_frame, loads the guest registers and jumps to the
+ * block with return_code as the return address at [rsp]. The exit
+ * trampoline goes back to the saved rsp, undoes all of it and returns the
+ * exit reason the block left in eax.
+ *
+ * return_code runs when a guest ret finds no host call to return to. It
+ * leaves [rsp] as it was and jumps to the index in eax through the block
+ * table, or leaves with JIT_EXIT_DYNAMIC if that block is not compiled.
+ */
+static void emit_trampolines(struct jit_state *jit, struct emitter *e)
+{
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+    uint8_t *entry = e->pos;
+    for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); ++i) {
+        emit_rex(e, false, 0, 0, saved[i]);
+        emit8(e, (uint8_t) (0x50 | (saved[i] & 7)));
+    }
+    emit_rr(e, true, 0x83, 5, RSP); // sub rsp, 8 (keeps rsp 16-byte aligned)
+    emit8(e, 8);
+    emit_rsp(e, true, 0x89, RDX, 0); // mov [rsp], rdx
+    emit_rex(e, true, 0, 0, 0);      // mov rax, [rdx + 8]
+    emit8(e, 0x8B);
+    emit8(e, 0x42);
+    emit8(e, offsetof(struct jit_exit, budget));
+    emit_rr(e, true, 0x89, RDI, RBP);
+    emit_rbp(e, true, 0x89, RAX, BUDGET_OFFSET);
+    emit_rbp(e, true, 0x89, RSP, CPU_OFFSET(jit_frame.stack));
+    emit_rex(e, true, RAX, 0, 0); // lea rax, [rsp - 16 * JIT_MAX_CALLS]
+    emit8(e, 0x8D);
+    emit8(e, 0x84);
+    emit8(e, 0x24);
+    emit32(e, (uint32_t) -16 * JIT_MAX_CALLS);
+    emit_rbp(e, true, 0x89, RAX, CPU_OFFSET(jit_frame.limit));
+    emit_rex(e, true, RAX, 0, 0); // lea rax, [rip + return_code]
+    emit8(e, 0x8D);
+    emit8(e, 0x05);
+    uint8_t *return_at = emit_rel32(e, NULL);
+    emit8(e, 0x50); // push rax, twice to keep rsp 16-byte aligned
+    emit8(e, 0x50);
+    emit_reload_registers(e);
+    emit_rr(e, false, 0xFF, 4, RSI); // jmp rsi
+
+    jit->return_code = e->pos;
+    emit_rr(e, true, 0x83, 5, RSP); // sub rsp, 8
+    emit8(e, 8);
+    emit8(e, 0x3D); // cmp eax, block_count
+    emit32(e, (uint32_t) jit->block_count);
+    uint8_t *outside = emit_jcc(e, CC_AE);
+    emit_mov_imm64(e, RCX, (uint64_t) (uintptr_t) jit->blocks);
+    emit_sib(e, true, 0x8B, RCX, RCX, RAX, 3); // mov rcx, [rcx + rax * 8]
+    emit_rr(e, true, 0x85, RCX, RCX);
+    uint8_t *missing = emit_jcc(e, CC_Z);
+    emit_rr(e, false, 0xFF, 4, RCX); // jmp rcx
+    uint8_t *leave = e->pos;
+    emit_store_field(e, CPU_OFFSET(inst_index), RAX);
+    emit_mov_imm(e, RAX, JIT_EXIT_DYNAMIC);
+    uint8_t *exit_at = e->pos;
+    emit_jmp(e, NULL);
+
+    jit->exit_code = e->pos;
+    emit_rbp(e, true, 0x8B, RSP, CPU_OFFSET(jit_frame.stack));
+    emit_spill_registers(e);
+    emit_rsp(e, true, 0x8B, RCX, 0); // mov rcx, [rsp]
+    emit_rex(e, true, 0, 0, 0);      // mov [rcx], rdx
+    emit8(e, 0x89);
+    emit8(e, 0x11);
+    emit_rbp(e, true, 0x8B, R8, BUDGET_OFFSET);
+    emit_rex(e, true, R8, 0, 0); // mov [rcx + 8], r8
+    emit8(e, 0x89);
+    emit8(e, 0x41);
+    emit8(e, offsetof(struct jit_exit, budget));
+    emit_rr(e, true, 0x83, 0, RSP); // add rsp, 8
+    emit8(e, 8);
+    for (size_t i = sizeof(saved) / sizeof(saved[0]); i-- > 0;) {
+        emit_rex(e, false, 0, 0, saved[i]);
+        emit8(e, (uint8_t) (0x58 | (saved[i] & 7)));
+    }
+    emit8(e, 0xC3);
+
+    if (!e->full) {
+        patch_rel32(return_at, jit->return_code);
+        patch_rel32(outside, leave);
+        patch_rel32(missing, leave);
+        patch_rel32(exit_at + 1, jit->exit_code);
+    }
+    memcpy(&jit->entry, &entry, sizeof(jit->entry));
+}
+
+/*
+ * Block compiler.
+ * Out-of-line code (taken branches, failures, budget refunds) is queued as
+ * stubs while the block body is emitted and placed after it, keeping the
+ * straight-line path free of taken jumps.
+ */
+enum stub_kind
+{
+    STUB_CHAIN,   // Continue at a static index
+    STUB_STOP,    // Record a failure and leave
+    STUB_DYNAMIC, // Leave with the target index in eax
+    STUB_BUDGET,  // Refund the block and leave
+    STUB_STACK,   // Refund the block and leave with its length in rdx
+};
+
+struct stub
+{
+    enum stub_kind kind;
+    uint8_t *jump;          // rel32 to patch with the stub address
+    int32_t index;          // CHAIN: target; STOP: inst_index, or -1 to keep
+    int32_t status;         // STOP: status to set, or -1 to keep
+    int32_t position;       // STOP: position of the op within the block
+};
+
+struct block_compiler
+{
+    struct emitter e;
+    struct jit_state *jit;
+    struct cpu *cpu;
+    int32_t start;
+    int32_t position; // Ops emitted so far
+    int32_t depth;    // Items pushed since the block started, less those popped
+    int32_t growth;   // Most items the block can push, checked on entry
+    struct stub stubs[JIT_MAX_STUBS];
+    int stub_count;
+};
+
+static void add_stub(struct block_compiler *bc, enum stub_kind kind, uint8_t *jump, int32_t index, int32_t status)
+{
+    assert(bc->stub_count < JIT_MAX_STUBS);
+    struct stub *stub = &bc->stubs[bc->stub_count++];
+    stub->kind = kind;
+    stub->jump = jump;
+    stub->index = index;
+    stub->status = status;
+    stub->position = bc->position;
+}
+
+// Conditional failure of the current op
+static void fail_if(struct block_compiler *bc, enum condition_code cc, enum cpu_status status, int32_t inst_index)
+{
+    add_stub(bc, STUB_STOP, emit_jcc(&bc->e, cc), inst_index, (int32_t) status);
+}
+
+// Unconditional stop on the current op, which is always the last one
+static void emit_stop(struct block_compiler *bc, enum cpu_status status, int32_t inst_index)
+{
+    emit_store_field_imm(&bc->e, CPU_OFFSET(status), (uint32_t) status);
+    emit_store_field_imm(&bc->e, CPU_OFFSET(inst_index), (uint32_t) inst_index);
+    emit_exit(&bc->e, bc->jit, JIT_EXIT_STOP);
+}
+
+static const void *linked_block(const struct block_compiler *bc, int32_t target)
+{
+    return target < bc->jit->block_count ? bc->jit->blocks[target] : NULL;
+}
+
+// Leaves for the dispatcher to compile target and patch the rel32 at stub + 1
+static void emit_unlinked_exit(struct block_compiler *bc, const uint8_t *stub, int32_t target)
+{
+    struct emitter *e = &bc->e;
+    emit_store_field_imm(e, CPU_OFFSET(inst_index), (uint32_t) target);
+    emit_rex(e, true, RDX, 0, 0); // lea rdx, [rip - distance to stub]
+    emit8(e, 0x8D);
+    emit8(e, 0x15);
+    emit_rel32(e, stub);
+    emit_exit(e, bc->jit, JIT_EXIT_CHAIN);
+}
+
+/*
+ * Static exit. Starts with a jmp that initially lands right behind itself;
+ * once the target block exists the dispatcher points it at that block.
+ */
+static void emit_chain_stub(struct block_compiler *bc, int32_t target)
+{
+    struct emitter *e = &bc->e;
+    uint8_t *stub = e->pos;
+    const void *linked = linked_block(bc, target);
+
+    emit8(e, 0xE9);
+    emit_rel32(e, linked != NULL ? linked : e->pos + 4);
+    emit_unlinked_exit(bc, stub, target);
+}
+
+static void chain_if(struct block_compiler *bc, enum condition_code cc, int32_t target)
+{
+    add_stub(bc, STUB_CHAIN, emit_jcc(&bc->e, cc), target, -1);
+}
+
+// Jump to the index in eax through the block table
+static void emit_dynamic_jump(struct block_compiler *bc)
+{
+    struct emitter *e = &bc->e;
+    uint8_t *jump;
+
+    emit8(e, 0x3D); // cmp eax, block_count
+    emit32(e, (uint32_t) bc->jit->block_count);
+    jump = emit_jcc(e, CC_AE);
+    add_stub(bc, STUB_DYNAMIC, jump, -1, -1);
+    emit_mov_imm64(e, RCX, (uint64_t) (uintptr_t) bc->jit->blocks);
+    emit_sib(e, true, 0x8B, RCX, RCX, RAX, 3); // mov rcx, [rcx + rax * 8]
+    emit_rr(e, true, 0x85, RCX, RCX);
+    jump = emit_jcc(e, CC_Z);
+    add_stub(bc, STUB_DYNAMIC, jump, -1, -1);
+    emit_rr(e, false, 0xFF, 4, RCX); // jmp rcx
+}
+
+/*
+ * Guest call to target as a host call, linked to the target block like a
+ * chain stub. The code behind the host call runs once a ret comes back
+ * with eax holding the index it popped, which is normally return_index.
+ * Calls that would take rsp below the frame's limit are plain jumps.
+ */
+static void emit_call(struct block_compiler *bc, int32_t target, int32_t return_index)
+{
+    struct emitter *e = &bc->e;
+
+    emit_rbp(e, true, 0x3B, RSP, CPU_OFFSET(jit_frame.limit)); // cmp rsp, limit
+    chain_if(bc, CC_BE, target);
+    emit_rr(e, true, 0x83, 5, RSP); // sub rsp, 8 (the callee sees rsp 16-byte aligned)
+    emit8(e, 8);
+    uint8_t *call = e->pos;
+    const void *linked = linked_block(bc, target);
+    emit8(e, 0xE8); // call target
+    uint8_t *call_at = emit_rel32(e, linked);
+
+    emit_rr(e, true, 0x83, 0, RSP); // add rsp, 8
+    emit8(e, 8);
+    emit8(e, 0x3D); // cmp eax, return_index
+    emit32(e, (uint32_t) return_index);
+    uint8_t *mismatch = emit_jcc(e, CC_NZ);
+    emit_chain_stub(bc, return_index);
+    if (!e->full) {
+        patch_rel32(mismatch, e->pos);
+    }
+    emit_dynamic_jump(bc);
+    if (linked == NULL) {
+        if (!e->full) {
+            patch_rel32(call_at, e->pos);
+        }
+        emit_unlinked_exit(bc, call, target);
+    }
+}
+
+// rcx = -eax sign-extended, rdx = stack_bottom: [rdx + rcx * 4] is the slot
+static void emit_stack_slot(struct emitter *e)
+{
+    emit_rr(e, true, 0x63, RCX, RAX); // movsxd rcx, eax
+    emit_rr(e, true, 0xF7, 3, RCX);   // neg rcx
+    emit_rbp(e, true, 0x8B, RDX, CPU_OFFSET(stack_bottom));
+}
+
+/*
+ * Leaves the free slot in [rdx + rcx * 4]. The check on entry to the
+ * block has already made sure there is one.
+ */
+static void emit_push_slot(struct block_compiler *bc)
+{
+    ++bc->depth;
+    assert(bc->depth <= bc->growth);
+    emit_load_field(&bc->e, RAX, CPU_OFFSET(stack_size));
+    emit_stack_slot(&bc->e);
+}
+
+static void emit_push_done(struct emitter *e)
+{
+    emit_rr(e, false, 0x83, 0, RAX); // add eax, 1
+    emit8(e, 1);
+    emit_store_field(e, CPU_OFFSET(stack_size), RAX);
+}
+
+// Pops the top of the stack (which must exist) into the given host register
+static void emit_pop(struct block_compiler *bc, int dst, int32_t fail_index, enum condition_code empty)
+{
+    struct emitter *e = &bc->e;
+    emit_load_field(e, RAX, CPU_OFFSET(stack_size));
+    emit_rr(e, false, 0x85, RAX, RAX);
+    fail_if(bc, empty, CPU_INVALID_STACK_OPERATION, fail_index);
+    emit_rr(e, false, 0x83, 5, RAX); // sub eax, 1
+    emit8(e, 1);
+    emit_store_field(e, CPU_OFFSET(stack_size), RAX);
+    --bc->depth;
+    emit_stack_slot(e);
+    emit_sib(e, false, 0x8B, dst, RDX, RCX, 2);
+    emit_sib(e, false, 0xC7, 0, RDX, RCX, 2); // the popped slot is cleared
+    emit32(e, 0);
+}
+
+/*
+ * Leaves [rdx + rax * 4] pointing at the slot load/store address through
+ * D + offset, after the same checks the interpreter does: the offset sum
+ * has to be in [0, stack_size).
+ */
+static void emit_stack_offset_slot(struct block_compiler *bc, const struct decoded_op *op, int32_t fail_index)
+{
+    struct emitter *e = &bc->e;
+    emit_mov(e, RAX, guest_register[REGISTER_D]);
+    emit_rr(e, false, 0x81, 0, RAX); // add eax, imm
+    emit32(e, (uint32_t) op->imm);
+    emit_load_field(e, RCX, CPU_OFFSET(stack_size));
+    emit_rr(e, false, 0x39, RCX, RAX); // cmp eax, ecx
+    fail_if(bc, CC_AE, CPU_INVALID_STACK_OPERATION, fail_index);
+    emit_rr(e, false, 0x29, RCX, RAX); // sub eax, ecx
+    emit_rr(e, false, 0x83, 0, RAX);   // add eax, 1
+    emit8(e, 1);
+    emit_rr(e, true, 0x63, RAX, RAX); // movsxd rax, eax
+    emit_rbp(e, true, 0x8B, RDX, CPU_OFFSET(stack_bottom));
+}
+
+/*
+ * Whether RESULT can still be read once the op being emitted hands over to
+ * the op at index. It is dead if the block goes on, through ops that
+ * neither read RESULT nor can leave the block, to one that overwrites it.
+ */
+static bool result_live(const struct block_compiler *bc, int32_t index)
+{
+    const struct cpu *cpu = bc->cpu;
+    for (int32_t position = bc->position + 1;
+            position < JIT_MAX_BLOCK_OPS && index <= cpu->end_of_stack; ++position) {
+        const struct decoded_op *op = &cpu->decoded[index];
+        if (decoded_kills_result(op)) {
+            return false;
+        }
+        switch ((enum decoded_kind) op->base) {
+        case DECODED_NOP:
+            index += 1;
+            break;
+        case DECODED_MOVR:
+            if (op->reg1 == REGISTER_RESULT) {
+                return false;
+            }
+            index += 3;
+            break;
+        case DECODED_SWAP:
+            if (op->reg1 == REGISTER_RESULT || op->reg2 == REGISTER_RESULT) {
+                return true;
+            }
+            index += 3;
+            break;
+        default:
+            return true;
+        }
+    }
+    return true;
+}
+
+// RESULT = src, left out when the op at next overwrites it anyway
+static void emit_set_result(struct block_compiler *bc, int src, int32_t next)
+{
+    if (result_live(bc, next)) {
+        emit_mov(&bc->e, guest_register[REGISTER_RESULT], src);
+    }
+}
+
+static bool is_io_opcode(uint32_t opcode)
+{
+    return opcode >= 0x0C && opcode <= 0x0F; // in, get, out, put
+}
+
+/*
+ * Emits one op. Returns the index of the next op when the block goes on,
+ * or -1 if the op ended the block.
+ */
+static int32_t emit_op(struct block_compiler *bc, int32_t index, const struct decoded_op *op)
+{
+    struct emitter *e = &bc->e;
+    int a = guest_register[REGISTER_A];
+    int r1 = guest_register[op->reg1];
+    int r2 = guest_register[op->reg2];
+
+    // Fused ops are compiled as the instructions they are made of
+    switch ((enum decoded_kind) op->base) {
+    case DECODED_NOP:
+        return index + 1;
+
+    case DECODED_HALT:
+        emit_stop(bc, CPU_HALTED, index);
+        return -1;
+
+    case DECODED_ADD:
+        emit_rr(e, false, 0x01, r1, a);
+        emit_set_result(bc, a, index + 2);
+        return index + 2;
+
+    case DECODED_SUB:
+        emit_rr(e, false, 0x29, r1, a);
+        emit_set_result(bc, a, index + 2);
+        return index + 2;
+
+    case DECODED_MUL:
+        emit_rr(e, false, 0x0FAF, a, r1);
+        emit_set_result(bc, a, index + 2);
+        return index + 2;
+
+    case DECODED_DIV:
+        emit_rr(e, false, 0x85, r1, r1);
+        fail_if(bc, CC_Z, CPU_DIV_BY_ZERO, index + 1);
+        emit_mov(e, RAX, a);
+        emit8(e, 0x99); // cdq
+        emit_rr(e, false, 0xF7, 7, r1);
+        emit_mov(e, a, RAX);
+        emit_set_result(bc, RAX, index + 2);
+        return index + 2;
+
+    case DECODED_INC:
+    case DECODED_DEC:
+        emit_rr(e, false, 0x83, op->base == DECODED_INC ? 0 : 5, r1);
+        emit8(e, 1);
+        emit_set_result(bc, r1, index + 2);
+        return index + 2;
+
+    case DECODED_MOVR:
+        emit_mov_imm(e, r1, (uint32_t) op->imm);
+        return index + 3;
+
+    case DECODED_LOAD:
+        emit_stack_offset_slot(bc, op, index + 2);
+        emit_sib(e, false, 0x8B, r1, RDX, RAX, 2);
+        return index + 3;
+
+    case DECODED_STORE:
+        emit_stack_offset_slot(bc, op, index + 2);
+        emit_sib(e, false, 0x89, r1, RDX, RAX, 2);
+        return index + 3;
+
+    case DECODED_SWAP:
+        if (r1 != r2) {
+            emit_rr(e, false, 0x87, r1, r2);
+        }
+        return index + 3;
+
+    case DECODED_PUSH:
+        emit_push_slot(bc);
+        emit_sib(e, false, 0x89, r1, RDX, RCX, 2);
+        emit_push_done(e);
+        return index + 2;
+
+    case DECODED_POP:
+        emit_pop(bc, r1, index + 1, CC_LE);
+        return index + 2;
+
+    case DECODED_CMP:
+        // RESULT is all cmp writes
+        if (result_live(bc, index + 3)) {
+            emit_mov(e, RAX, r1);
+            emit_rr(e, false, 0x29, r2, RAX);
+            emit_mov(e, guest_register[REGISTER_RESULT], RAX);
+        }
+        return index + 3;
+
+    case DECODED_LOOP:
+        emit_rr(e, false, 0x85, guest_register[REGISTER_C], guest_register[REGISTER_C]);
+        chain_if(bc, CC_NZ, op->target);
+        emit_chain_stub(bc, index + 2);
+        return -1;
+
+    case DECODED_JMP:
+        emit_chain_stub(bc, op->target);
+        return -1;
+
+    case DECODED_JZ:
+    case DECODED_JNZ:
+    case DECODED_JGT: {
+        enum condition_code cc = op->kind == DECODED_JZ ? CC_Z : op->kind == DECODED_JNZ ? CC_NZ : CC_G;
+        emit_rr(e, false, 0x85, guest_register[REGISTER_RESULT], guest_register[REGISTER_RESULT]);
+        chain_if(bc, cc, op->target);
+        emit_chain_stub(bc, index + 2);
+        return -1;
+    }
+
+    case DECODED_CALL:
+        emit_push_slot(bc);
+        emit_sib(e, false, 0xC7, 0, RDX, RCX, 2);
+        emit32(e, (uint32_t) op->imm);
+        emit_push_done(e);
+        emit_call(bc, op->target, op->imm);
+        return -1;
+
+    case DECODED_RET:
+        emit_pop(bc, RAX, index, CC_Z);
+        emit8(e, 0xC3); // ret, see emit_call
+        return -1;
+
+    case DECODED_INTERPRET: {
+        int (*step)(struct cpu *) = cpu_step;
+        uint64_t step_address;
+        memcpy(&step_address, &step, sizeof(step_address));
+
+        emit_spill_registers(e);
+        emit_store_field_imm(e, CPU_OFFSET(inst_index), (uint32_t) index);
+        emit_rr(e, true, 0x89, RBP, RDI);
+        emit_mov_imm64(e, RAX, step_address);
+        emit_rr(e, false, 0xFF, 2, RAX); // call rax
+        emit_reload_registers(e);
+        emit_rr(e, false, 0x85, RAX, RAX);
+        add_stub(bc, STUB_STOP, emit_jcc(e, CC_Z), -1, -1);
+
+        // I/O always moves on to the next instruction, anything else may jump
+        if (is_io_opcode((uint32_t) bc->cpu->memory[index]) && index + 2 <= bc->cpu->end_of_stack + 1) {
+            return index + 2;
+        }
+        emit_load_field(e, RAX, CPU_OFFSET(inst_index));
+        emit_dynamic_jump(bc);
+        return -1;
+    }
+
+    case DECODED_ILLEGAL_OPERAND:
+        emit_stop(bc, CPU_ILLEGAL_OPERAND, index + op->imm);
+        return -1;
+
+    case DECODED_ILLEGAL_INSTRUCTION:
+        emit_stop(bc, CPU_ILLEGAL_INSTRUCTION, index);
+        return -1;
+
+    default:
+        break;
+    }
+    emit_stop(bc, CPU_INVALID_ADDRESS, index);
+    return -1;
+}
+
+static void emit_stub(struct block_compiler *bc, const struct stub *stub)
+{
+    struct emitter *e = &bc->e;
+    int32_t refund;
+
+    patch_rel32(stub->jump, e->pos);
+    switch (stub->kind) {
+    case STUB_CHAIN:
+        emit_chain_stub(bc, stub->index);
+        break;
+    case STUB_STOP:
+        if (stub->status >= 0) {
+            emit_store_field_imm(e, CPU_OFFSET(status), (uint32_t) stub->status);
+        }
+        if (stub->index >= 0) {
+            emit_store_field_imm(e, CPU_OFFSET(inst_index), (uint32_t) stub->index);
+        }
+        refund = bc->position - (stub->position + 1);
+        if (refund > 0) {
+            emit_rbp(e, true, 0x81, 0, BUDGET_OFFSET); // add qword [budget], refund
+            emit32(e, (uint32_t) refund);
+        }
+        emit_exit(e, bc->jit, JIT_EXIT_STOP);
+        break;
+    case STUB_DYNAMIC:
+        emit_store_field(e, CPU_OFFSET(inst_index), RAX);
+        emit_exit(e, bc->jit, JIT_EXIT_DYNAMIC);
+        break;
+    case STUB_BUDGET:
+        emit_rbp(e, true, 0x81, 0, BUDGET_OFFSET); // add qword [budget], block length
+        emit32(e, (uint32_t) bc->position);
+        emit_store_field_imm(e, CPU_OFFSET(inst_index), (uint32_t) bc->start);
+        emit_exit(e, bc->jit, JIT_EXIT_BUDGET);
+        break;
+    case STUB_STACK:
+        emit_rbp(e, true, 0x81, 0, BUDGET_OFFSET); // add qword [budget], block length
+        emit32(e, (uint32_t) bc->position);
+        emit_store_field_imm(e, CPU_OFFSET(inst_index), (uint32_t) bc->start);
+        emit_mov_imm(e, RDX, (uint32_t) bc->position);
+        emit_exit(e, bc->jit, JIT_EXIT_STACK);
+        break;
+    }
+}
+
+/*
+ * Most items the block at start has on the stack on top of what it found
+ * there, at any point. Follows the ops the way emit_op goes through them;
+ * pop is counted as succeeding, if it fails nothing after it runs.
+ */
+static int32_t block_stack_growth(const struct cpu *cpu, int32_t start)
+{
+    int32_t depth = 0;
+    int32_t growth = 0;
+    int32_t index = start;
+    for (int32_t position = 0; position < JIT_MAX_BLOCK_OPS; ++position) {
+        const struct decoded_op *op = &cpu->decoded[index];
+        switch ((enum decoded_kind) op->base) {
+        case DECODED_NOP:
+            index += 1;
+            break;
+        case DECODED_ADD:
+        case DECODED_SUB:
+        case DECODED_MUL:
+        case DECODED_DIV:
+        case DECODED_INC:
+        case DECODED_DEC:
+            index += 2;
+            break;
+        case DECODED_MOVR:
+        case DECODED_LOAD:
+        case DECODED_STORE:
+        case DECODED_SWAP:
+        case DECODED_CMP:
+            index += 3;
+            break;
+        case DECODED_PUSH:
+            growth = ++depth > growth ? depth : growth;
+            index += 2;
+            break;
+        case DECODED_POP:
+            --depth;
+            index += 2;
+            break;
+        case DECODED_CALL:
+            return depth + 1 > growth ? depth + 1 : growth;
+        case DECODED_INTERPRET:
+            if (is_io_opcode((uint32_t) cpu->memory[index]) && index + 2 <= cpu->end_of_stack + 1) {
+                index += 2;
+                break;
+            }
+            return growth;
+        default:
+            return growth;
+        }
+    }
+    return growth;
+}
+
+// Returns the native code of the new block, or NULL if the cache is full
+static void *jit_compile(struct jit_state *jit, struct cpu *cpu, int32_t start)
+{
+    struct block_compiler *bc = malloc(sizeof(*bc));
+    if (bc == NULL) {
+        return NULL;
+    }
+    bc->e.pos = jit->free;
+    bc->e.end = jit->cache + JIT_CACHE_SIZE;
+    bc->e.full = false;
+    bc->jit = jit;
+    bc->cpu = cpu;
+    bc->start = start;
+    bc->position = 0;
+    bc->depth = 0;
+    bc->growth = block_stack_growth(cpu, start);
+    bc->stub_count = 0;
+
+    struct emitter *e = &bc->e;
+    uint8_t *code = e->pos;
+
+    // Charge the whole block up front: sub qword [budget], length; jl refund
+    emit_rbp(e, true, 0x81, 5, BUDGET_OFFSET);
+    uint8_t *length_at = e->pos;
+    emit32(e, 0);
+    add_stub(bc, STUB_BUDGET, emit_jcc(e, CC_L), -1, -1);
+    if (bc->growth > 0) {
+        // stack_size + growth > capacity: jg refund
+        emit_load_field(e, RAX, CPU_OFFSET(stack_size));
+        emit_rr(e, false, 0x81, 0, RAX); // add eax, growth
+        emit32(e, (uint32_t) bc->growth);
+        emit_rbp(e, false, 0x3B, RAX, CPU_OFFSET(stack_capacity)); // cmp eax, (int32_t) capacity
+        add_stub(bc, STUB_STACK, emit_jcc(e, CC_G), -1, -1);
+    }
+
+    int32_t index = start;
+    while (index >= 0) {
+        const struct decoded_op *op = &cpu->decoded[index];
+        index = emit_op(bc, index, op);
+        bc->position++;
+        if (index >= 0 && bc->position == JIT_MAX_BLOCK_OPS) {
+            emit_chain_stub(bc, index);
+            break;
+        }
+    }
+
+    // Stubs are only patched while the buffer still has room
+    for (int i = 0; i < bc->stub_count && !e->full; ++i) {
+        emit_stub(bc, &bc->stubs[i]);
+    }
+    if (e->full) {
+        free(bc);
+        return NULL;
+    }
+    memcpy(length_at, &bc->position, sizeof(bc->position));
+
+    jit->free = e->pos;
+    jit->blocks[start] = code;
+    free(bc);
+    return code;
+}
+
+static void jit_flush(struct jit_state *jit)
+{
+    memset(jit->blocks, 0, (size_t) jit->block_count * sizeof(*jit->blocks));
+    jit->free = jit->blocks_start;
+    jit->generation++;
+}
+
+static void *jit_block(struct jit_state *jit, struct cpu *cpu, int32_t index)
+{
+    if (jit->blocks[index] != NULL) {
+        return jit->blocks[index];
+    }
+    void *code = jit_compile(jit, cpu, index);
+    if (code == NULL) {
+        jit_flush(jit);
+        code = jit_compile(jit, cpu, index);
+    }
+    return code;
+}
+
+static struct jit_state *jit_create(struct cpu *cpu)
+{
+    if (sizeof(enum cpu_status) != sizeof(int32_t)) {
+        return NULL;
+    }
+    struct jit_state *jit = calloc(1, sizeof(*jit));
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->block_count = cpu->end_of_stack + 1;
+    jit->blocks = calloc((size_t) jit->block_count, sizeof(*jit->blocks));
+    jit->cache = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->blocks == NULL || jit->cache == MAP_FAILED) {
+        if (jit->cache != MAP_FAILED) {
+            munmap(jit->cache, JIT_CACHE_SIZE);
+        }
+        free(jit->blocks);
+        free(jit);
+        return NULL;
+    }
+
+    struct emitter e = { jit->cache, jit->cache + JIT_CACHE_SIZE, false };
+    emit_trampolines(jit, &e);
+    jit->blocks_start = e.pos;
+    jit->free = e.pos;
+    return jit;
+}
+
+void jit_destroy(struct jit_state *jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->cache, JIT_CACHE_SIZE);
+    free(jit->blocks);
+    free(jit);
+}
+
+// Adds the result of a cpu_run style call to steps already executed
+static long long add_steps(long long executed, long long result)
+{
+    return result < 0 ? result - executed : result + executed;
+}
+
+/*
+ * Runs the program as native code, equivalent to cpu_run.
+ * Falls back to cpu_run_decoded if no code cache can be set up.
+ */
+long long cpu_run_jit(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    if (cpu->debug != NULL) {
+        return debug_run(cpu, steps); // Native code has no traps
+    }
+    if (cpu->status != CPU_OK && !debug_resume(cpu)) {
+        return 0;
+    }
+    if (!cpu_predecode(cpu)) {
+        return cpu_run(cpu, steps);
+    }
+    if (cpu->jit == NULL && (cpu->jit = jit_create(cpu)) == NULL) {
+        return cpu_run_decoded(cpu, steps);
+    }
+
+    struct jit_state *jit = cpu->jit;
+    const int64_t budget = steps > INT64_MAX ? INT64_MAX : (int64_t) steps;
+    struct jit_exit exit = { NULL, budget };
+    uint8_t *unlinked = NULL; // Chain stub waiting for the block it leads to
+    unsigned unlinked_generation = 0;
+
+    for (;;) {
+        long long executed = budget - exit.budget;
+        if (exit.budget == 0) {
+            return executed;
+        }
+        if (cpu->inst_index < 0 || cpu->inst_index > cpu->end_of_stack) {
+            cpu->status = CPU_INVALID_ADDRESS;
+            cpu_flush_output(cpu);
+            return -(executed + 1);
+        }
+
+        void *code = jit_block(jit, cpu, cpu->inst_index);
+        if (code == NULL) {
+            return add_steps(executed, cpu_run_decoded(cpu, (size_t) exit.budget));
+        }
+        if (unlinked != NULL && unlinked_generation == jit->generation) {
+            patch_rel32(unlinked + 1, code);
+        }
+        unlinked = NULL;
+
+        switch (jit->entry(cpu, code, &exit)) {
+        case JIT_EXIT_CHAIN:
+            unlinked = exit.stub;
+            unlinked_generation = jit->generation;
+            break;
+        case JIT_EXIT_DYNAMIC:
+            break;
+        case JIT_EXIT_BUDGET:
+            executed = budget - exit.budget;
+            return add_steps(executed, cpu_run_decoded(cpu, (size_t) exit.budget));
+        case JIT_EXIT_STACK: {
+            // The budget covers the block, it was checked first
+            long long result = cpu_run_decoded(cpu, (size_t) (uintptr_t) exit.stub);
+            if (cpu->status != CPU_OK) {
+                return add_steps(budget - exit.budget, result);
+            }
+            exit.budget -= result;
+            break;
+        }
+        default:
+            executed = budget - exit.budget;
+            cpu_flush_output(cpu);
+            return stop_result(cpu, executed);
+        }
+    }
+}
+
+/*
+ * Bytes of native code and block table held for the CPU.
+ */
+size_t jit_footprint(const struct jit_state *jit)
+{
+    if (jit == NULL) {
+        return 0;
+    }
+    return sizeof(*jit) + (size_t) (jit->free - jit->cache)
+            + (size_t) jit->block_count * sizeof(*jit->blocks);
+}
+
+#else
+
+long long cpu_run_jit(struct cpu *cpu, size_t steps)
+{
+    return cpu_run_decoded(cpu, steps);
+}
+
+void jit_destroy(struct jit_state *jit)
+{
+    assert(jit == NULL);
+    (void) jit;
+}
+
+size_t jit_footprint(const struct jit_state *jit)
+{
+    assert(jit == NULL);
+    (void) jit;
+    return 0;
+}
+
+#endif
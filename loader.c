@@ -0,0 +1,341 @@
+/*
+ * Program loader.
+ *
+ * Guest memory is laid out exactly like cpu_create_memory always did it:
+ * the program words, zeroes up to the next multiple of 1024 words that
+ * leaves room for the stack, and the stack at the very end. The difference
+ * is how it gets there. The whole region is reserved once as anonymous
+ * memory and the image file is mapped copy-on-write over its start, so
+ * loading costs a few system calls no matter how large the program is and
+ * only pages the guest touches are ever read. Pipes and other streams
+ * that cannot be mapped are read in large chunks instead.
+ *
+ * Compact images (image.h) are recognized by their magic and expanded
+ * into anonymous memory of the same layout, the words they hold are not in
+ * the file to be mapped. Assembly sources (.asm files) are assembled into
+ * anonymous memory the same way, so every mode takes them.
+ */
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "asm.h"
+#include "cpu.h"
+#include "cpu_internal.h"
+#include "image.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+/*
+ * Computes the size of guest memory in words for a program of
+ * program_words words. Returns false if it does not fit in a size_t or in
+ * the 32-bit instruction pointer.
+ */
+bool memory_layout_words(size_t program_words, size_t stack_capacity, size_t *total_words)
+{
+    if (program_words > SIZE_MAX - stack_capacity) {
+        return false;
+    }
+    size_t needed = program_words + stack_capacity;
+    size_t blocks = needed == 0 ? 1 : (needed - 1) / MEMORY_BLOCK_WORDS + 1;
+    if (blocks > INT32_MAX / MEMORY_BLOCK_WORDS) {
+        return false;
+    }
+    *total_words = blocks * MEMORY_BLOCK_WORDS;
+    return true;
+}
+
+/*
+ * Reads the header of the compact image of size bytes at image and computes
+ * the size of guest memory for it like memory_layout_words. Returns false
+ * with errno set if the image is malformed, needs a larger stack than
+ * stack_capacity or does not fit.
+ */
+bool memory_layout_image(const void *image, size_t size, size_t stack_capacity,
+        struct image_header *header, size_t *total_words)
+{
+    if (image_read_header(image, size, header) != 0) {
+        return false;
+    }
+    if (header->stack_capacity > stack_capacity) {
+        errno = ENOSPC; // The program asks for more stack than it would get
+        return false;
+    }
+    if (!memory_layout_words(header->words, stack_capacity, total_words)) {
+        errno = ENOMEM;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Turns count little-endian words stored at memory into host words, in
+ * place. Nothing to do on little-endian hosts.
+ */
+void memory_words_from_le(int32_t *memory, size_t count)
+{
+#ifdef CPU_NATIVE_LITTLE_ENDIAN
+    (void) memory;
+    (void) count;
+#else
+    unsigned char *bytes = (unsigned char *) memory;
+    for (size_t i = 0; i < count; ++i, bytes += 4) {
+        uint32_t word = (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8
+                | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+        memory[i] = (int32_t) word;
+    }
+#endif
+}
+
+/*
+ * Reserves zeroed guest memory of total_words words.
+ */
+int32_t *memory_map_anonymous(size_t total_words)
+{
+    void *memory = mmap(NULL, total_words * sizeof(int32_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+#ifndef CPU_NATIVE_LITTLE_ENDIAN
+static bool read_exact(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size > 0) {
+        ssize_t result = read(fd, p, size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            if (result == 0) {
+                errno = EIO; // The file shrank while we were reading it
+            }
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+#endif
+
+/*
+ * Maps size bytes of the regular file fd over the start of new guest
+ * memory of total_words words. Returns NULL with errno set on failure.
+ */
+int32_t *memory_map_image(int fd, size_t size, size_t total_words)
+{
+    assert(size <= total_words * sizeof(int32_t));
+    int32_t *memory = memory_map_anonymous(total_words);
+    if (memory == NULL || size == 0) {
+        return memory;
+    }
+#ifdef CPU_NATIVE_LITTLE_ENDIAN
+    // Private file mappings are copy-on-write, the file never changes
+    bool loaded = mmap(memory, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0)
+            != MAP_FAILED;
+#else
+    bool loaded = lseek(fd, 0, SEEK_SET) == 0 && read_exact(fd, memory, size);
+    memory_words_from_le(memory, size / sizeof(int32_t));
+#endif
+    if (!loaded) {
+        int saved_errno = errno;
+        munmap(memory, total_words * sizeof(int32_t));
+        errno = saved_errno;
+        return NULL;
+    }
+    return memory;
+}
+
+/*
+ * Loads an image that cannot be mapped (a pipe, a terminal, ...).
+ */
+static int32_t *load_stream(int fd, size_t stack_capacity, size_t *total_words)
+{
+    size_t capacity = STREAM_CHUNK_SIZE;
+    size_t size = 0;
+    char *image = malloc(capacity);
+    if (image == NULL) {
+        return NULL;
+    }
+    for (;;) {
+        if (size == capacity) {
+            char *bigger = capacity <= SIZE_MAX / 2 ? realloc(image, capacity * 2) : NULL;
+            if (bigger == NULL) {
+                free(image);
+                errno = ENOMEM;
+                return NULL;
+            }
+            image = bigger;
+            capacity *= 2;
+        }
+        ssize_t result = read(fd, image + size, capacity - size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            free(image);
+            return NULL;
+        }
+        if (result == 0) {
+            break;
+        }
+        size += (size_t) result;
+    }
+
+    int32_t *memory = NULL;
+    struct image_header header;
+    if (image_is_compact(image, size)) {
+        if (memory_layout_image(image, size, stack_capacity, &header, total_words)
+                && (memory = memory_map_anonymous(*total_words)) != NULL
+                && image_decode(image, &header, memory) != 0) {
+            int saved_errno = errno;
+            munmap(memory, *total_words * sizeof(int32_t));
+            errno = saved_errno;
+            memory = NULL;
+        }
+    } else if (size % sizeof(int32_t) != 0) {
+        errno = EINVAL; // Truncated last word
+    } else if (!memory_layout_words(size / sizeof(int32_t), stack_capacity, total_words)) {
+        errno = ENOMEM;
+    } else if ((memory = memory_map_anonymous(*total_words)) != NULL) {
+        memcpy(memory, image, size);
+        memory_words_from_le(memory, size / sizeof(int32_t));
+    }
+    free(image);
+    return memory;
+}
+
+/*
+ * cpu_map_program_fd, which also stores in mapped whether the memory
+ * maps the file itself: only then can more copies of it be mapped from
+ * the file with memory_map_image.
+ */
+int32_t *memory_load_fd(int fd, size_t stack_capacity, int32_t **stack_bottom, bool *mapped)
+{
+    assert(fd >= 0);
+    assert(stack_bottom != NULL);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        return NULL;
+    }
+
+    size_t total_words;
+    int32_t *memory;
+    unsigned char magic[4];
+    *mapped = false;
+    if (!S_ISREG(info.st_mode)) {
+        memory = load_stream(fd, stack_capacity, &total_words);
+    } else if (pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)
+            && image_is_compact(magic, sizeof(magic))) {
+        memory = lseek(fd, 0, SEEK_SET) == 0 ? load_stream(fd, stack_capacity, &total_words)
+                                             : NULL;
+    } else {
+        *mapped = true;
+        if ((uintmax_t) info.st_size > SIZE_MAX || info.st_size % sizeof(int32_t) != 0) {
+            errno = info.st_size % sizeof(int32_t) != 0 ? EINVAL : EFBIG;
+            return NULL;
+        }
+        size_t size = (size_t) info.st_size;
+        if (!memory_layout_words(size / sizeof(int32_t), stack_capacity, &total_words)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memory = memory_map_image(fd, size, total_words);
+    }
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    *stack_bottom = &memory[total_words - 1];
+    return memory;
+}
+
+bool memory_is_source(const char *path)
+{
+    size_t length = strlen(path);
+    return length > 4 && strcmp(path + length - 4, ".asm") == 0;
+}
+
+/*
+ * Assembles the source file at path into newly mapped guest memory. The
+ * assembler reports what is wrong with the source on stderr; the errno
+ * for a source that does not assemble is EINVAL.
+ */
+int32_t *memory_load_source(const char *path, size_t stack_capacity, int32_t **stack_bottom)
+{
+    FILE *source = fopen(path, "r");
+    if (source == NULL) {
+        return NULL;
+    }
+    struct asm_context *ctx = asm_create();
+    enum asm_status status = ctx != NULL ? asm_assemble_file(ctx, source) : ASM_ERR_NOMEM;
+    fclose(source);
+
+    int32_t *memory = NULL;
+    size_t count = 0;
+    const uint32_t *words = status == ASM_SUCCESS ? asm_words(ctx, &count) : NULL;
+    size_t total_words;
+    if (status != ASM_SUCCESS) {
+        errno = status == ASM_ERR_NOMEM ? ENOMEM : EINVAL;
+    } else if (!memory_layout_words(count, stack_capacity, &total_words)) {
+        errno = ENOMEM;
+    } else if ((memory = memory_map_anonymous(total_words)) != NULL) {
+        if (count > 0) {
+            memcpy(memory, words, count * sizeof(int32_t));
+        }
+        *stack_bottom = &memory[total_words - 1];
+    }
+    asm_destroy(ctx);
+    return memory;
+}
+
+/*
+ * Loads the program image read from fd into newly mapped guest memory
+ * with room for stack_capacity stack items. The fd can be closed
+ * afterwards. Returns NULL and sets errno on failure.
+ * The memory must be released with cpu_unmap_memory, or handed to
+ * cpu_create_mapped so that cpu_destroy does it.
+ */
+int32_t *cpu_map_program_fd(int fd, size_t stack_capacity, int32_t **stack_bottom)
+{
+    bool mapped;
+    return memory_load_fd(fd, stack_capacity, stack_bottom, &mapped);
+}
+
+/*
+ * Same as cpu_map_program_fd for the file at path, which may also be an
+ * assembly source.
+ */
+int32_t *cpu_map_program(const char *path, size_t stack_capacity, int32_t **stack_bottom)
+{
+    assert(path != NULL);
+    if (memory_is_source(path)) {
+        return memory_load_source(path, stack_capacity, stack_bottom);
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    int32_t *memory = cpu_map_program_fd(fd, stack_capacity, stack_bottom);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return memory;
+}
+
+void cpu_unmap_memory(int32_t *memory, int32_t *stack_bottom)
+{
+    assert(memory != NULL);
+    assert(stack_bottom >= memory);
+    munmap(memory, (size_t) (stack_bottom - memory + 1) * sizeof(int32_t));
+}
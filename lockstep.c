@@ -0,0 +1,420 @@
+/*
+ * Lockstep execution of many CPUs running the same program.
+ *
+ * cpu_run_lockstep runs up to LOCKSTEP_LANES CPUs at a time on one thread.
+ * Their registers are kept as vectors of one lane per CPU (GCC vector
+ * extensions, which become AVX2 with -mavx2 and SSE2 otherwise), and the
+ * ops of the shared pre-decoded program are executed for all the lanes
+ * in a group at once. A group is the lanes that are at the same
+ * instruction with the same stack size; memory below the stack is code
+ * and never changes, so those lanes execute exactly the same op next.
+ *
+ * add/sub/mul/inc/dec/movr/swap/cmp are vector operations under the
+ * group's lane mask. Stack instructions move one word per lane, at the
+ * same stack slot in every lane's own memory. A conditional branch that
+ * goes both ways splits the group, and groups meet again once their lanes
+ * reach the same instruction with the same stack size: the engine always
+ * continues with the lanes that have executed the fewest steps, so lanes
+ * that fell behind catch up with the rest. Everything that could fail
+ * (div by zero, stack overflow, bad load/store indices, illegal
+ * instructions, a ret that goes different ways) and all I/O run one lane
+ * at a time through cpu_step, which keeps every lane's status, step count
+ * and output exactly what cpu_run_decoded would give it.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+__extension__ typedef uint32_t lane_vector
+        __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint32_t))));
+__extension__ typedef int32_t lane_signed
+        __attribute__((vector_size(LOCKSTEP_LANES * sizeof(int32_t))));
+
+struct lockstep
+{
+    struct cpu *cpus[LOCKSTEP_LANES];
+    long long *results[LOCKSTEP_LANES];
+    unsigned running;           // Bit per lane that has not stopped yet
+    const struct decoded_op *ops;
+    int32_t end_of_stack;
+    int32_t stack_capacity;
+    size_t steps;
+
+    lane_vector reg[REGISTER_RESULT + 1];
+    int32_t inst_index[LOCKSTEP_LANES];
+    int32_t stack_size[LOCKSTEP_LANES];
+    size_t executed[LOCKSTEP_LANES];
+};
+
+static void store_lane(struct lockstep *ls, unsigned lane)
+{
+    struct cpu *cpu = ls->cpus[lane];
+    for (int r = 0; r <= REGISTER_RESULT; ++r) {
+        cpu->registers[r] = (int32_t) ls->reg[r][lane];
+    }
+    cpu->inst_index = ls->inst_index[lane];
+    cpu->stack_size = ls->stack_size[lane];
+}
+
+static void load_lane(struct lockstep *ls, unsigned lane)
+{
+    struct cpu *cpu = ls->cpus[lane];
+    for (int r = 0; r <= REGISTER_RESULT; ++r) {
+        ls->reg[r][lane] = (uint32_t) cpu->registers[r];
+    }
+    ls->inst_index[lane] = cpu->inst_index;
+    ls->stack_size[lane] = cpu->stack_size;
+}
+
+static void retire(struct lockstep *ls, unsigned lane, long long result)
+{
+    ls->running &= ~(1u << lane);
+    *ls->results[lane] = result;
+}
+
+// Executes one instruction of a lane with the regular interpreter
+static void step_lane(struct lockstep *ls, unsigned lane)
+{
+    struct cpu *cpu = ls->cpus[lane];
+    store_lane(ls, lane);
+    int result = cpu_step(cpu);
+    load_lane(ls, lane);
+    long long executed = (long long) ++ls->executed[lane];
+    if (result == 0) {
+        retire(ls, lane, stop_result(cpu, executed));
+    } else if (ls->executed[lane] == ls->steps) {
+        retire(ls, lane, executed);
+    }
+}
+
+static unsigned lane_bits(const lane_signed *condition, unsigned group)
+{
+    unsigned bits = 0;
+    for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+        bits |= ((*condition)[lane] != 0 ? 1u : 0u) << lane;
+    }
+    return bits & group;
+}
+
+/*
+ * Runs the group of the given lane until it splits, needs the interpreter
+ * or one of its lanes runs out of steps.
+ */
+static void run_group(struct lockstep *ls, unsigned leader)
+{
+    int32_t index = ls->inst_index[leader];
+    int32_t stack_size = ls->stack_size[leader];
+    unsigned group = 0;
+    size_t budget = SIZE_MAX;
+    lane_vector mask = { 0 };
+    for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+        if ((ls->running & (1u << lane)) && ls->inst_index[lane] == index
+                && ls->stack_size[lane] == stack_size) {
+            group |= 1u << lane;
+            mask[lane] = ~0u;
+            size_t left = ls->steps - ls->executed[lane];
+            budget = left < budget ? left : budget;
+        }
+    }
+
+    lane_vector *reg = ls->reg;
+    unsigned taken = 0;         // Lanes of a split group that branch
+    int32_t target = 0;
+    bool interpret = index < 0 || index > ls->end_of_stack;
+    size_t done = 0;
+
+#define SELECT(value, old) (((value) & mask) | ((old) & ~mask))
+#define LANES(lane)                                                            \
+    for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane)                     \
+        if (group & (1u << lane))
+// Takes a conditional branch for the lanes in condition, splitting the group if needed
+#define BRANCH(condition, length)                                              \
+    do {                                                                       \
+        lane_signed lanes_taken = (condition);                                 \
+        unsigned branching = lane_bits(&lanes_taken, group);                   \
+        if (branching == group) {                                              \
+            index = op->target;                                                \
+        } else if (branching == 0) {                                           \
+            index += (length);                                                 \
+        } else {                                                               \
+            taken = branching;                                                 \
+            target = op->target;                                               \
+            ++done;                                                            \
+            goto split;                                                        \
+        }                                                                      \
+    } while (0)
+
+    while (!interpret && done < budget) {
+        const struct decoded_op *op = ls->ops + index;
+        switch ((enum decoded_kind) op->base) {
+        case DECODED_NOP:
+            index += 1;
+            break;
+
+        case DECODED_ADD:
+        case DECODED_SUB:
+        case DECODED_MUL: {
+            lane_vector value = op->base == DECODED_ADD ? reg[REGISTER_A] + reg[op->reg1]
+                    : op->base == DECODED_SUB           ? reg[REGISTER_A] - reg[op->reg1]
+                                                        : reg[REGISTER_A] * reg[op->reg1];
+            reg[REGISTER_A] = SELECT(value, reg[REGISTER_A]);
+            reg[REGISTER_RESULT] = SELECT(value, reg[REGISTER_RESULT]);
+            index += 2;
+            break;
+        }
+
+        case DECODED_DIV: {
+            bool zero = false;
+            LANES(lane) {
+                zero |= reg[op->reg1][lane] == 0;
+            }
+            if (zero) {
+                interpret = true;
+                break;
+            }
+            // No vector division on the host; INT32_MIN / -1 traps as it does in cpu_step
+            LANES(lane) {
+                int32_t value = (int32_t) reg[REGISTER_A][lane] / (int32_t) reg[op->reg1][lane];
+                reg[REGISTER_A][lane] = (uint32_t) value;
+                reg[REGISTER_RESULT][lane] = (uint32_t) value;
+            }
+            index += 2;
+            break;
+        }
+
+        case DECODED_INC:
+        case DECODED_DEC: {
+            lane_vector value = reg[op->reg1] + (op->base == DECODED_INC ? 1u : ~0u);
+            reg[op->reg1] = SELECT(value, reg[op->reg1]);
+            reg[REGISTER_RESULT] = SELECT(value, reg[REGISTER_RESULT]);
+            index += 2;
+            break;
+        }
+
+        case DECODED_LOOP:
+            BRANCH(reg[REGISTER_C] != 0, 2);
+            break;
+
+        case DECODED_MOVR: {
+            lane_vector value = mask & (uint32_t) op->imm;
+            reg[op->reg1] = SELECT(value, reg[op->reg1]);
+            index += 3;
+            break;
+        }
+
+        case DECODED_LOAD:
+        case DECODED_STORE: {
+            bool valid = stack_size > 0;
+            LANES(lane) {
+                int32_t offset = (int32_t) reg[REGISTER_D][lane] + op->imm;
+                valid &= offset >= 0 && offset < stack_size;
+            }
+            if (!valid) {
+                interpret = true;
+                break;
+            }
+            LANES(lane) {
+                int32_t stack_index = stack_size - ((int32_t) reg[REGISTER_D][lane] + op->imm) - 1;
+                int32_t *slot = &ls->cpus[lane]->stack_bottom[-stack_index];
+                if (op->base == DECODED_LOAD) {
+                    reg[op->reg1][lane] = (uint32_t) *slot;
+                } else {
+                    *slot = (int32_t) reg[op->reg1][lane];
+                }
+            }
+            index += 3;
+            break;
+        }
+
+        case DECODED_SWAP: {
+            lane_vector first = reg[op->reg1];
+            lane_vector second = reg[op->reg2];
+            reg[op->reg1] = SELECT(second, first);
+            reg[op->reg2] = SELECT(first, reg[op->reg2]);
+            index += 3;
+            break;
+        }
+
+        case DECODED_PUSH:
+            if (stack_size >= ls->stack_capacity) {
+                interpret = true;
+                break;
+            }
+            LANES(lane) {
+                ls->cpus[lane]->stack_bottom[-stack_size] = (int32_t) reg[op->reg1][lane];
+            }
+            stack_size += 1;
+            index += 2;
+            break;
+
+        case DECODED_POP:
+            if (stack_size <= 0) {
+                interpret = true;
+                break;
+            }
+            LANES(lane) {
+                int32_t *slot = &ls->cpus[lane]->stack_bottom[-(stack_size - 1)];
+                reg[op->reg1][lane] = (uint32_t) *slot;
+                *slot = 0;
+            }
+            stack_size -= 1;
+            index += 2;
+            break;
+
+        case DECODED_CMP: {
+            lane_vector value = reg[op->reg1] - reg[op->reg2];
+            reg[REGISTER_RESULT] = SELECT(value, reg[REGISTER_RESULT]);
+            index += 3;
+            break;
+        }
+
+        case DECODED_JMP:
+            index = op->target;
+            break;
+
+        case DECODED_JZ:
+            BRANCH(reg[REGISTER_RESULT] == 0, 2);
+            break;
+
+        case DECODED_JNZ:
+            BRANCH(reg[REGISTER_RESULT] != 0, 2);
+            break;
+
+        case DECODED_JGT:
+            BRANCH((lane_signed) reg[REGISTER_RESULT] > 0, 2);
+            break;
+
+        case DECODED_CALL:
+            if (stack_size >= ls->stack_capacity) {
+                interpret = true;
+                break;
+            }
+            LANES(lane) {
+                ls->cpus[lane]->stack_bottom[-stack_size] = op->imm;
+            }
+            stack_size += 1;
+            index = op->target;
+            break;
+
+        case DECODED_RET: {
+            unsigned first = (unsigned) __builtin_ctz(group);
+            int32_t return_index = stack_size > 0
+                    ? ls->cpus[first]->stack_bottom[-(stack_size - 1)]
+                    : -1;
+            bool same = return_index >= 0 && return_index <= ls->end_of_stack;
+            LANES(lane) {
+                same &= ls->cpus[lane]->stack_bottom[-(stack_size - 1)] == return_index;
+            }
+            if (!same) {
+                interpret = true;
+                break;
+            }
+            LANES(lane) {
+                ls->cpus[lane]->stack_bottom[-(stack_size - 1)] = 0;
+            }
+            stack_size -= 1;
+            index = return_index;
+            break;
+        }
+
+        default:
+            // halt, I/O, undecodable operands, illegal instructions, the end of memory
+            interpret = true;
+            break;
+        }
+        if (!interpret) {
+            ++done;
+        }
+    }
+
+split:
+    LANES(lane) {
+        ls->executed[lane] += done;
+        ls->stack_size[lane] = stack_size;
+        ls->inst_index[lane] = index;
+        if (taken != 0) {
+            ls->inst_index[lane] = taken & (1u << lane) ? target : index + 2;
+        }
+    }
+    LANES(lane) {
+        if (ls->executed[lane] == ls->steps) {
+            retire(ls, lane, (long long) ls->steps);
+        } else if (interpret) {
+            step_lane(ls, lane);
+        }
+    }
+#undef BRANCH
+#undef LANES
+#undef SELECT
+}
+
+static void run_lanes(struct lockstep *ls)
+{
+    while (ls->running != 0) {
+        unsigned leader = 0;
+        size_t fewest = SIZE_MAX;
+        for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+            if ((ls->running & (1u << lane)) && ls->executed[lane] < fewest) {
+                fewest = ls->executed[lane];
+                leader = lane;
+            }
+        }
+        run_group(ls, leader);
+    }
+    for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+        if (ls->cpus[lane] != NULL) {
+            store_lane(ls, lane);
+        }
+    }
+}
+
+/*
+ * Runs each of the count CPUs for at most steps steps and stores what
+ * cpu_run_decoded would have returned for cpus[i] in results[i]. CPUs that
+ * share their pre-decoded program (made by cpu_program_instance from the
+ * same program) run in lockstep, LOCKSTEP_LANES at a time; the others, and
+ * CPUs with breakpoints or watchpoints, run one after the other.
+ */
+void cpu_run_lockstep(struct cpu **cpus, size_t count, size_t steps, long long *results)
+{
+    assert(cpus != NULL || count == 0);
+    assert(results != NULL || count == 0);
+
+    struct lockstep ls;
+    memset(&ls, 0, sizeof(ls));
+    ls.steps = steps;
+    unsigned lanes = 0;
+    for (size_t i = 0; i <= count; ++i) {
+        struct cpu *cpu = i < count ? cpus[i] : NULL;
+        bool eligible = cpu != NULL && steps > 0 && cpu->status == CPU_OK && cpu->debug == NULL
+                && cpu_predecode(cpu);
+        if (eligible && lanes > 0 && cpu->decoded != ls.ops) {
+            eligible = false;
+        }
+        if (cpu != NULL && !eligible) {
+            results[i] = cpu_run_decoded(cpu, steps);
+            continue;
+        }
+        if (cpu != NULL) {
+            if (lanes == 0) {
+                ls.ops = cpu->decoded;
+                ls.end_of_stack = cpu->end_of_stack;
+                ls.stack_capacity = (int32_t) cpu->stack_capacity;
+            }
+            ls.cpus[lanes] = cpu;
+            ls.results[lanes] = &results[i];
+            load_lane(&ls, lanes);
+            ls.running |= 1u << lanes;
+            ++lanes;
+        }
+        if (lanes == LOCKSTEP_LANES || (cpu == NULL && lanes > 0)) {
+            run_lanes(&ls);
+            memset(&ls, 0, sizeof(ls));
+            ls.steps = steps;
+            lanes = 0;
+        }
+    }
+}
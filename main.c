@@ -1,11 +1,16 @@
 #include "cpu.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
 const char *status_name(enum cpu_status status)
 {
@@ -26,6 +31,12 @@ const char *status_name(enum cpu_status status)
         return "CPU_DIV_BY_ZERO";
     case CPU_IO_ERROR:
         return "CPU_IO_ERROR";
+    case CPU_BREAKPOINT:
+        return "CPU_BREAKPOINT";
+    case CPU_WATCHPOINT:
+        return "CPU_WATCHPOINT";
+    case CPU_WAITING_INPUT:
+        return "CPU_WAITING_INPUT";
     default:
         fprintf(stderr, "BUG: Unknown status (%d)\n", status);
         abort();
@@ -46,63 +57,728 @@ static void state(struct cpu *cpu)
     printf("Status: %s\n", status_name(cpu_get_status(cpu)));
 }
 
+/*
+ * Trace mode shares stdin and stdout with the guest, so guest I/O goes
+ * through the same stdio streams, one input byte at a time.
+ */
+static long stdio_read(void *context, char *buf, size_t size)
+{
+    (void) context;
+    (void) size;
+    int c = getchar();
+    if (c == EOF) {
+        return ferror(stdin) ? -1 : 0;
+    }
+    buf[0] = (char) c;
+    return 1;
+}
+
+static int stdio_write(void *context, const char *buf, size_t size)
+{
+    (void) context;
+    return fwrite(buf, 1, size, stdout) == size ? 0 : -1;
+}
+
+static const struct cpu_io_ops stdio_ops = { stdio_read, stdio_write };
+
+// Steps a run may take; the count has to fit the long long it returns
+#define RUN_STEPS (SIZE_MAX < LLONG_MAX ? SIZE_MAX : (size_t) LLONG_MAX)
+
+static bool parse_register(const char *text, enum cpu_register *reg)
+{
+    static const char *const names[] = { "A", "B", "C", "D", "RESULT" };
+    for (int i = REGISTER_A; i <= REGISTER_RESULT; ++i) {
+        if (strcasecmp(text, names[i]) == 0) {
+            *reg = (enum cpu_register) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds the counts of one run to those of the runs before it
+static void add_perf(struct cpu_perf_result *total, const struct cpu_perf_result *part)
+{
+    total->valid &= part->valid;
+    total->error = part->error != 0 ? part->error : total->error;
+    total->cycles += part->cycles;
+    total->instructions += part->instructions;
+    total->branch_misses += part->branch_misses;
+    total->l1d_misses += part->l1d_misses;
+}
+
+/*
+ * Runs cp until it halts or fails, printing its state at every breakpoint
+ * and watchpoint on the way and sleeping while a non-blocking standard
+ * input has nothing to read. Returns the steps of the whole run the way
+ * cpu_run counts them. If perf is not NULL, the runs are counted into it
+ * with cpu_run_perf, the printing in between is not.
+ */
+static long long run_to_end(struct cpu *cp, long long (*run)(struct cpu *, size_t),
+        struct cpu_perf_result *perf)
+{
+    long long executed = 0;
+    if (perf != NULL) {
+        memset(perf, 0, sizeof(*perf));
+        perf->valid = ~0u;
+    }
+    for (;;) {
+        long long result;
+        if (perf != NULL) {
+            struct cpu_perf_result part = cpu_run_perf(cp, run, RUN_STEPS - (size_t) executed);
+            add_perf(perf, &part);
+            result = part.steps;
+        } else {
+            result = run(cp, RUN_STEPS - (size_t) executed);
+        }
+        executed += result < 0 ? -result : result;
+        enum cpu_status status = cpu_get_status(cp);
+        if (status == CPU_WAITING_INPUT && (size_t) executed < RUN_STEPS) {
+            struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+            while (poll(&input, 1, -1) < 0 && errno == EINTR) {
+            }
+            continue;
+        }
+        if ((status != CPU_BREAKPOINT && status != CPU_WATCHPOINT) || (size_t) executed >= RUN_STEPS) {
+            if (perf != NULL) {
+                perf->steps = result < 0 ? -executed : executed;
+            }
+            return result < 0 ? -executed : executed;
+        }
+
+        // Guest output is written to the fd directly, keep it in order with the report
+        cpu_flush_output(cp);
+        enum cpu_watch_kind kind;
+        int32_t which;
+        if (cpu_watchpoint_hit(cp, &kind, &which)) {
+            static const char *const names[] = { "A", "B", "C", "D", "RESULT" };
+            if (kind == CPU_WATCH_REGISTER) {
+                printf("Watchpoint: %s changed\n", names[which]);
+            } else {
+                printf("Watchpoint: stack slot %d changed\n", which);
+            }
+        } else {
+            printf("Breakpoint at %d\n", cpu_get_inst_index(cp));
+        }
+        state(cp);
+        printf("\'cpu_run\' steps so far: %lld\n", executed);
+        fflush(stdout);
+    }
+}
+
 static void usage(void)
 {
-    printf("Invalid arguments, run ./cpu (run|trace) [stack_capacity] FILE\n");
+    printf("Invalid arguments, run ./cpu (run|trace|jit|profile|replay) [--fusion-report] [--perf] [--memory] "
+           "[--cache DIR [--cache-size BYTES]] [--folded OUTPUT] "
+           "[--trace-file TRACE [--compress]] [--interval STEPS] [--rewind STEPS] "
+           "[--break INDEX] [--watch REGISTER] [--watch-stack SLOT] [--snapshot SNAPSHOT] "
+           "([stack_capacity] FILE | --from-snapshot SNAPSHOT)\n"
+           "                   or ./cpu batch [--threads N] [--lockstep] [stack_capacity] FILE INPUT...\n"
+           "                   or ./cpu serve [--threads N] [stack_capacity] SOCKET FILE...\n"
+           "                   or ./cpu request SOCKET PROGRAM\n"
+           "                   or ./cpu stats SOCKET\n");
 }
 
-int main(int argc, char *argv[])
+static void memory_report(struct cpu *cpu)
 {
-    if (argc > 4 || argc < 3) {
-        usage();
-        return EXIT_FAILURE;
+    struct cpu_memory_stats stats;
+    cpu_memory_stats(cpu, &stats);
+    fprintf(stderr, "Resident memory, %zu bytes of its own:\n",
+            stats.state_bytes + stats.code_bytes + stats.stack_bytes);
+    fprintf(stderr, "  %-14s %14zu\n", "state", stats.state_bytes);
+    fprintf(stderr, "  %-14s %14zu\n", "code", stats.code_bytes);
+    fprintf(stderr, "  %-14s %14zu\n", "stack", stats.stack_bytes);
+    fprintf(stderr, "  %-14s %14zu\n", "shared", stats.shared_bytes);
+}
+
+/*
+ * Parses the value of a numeric option, a decimal number from min to max
+ * and nothing else.
+ */
+static bool parse_option_number(const char *text, unsigned long long min, unsigned long long max,
+        unsigned long long *value)
+{
+    // strtoull takes a sign and whitespace, which no option value has
+    if (*text < '0' || *text > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (errno != 0 || *end != '\0' || number < min || number > max) {
+        return false;
     }
+    *value = number;
+    return true;
+}
 
-    size_t stack_capacity = 256;
-    if (argc == 4) {
-        char *end;
-        stack_capacity = (size_t) strtol(argv[2], &end, 10);
-        if (*end != '\0') {
-            printf("Invalid stack capacity\n");
-            return EXIT_FAILURE;
+static bool parse_stack_capacity(const char *text, size_t *stack_capacity)
+{
+    char *end;
+    errno = 0;
+    *stack_capacity = (size_t) strtol(text, &end, 10);
+    if (*end != '\0') {
+        printf("Invalid stack capacity\n");
+        return false;
+    }
+    if (errno == ERANGE) {
+        printf("Stack capacity out of range\n");
+        return false;
+    }
+    return true;
+}
+
+static char *read_stream(FILE *file, size_t *size)
+{
+    size_t capacity = 4096;
+    char *data = malloc(capacity);
+    *size = 0;
+    while (data != NULL) {
+        *size += fread(data + *size, 1, capacity - *size, file);
+        if (*size < capacity) {
+            break;
+        }
+        char *bigger = realloc(data, capacity *= 2);
+        if (bigger == NULL) {
+            free(data);
         }
-        if (errno == ERANGE) {
-            printf("Stack capacity out of range\n");
+        data = bigger;
+    }
+    if (data != NULL && ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    char *data = read_stream(file, size);
+    fclose(file);
+    return data;
+}
+
+/*
+ * Runs cp like run_to_end, through the result cache in dir when there is
+ * one to use. The cache needs the whole guest input before the run, so
+ * stdin is read up front; that is not done to a terminal. Returns false
+ * after reporting the problem if stdin could not be read.
+ */
+static bool run_cached(struct cpu *cp, long long (*run)(struct cpu *, size_t), const char *dir,
+        unsigned long long max_size, long long *steps)
+{
+    struct cpu_cache *cache = NULL;
+    if (!isatty(STDIN_FILENO) && (cache = cpu_cache_open(dir, max_size)) == NULL) {
+        perror(dir);
+    }
+    if (cache == NULL) {
+        *steps = run_to_end(cp, run, NULL);
+        return true;
+    }
+
+    size_t size;
+    char *input = read_stream(stdin, &size);
+    if (input == NULL) {
+        perror("stdin");
+        cpu_cache_close(cache);
+        return false;
+    }
+    *steps = cpu_run_cached(cp, cache, run, RUN_STEPS, input, size, NULL);
+    cpu_cache_close(cache);
+    free(input);
+    return true;
+}
+
+static bool is_source(const char *path)
+{
+    size_t length = strlen(path);
+    return length > 4 && strcmp(path + length - 4, ".asm") == 0;
+}
+
+// Reports why the program at path could not be loaded, in every mode alike
+static void load_failed(const char *path)
+{
+    if (is_source(path) && errno == EINVAL) {
+        fprintf(stderr, "%s: assembly failed\n", path);
+    } else {
+        perror(path);
+    }
+}
+
+// Prints a job's output followed by its final state
+static void print_job(const struct cpu_batch_job *job)
+{
+    if (job->error != 0) {
+        printf("Error: %s\n", strerror(job->error));
+    }
+    fwrite(job->output, 1, job->output_size, stdout);
+    if (job->output_size > 0 && job->output[job->output_size - 1] != '\n') {
+        printf("\n");
+    }
+    printf("A: %d, B: %d, C: %d, D: %d\n", job->registers[REGISTER_A],
+        job->registers[REGISTER_B], job->registers[REGISTER_C], job->registers[REGISTER_D]);
+    printf("Stack size: %d\n", job->stack_size);
+    printf("Status: %s\n", status_name(job->status));
+    printf("\'cpu_run\' result: %lld\n", job->steps);
+}
+
+/*
+ * ./cpu batch: runs FILE once per INPUT file, the file being the guest's
+ * input, and prints every job's output followed by its final state.
+ */
+static int batch(int argc, char *argv[], unsigned threads, bool lockstep)
+{
+    size_t stack_capacity = 256;
+    int first_input = 3;
+    if (argc >= 5 && strspn(argv[2], "0123456789") == strlen(argv[2])) {
+        if (!parse_stack_capacity(argv[2], &stack_capacity)) {
             return EXIT_FAILURE;
         }
+        ++first_input;
     }
+    const char *path = argv[first_input - 1];
+    size_t job_count = (size_t) (argc - first_input);
 
-    FILE *fptr;
-    if ((fptr = fopen(argv[argc - 1], "rb")) == NULL) {
-        perror(argv[argc - 1]);
+    struct cpu_program *program = cpu_program_load(path, stack_capacity);
+    if (program == NULL) {
+        load_failed(path);
         return EXIT_FAILURE;
     }
-    int32_t *stack_ptr;
-    int32_t *memory = cpu_create_memory(fptr, stack_capacity, &stack_ptr);
-    if (memory == NULL) {
+    struct cpu_batch_job *jobs = calloc(job_count, sizeof(*jobs));
+    if (jobs == NULL) {
         fprintf(stderr, "Memory failure");
-        fclose(fptr);
+        cpu_program_destroy(program);
         return EXIT_FAILURE;
     }
 
-    struct cpu *cp = cpu_create(memory, stack_ptr, stack_capacity);
-    if (cp == NULL) {
+    int exit_code = EXIT_SUCCESS;
+    for (size_t i = 0; i < job_count; ++i) {
+        const char *input = argv[first_input + i];
+        if ((jobs[i].input = read_file(input, &jobs[i].input_size)) == NULL) {
+            perror(input);
+            exit_code = EXIT_FAILURE;
+            job_count = i;
+        }
+    }
+    int (*run)(struct cpu_program *, struct cpu_batch_job *, size_t, size_t, unsigned)
+            = lockstep ? cpu_run_batch_lockstep : cpu_run_batch;
+    if (exit_code == EXIT_SUCCESS && run(program, jobs, job_count, RUN_STEPS, threads) != 0) {
+        fprintf(stderr, "Memory failure");
+        exit_code = EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < job_count && exit_code == EXIT_SUCCESS; ++i) {
+        printf("==> %s <==\n", argv[first_input + i]);
+        print_job(&jobs[i]);
+    }
+
+    for (size_t i = 0; i < job_count; ++i) {
+        free((char *) jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+    cpu_program_destroy(program);
+    return exit_code;
+}
+
+static struct cpu_server *running_server;
+
+static void stop_server(int signal)
+{
+    (void) signal;
+    cpu_server_stop(running_server);
+}
+
+/*
+ * ./cpu serve: keeps every FILE loaded and runs it for clients on SOCKET,
+ * FILE number i being program i, until SIGINT or SIGTERM. The metrics are
+ * printed at the end.
+ */
+static int serve(int argc, char *argv[], unsigned threads)
+{
+    size_t stack_capacity = 256;
+    int first = 2;
+    if (argc >= 5 && strspn(argv[2], "0123456789") == strlen(argv[2])) {
+        if (!parse_stack_capacity(argv[2], &stack_capacity)) {
+            return EXIT_FAILURE;
+        }
+        ++first;
+    }
+    const char *socket_path = argv[first];
+    size_t program_count = (size_t) (argc - first - 1);
+    struct cpu_program **programs = calloc(program_count, sizeof(*programs));
+    if (programs == NULL) {
         fprintf(stderr, "Memory failure");
-        free(memory);
-        fclose(fptr);
         return EXIT_FAILURE;
     }
 
-    if (strcmp(argv[1], "run") == 0) {
-        int run_result = cpu_run(cp, INT_MAX);
+    int exit_code = EXIT_SUCCESS;
+    for (size_t i = 0; i < program_count && exit_code == EXIT_SUCCESS; ++i) {
+        const char *path = argv[first + 1 + i];
+        if ((programs[i] = cpu_program_load(path, stack_capacity)) == NULL) {
+            load_failed(path);
+            exit_code = EXIT_FAILURE;
+        }
+    }
+    if (exit_code == EXIT_SUCCESS) {
+        running_server = cpu_server_create(socket_path, programs, program_count, RUN_STEPS, threads);
+        if (running_server == NULL) {
+            perror(socket_path);
+            exit_code = EXIT_FAILURE;
+        }
+    }
+    if (exit_code == EXIT_SUCCESS) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stop_server;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        if (cpu_server_run(running_server) != 0) {
+            perror("serve");
+            exit_code = EXIT_FAILURE;
+        }
+        cpu_server_stats(running_server, stderr);
+        cpu_server_destroy(running_server);
+    }
+
+    for (size_t i = 0; i < program_count; ++i) {
+        if (programs[i] != NULL) {
+            cpu_program_destroy(programs[i]);
+        }
+    }
+    free(programs);
+    return exit_code;
+}
+
+/*
+ * ./cpu request: runs program number PROGRAM of the server on SOCKET with
+ * stdin as the guest's input and prints the result like batch mode.
+ * ./cpu stats prints the server's metrics.
+ */
+static int request(char *argv[])
+{
+    bool stats = strcmp(argv[1], "stats") == 0;
+    char *end;
+    unsigned long program = stats ? 0 : strtoul(argv[3], &end, 10);
+    if (!stats && (*end != '\0' || end == argv[3] || program > UINT32_MAX)) {
+        printf("Invalid program number\n");
+        return EXIT_FAILURE;
+    }
+    int fd = cpu_server_connect(argv[2]);
+    if (fd < 0) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+    int exit_code = EXIT_SUCCESS;
+    if (stats) {
+        char *text = cpu_server_request_stats(fd);
+        if (text == NULL) {
+            perror(argv[2]);
+            exit_code = EXIT_FAILURE;
+        } else {
+            fputs(text, stdout);
+            free(text);
+        }
+    } else {
+        struct cpu_batch_job job;
+        memset(&job, 0, sizeof(job));
+        char *input = read_stream(stdin, &job.input_size);
+        job.input = input;
+        if (input == NULL) {
+            perror("stdin");
+            exit_code = EXIT_FAILURE;
+        } else if (cpu_server_request(fd, (uint32_t) program, &job) != 0) {
+            perror(argv[2]);
+            exit_code = EXIT_FAILURE;
+        } else {
+            print_job(&job);
+            exit_code = job.error == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        free(input);
+        free(job.output);
+    }
+    close(fd);
+    return exit_code;
+}
+
+int main(int argc, char *argv[])
+{
+    // Options may appear anywhere after the mode, drop them from argv
+    bool fusion_report = false;
+    bool perf = false;                // Run and JIT mode: print hardware counters
+    bool memory = false;              // Run and JIT mode: print the resident memory
+    const char *cache_dir = NULL;     // Run and JIT mode: result cache directory
+    unsigned long long cache_size = 64ull << 20;
+    const char *snapshot = NULL;      // Save the CPU before it reads input
+    const char *from_snapshot = NULL; // Start from a saved CPU instead of FILE
+    unsigned threads = 0;             // Batch worker threads, 0 = one per core
+    bool lockstep = false;            // Batch mode: run jobs with cpu_run_lockstep
+    const char *folded = NULL;        // Profile mode: where to write folded stacks
+    const char *trace_file = NULL;    // Trace mode: stream binary records here
+    bool compress = false;
+    size_t interval = 4096;           // Replay mode: steps between checkpoints
+    unsigned long long rewind = 10;   // Replay mode: steps to go back at the end
+    // Breakpoints and watchpoints as given, checked once the CPU exists
+    const char *breakpoints[argc];
+    const char *watchpoints[argc];
+    int breakpoint_count = 0;
+    int watchpoint_count = 0;
+    int kept = argc < 2 ? argc : 2;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--fusion-report") == 0) {
+            fusion_report = true;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf = true;
+        } else if (strcmp(argv[i], "--memory") == 0) {
+            memory = true;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            if (!parse_option_number(argv[++i], 1, ULLONG_MAX, &cache_size)) {
+                usage();
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--from-snapshot") == 0 && i + 1 < argc) {
+            from_snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+            folded = argv[++i];
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = true;
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            unsigned long long value;
+            if (!parse_option_number(argv[++i], 1, SIZE_MAX, &value)) {
+                usage();
+                return EXIT_FAILURE;
+            }
+            interval = (size_t) value;
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            if (!parse_option_number(argv[++i], 0, ULLONG_MAX, &rewind)) {
+                usage();
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+            breakpoints[breakpoint_count++] = argv[++i];
+        } else if ((strcmp(argv[i], "--watch") == 0 || strcmp(argv[i], "--watch-stack") == 0)
+                && i + 1 < argc) {
+            // Keep the option with its value to tell registers from stack slots
+            watchpoints[watchpoint_count++] = argv[i++];
+            watchpoints[watchpoint_count++] = argv[i];
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            lockstep = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            unsigned long long value;
+            if (!parse_option_number(argv[++i], 1, UINT_MAX, &value)) {
+                usage();
+                return EXIT_FAILURE;
+            }
+            threads = (unsigned) value;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            usage();
+            return EXIT_FAILURE;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0) {
+        if (argc < 4) {
+            usage();
+            return EXIT_FAILURE;
+        }
+        return batch(argc, argv, threads, lockstep);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+        if (argc < 4) {
+            usage();
+            return EXIT_FAILURE;
+        }
+        return serve(argc, argv, threads);
+    }
+    if (argc >= 2 && (strcmp(argv[1], "request") == 0 || strcmp(argv[1], "stats") == 0)) {
+        if (argc != (strcmp(argv[1], "stats") == 0 ? 3 : 4)) {
+            usage();
+            return EXIT_FAILURE;
+        }
+        return request(argv);
+    }
+
+    if (from_snapshot != NULL ? argc != 2 : argc > 4 || argc < 3) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    size_t stack_capacity = 256;
+    if (argc == 4 && !parse_stack_capacity(argv[2], &stack_capacity)) {
+        return EXIT_FAILURE;
+    }
+
+    struct cpu *cp;
+    if (from_snapshot != NULL) {
+        if ((cp = cpu_restore(from_snapshot)) == NULL) {
+            perror(from_snapshot);
+            return EXIT_FAILURE;
+        }
+    } else {
+        int32_t *stack_ptr;
+        int32_t *memory = cpu_map_program(argv[argc - 1], stack_capacity, &stack_ptr);
+        if (memory == NULL) {
+            load_failed(argv[argc - 1]);
+            return EXIT_FAILURE;
+        }
+
+        cp = cpu_create_mapped(memory, stack_ptr, stack_capacity);
+        if (cp == NULL) {
+            fprintf(stderr, "Memory failure");
+            cpu_unmap_memory(memory, stack_ptr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < breakpoint_count + watchpoint_count; ++i) {
+        bool is_break = i < breakpoint_count;
+        const char *option = is_break ? "--break" : watchpoints[i - breakpoint_count];
+        const char *value = is_break ? breakpoints[i] : watchpoints[++i - breakpoint_count];
+        enum cpu_register reg;
+        char *end;
+        long number = strtol(value, &end, 10);
+        bool numeric = *end == '\0' && end != value && number >= 0 && number <= INT32_MAX;
+        int result = -1;
+        if (is_break && numeric) {
+            result = cpu_set_breakpoint(cp, (int32_t) number);
+        } else if (strcmp(option, "--watch-stack") == 0 && numeric) {
+            result = cpu_set_watchpoint(cp, CPU_WATCH_STACK, (int32_t) number);
+        } else if (strcmp(option, "--watch") == 0 && parse_register(value, &reg)) {
+            result = cpu_set_watchpoint(cp, CPU_WATCH_REGISTER, (int32_t) reg);
+        }
+        if (result != 0) {
+            printf("Invalid %s %s\n", option, value);
+            cpu_destroy(cp);
+            free(cp);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (snapshot != NULL && strcmp(argv[1], "trace") != 0) {
+        // Only run the part before the first in/get, a later run resumes there
+        long long run_result = cpu_run_to_input(cp, RUN_STEPS);
+        if (cpu_snapshot(cp, snapshot) != 0) {
+            perror(snapshot);
+            cpu_destroy(cp);
+            free(cp);
+            return EXIT_FAILURE;
+        }
+        state(cp);
+        printf("\'cpu_run\' result: %lld\n", run_result);
+    } else if (strcmp(argv[1], "run") == 0 || strcmp(argv[1], "jit") == 0) {
+        bool jit = strcmp(argv[1], "jit") == 0;
+        long long (*run)(struct cpu *, size_t) = jit ? cpu_run_jit : cpu_run_decoded;
+        struct cpu_perf_result counters;
+        long long run_result;
+        // Hardware counters and stops at breakpoints need the run to happen
+        if (cache_dir != NULL && !perf && breakpoint_count + watchpoint_count == 0) {
+            if (!run_cached(cp, run, cache_dir, cache_size, &run_result)) {
+                cpu_destroy(cp);
+                free(cp);
+                return EXIT_FAILURE;
+            }
+        } else {
+            run_result = run_to_end(cp, run, perf ? &counters : NULL);
+        }
+        cpu_flush_output(cp);
+        state(cp);
+        printf("\'cpu_run\' result: %lld\n", run_result);
+        if (fusion_report && !jit) {
+            cpu_fusion_report(cp, stderr);
+        }
+        if (perf) {
+            cpu_perf_report(&counters, stderr);
+        }
+        if (memory) {
+            memory_report(cp);
+        }
+    } else if (strcmp(argv[1], "profile") == 0) {
+        struct cpu_profile *profile = cpu_profile_create(cp);
+        if (profile == NULL) {
+            perror("profile");
+            cpu_destroy(cp);
+            free(cp);
+            return EXIT_FAILURE;
+        }
+        long long run_result = cpu_run_profiled(cp, profile, RUN_STEPS);
+        cpu_flush_output(cp);
         state(cp);
-        printf("\'cpu_run\' result: %d\n", run_result);
+        printf("\'cpu_run\' result: %lld\n", run_result);
+        cpu_profile_report(profile, cp, stderr);
+        if (folded != NULL) {
+            FILE *out = fopen(folded, "w");
+            if (out == NULL || cpu_profile_folded(profile, out) != 0 || fclose(out) != 0) {
+                perror(folded);
+            }
+        }
+        cpu_profile_destroy(profile);
+    } else if (strcmp(argv[1], "replay") == 0) {
+        struct cpu_recording *recording = cpu_recording_create(cp, interval);
+        if (recording == NULL) {
+            perror("replay");
+            cpu_destroy(cp);
+            free(cp);
+            return EXIT_FAILURE;
+        }
+        long long run_result = cpu_run_recorded(cp, recording, RUN_STEPS);
+        cpu_flush_output(cp);
+        state(cp);
+        printf("\'cpu_run\' result: %lld\n", run_result);
+
+        // Go back and show how the run got to its end, one step at a time
+        unsigned long long end = cpu_recording_length(recording);
+        unsigned long long step = end > rewind ? end - rewind : 0;
+        printf("Replaying steps %llu to %llu\n", step, end);
+        for (; step <= end; ++step) {
+            cpu_replay_seek(cp, recording, step);
+            printf("Step %llu, next instruction at %d\n", step, cpu_get_inst_index(cp));
+            state(cp);
+        }
+        cpu_recording_destroy(recording);
+    } else if (strcmp(argv[1], "trace") == 0 && trace_file != NULL) {
+        int fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        struct cpu_trace_writer *trace
+                = fd < 0 ? NULL : cpu_trace_writer_create(fd, compress ? CPU_TRACE_COMPRESSED : 0);
+        if (trace == NULL) {
+            perror(trace_file);
+            if (fd >= 0) {
+                close(fd);
+            }
+            cpu_destroy(cp);
+            free(cp);
+            return EXIT_FAILURE;
+        }
+        long long run_result = cpu_run_traced(cp, trace, RUN_STEPS);
+        cpu_flush_output(cp);
+        state(cp);
+        printf("\'cpu_run\' result: %lld\n", run_result);
+        if (cpu_trace_writer_finish(trace) != 0 || close(fd) != 0) {
+            perror(trace_file);
+        }
     } else if (strcmp(argv[1], "trace") == 0) {
+        cpu_set_io(cp, &stdio_ops, NULL, 0);
         printf("Press Enter to execute the next instruction or type 'q' to quit.\n");
         while (true) {
             int c;
             if ((c = getchar()) == '\n') {
-                if (cpu_step(cp) == 0) {
+                int result = cpu_step(cp);
+                cpu_flush_output(cp);
+                if (result == 0) {
                     state(cp);
                     printf("finished\n");
                     break;
@@ -116,7 +792,6 @@ int main(int argc, char *argv[])
         usage();
     }
 
-    fclose(fptr);
     cpu_destroy(cp);
     free(cp);
     return EXIT_SUCCESS;
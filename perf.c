@@ -0,0 +1,158 @@
+/*
+ * Hardware performance counters around a run.
+ *
+ * cpu_run_perf opens one perf_event_open counter per event for the calling
+ * thread, user space only, enables them right before the engine runs and
+ * disables them right after, so everything the engine does (pre-decoding
+ * and JIT compilation included) is counted and nothing around it is.
+ * Counters are opened separately rather than as a group: a machine or a
+ * VM that lacks one event still reports the others. When the kernel had
+ * to multiplex them, the counts are scaled up to the whole run.
+ *
+ * Only Linux has perf_event_open; elsewhere, and with CPU_NO_PERF, the run
+ * happens without counters.
+ */
+#define _DEFAULT_SOURCE // syscall
+
+#include "cpu.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__linux__) && !defined(CPU_NO_PERF)
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PERF_EVENT_COUNT 4
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_EVENT_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+static int open_counter(unsigned event)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[event].type;
+    attr.config = perf_events[event].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Reads a disabled counter, false if it never got to run
+static bool read_counter(int fd, unsigned long long *count)
+{
+    uint64_t values[3]; // Count, time enabled, time running
+    if (read(fd, values, sizeof(values)) != (ssize_t) sizeof(values) || values[2] == 0) {
+        return false;
+    }
+    *count = values[2] < values[1]
+            ? (unsigned long long) ((double) values[0] * values[1] / values[2])
+            : values[0];
+    return true;
+}
+
+struct cpu_perf_result cpu_run_perf(struct cpu *cpu, long long (*run)(struct cpu *, size_t),
+        size_t steps)
+{
+    struct cpu_perf_result result;
+    memset(&result, 0, sizeof(result));
+    unsigned long long *counts[PERF_EVENT_COUNT] = {
+        &result.cycles, &result.instructions, &result.branch_misses, &result.l1d_misses,
+    };
+
+    int fds[PERF_EVENT_COUNT];
+    for (unsigned i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if ((fds[i] = open_counter(i)) < 0 && result.error == 0) {
+            result.error = errno;
+        }
+    }
+
+    for (unsigned i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    result.steps = run(cpu, steps);
+    for (unsigned i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    for (unsigned i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (fds[i] >= 0) {
+            if (read_counter(fds[i], counts[i])) {
+                result.valid |= 1u << i;
+            }
+            close(fds[i]);
+        }
+    }
+    if (result.valid != 0) {
+        result.error = 0;
+    } else if (result.error == 0) {
+        result.error = ENODATA;
+    }
+    return result;
+}
+
+#else
+
+struct cpu_perf_result cpu_run_perf(struct cpu *cpu, long long (*run)(struct cpu *, size_t),
+        size_t steps)
+{
+    struct cpu_perf_result result;
+    memset(&result, 0, sizeof(result));
+    result.error = ENOSYS;
+    result.steps = run(cpu, steps);
+    return result;
+}
+
+#endif
+
+void cpu_perf_report(const struct cpu_perf_result *result, FILE *out)
+{
+    static const char *const names[] = { "cycles", "instructions", "branch-misses", "L1d-misses" };
+    const unsigned long long counts[] = {
+        result->cycles, result->instructions, result->branch_misses, result->l1d_misses,
+    };
+    unsigned long long guest = (unsigned long long) (result->steps < 0 ? -result->steps
+                                                                       : result->steps);
+
+    fprintf(out, "Hardware counters, %llu guest instructions:\n", guest);
+    if (result->valid == 0) {
+        fprintf(out, "  not available (perf_event_open: %s)\n", strerror(result->error));
+        return;
+    }
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (!(result->valid & (1u << i))) {
+            fprintf(out, "  %-14s not counted\n", names[i]);
+        } else if (guest == 0) {
+            fprintf(out, "  %-14s %14llu\n", names[i], counts[i]);
+        } else {
+            fprintf(out, "  %-14s %14llu  %10.3f per guest instruction\n", names[i], counts[i],
+                    (double) counts[i] / (double) guest);
+        }
+    }
+    unsigned both = CPU_PERF_CYCLES | CPU_PERF_INSTRUCTIONS;
+    if ((result->valid & both) == both && result->cycles != 0) {
+        fprintf(out, "  IPC %.3f\n", (double) result->instructions / (double) result->cycles);
+    }
+}
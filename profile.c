@@ -0,0 +1,383 @@
+/*
+ * Execution profiler.
+ *
+ * cpu_run_profiled runs the CPU one cpu_step at a time and looks at every
+ * instruction before it executes: it counts executions per opcode and per
+ * instruction index, and for jz/jnz/jgt/loop whether the branch is taken.
+ * Call/ret maintain a tree of call paths (one node per distinct chain of
+ * call targets) that collects the steps spent in each path, which is what
+ * cpu_profile_folded prints for flamegraph tools.
+ *
+ * The regular engines know nothing about this, so profiling costs them
+ * nothing. Define CPU_NO_PROFILE to leave the profiler out altogether.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+
+#ifndef CPU_NO_PROFILE
+
+#define HOT_SPOT_COUNT 20
+#define OPCODE_OTHER CPU_OPCODE_SLOTS // Words that are not an instruction
+
+struct call_node
+{
+    int32_t entry;               // Call target, -1 for the node of the start
+    struct call_node *parent;
+    struct call_node *child;     // First callee
+    struct call_node *sibling;   // Next callee of parent
+    size_t depth;                // Calls between the start and here
+    unsigned long long steps;    // Steps spent here, without callees
+};
+
+struct cpu_profile
+{
+    size_t code_words;
+    unsigned long long total_steps;
+    unsigned long long opcode_runs[CPU_OPCODE_SLOTS + 1];
+    unsigned long long *hits;    // Executions per instruction index
+    unsigned long long *taken;   // Taken branches per instruction index
+    struct call_node root;
+    struct call_node *current;
+    size_t max_depth;
+    size_t lost_calls; // Calls not in the tree for a lack of memory
+};
+
+static const char *const opcode_names[CPU_OPCODE_SLOTS] = {
+#define NAME_ENTRY(opcode, name, operands) [opcode] = #name,
+    CPU_INSTRUCTION_LIST(NAME_ENTRY)
+#undef NAME_ENTRY
+};
+
+static const char *opcode_name(uint32_t opcode)
+{
+    return opcode < CPU_OPCODE_SLOTS && opcode_names[opcode] != NULL
+            ? opcode_names[opcode]
+            : "(illegal)";
+}
+
+/*
+ * Creates an empty profile for runs of cpu, which must not be given
+ * memory of a different size later on.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu_profile *cpu_profile_create(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    struct cpu_profile *profile = calloc(1, sizeof(*profile));
+    if (profile == NULL) {
+        return NULL;
+    }
+    profile->code_words = (size_t) cpu->end_of_stack + 1;
+    profile->hits = calloc(profile->code_words, sizeof(*profile->hits));
+    profile->taken = calloc(profile->code_words, sizeof(*profile->taken));
+    if (profile->hits == NULL || profile->taken == NULL) {
+        free(profile->hits);
+        free(profile->taken);
+        free(profile);
+        errno = ENOMEM;
+        return NULL;
+    }
+    profile->root.entry = -1;
+    profile->current = &profile->root;
+    return profile;
+}
+
+/*
+ * Visits the call tree in preorder without recursion, guests may nest
+ * calls as deep as their stack allows.
+ */
+static const struct call_node *next_node(const struct call_node *node)
+{
+    if (node->child != NULL) {
+        return node->child;
+    }
+    while (node != NULL && node->sibling == NULL) {
+        node = node->parent;
+    }
+    return node != NULL ? node->sibling : NULL;
+}
+
+static void free_calls(struct call_node *root)
+{
+    struct call_node *node = root->child;
+    while (node != NULL) {
+        if (node->child != NULL) {
+            node = node->child;
+            continue;
+        }
+        struct call_node *parent = node->parent;
+        parent->child = node->sibling;
+        free(node);
+        node = parent->child != NULL ? parent->child : parent != root ? parent : NULL;
+    }
+}
+
+void cpu_profile_destroy(struct cpu_profile *profile)
+{
+    if (profile == NULL) {
+        return;
+    }
+    free_calls(&profile->root);
+    free(profile->hits);
+    free(profile->taken);
+    free(profile);
+}
+
+/*
+ * Returns whether the jz/jnz/jgt/loop about to execute will jump.
+ */
+static bool branch_taken(const struct cpu *cpu, uint32_t opcode)
+{
+    switch (opcode) {
+    case 0x08: // loop
+        return cpu->registers[REGISTER_C] != 0;
+    case 0x15: // jz
+        return cpu->registers[REGISTER_RESULT] == 0;
+    case 0x16: // jnz
+        return cpu->registers[REGISTER_RESULT] != 0;
+    default: // jgt
+        return cpu->registers[REGISTER_RESULT] > 0;
+    }
+}
+
+static bool is_branch(uint32_t opcode)
+{
+    return opcode == 0x08 || (opcode >= 0x15 && opcode <= 0x17);
+}
+
+/*
+ * Records a call to entry. Without memory for a new call path the callee's
+ * steps are counted in the caller's path.
+ */
+static void enter_call(struct cpu_profile *profile, int32_t entry)
+{
+    if (profile->lost_calls > 0) {
+        ++profile->lost_calls;
+        return;
+    }
+    struct call_node *node = profile->current->child;
+    while (node != NULL && node->entry != entry) {
+        node = node->sibling;
+    }
+    if (node == NULL) {
+        if ((node = calloc(1, sizeof(*node))) == NULL) {
+            ++profile->lost_calls;
+            return;
+        }
+        node->entry = entry;
+        node->parent = profile->current;
+        node->depth = profile->current->depth + 1;
+        if (node->depth > profile->max_depth) {
+            profile->max_depth = node->depth;
+        }
+        node->sibling = profile->current->child;
+        profile->current->child = node;
+    }
+    profile->current = node;
+}
+
+static void leave_call(struct cpu_profile *profile)
+{
+    if (profile->lost_calls > 0) {
+        --profile->lost_calls;
+    } else if (profile->current->parent != NULL) {
+        profile->current = profile->current->parent;
+    }
+}
+
+/*
+ * Runs like cpu_run and adds what the CPU executes to profile. Repeated
+ * runs keep adding to the same profile. Returns what cpu_run would.
+ */
+long long cpu_run_profiled(struct cpu *cpu, struct cpu_profile *profile, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(profile != NULL);
+    assert((size_t) cpu->end_of_stack + 1 == profile->code_words);
+    if (cpu->status != CPU_OK) {
+        return 0;
+    }
+
+    long long executed_steps = 0;
+    for (size_t i = 0; i < steps; ++i) {
+        int32_t index = cpu->inst_index;
+        bool in_code = index >= 0 && (size_t) index < profile->code_words;
+        uint32_t opcode = in_code ? (uint32_t) cpu->memory[index] : OPCODE_OTHER;
+        bool taken = in_code && is_branch(opcode) && branch_taken(cpu, opcode);
+
+        int result = cpu_step(cpu);
+        if (result == 0 && cpu->status == CPU_WAITING_INPUT) {
+            return executed_steps; // The in/get did not run
+        }
+        ++executed_steps;
+        ++profile->total_steps;
+        profile->current->steps++;
+        if (in_code) {
+            profile->opcode_runs[opcode < CPU_OPCODE_SLOTS ? opcode : OPCODE_OTHER]++;
+            profile->hits[index]++;
+            profile->taken[index] += taken;
+        }
+        if (result == 0) {
+            return cpu->status == CPU_HALTED ? executed_steps : -executed_steps;
+        }
+
+        if (opcode == 0x18) { // call
+            enter_call(profile, cpu->inst_index);
+        } else if (opcode == 0x19) { // ret
+            leave_call(profile);
+        }
+    }
+    return executed_steps;
+}
+
+static void sort_indices(size_t *indices, size_t count, const unsigned long long *counts)
+{
+    // Insertion sort, descending; only used for short lists
+    for (size_t i = 1; i < count; ++i) {
+        size_t key = indices[i];
+        size_t j = i;
+        while (j > 0 && counts[indices[j - 1]] < counts[key]) {
+            indices[j] = indices[j - 1];
+            --j;
+        }
+        indices[j] = key;
+    }
+}
+
+static double percent(unsigned long long part, unsigned long long total)
+{
+    return total > 0 ? 100.0 * (double) part / (double) total : 0.0;
+}
+
+/*
+ * Prints the hot-spot report: executions per opcode, the most executed
+ * instruction indices and the taken/not-taken counts of every branch that
+ * ran.
+ */
+void cpu_profile_report(const struct cpu_profile *profile, const struct cpu *cpu, FILE *out)
+{
+    assert(profile != NULL);
+    assert(cpu != NULL);
+    assert(out != NULL);
+
+    size_t opcodes[CPU_OPCODE_SLOTS + 1];
+    size_t opcode_count = 0;
+    for (size_t op = 0; op <= CPU_OPCODE_SLOTS; ++op) {
+        if (profile->opcode_runs[op] > 0) {
+            opcodes[opcode_count++] = op;
+        }
+    }
+    sort_indices(opcodes, opcode_count, profile->opcode_runs);
+
+    fprintf(out, "Profile: %llu steps\n", profile->total_steps);
+    fprintf(out, "\nOpcode       Executions        %%\n");
+    for (size_t i = 0; i < opcode_count; ++i) {
+        size_t op = opcodes[i];
+        fprintf(out, "%-10s %12llu %7.2f%%\n",
+                op == OPCODE_OTHER ? "(illegal)" : opcode_name((uint32_t) op),
+                profile->opcode_runs[op], percent(profile->opcode_runs[op], profile->total_steps));
+    }
+
+    // Keep the HOT_SPOT_COUNT most executed indices, sorted
+    size_t hot[HOT_SPOT_COUNT + 1];
+    size_t hot_count = 0;
+    for (size_t index = 0; index < profile->code_words; ++index) {
+        if (profile->hits[index] == 0) {
+            continue;
+        }
+        if (hot_count == HOT_SPOT_COUNT
+                && profile->hits[hot[hot_count - 1]] >= profile->hits[index]) {
+            continue;
+        }
+        hot[hot_count < HOT_SPOT_COUNT ? hot_count++ : hot_count - 1] = index;
+        sort_indices(hot, hot_count, profile->hits);
+    }
+    fprintf(out, "\nHot spots\n    Index  Instruction    Executions        %%\n");
+    for (size_t i = 0; i < hot_count; ++i) {
+        size_t index = hot[i];
+        fprintf(out, "%9zu  %-10s %14llu %7.2f%%\n", index,
+                opcode_name((uint32_t) cpu->memory[index]), profile->hits[index],
+                percent(profile->hits[index], profile->total_steps));
+    }
+
+    fprintf(out, "\nBranches\n    Index  Instruction         Taken     Not taken\n");
+    for (size_t index = 0; index < profile->code_words; ++index) {
+        uint32_t opcode = (uint32_t) cpu->memory[index];
+        if (profile->hits[index] == 0 || !is_branch(opcode)) {
+            continue;
+        }
+        fprintf(out, "%9zu  %-10s %14llu %13llu\n", index, opcode_name(opcode),
+                profile->taken[index], profile->hits[index] - profile->taken[index]);
+    }
+}
+
+/*
+ * Prints the steps spent in every call path in the folded-stack format of
+ * flamegraph.pl: "main;sub_12;sub_40 1234", where sub_N is the code called
+ * at index N and main the code outside any call.
+ */
+int cpu_profile_folded(const struct cpu_profile *profile, FILE *out)
+{
+    assert(profile != NULL);
+    assert(out != NULL);
+    int32_t *path = malloc((profile->max_depth + 1) * sizeof(*path));
+    if (path == NULL) {
+        return -1;
+    }
+    for (const struct call_node *node = &profile->root; node != NULL; node = next_node(node)) {
+        if (node->steps == 0) {
+            continue;
+        }
+        size_t depth = 0;
+        for (const struct call_node *frame = node; frame->parent != NULL; frame = frame->parent) {
+            path[depth++] = frame->entry;
+        }
+        fprintf(out, "main");
+        while (depth > 0) {
+            fprintf(out, ";sub_%d", path[--depth]);
+        }
+        fprintf(out, " %llu\n", node->steps);
+    }
+    free(path);
+    return ferror(out) ? -1 : 0;
+}
+
+#else
+
+struct cpu_profile *cpu_profile_create(struct cpu *cpu)
+{
+    (void) cpu;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void cpu_profile_destroy(struct cpu_profile *profile)
+{
+    assert(profile == NULL);
+}
+
+long long cpu_run_profiled(struct cpu *cpu, struct cpu_profile *profile, size_t steps)
+{
+    (void) profile;
+    return cpu_run(cpu, steps);
+}
+
+void cpu_profile_report(const struct cpu_profile *profile, const struct cpu *cpu, FILE *out)
+{
+    (void) profile;
+    (void) cpu;
+    (void) out;
+}
+
+int cpu_profile_folded(const struct cpu_profile *profile, FILE *out)
+{
+    (void) profile;
+    (void) out;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Programs shared by many CPUs.
+ *
+ * cpu_program_load loads and pre-decodes a program once. Every CPU made
+ * from it with cpu_program_instance uses the same decoded ops and gets
+ * private guest memory. For a regular file that memory is a fresh
+ * copy-on-write mapping of the image: the code pages are shared through
+ * the page cache and never copied, since the guest cannot write below
+ * its stack. The code of images read from a stream, and of compact
+ * images, is written out to an unlinked temporary file once and shared
+ * the same way; only if that fails is it copied into each instance.
+ *
+ * Assembly sources are assembled on loading and shared like compact
+ * images.
+ *
+ * Every instance holds a reference to its program, so the program may be
+ * destroyed while CPUs made from it are still running.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t result = write(fd, p, size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+/*
+ * Writes words of code to an unlinked file in $TMPDIR (or /tmp) that
+ * instances can map like a regular image. Returns its descriptor, or -1.
+ */
+static int code_file(const int32_t *code, size_t words)
+{
+#ifdef CPU_NATIVE_LITTLE_ENDIAN
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    int length = snprintf(path, sizeof(path), "%s/cpu-code-XXXXXX",
+            dir != NULL && *dir != '\0' ? dir : "/tmp");
+    if (length < 0 || (size_t) length >= sizeof(path)) {
+        return -1;
+    }
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 || !write_all(fd, code, words * sizeof(int32_t))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    // memory_map_image would read the file into every instance anyway
+    (void) code;
+    (void) words;
+    return -1;
+#endif
+}
+
+/*
+ * Loads the program at path for CPUs with room for stack_capacity items.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu_program *cpu_program_load(const char *path, size_t stack_capacity)
+{
+    assert(path != NULL);
+    struct cpu_program *program = malloc(sizeof(*program));
+    if (program == NULL) {
+        return NULL;
+    }
+    int32_t *stack_bottom;
+    bool mapped = false;
+    int32_t *memory = NULL;
+    struct stat info;
+    if (memory_is_source(path)) {
+        program->fd = -1;
+        memory = memory_load_source(path, stack_capacity, &stack_bottom);
+    } else if ((program->fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        memory = memory_load_fd(program->fd, stack_capacity, &stack_bottom, &mapped);
+        if (memory != NULL && fstat(program->fd, &info) != 0) {
+            int saved_errno = errno;
+            cpu_unmap_memory(memory, stack_bottom);
+            errno = saved_errno;
+            memory = NULL;
+        }
+    }
+    if (memory == NULL) {
+        int saved_errno = errno;
+        if (program->fd >= 0) {
+            close(program->fd);
+        }
+        free(program);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    program->memory_words = (size_t) (stack_bottom - memory) + 1;
+    program->program_words = (size_t) (stack_bottom - memory) + 1 - stack_capacity;
+    while (program->program_words > 0 && memory[program->program_words - 1] == 0) {
+        --program->program_words;
+    }
+    program->stack_capacity = stack_capacity;
+    program->decoder = cpu_create_mapped(memory, stack_bottom, stack_capacity);
+    if (program->decoder == NULL || !cpu_predecode(program->decoder)) {
+        if (program->decoder != NULL) {
+            cpu_destroy(program->decoder);
+            free(program->decoder);
+        } else {
+            cpu_unmap_memory(memory, stack_bottom);
+        }
+        if (program->fd >= 0) {
+            close(program->fd);
+        }
+        free(program);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (mapped) {
+        program->image_size = (size_t) info.st_size;
+    } else {
+        if (program->fd >= 0) {
+            close(program->fd);
+        }
+        program->fd = code_file(memory, program->program_words);
+        // Without one, instances copy the image from the decoder CPU
+        program->image_size = program->fd >= 0 ? program->program_words * sizeof(int32_t) : 0;
+    }
+    program->refs = 1;
+    return program;
+}
+
+/*
+ * Drops the loader's reference. The program goes away once the last CPU
+ * made from it is destroyed too.
+ */
+void cpu_program_destroy(struct cpu_program *program)
+{
+    program_release(program);
+}
+
+void program_acquire(struct cpu_program *program)
+{
+    __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+}
+
+void program_release(struct cpu_program *program)
+{
+    if (program == NULL || __atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    cpu_destroy(program->decoder);
+    free(program->decoder);
+    if (program->fd >= 0) {
+        close(program->fd);
+    }
+    free(program);
+}
+
+/*
+ * Creates a CPU that runs program from the start, with its own registers,
+ * stack and I/O. Returns NULL with errno set on failure.
+ */
+struct cpu *cpu_program_instance(struct cpu_program *program)
+{
+    assert(program != NULL);
+    int32_t *memory;
+    if (program->fd >= 0) {
+        memory = memory_map_image(program->fd, program->image_size, program->memory_words);
+    } else if ((memory = memory_map_anonymous(program->memory_words)) != NULL) {
+        size_t code_words = (size_t) program->decoder->end_of_stack + 1;
+        memcpy(memory, program->decoder->memory, code_words * sizeof(int32_t));
+    }
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    int32_t *stack_bottom = &memory[program->memory_words - 1];
+    struct cpu *cpu = cpu_create_mapped(memory, stack_bottom, program->stack_capacity);
+    if (cpu == NULL) {
+        cpu_unmap_memory(memory, stack_bottom);
+        errno = ENOMEM;
+        return NULL;
+    }
+    cpu->decoded = program->decoder->decoded;
+    cpu->decoded_shared = true;
+#ifdef CPU_NATIVE_LITTLE_ENDIAN
+    cpu->code_shared = program->fd >= 0;
+#endif
+    program_acquire(program);
+    cpu->program = program;
+    return cpu;
+}
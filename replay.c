@@ -0,0 +1,477 @@
+/*
+ * Record and replay.
+ *
+ * cpu_run_recorded runs the CPU one cpu_step at a time and keeps what is
+ * needed to bring it back to any earlier step:
+ *
+ *   - every byte the guest's I/O backend hands to in/get, in an input log.
+ *     Input is the only thing that can make two runs of a program differ.
+ *   - a checkpoint every interval steps: registers, status, stack size and
+ *     the positions in the input and output streams.
+ *
+ * Code does not change at run time, so a checkpoint only has to save stack
+ * memory, and of that only the chunks written since the previous
+ * checkpoint: instructions that write a stack slot mark its chunk dirty.
+ * Every KEYFRAME_INTERVAL-th checkpoint saves the whole stack, so restoring
+ * one never goes back further than that.
+ *
+ * cpu_replay_seek restores the last checkpoint at or before the wanted step
+ * and steps forward from there, with input coming from the log. Output the
+ * guest already produced is not written again. Going to any step therefore
+ * costs at most interval steps, however long the recording.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#define CHUNK_SLOTS 64 // Stack slots per dirty chunk
+#define KEYFRAME_INTERVAL 64
+
+struct checkpoint
+{
+    unsigned long long step;
+    enum cpu_status status;
+    int32_t inst_index;
+    int32_t stack_size;
+    int32_t registers[REGISTER_RESULT + 1];
+    size_t input_pos;               // Log bytes the guest had consumed
+    bool input_eof;
+    unsigned long long output_pos;  // Output bytes the guest had produced
+    bool full;                      // Holds every chunk
+    size_t chunk_count;
+    size_t *chunks;                 // Indices of the chunks saved
+    int32_t *words;                 // CHUNK_SLOTS words per chunk
+};
+
+struct cpu_recording
+{
+    struct cpu *cpu;
+    size_t interval;
+    unsigned long long position; // Steps since the recording started
+    unsigned long long length;   // Steps recorded so far
+
+    // The CPU's own backend, the CPU reads and writes through the recording
+    struct cpu_io_ops ops;
+    void *context;
+
+    char *input;                 // Input log
+    size_t input_size;
+    size_t input_capacity;
+    size_t input_fed;            // Log bytes handed to the CPU
+    bool input_ended;            // The backend reported the end of input
+    unsigned long long output_pos;   // Output bytes the CPU has written
+    unsigned long long output_total; // Output bytes sent to the backend
+
+    size_t slots;                // Stack slots tracked, capacity + 1
+    size_t chunk_total;
+    uint64_t *dirty;             // Chunks written since the last checkpoint
+    struct checkpoint *checkpoints;
+    size_t checkpoint_count;
+    size_t checkpoint_capacity;
+};
+
+/*
+ * Serves the log first, so a CPU that went back in time reads the same
+ * input again; only then asks the real backend for more.
+ */
+static long recording_read(void *context, char *buf, size_t size)
+{
+    struct cpu_recording *recording = context;
+    if (recording->input_fed < recording->input_size) {
+        size_t left = recording->input_size - recording->input_fed;
+        size_t n = size < left ? size : left;
+        memcpy(buf, recording->input + recording->input_fed, n);
+        recording->input_fed += n;
+        return (long) n;
+    }
+    if (recording->input_ended) {
+        return 0;
+    }
+
+    long result = recording->ops.read(recording->context, buf, size);
+    if (result <= 0) {
+        recording->input_ended = true;
+        return result;
+    }
+    size_t needed = recording->input_size + (size_t) result;
+    if (needed > recording->input_capacity) {
+        size_t capacity = recording->input_capacity == 0 ? 4096 : recording->input_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *bigger = realloc(recording->input, capacity);
+        if (bigger == NULL) {
+            // Input that cannot be replayed is not given to the guest either
+            recording->input_ended = true;
+            return -1;
+        }
+        recording->input = bigger;
+        recording->input_capacity = capacity;
+    }
+    memcpy(recording->input + recording->input_size, buf, (size_t) result);
+    recording->input_size = needed;
+    recording->input_fed = needed;
+    return result;
+}
+
+/*
+ * Drops what a replay writes up to where the output was before.
+ */
+static int recording_write(void *context, const char *buf, size_t size)
+{
+    struct cpu_recording *recording = context;
+    if (recording->output_pos < recording->output_total) {
+        unsigned long long left = recording->output_total - recording->output_pos;
+        size_t skip = size < left ? size : (size_t) left;
+        recording->output_pos += skip;
+        buf += skip;
+        size -= skip;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    recording->output_pos += size;
+    recording->output_total = recording->output_pos;
+    return recording->ops.write(recording->context, buf, size);
+}
+
+static const struct cpu_io_ops recording_ops = { recording_read, recording_write };
+
+static int32_t *slot_address(const struct cpu_recording *recording, size_t slot)
+{
+    return recording->cpu->stack_bottom - slot;
+}
+
+static void mark_dirty(struct cpu_recording *recording, size_t slot)
+{
+    size_t chunk = slot / CHUNK_SLOTS;
+    recording->dirty[chunk / 64] |= (uint64_t) 1 << (chunk % 64);
+}
+
+static void mark_all_dirty(struct cpu_recording *recording)
+{
+    memset(recording->dirty, 0xff, (recording->chunk_total + 63) / 64 * sizeof(uint64_t));
+}
+
+static bool is_dirty(const struct cpu_recording *recording, size_t chunk)
+{
+    return recording->dirty[chunk / 64] & ((uint64_t) 1 << (chunk % 64));
+}
+
+static size_t chunk_slots(const struct cpu_recording *recording, size_t chunk)
+{
+    size_t left = recording->slots - chunk * CHUNK_SLOTS;
+    return left < CHUNK_SLOTS ? left : CHUNK_SLOTS;
+}
+
+/*
+ * Saves the current state with the chunks written since the previous
+ * checkpoint. On failure the chunks stay dirty for the next one.
+ */
+static bool take_checkpoint(struct cpu_recording *recording)
+{
+    struct cpu *cpu = recording->cpu;
+    if (recording->checkpoint_count == recording->checkpoint_capacity) {
+        size_t capacity = recording->checkpoint_capacity == 0 ? 64 : recording->checkpoint_capacity * 2;
+        struct checkpoint *bigger = realloc(recording->checkpoints, capacity * sizeof(*bigger));
+        if (bigger == NULL) {
+            return false;
+        }
+        recording->checkpoints = bigger;
+        recording->checkpoint_capacity = capacity;
+    }
+    bool full = recording->checkpoint_count % KEYFRAME_INTERVAL == 0;
+    if (full) {
+        mark_all_dirty(recording);
+    }
+
+    size_t count = 0;
+    for (size_t chunk = 0; chunk < recording->chunk_total; ++chunk) {
+        count += is_dirty(recording, chunk);
+    }
+    struct checkpoint *checkpoint = &recording->checkpoints[recording->checkpoint_count];
+    checkpoint->chunks = malloc(count * sizeof(*checkpoint->chunks) + 1);
+    checkpoint->words = malloc(count * CHUNK_SLOTS * sizeof(*checkpoint->words) + 1);
+    if (checkpoint->chunks == NULL || checkpoint->words == NULL) {
+        free(checkpoint->chunks);
+        free(checkpoint->words);
+        return false;
+    }
+
+    size_t saved = 0;
+    for (size_t chunk = 0; chunk < recording->chunk_total; ++chunk) {
+        if (!is_dirty(recording, chunk)) {
+            continue;
+        }
+        // Slots grow downwards in memory, a chunk is the range below its first slot
+        size_t slots = chunk_slots(recording, chunk);
+        memcpy(checkpoint->words + saved * CHUNK_SLOTS,
+                slot_address(recording, chunk * CHUNK_SLOTS + slots - 1), slots * sizeof(int32_t));
+        checkpoint->chunks[saved++] = chunk;
+    }
+    memset(recording->dirty, 0, (recording->chunk_total + 63) / 64 * sizeof(uint64_t));
+
+    checkpoint->step = recording->position;
+    checkpoint->status = cpu->status;
+    checkpoint->inst_index = cpu->inst_index;
+    checkpoint->stack_size = cpu->stack_size;
+    memcpy(checkpoint->registers, cpu->registers, sizeof(checkpoint->registers));
+    checkpoint->input_pos = recording->input_fed - (cpu->io.in_len - cpu->io.in_pos);
+    checkpoint->input_eof = cpu->io.in_eof;
+    checkpoint->output_pos = recording->output_pos + cpu->io.out_len;
+    checkpoint->full = full;
+    checkpoint->chunk_count = count;
+    ++recording->checkpoint_count;
+    return true;
+}
+
+/*
+ * Starts recording cpu, taking a checkpoint every interval steps. From now
+ * on the CPU does its I/O through the recording; use cpu_run_recorded to
+ * run it and call cpu_recording_destroy before destroying the CPU.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu_recording *cpu_recording_create(struct cpu *cpu, size_t interval)
+{
+    assert(cpu != NULL);
+    if (interval == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct cpu_recording *recording = calloc(1, sizeof(*recording));
+    if (recording == NULL) {
+        return NULL;
+    }
+    recording->cpu = cpu;
+    recording->interval = interval;
+    recording->slots = cpu->stack_capacity + 1; // store can reach one slot past the top
+    recording->chunk_total = (recording->slots + CHUNK_SLOTS - 1) / CHUNK_SLOTS;
+    recording->dirty = calloc((recording->chunk_total + 63) / 64, sizeof(uint64_t));
+
+    // Input the CPU has buffered already is where the log starts
+    struct cpu_io *io = &cpu->io;
+    cpu_flush_output(cpu);
+    size_t pending = io->in_len - io->in_pos;
+    recording->input_capacity = pending;
+    recording->input = malloc(pending + 1);
+    if (recording->dirty == NULL || recording->input == NULL) {
+        free(recording->dirty);
+        free(recording->input);
+        free(recording);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pending > 0) {
+        memcpy(recording->input, io->in_buf + io->in_pos, pending);
+    }
+    recording->input_size = pending;
+    recording->input_fed = pending;
+
+    if (!take_checkpoint(recording)) {
+        free(recording->checkpoints);
+        free(recording->dirty);
+        free(recording->input);
+        free(recording);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Swap the backend in place, keeping the buffers and terminal flags
+    recording->ops = io->ops;
+    recording->context = io->context;
+    io->ops = recording_ops;
+    io->context = recording;
+    return recording;
+}
+
+/*
+ * Stops recording and gives the CPU its own backend back. Recorded input
+ * that a CPU sent back in time has not read again is lost.
+ */
+void cpu_recording_destroy(struct cpu_recording *recording)
+{
+    if (recording == NULL) {
+        return;
+    }
+    struct cpu *cpu = recording->cpu;
+    cpu_flush_output(cpu);
+    cpu->io.ops = recording->ops;
+    cpu->io.context = recording->context;
+
+    for (size_t i = 0; i < recording->checkpoint_count; ++i) {
+        free(recording->checkpoints[i].chunks);
+        free(recording->checkpoints[i].words);
+    }
+    free(recording->checkpoints);
+    free(recording->dirty);
+    free(recording->input);
+    free(recording);
+}
+
+/*
+ * Marks the stack chunk the instruction at inst_index is about to write.
+ * Only push, call, pop, ret and store write the stack.
+ */
+static void track_write(struct cpu_recording *recording)
+{
+    const struct cpu *cpu = recording->cpu;
+    if (cpu->inst_index < 0 || cpu->inst_index > cpu->end_of_stack) {
+        return;
+    }
+    switch (cpu->memory[cpu->inst_index]) {
+    case 0x11: // push
+    case 0x18: // call
+        if ((size_t) cpu->stack_size < recording->slots) {
+            mark_dirty(recording, (size_t) cpu->stack_size);
+        }
+        break;
+    case 0x12: // pop
+    case 0x19: // ret
+        // Both clear the slot they take off the stack
+        if (cpu->stack_size > 0 && (size_t) cpu->stack_size <= recording->slots) {
+            mark_dirty(recording, (size_t) cpu->stack_size - 1);
+        }
+        break;
+    case 0x0B: { // store
+        if (&cpu->memory[cpu->inst_index + 2] > cpu->stack_bottom) {
+            break; // Fails with a missing operand
+        }
+        long long slot = (long long) cpu->stack_size - cpu->registers[REGISTER_D]
+                - cpu->memory[cpu->inst_index + 2] - 1;
+        if (slot >= 0 && slot < (long long) recording->slots) {
+            mark_dirty(recording, (size_t) slot);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/*
+ * Runs like cpu_run while recording. Steps that were recorded before (the
+ * CPU was sent back with cpu_replay_seek) are replayed, after that the
+ * recording carries on. Returns what cpu_run would.
+ */
+long long cpu_run_recorded(struct cpu *cpu, struct cpu_recording *recording, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(recording != NULL && recording->cpu == cpu);
+    if (cpu->status != CPU_OK) {
+        return 0;
+    }
+
+    long long executed_steps = 0;
+    for (size_t i = 0; i < steps; ++i) {
+        bool recording_new = recording->position == recording->length;
+        if (recording_new) {
+            const struct checkpoint *last = &recording->checkpoints[recording->checkpoint_count - 1];
+            if (recording->position - last->step >= recording->interval) {
+                take_checkpoint(recording); // Without memory the next one covers this
+            }
+            track_write(recording);
+        }
+
+        int result = cpu_step(cpu);
+        if (result == 0 && cpu->status == CPU_WAITING_INPUT) {
+            return executed_steps; // The in/get did not run
+        }
+        ++executed_steps;
+        ++recording->position;
+        if (recording_new) {
+            ++recording->length;
+        }
+        if (result == 0) {
+            return cpu->status == CPU_HALTED ? executed_steps : -executed_steps;
+        }
+    }
+    return executed_steps;
+}
+
+/*
+ * Returns how many steps the CPU is into the recording.
+ */
+unsigned long long cpu_recording_position(const struct cpu_recording *recording)
+{
+    assert(recording != NULL);
+    return recording->position;
+}
+
+/*
+ * Returns how many steps have been recorded.
+ */
+unsigned long long cpu_recording_length(const struct cpu_recording *recording)
+{
+    assert(recording != NULL);
+    return recording->length;
+}
+
+static void restore_checkpoint(struct cpu_recording *recording, size_t index)
+{
+    struct cpu *cpu = recording->cpu;
+    size_t first = index;
+    while (!recording->checkpoints[first].full) {
+        --first;
+    }
+    // Oldest first, so every chunk ends up as the newest checkpoint saved it
+    for (size_t i = first; i <= index; ++i) {
+        const struct checkpoint *checkpoint = &recording->checkpoints[i];
+        for (size_t c = 0; c < checkpoint->chunk_count; ++c) {
+            size_t chunk = checkpoint->chunks[c];
+            size_t slots = chunk_slots(recording, chunk);
+            memcpy(slot_address(recording, chunk * CHUNK_SLOTS + slots - 1),
+                    checkpoint->words + c * CHUNK_SLOTS, slots * sizeof(int32_t));
+        }
+    }
+
+    const struct checkpoint *checkpoint = &recording->checkpoints[index];
+    cpu->status = checkpoint->status;
+    cpu->inst_index = checkpoint->inst_index;
+    cpu->stack_size = checkpoint->stack_size;
+    memcpy(cpu->registers, checkpoint->registers, sizeof(checkpoint->registers));
+    cpu->io.in_pos = 0;
+    cpu->io.in_len = 0;
+    cpu->io.in_eof = checkpoint->input_eof;
+    cpu->io.out_len = 0;
+    recording->input_fed = checkpoint->input_pos;
+    recording->output_pos = checkpoint->output_pos;
+    recording->position = checkpoint->step;
+}
+
+/*
+ * Puts the CPU in the state it was in after step steps of the recording,
+ * stepping back as well as forward. Returns 0 on success, -1 with errno
+ * set to EINVAL if step has not been recorded yet.
+ */
+int cpu_replay_seek(struct cpu *cpu, struct cpu_recording *recording, unsigned long long step)
+{
+    assert(cpu != NULL);
+    assert(recording != NULL && recording->cpu == cpu);
+    if (step > recording->length) {
+        errno = EINVAL;
+        return -1;
+    }
+    cpu_flush_output(cpu);
+
+    if (step < recording->position || step - recording->position > recording->interval) {
+        // Last checkpoint at or before step
+        size_t low = 0, high = recording->checkpoint_count;
+        while (high - low > 1) {
+            size_t middle = low + (high - low) / 2;
+            if (recording->checkpoints[middle].step <= step) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        restore_checkpoint(recording, low);
+    }
+    while (recording->position < step) {
+        cpu_step(cpu);
+        ++recording->position;
+    }
+    return 0;
+}
@@ -0,0 +1,756 @@
+/*
+ * Emulator service.
+ *
+ * cpu_server_run keeps a set of loaded and pre-decoded programs resident
+ * and runs them on request, so a short guest costs a round trip over a
+ * Unix socket instead of a process start and a program load.
+ *
+ * Every connection gets a thread that reads requests from it. A run
+ * request becomes a job on a bounded lock-free queue (Vyukov's MPMC ring:
+ * every cell carries a sequence number that tells producers and consumers
+ * whose turn it is, so both sides claim cells with one compare-and-swap
+ * and no lock is ever taken). Worker threads take the jobs and run them,
+ * each on a CPU it keeps per program and restarts for every job, the way
+ * cpu_run_batch does. Two semaphores count the free and the filled cells,
+ * so idle workers and producers facing a full queue sleep instead of
+ * spinning. The connection thread waits for its job and writes the
+ * response, then reads the next request.
+ *
+ * Protocol, all fields little-endian:
+ *
+ *   request   u32 kind (SERVE_RUN or SERVE_STATS), u32 program index,
+ *             u64 input size, then the input bytes (SERVE_RUN only)
+ *   response  u32 error (errno value, 0 on success), u32 enum cpu_status,
+ *             i64 steps, i32 registers A, B, C, D and RESULT,
+ *             i32 stack size, u64 output size, then the output bytes
+ *
+ * The output of a SERVE_STATS response is the text of cpu_server_stats.
+ * A request the server cannot parse gets an EINVAL response, then the
+ * connection is closed.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUEUE_CELLS 1024 // Power of two
+#define REQUEST_HEADER_SIZE 16
+#define RESPONSE_HEADER_SIZE 48
+#define MAX_INPUT_SIZE (1ull << 30)
+
+// Latency histogram: 16 linear buckets per power of two of nanoseconds
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+enum serve_kind
+{
+    SERVE_RUN = 1,
+    SERVE_STATS = 2,
+};
+
+struct serve_job
+{
+    struct cpu_batch_job job;
+    uint32_t program;
+    struct timespec queued;
+    sem_t done;
+};
+
+struct queue_cell
+{
+    size_t sequence;
+    struct serve_job *job;
+};
+
+struct serve_connection
+{
+    struct cpu_server *server;
+    int fd;
+    struct serve_connection *next;
+};
+
+struct cpu_server
+{
+    struct cpu_program **programs;
+    size_t program_count;
+    size_t steps;
+    unsigned threads;
+    char *socket_path;
+    int listen_fd;
+    int stop_pipe[2];
+
+    // Job queue, head and tail on cache lines of their own
+    struct queue_cell cells[QUEUE_CELLS];
+    char pad0[64];
+    size_t head;
+    char pad1[64];
+    size_t tail;
+    char pad2[64];
+    sem_t filled;
+    sem_t vacant;
+
+    // Connections still open, for shutting them down at the end
+    pthread_mutex_t lock;
+    pthread_cond_t closed;
+    struct serve_connection *connections;
+    size_t connection_count;
+
+    // Metrics, updated with atomic operations
+    struct timespec started;
+    size_t depth;
+    size_t max_depth;
+    unsigned long long completed;
+    unsigned long long failed;
+    unsigned long long guest_steps;
+    unsigned long long latency[LATENCY_BUCKETS];
+};
+
+static bool queue_push(struct cpu_server *server, struct serve_job *job)
+{
+    size_t position = __atomic_load_n(&server->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        struct queue_cell *cell = &server->cells[position & (QUEUE_CELLS - 1)];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        ptrdiff_t difference = (ptrdiff_t) (sequence - position);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&server->tail, &position, position + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->job = job;
+                __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false; // Full
+        } else {
+            position = __atomic_load_n(&server->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static struct serve_job *queue_pop(struct cpu_server *server, bool *empty)
+{
+    size_t position = __atomic_load_n(&server->head, __ATOMIC_RELAXED);
+    for (;;) {
+        struct queue_cell *cell = &server->cells[position & (QUEUE_CELLS - 1)];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        ptrdiff_t difference = (ptrdiff_t) (sequence - (position + 1));
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&server->head, &position, position + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                struct serve_job *job = cell->job;
+                __atomic_store_n(&cell->sequence, position + QUEUE_CELLS, __ATOMIC_RELEASE);
+                *empty = false;
+                return job;
+            }
+        } else if (difference < 0) {
+            *empty = true;
+            return NULL;
+        } else {
+            position = __atomic_load_n(&server->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void semaphore_wait(sem_t *semaphore)
+{
+    while (sem_wait(semaphore) != 0 && errno == EINTR) {
+    }
+}
+
+/*
+ * Hands a job to the workers, NULL tells one worker to exit. Waits while
+ * the queue is full.
+ */
+static void enqueue(struct cpu_server *server, struct serve_job *job)
+{
+    semaphore_wait(&server->vacant);
+    // A free cell is counted only after its consumer released it
+    bool pushed = queue_push(server, job);
+    assert(pushed);
+    (void) pushed;
+    size_t depth = __atomic_add_fetch(&server->depth, 1, __ATOMIC_RELAXED);
+    size_t max_depth = __atomic_load_n(&server->max_depth, __ATOMIC_RELAXED);
+    while (depth > max_depth
+            && !__atomic_compare_exchange_n(&server->max_depth, &max_depth, depth, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    sem_post(&server->filled);
+}
+
+static struct serve_job *dequeue(struct cpu_server *server)
+{
+    semaphore_wait(&server->filled);
+    bool empty;
+    struct serve_job *job = queue_pop(server, &empty);
+    assert(!empty);
+    __atomic_sub_fetch(&server->depth, 1, __ATOMIC_RELAXED);
+    sem_post(&server->vacant);
+    return job;
+}
+
+static unsigned long long elapsed_ns(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) (now.tv_sec - since->tv_sec) * 1000000000u
+            + (unsigned long long) now.tv_nsec - (unsigned long long) since->tv_nsec;
+}
+
+static unsigned latency_bucket(unsigned long long ns)
+{
+    if (ns < (1u << LATENCY_SUB_BITS)) {
+        return (unsigned) ns;
+    }
+    unsigned top = 63 - (unsigned) __builtin_clzll(ns);
+    unsigned shift = top - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS)
+            + (unsigned) ((ns >> shift) & ((1u << LATENCY_SUB_BITS) - 1));
+}
+
+// Smallest latency that falls into bucket
+static unsigned long long bucket_floor(unsigned bucket)
+{
+    if (bucket < (1u << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    unsigned long long sub = bucket & ((1u << LATENCY_SUB_BITS) - 1);
+    return ((1ull << LATENCY_SUB_BITS) | sub) << shift;
+}
+
+static void *worker_main(void *argument)
+{
+    struct cpu_server *server = argument;
+    struct cpu **cpus = calloc(server->program_count, sizeof(*cpus));
+    struct serve_job *job;
+
+    while ((job = dequeue(server)) != NULL) {
+        struct cpu_batch_job *record = &job->job;
+        struct cpu **cpu = cpus != NULL ? &cpus[job->program] : NULL;
+        if (cpu != NULL && *cpu == NULL) {
+            *cpu = cpu_program_instance(server->programs[job->program]);
+        }
+        if (cpu == NULL || *cpu == NULL) {
+            record->error = cpu == NULL ? ENOMEM : errno;
+        } else {
+            batch_run_job(*cpu, record, server->steps);
+        }
+
+        unsigned long long ns = elapsed_ns(&job->queued);
+        __atomic_add_fetch(&server->latency[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(record->error == 0 ? &server->completed : &server->failed, 1,
+                __ATOMIC_RELAXED);
+        __atomic_add_fetch(&server->guest_steps,
+                (unsigned long long) (record->steps < 0 ? -record->steps : record->steps),
+                __ATOMIC_RELAXED);
+        sem_post(&job->done);
+    }
+
+    for (size_t i = 0; cpus != NULL && i < server->program_count; ++i) {
+        if (cpus[i] != NULL) {
+            cpu_destroy(cpus[i]);
+            free(cpus[i]);
+        }
+    }
+    free(cpus);
+    return NULL;
+}
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+    put_u32(p, (uint32_t) value);
+    put_u32(p + 4, (uint32_t) (value >> 32));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    return get_u32(p) | (uint64_t) get_u32(p + 4) << 32;
+}
+
+static bool send_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t result = send(fd, p, size, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+// Returns false on errors and when the peer closed the connection first
+static bool receive_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size > 0) {
+        ssize_t result = recv(fd, p, size, 0);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+static bool send_response(int fd, const struct cpu_batch_job *job)
+{
+    unsigned char header[RESPONSE_HEADER_SIZE];
+    put_u32(header, (uint32_t) job->error);
+    put_u32(header + 4, (uint32_t) job->status);
+    put_u64(header + 8, (uint64_t) job->steps);
+    for (int i = 0; i <= REGISTER_RESULT; ++i) {
+        put_u32(header + 16 + 4 * i, (uint32_t) job->registers[i]);
+    }
+    put_u32(header + 36, (uint32_t) job->stack_size);
+    put_u64(header + 40, job->output_size);
+    return send_all(fd, header, sizeof(header)) && send_all(fd, job->output, job->output_size);
+}
+
+static bool send_error(int fd, int error)
+{
+    struct cpu_batch_job job;
+    memset(&job, 0, sizeof(job));
+    job.error = error;
+    return send_response(fd, &job);
+}
+
+/*
+ * Serves one request. Returns false once the connection has to be closed.
+ */
+static bool serve_request(struct cpu_server *server, int fd)
+{
+    unsigned char header[REQUEST_HEADER_SIZE];
+    if (!receive_all(fd, header, sizeof(header))) {
+        return false;
+    }
+    uint32_t kind = get_u32(header);
+    uint32_t program = get_u32(header + 4);
+    uint64_t input_size = get_u64(header + 8);
+
+    if (kind == SERVE_STATS && input_size == 0) {
+        struct cpu_batch_job stats;
+        memset(&stats, 0, sizeof(stats));
+        FILE *out = open_memstream(&stats.output, &stats.output_size);
+        if (out == NULL) {
+            return send_error(fd, errno);
+        }
+        cpu_server_stats(server, out);
+        fclose(out);
+        bool sent = send_response(fd, &stats);
+        free(stats.output);
+        return sent;
+    }
+    if (kind != SERVE_RUN || input_size > MAX_INPUT_SIZE) {
+        send_error(fd, kind != SERVE_RUN ? EINVAL : EFBIG);
+        return false;
+    }
+
+    struct serve_job job;
+    memset(&job, 0, sizeof(job));
+    char *input = malloc(input_size > 0 ? (size_t) input_size : 1);
+    if (input == NULL) {
+        send_error(fd, ENOMEM);
+        return false;
+    }
+    if (!receive_all(fd, input, (size_t) input_size)) {
+        free(input);
+        return false;
+    }
+    if (program >= server->program_count) {
+        free(input);
+        return send_error(fd, EINVAL);
+    }
+
+    job.job.input = input;
+    job.job.input_size = (size_t) input_size;
+    job.program = program;
+    sem_init(&job.done, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &job.queued);
+    enqueue(server, &job);
+    semaphore_wait(&job.done);
+    sem_destroy(&job.done);
+    free(input);
+
+    bool sent = send_response(fd, &job.job);
+    free(job.job.output);
+    return sent;
+}
+
+static void *connection_main(void *argument)
+{
+    struct serve_connection *connection = argument;
+    struct cpu_server *server = connection->server;
+    while (serve_request(server, connection->fd)) {
+    }
+
+    pthread_mutex_lock(&server->lock);
+    struct serve_connection **link = &server->connections;
+    while (*link != connection) {
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    --server->connection_count;
+    pthread_cond_signal(&server->closed);
+    pthread_mutex_unlock(&server->lock);
+
+    close(connection->fd);
+    free(connection);
+    return NULL;
+}
+
+/*
+ * Creates a server for programs, which stay owned by the caller, listening
+ * on a Unix socket at socket_path (replacing a stale socket there). Jobs
+ * run for at most steps steps on threads worker threads, 0 picks one per
+ * online CPU core. Returns NULL with errno set on failure.
+ */
+struct cpu_server *cpu_server_create(const char *socket_path, struct cpu_program **programs,
+        size_t program_count, size_t steps, unsigned threads)
+{
+    assert(socket_path != NULL);
+    assert(programs != NULL || program_count == 0);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct cpu_server *server = calloc(1, sizeof(*server));
+    if (server == NULL) {
+        return NULL;
+    }
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned) online : 1;
+    }
+    server->programs = programs;
+    server->program_count = program_count;
+    server->steps = steps;
+    server->threads = threads;
+    server->listen_fd = -1;
+    server->stop_pipe[0] = server->stop_pipe[1] = -1;
+    for (size_t i = 0; i < QUEUE_CELLS; ++i) {
+        server->cells[i].sequence = i;
+    }
+
+    struct stat info;
+    if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(socket_path);
+    }
+    if ((server->socket_path = malloc(strlen(socket_path) + 1)) == NULL
+            || pipe(server->stop_pipe) != 0
+            || (server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || bind(server->listen_fd, (const struct sockaddr *) &address, sizeof(address)) != 0
+            || listen(server->listen_fd, 128) != 0) {
+        int saved_errno = errno;
+        if (server->listen_fd >= 0) {
+            close(server->listen_fd);
+        }
+        if (server->stop_pipe[0] >= 0) {
+            close(server->stop_pipe[0]);
+            close(server->stop_pipe[1]);
+        }
+        free(server->socket_path);
+        free(server);
+        errno = saved_errno;
+        return NULL;
+    }
+    strcpy(server->socket_path, socket_path);
+
+    sem_init(&server->filled, 0, 0);
+    sem_init(&server->vacant, 0, QUEUE_CELLS);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->closed, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &server->started);
+    return server;
+}
+
+/*
+ * Makes cpu_server_run return. Safe to call from a signal handler.
+ */
+void cpu_server_stop(struct cpu_server *server)
+{
+    assert(server != NULL);
+    char byte = 0;
+    ssize_t written = write(server->stop_pipe[1], &byte, 1);
+    (void) written;
+}
+
+/*
+ * Accepts connections and serves their requests until cpu_server_stop.
+ * Then the open connections are shut down and the jobs already queued are
+ * finished. Returns 0, or -1 with errno set if the server could not run.
+ */
+int cpu_server_run(struct cpu_server *server)
+{
+    assert(server != NULL);
+    pthread_t *workers = malloc(server->threads * sizeof(*workers));
+    if (workers == NULL) {
+        return -1;
+    }
+    unsigned started = 0;
+    while (started < server->threads
+            && pthread_create(&workers[started], NULL, worker_main, server) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        free(workers);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        struct pollfd fds[2] = {
+            { server->listen_fd, POLLIN, 0 },
+            { server->stop_pipe[0], POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        struct serve_connection *connection = malloc(sizeof(*connection));
+        if (connection == NULL) {
+            close(fd);
+            continue;
+        }
+        connection->server = server;
+        connection->fd = fd;
+        pthread_mutex_lock(&server->lock);
+        connection->next = server->connections;
+        server->connections = connection;
+        ++server->connection_count;
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, connection_main, connection) != 0) {
+            server->connections = connection->next;
+            --server->connection_count;
+            close(fd);
+            free(connection);
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+    pthread_attr_destroy(&detached);
+
+    // Wake up connection threads waiting for a request, then for them to finish
+    pthread_mutex_lock(&server->lock);
+    for (struct serve_connection *c = server->connections; c != NULL; c = c->next) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    while (server->connection_count > 0) {
+        pthread_cond_wait(&server->closed, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    for (unsigned i = 0; i < started; ++i) {
+        enqueue(server, NULL);
+    }
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    return 0;
+}
+
+/*
+ * Writes the server's metrics to out, one "name value" pair per line.
+ * Latencies are from the moment a request was queued to the end of its
+ * run, in microseconds.
+ */
+void cpu_server_stats(struct cpu_server *server, FILE *out)
+{
+    assert(server != NULL);
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+        counts[i] = __atomic_load_n(&server->latency[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    double percentiles[] = { 0.50, 0.99 };
+    unsigned long long values[2] = { 0, 0 };
+    for (unsigned p = 0; p < 2 && total > 0; ++p) {
+        unsigned long long rank = (unsigned long long) (percentiles[p] * (double) (total - 1));
+        unsigned long long seen = 0;
+        unsigned i = 0;
+        while ((seen += counts[i]) <= rank) {
+            ++i;
+        }
+        values[p] = bucket_floor(i);
+    }
+
+    double uptime = (double) elapsed_ns(&server->started) / 1e9;
+    unsigned long long completed = __atomic_load_n(&server->completed, __ATOMIC_RELAXED);
+    unsigned long long steps = __atomic_load_n(&server->guest_steps, __ATOMIC_RELAXED);
+    fprintf(out, "uptime_seconds %.3f\n", uptime);
+    fprintf(out, "programs %zu\n", server->program_count);
+    fprintf(out, "workers %u\n", server->threads);
+    fprintf(out, "requests_completed %llu\n", completed);
+    fprintf(out, "requests_failed %llu\n", __atomic_load_n(&server->failed, __ATOMIC_RELAXED));
+    fprintf(out, "queue_depth %zu\n", __atomic_load_n(&server->depth, __ATOMIC_RELAXED));
+    fprintf(out, "queue_depth_max %zu\n", __atomic_load_n(&server->max_depth, __ATOMIC_RELAXED));
+    fprintf(out, "latency_p50_us %.1f\n", (double) values[0] / 1e3);
+    fprintf(out, "latency_p99_us %.1f\n", (double) values[1] / 1e3);
+    fprintf(out, "requests_per_second %.1f\n", uptime > 0 ? (double) completed / uptime : 0.0);
+    fprintf(out, "guest_steps_per_second %.0f\n", uptime > 0 ? (double) steps / uptime : 0.0);
+}
+
+/*
+ * Closes the socket and removes it. The programs stay with the caller.
+ */
+void cpu_server_destroy(struct cpu_server *server)
+{
+    if (server == NULL) {
+        return;
+    }
+    close(server->listen_fd);
+    unlink(server->socket_path);
+    close(server->stop_pipe[0]);
+    close(server->stop_pipe[1]);
+    sem_destroy(&server->filled);
+    sem_destroy(&server->vacant);
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->closed);
+    free(server->socket_path);
+    free(server);
+}
+
+/*
+ * Client side: connects to the server listening at socket_path.
+ * Returns the connected descriptor, or -1 with errno set.
+ */
+int cpu_server_connect(const char *socket_path)
+{
+    assert(socket_path != NULL);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+static int request(int fd, enum serve_kind kind, uint32_t program, struct cpu_batch_job *job)
+{
+    unsigned char header[RESPONSE_HEADER_SIZE];
+    put_u32(header, kind);
+    put_u32(header + 4, program);
+    put_u64(header + 8, job->input_size);
+    if (!send_all(fd, header, REQUEST_HEADER_SIZE) || !send_all(fd, job->input, job->input_size)
+            || !receive_all(fd, header, sizeof(header))) {
+        return -1;
+    }
+
+    uint64_t output_size = get_u64(header + 40);
+    if (output_size > SIZE_MAX - 1) {
+        errno = EPROTO;
+        return -1;
+    }
+    job->error = (int) get_u32(header);
+    job->status = (enum cpu_status) get_u32(header + 4);
+    job->steps = (long long) get_u64(header + 8);
+    for (int i = 0; i <= REGISTER_RESULT; ++i) {
+        job->registers[i] = (int32_t) get_u32(header + 16 + 4 * i);
+    }
+    job->stack_size = (int32_t) get_u32(header + 36);
+    job->output_size = (size_t) output_size;
+    if ((job->output = malloc(job->output_size + 1)) == NULL) {
+        return -1;
+    }
+    if (!receive_all(fd, job->output, job->output_size)) {
+        free(job->output);
+        job->output = NULL;
+        return -1;
+    }
+    job->output[job->output_size] = '\0';
+    return 0;
+}
+
+/*
+ * Runs program (an index into the server's programs) with the job's input
+ * on the server connected to fd and fills in the rest of the job like
+ * cpu_run_batch. Returns 0 once the server answered, -1 with errno set if
+ * it could not be reached.
+ */
+int cpu_server_request(int fd, uint32_t program, struct cpu_batch_job *job)
+{
+    assert(job != NULL);
+    assert(job->input != NULL || job->input_size == 0);
+    return request(fd, SERVE_RUN, program, job);
+}
+
+/*
+ * Asks the server connected to fd for its metrics (see cpu_server_stats).
+ * Returns the text, to be released with free(), or NULL with errno set.
+ */
+char *cpu_server_request_stats(int fd)
+{
+    struct cpu_batch_job job;
+    memset(&job, 0, sizeof(job));
+    if (request(fd, SERVE_STATS, 0, &job) != 0) {
+        return NULL;
+    }
+    if (job.error != 0) {
+        free(job.output);
+        errno = job.error;
+        return NULL;
+    }
+    return job.output;
+}
@@ -0,0 +1,289 @@
+/*
+ * CPU snapshots.
+ *
+ * A snapshot file holds the architectural state of a CPU and its memory:
+ *
+ *   offset 0     header, SNAPSHOT_HEADER_SIZE bytes, little-endian fields
+ *   offset 4096  low segment:  memory words [0, low_words)
+ *   then         high segment: memory words [high_start, memory_words)
+ *
+ * Everything between the segments is zero and not stored. The low segment
+ * holds the program and ends at the page after its last non-zero word, the
+ * high segment starts at the page of the first non-zero stack word. Both
+ * start on page boundaries in the file and in memory, so cpu_restore maps
+ * them copy-on-write over an anonymous region and the restored CPU only
+ * reads the pages it touches.
+ *
+ * Buffered I/O is not part of the state: cpu_snapshot flushes pending
+ * output, unread input stays with the original CPU.
+ */
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CPUSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 4096
+
+enum snapshot_field
+{
+    FIELD_VERSION = 8, // After the 8-byte magic
+    FIELD_STATUS = 12,
+    FIELD_INST_INDEX = 16,
+    FIELD_STACK_SIZE = 20,
+    FIELD_REGISTERS = 24, // 5 words
+    FIELD_STACK_CAPACITY = 44,
+    FIELD_MEMORY_WORDS = 48,
+    FIELD_LOW_WORDS = 52,
+    FIELD_HIGH_START = 56,
+    FIELD_END = 60,
+};
+
+static void put_u32(unsigned char *header, enum snapshot_field field, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        header[field + i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *header, enum snapshot_field field)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= (uint32_t) header[field + i] << (8 * i);
+    }
+    return value;
+}
+
+static bool write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t result = write(fd, p, size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            return false;
+        }
+        p += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+static bool write_words(int fd, const int32_t *words, size_t count)
+{
+#ifdef CPU_NATIVE_LITTLE_ENDIAN
+    return write_all(fd, words, count * sizeof(int32_t));
+#else
+    unsigned char chunk[4096];
+    while (count > 0) {
+        size_t n = count < sizeof(chunk) / 4 ? count : sizeof(chunk) / 4;
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t word = (uint32_t) words[i];
+            for (int b = 0; b < 4; ++b) {
+                chunk[4 * i + b] = (unsigned char) (word >> (8 * b));
+            }
+        }
+        if (!write_all(fd, chunk, n * 4)) {
+            return false;
+        }
+        words += n;
+        count -= n;
+    }
+    return true;
+#endif
+}
+
+static size_t round_up_page(size_t words)
+{
+    return (words + MEMORY_BLOCK_WORDS - 1) / MEMORY_BLOCK_WORDS * MEMORY_BLOCK_WORDS;
+}
+
+/*
+ * Writes the state of the CPU to the snapshot file at path.
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int cpu_snapshot(struct cpu *cpu, const char *path)
+{
+    assert(cpu != NULL);
+    assert(path != NULL);
+
+    const size_t memory_words = (size_t) (cpu->stack_bottom - cpu->memory) + 1;
+    const size_t code_words = (size_t) cpu->end_of_stack + 1;
+
+    size_t low_end = code_words;
+    while (low_end > 0 && cpu->memory[low_end - 1] == 0) {
+        --low_end;
+    }
+    size_t high_first = code_words;
+    while (high_first < memory_words && cpu->memory[high_first] == 0) {
+        ++high_first;
+    }
+    size_t low_words = round_up_page(low_end);
+    if (low_words > memory_words) {
+        low_words = memory_words;
+    }
+    size_t high_start = high_first / MEMORY_BLOCK_WORDS * MEMORY_BLOCK_WORDS;
+    if (high_start < low_words || high_first == memory_words) {
+        high_start = high_first == memory_words ? memory_words : low_words;
+    }
+
+    unsigned char header[SNAPSHOT_HEADER_SIZE] = { 0 };
+    memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put_u32(header, FIELD_VERSION, SNAPSHOT_VERSION);
+    put_u32(header, FIELD_STATUS, (uint32_t) cpu->status);
+    put_u32(header, FIELD_INST_INDEX, (uint32_t) cpu->inst_index);
+    put_u32(header, FIELD_STACK_SIZE, (uint32_t) cpu->stack_size);
+    for (int i = 0; i <= REGISTER_RESULT; ++i) {
+        put_u32(header, FIELD_REGISTERS + 4 * i, (uint32_t) cpu->registers[i]);
+    }
+    put_u32(header, FIELD_STACK_CAPACITY, (uint32_t) cpu->stack_capacity);
+    put_u32(header, FIELD_MEMORY_WORDS, (uint32_t) memory_words);
+    put_u32(header, FIELD_LOW_WORDS, (uint32_t) low_words);
+    put_u32(header, FIELD_HIGH_START, (uint32_t) high_start);
+
+    // Output produced before the snapshot belongs to this run only
+    cpu_flush_output(cpu);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    bool written = write_all(fd, header, sizeof(header))
+            && write_words(fd, cpu->memory, low_words)
+            && write_words(fd, cpu->memory + high_start, memory_words - high_start);
+    int saved_errno = errno;
+    if (close(fd) != 0 && written) {
+        return -1;
+    }
+    errno = saved_errno;
+    return written ? 0 : -1;
+}
+
+/*
+ * Maps count words of the snapshot at file offset over memory. Reads them
+ * instead on big-endian hosts and when the host page size does not divide
+ * the offset.
+ */
+static bool load_segment(int fd, int32_t *memory, size_t count, off_t offset)
+{
+    if (count == 0) {
+        return true;
+    }
+#ifdef CPU_NATIVE_LITTLE_ENDIAN
+    if (mmap(memory, count * sizeof(int32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, offset)
+            != MAP_FAILED) {
+        return true;
+    }
+#endif
+    char *p = (char *) memory;
+    size_t size = count * sizeof(int32_t);
+    while (size > 0) {
+        ssize_t result = pread(fd, p, size, offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            if (result == 0) {
+                errno = EINVAL;
+            }
+            return false;
+        }
+        p += result;
+        offset += result;
+        size -= (size_t) result;
+    }
+    memory_words_from_le(memory, count);
+    return true;
+}
+
+/*
+ * Creates a CPU from the snapshot file at path. Guest I/O of the new CPU
+ * starts on stdin and stdout like after cpu_create.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu *cpu_restore(const char *path)
+{
+    assert(path != NULL);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    unsigned char header[FIELD_END];
+    struct stat info;
+    ssize_t got = read(fd, header, sizeof(header));
+    if (got != (ssize_t) sizeof(header) || fstat(fd, &info) != 0) {
+        int saved_errno = got < 0 ? errno : EINVAL;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    const size_t memory_words = get_u32(header, FIELD_MEMORY_WORDS);
+    const size_t low_words = get_u32(header, FIELD_LOW_WORDS);
+    const size_t high_start = get_u32(header, FIELD_HIGH_START);
+    const size_t stack_capacity = get_u32(header, FIELD_STACK_CAPACITY);
+    const uint32_t status = get_u32(header, FIELD_STATUS);
+    const int32_t stack_size = (int32_t) get_u32(header, FIELD_STACK_SIZE);
+    const off_t high_offset = SNAPSHOT_HEADER_SIZE + (off_t) low_words * (off_t) sizeof(int32_t);
+    const off_t file_size = high_offset + (off_t) (memory_words - high_start) * (off_t) sizeof(int32_t);
+
+    if (memcmp(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+            || get_u32(header, FIELD_VERSION) != SNAPSHOT_VERSION
+            || memory_words == 0 || memory_words > INT32_MAX
+            || stack_capacity >= memory_words
+            || low_words > high_start || high_start > memory_words
+            || (low_words % MEMORY_BLOCK_WORDS != 0 && low_words != memory_words)
+            || (high_start % MEMORY_BLOCK_WORDS != 0 && high_start != memory_words)
+            || stack_size < 0 || (size_t) stack_size > stack_capacity
+            || status > CPU_WAITING_INPUT || info.st_size != file_size) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int32_t *memory = memory_map_anonymous(memory_words);
+    if (memory == NULL) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (!load_segment(fd, memory, low_words, SNAPSHOT_HEADER_SIZE)
+            || !load_segment(fd, memory + high_start, memory_words - high_start, high_offset)) {
+        int saved_errno = errno;
+        munmap(memory, memory_words * sizeof(int32_t));
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    close(fd); // The mappings keep the file alive
+
+    int32_t *stack_bottom = &memory[memory_words - 1];
+    struct cpu *cpu = cpu_create_mapped(memory, stack_bottom, stack_capacity);
+    if (cpu == NULL) {
+        cpu_unmap_memory(memory, stack_bottom);
+        errno = ENOMEM;
+        return NULL;
+    }
+    cpu->status = (enum cpu_status) status;
+    cpu->inst_index = (int32_t) get_u32(header, FIELD_INST_INDEX);
+    cpu->stack_size = stack_size;
+    for (int i = 0; i <= REGISTER_RESULT; ++i) {
+        cpu->registers[i] = (int32_t) get_u32(header, FIELD_REGISTERS + 4 * i);
+    }
+    return cpu;
+}
@@ -0,0 +1,340 @@
+/*
+ * Binary execution traces.
+ *
+ * cpu_run_traced writes one record per executed step to a file:
+ *
+ *   header   "CPUTRACE", u32 version, u32 flags (enum cpu_trace_flags)
+ *   records  16 bytes each, little-endian:
+ *              u32 inst_index  index the instruction was fetched from
+ *              u8  opcode      word at that index, 255 if it is larger
+ *              u8  changed     bit i set if register i changed
+ *              u8  status      enum cpu_status after the step
+ *              u8  reserved    0
+ *              i32 value       new value of the lowest changed register
+ *              i32 stack_size  after the step
+ *
+ * With CPU_TRACE_COMPRESSED every record is stored as its XOR with the
+ * previous one: a u16 mask of the non-zero bytes followed by those bytes.
+ * Consecutive records share most bytes, so this is typically 5-8 bytes a
+ * step. Records collect in a large buffer that is written out whole.
+ */
+#include "cpu.h"
+#include "cpu_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "CPUTRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_SIZE 16
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+struct cpu_trace_writer
+{
+    int fd;
+    unsigned flags;
+    bool failed;
+    size_t len;
+    unsigned char previous[TRACE_RECORD_SIZE];
+    unsigned char buf[TRACE_BUFFER_SIZE];
+};
+
+struct cpu_trace_reader
+{
+    int fd;
+    unsigned flags;
+    size_t pos;
+    size_t len;
+    unsigned char previous[TRACE_RECORD_SIZE];
+    unsigned char buf[64 * 1024];
+};
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+            | (uint32_t) p[3] << 24;
+}
+
+static bool write_all(int fd, const unsigned char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t result = write(fd, buf, size);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += result;
+        size -= (size_t) result;
+    }
+    return true;
+}
+
+static void trace_flush(struct cpu_trace_writer *trace)
+{
+    if (!trace->failed && !write_all(trace->fd, trace->buf, trace->len)) {
+        trace->failed = true;
+    }
+    trace->len = 0;
+}
+
+/*
+ * Starts a trace on fd, which stays open and owned by the caller.
+ * Returns NULL with errno set on failure.
+ */
+struct cpu_trace_writer *cpu_trace_writer_create(int fd, unsigned flags)
+{
+    assert(fd >= 0);
+    struct cpu_trace_writer *trace = malloc(sizeof(*trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->fd = fd;
+    trace->flags = flags;
+    trace->failed = false;
+    memset(trace->previous, 0, sizeof(trace->previous));
+
+    memcpy(trace->buf, TRACE_MAGIC, 8);
+    put_u32(trace->buf + 8, TRACE_VERSION);
+    put_u32(trace->buf + 12, flags);
+    trace->len = TRACE_HEADER_SIZE;
+    return trace;
+}
+
+/*
+ * Writes out what is still buffered and frees the writer.
+ * Returns 0 if the whole trace was written, -1 with errno set otherwise.
+ */
+int cpu_trace_writer_finish(struct cpu_trace_writer *trace)
+{
+    if (trace == NULL) {
+        return 0;
+    }
+    trace_flush(trace);
+    int result = trace->failed ? -1 : 0;
+    free(trace);
+    return result;
+}
+
+static void encode_record(const struct cpu_trace_record *record, unsigned char *bytes)
+{
+    put_u32(bytes, record->inst_index);
+    bytes[4] = record->opcode;
+    bytes[5] = record->changed;
+    bytes[6] = record->status;
+    bytes[7] = 0;
+    put_u32(bytes + 8, (uint32_t) record->value);
+    put_u32(bytes + 12, (uint32_t) record->stack_size);
+}
+
+static void decode_record(const unsigned char *bytes, struct cpu_trace_record *record)
+{
+    record->inst_index = get_u32(bytes);
+    record->opcode = bytes[4];
+    record->changed = bytes[5];
+    record->status = bytes[6];
+    record->value = (int32_t) get_u32(bytes + 8);
+    record->stack_size = (int32_t) get_u32(bytes + 12);
+}
+
+static void trace_append(struct cpu_trace_writer *trace, const struct cpu_trace_record *record)
+{
+    // A compressed record takes at most 2 bytes more than a plain one
+    if (TRACE_BUFFER_SIZE - trace->len < TRACE_RECORD_SIZE + 2) {
+        trace_flush(trace);
+    }
+    unsigned char bytes[TRACE_RECORD_SIZE];
+    encode_record(record, bytes);
+    unsigned char *out = trace->buf + trace->len;
+
+    if (!(trace->flags & CPU_TRACE_COMPRESSED)) {
+        memcpy(out, bytes, TRACE_RECORD_SIZE);
+        trace->len += TRACE_RECORD_SIZE;
+        return;
+    }
+    unsigned mask = 0;
+    size_t n = 2;
+    for (int i = 0; i < TRACE_RECORD_SIZE; ++i) {
+        unsigned char delta = bytes[i] ^ trace->previous[i];
+        if (delta != 0) {
+            mask |= 1u << i;
+            out[n++] = delta;
+        }
+    }
+    out[0] = (unsigned char) mask;
+    out[1] = (unsigned char) (mask >> 8);
+    trace->len += n;
+    memcpy(trace->previous, bytes, TRACE_RECORD_SIZE);
+}
+
+/*
+ * Runs like cpu_run and appends a record for every step to trace.
+ * Returns what cpu_run would.
+ */
+long long cpu_run_traced(struct cpu *cpu, struct cpu_trace_writer *trace, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(trace != NULL);
+    if (cpu->status != CPU_OK) {
+        return 0;
+    }
+
+    long long executed_steps = 0;
+    for (size_t i = 0; i < steps; ++i) {
+        struct cpu_trace_record record = { 0 };
+        int32_t before[REGISTER_RESULT + 1];
+        memcpy(before, cpu->registers, sizeof(before));
+        record.inst_index = (uint32_t) cpu->inst_index;
+        if (cpu->inst_index >= 0 && cpu->inst_index <= cpu->end_of_stack) {
+            uint32_t word = (uint32_t) cpu->memory[cpu->inst_index];
+            record.opcode = word < 255 ? (uint8_t) word : 255;
+        } else {
+            record.opcode = 255;
+        }
+
+        int result = cpu_step(cpu);
+        if (result == 0 && cpu->status == CPU_WAITING_INPUT) {
+            return executed_steps; // The in/get did not run
+        }
+        ++executed_steps;
+        for (int r = REGISTER_RESULT; r >= 0; --r) {
+            if (cpu->registers[r] != before[r]) {
+                record.changed |= (uint8_t) (1u << r);
+                record.value = cpu->registers[r];
+            }
+        }
+        record.status = (uint8_t) cpu->status;
+        record.stack_size = cpu->stack_size;
+        trace_append(trace, &record);
+
+        if (result == 0) {
+            return cpu->status == CPU_HALTED ? executed_steps : -executed_steps;
+        }
+    }
+    return executed_steps;
+}
+
+/*
+ * Reads exactly size bytes. Returns size, 0 at the end of the trace or -1
+ * with errno set on error or if the trace ends mid-record.
+ */
+static int reader_get(struct cpu_trace_reader *reader, unsigned char *out, size_t size, bool at_start)
+{
+    size_t done = 0;
+    while (done < size) {
+        if (reader->pos == reader->len) {
+            ssize_t result = read(reader->fd, reader->buf, sizeof(reader->buf));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                return -1;
+            }
+            if (result == 0) {
+                if (done == 0 && at_start) {
+                    return 0;
+                }
+                errno = EINVAL;
+                return -1;
+            }
+            reader->pos = 0;
+            reader->len = (size_t) result;
+        }
+        size_t n = reader->len - reader->pos;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(out + done, reader->buf + reader->pos, n);
+        reader->pos += n;
+        done += n;
+    }
+    return (int) size;
+}
+
+/*
+ * Opens the trace on fd, which stays owned by the caller.
+ * Returns NULL with errno set on failure or if fd holds no trace.
+ */
+struct cpu_trace_reader *cpu_trace_reader_open(int fd)
+{
+    assert(fd >= 0);
+    struct cpu_trace_reader *reader = malloc(sizeof(*reader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->fd = fd;
+    reader->pos = 0;
+    reader->len = 0;
+    memset(reader->previous, 0, sizeof(reader->previous));
+
+    unsigned char header[TRACE_HEADER_SIZE];
+    if (reader_get(reader, header, sizeof(header), false) < 0) {
+        int saved_errno = errno;
+        free(reader);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (memcmp(header, TRACE_MAGIC, 8) != 0 || get_u32(header + 8) != TRACE_VERSION
+            || (get_u32(header + 12) & ~(uint32_t) CPU_TRACE_COMPRESSED) != 0) {
+        free(reader);
+        errno = EINVAL;
+        return NULL;
+    }
+    reader->flags = get_u32(header + 12);
+    return reader;
+}
+
+/*
+ * Reads the next record. Returns 1 on success, 0 at the end of the trace
+ * and -1 with errno set on error.
+ */
+int cpu_trace_read(struct cpu_trace_reader *reader, struct cpu_trace_record *record)
+{
+    assert(reader != NULL);
+    assert(record != NULL);
+    unsigned char bytes[TRACE_RECORD_SIZE];
+
+    if (!(reader->flags & CPU_TRACE_COMPRESSED)) {
+        int result = reader_get(reader, bytes, sizeof(bytes), true);
+        if (result <= 0) {
+            return result;
+        }
+    } else {
+        unsigned char mask_bytes[2];
+        int result = reader_get(reader, mask_bytes, sizeof(mask_bytes), true);
+        if (result <= 0) {
+            return result;
+        }
+        unsigned mask = mask_bytes[0] | (unsigned) mask_bytes[1] << 8;
+        memcpy(bytes, reader->previous, sizeof(bytes));
+        for (int i = 0; i < TRACE_RECORD_SIZE; ++i) {
+            unsigned char delta;
+            if ((mask & (1u << i)) == 0) {
+                continue;
+            }
+            if (reader_get(reader, &delta, 1, false) < 0) {
+                return -1;
+            }
+            bytes[i] ^= delta;
+        }
+        memcpy(reader->previous, bytes, sizeof(bytes));
+    }
+    decode_record(bytes, record);
+    return 1;
+}
+
+void cpu_trace_reader_close(struct cpu_trace_reader *reader)
+{
+    free(reader);
+}